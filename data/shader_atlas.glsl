@@ -1,11 +1,27 @@
 //example of some shaders compiled
+//USE_UBO: frame, material and light data come from uniform blocks (see frame_block.glsl)
+//PER_DRAW_DECODE: the dequantization comes with the model as per draw attributes (multi draw indirect of the geometry pools)
 flat basic.vs flat.fs
 texture basic.vs texture.fs
-lightSP basic.vs lightSP.fs
-lightMP basic.vs lightMP.fs
+lightSP basic.vs lightSP.fs USE_UBO
+lightMP basic.vs lightMP.fs USE_UBO
+lightSP_instanced instanced.vs lightSP.fs USE_UBO
+lightMP_instanced instanced.vs lightMP.fs USE_UBO
+lightSP_indirect instanced.vs lightSP.fs USE_UBO,PER_DRAW_DECODE
+lightClustered basic.vs lightClustered.fs USE_UBO
+lightClustered_instanced instanced.vs lightClustered.fs USE_UBO
+lightClustered_indirect instanced.vs lightClustered.fs USE_UBO,PER_DRAW_DECODE
 skybox basic.vs skybox.fs
 depth quad.vs depth.fs
 multi basic.vs multi.fs
+gbuffer basic.vs gbuffer.fs USE_UBO
+gbuffer_instanced instanced.vs gbuffer.fs USE_UBO
+gbuffer_indirect instanced.vs gbuffer.fs USE_UBO,PER_DRAW_DECODE
+deferred_global quad.vs deferred.fs GLOBAL_PASS
+deferred_light basic.vs deferred.fs
+deferred_light_quad quad.vs deferred.fs
+impostor_bake basic.vs impostor_bake.fs
+impostor impostor.vs impostor.fs USE_UBO
 
 \basic.vs
 
@@ -16,10 +32,16 @@ in vec3 a_normal;
 in vec2 a_coord;
 in vec4 a_color;
 
-uniform vec3 u_camera_pos;
-
 uniform mat4 u_model;
-uniform mat4 u_viewprojection;
+
+#include "vertex_decode.glsl"
+
+#ifdef USE_UBO
+	#include "frame_block.glsl"
+#else
+	uniform mat4 u_viewprojection;
+	uniform float u_time;
+#endif
 
 //this will store the color for the pixel shader
 out vec3 v_position;
@@ -28,22 +50,20 @@ out vec3 v_normal;
 out vec2 v_uv;
 out vec4 v_color;
 
-uniform float u_time;
-
 void main()
 {	
 	//calcule the normal in camera space (the NormalMatrix is like ViewMatrix but without traslation)
-	v_normal = (u_model * vec4( a_normal, 0.0) ).xyz;
+	v_normal = (u_model * vec4( decodeNormal(a_normal), 0.0) ).xyz;
 	
 	//calcule the vertex in object space
-	v_position = a_vertex;
+	v_position = decodePosition(a_vertex);
 	v_world_position = (u_model * vec4( v_position, 1.0) ).xyz;
 	
 	//store the color in the varying var to use it from the pixel shader
 	v_color = a_color;
 
 	//store the texture coordinates
-	v_uv = a_coord;
+	v_uv = decodeUV(a_coord);
 
 	//calcule the position of the vertex using the matrices
 	gl_Position = u_viewprojection * vec4( v_world_position, 1.0 );
@@ -107,50 +127,165 @@ void main()
 	FragColor = color;
 }
 
-\lightSP.fs
+\frame_block.glsl
+
+//std140 blocks, they must match the structs in renderer.h
+layout(std140) uniform FrameBlock {
+	mat4 u_viewprojection;
+	vec3 u_camera_position;
+	float u_time;
+	vec3 u_camera_front;
+	vec3 u_ambient_light;
+};
+
+\vertex_decode.glsl
+
+//attributes of the meshes with a packed vertex layout (see Mesh::vertex_layout), the uniforms are the identity for float ones
+#ifdef PER_DRAW_DECODE
+	in vec4 a_vertex_offset;
+	in vec4 a_vertex_scale;
+	in vec4 a_uv_transform;
+	#define u_vertex_offset a_vertex_offset.xyz
+	#define u_vertex_scale a_vertex_scale.xyz
+	#define u_uv_transform a_uv_transform
+#else
+	uniform vec3 u_vertex_offset;
+	uniform vec3 u_vertex_scale;
+	uniform vec4 u_uv_transform; //offset in xy, scale in zw
+#endif
+uniform int u_octahedral_normals;
+
+vec3 decodePosition(vec3 p)
+{
+	return u_vertex_offset + p * u_vertex_scale;
+}
 
-#version 330 core
+vec2 decodeUV(vec2 uv)
+{
+	return u_uv_transform.xy + uv * u_uv_transform.zw;
+}
+
+vec3 decodeNormal(vec3 n)
+{
+	if (u_octahedral_normals == 0)
+		return n;
+	vec3 v = vec3(n.xy, 1.0 - abs(n.x) - abs(n.y));
+	float t = max(-v.z, 0.0);
+	v.x += v.x >= 0.0 ? -t : t;
+	v.y += v.y >= 0.0 ? -t : t;
+	return normalize(v);
+}
+
+\material_block.glsl
+
+layout(std140) uniform MaterialBlock {
+	vec4 u_color;
+	vec3 u_emissive_factor;
+	float u_alpha_cutoff;
+	vec2 u_metallic_roughness; //factors
+	int u_use_normalmap;
+	int u_use_emissive;
+	int u_use_occlusion;
+	int u_use_specular;
+};
+
+\light_block.glsl
+
+//all the lights of the frame, same layout than the light grid buffer
+const int MAX_BLOCK_LIGHTS = 128;
+
+struct sLightData {
+	vec4 position_range; //xyz position, w max distance
+	vec4 color_type; //rgb color * intensity, w light type
+	vec4 front_cone; //xyz front, w cos(cone start)
+	vec4 cone_end; //x cos(cone end)
+};
+
+layout(std140) uniform LightBlock {
+	sLightData u_lights[MAX_BLOCK_LIGHTS];
+};
+
+vec3 computeBlockLight(sSurface s, int index)
+{
+	sLightData light = u_lights[index];
+	return computeLight(s, int(light.color_type.w), light.position_range.xyz, light.front_cone.xyz, light.color_type.xyz, vec2(light.front_cone.w, light.cone_end.x), light.position_range.w);
+}
+
+\light_eval.fs
+
+//surface and light evaluation shared by the forward and deferred lighting shaders
+
+#ifndef USE_UBO
+	uniform int u_use_specular;
+	uniform vec3 u_ambient_light;
+#endif
+
+struct sSurface {
+	vec3 position;
+	vec3 albedo;
+	float alpha;
+	vec3 N;
+	vec3 V;
+	vec3 emissive;
+	float occlusion;
+	float metalness;
+	float roughness;
+};
+
+//light types: POINT = 1, SPOT = 2, DIRECTIONAL = 3
+//the front of the light points from the scene to the light, cone_info has the cosines of the cone start and end
+vec3 computeLight(sSurface s, int light_type, vec3 light_pos, vec3 light_front, vec3 light_color, vec2 cone_info, float max_distance)
+{
+	vec3 L = light_front;
+	float attenuation = 1.0;
+	if(light_type != 3)
+	{
+		L = light_pos - s.position;
+		float dist = length(L);
+		L /= dist;
+		attenuation = clamp(1.0 - dist / max_distance, 0.0, 1.0);
+		attenuation *= attenuation;
+		if(light_type == 2)
+			attenuation *= smoothstep(cone_info.y, cone_info.x, dot(L, light_front));
+	}
+
+	float NdotL = max(dot(s.N, L), 0.0);
+	vec3 diffuse = s.albedo * (1.0 - s.metalness);
+	vec3 specular = vec3(0.0);
+	if(u_use_specular != 0)
+	{
+		vec3 H = normalize(L + s.V);
+		float shininess = mix(128.0, 2.0, s.roughness);
+		specular = mix(vec3(0.04), s.albedo, s.metalness) * pow(max(dot(s.N, H), 0.0), shininess);
+	}
+	return (diffuse + specular) * NdotL * light_color * attenuation;
+}
+
+vec3 computeAmbient(sSurface s)
+{
+	return s.albedo * u_ambient_light * s.occlusion + s.emissive;
+}
+
+
+\lighting.fs
+
+//material inputs shared by the forward lighting shaders, the material parameters come from the material block
+
+#include "frame_block.glsl"
+#include "material_block.glsl"
+#include "light_eval.fs"
 
-const int MAX_LIGHTS = 10;
 in vec3 v_position;
 in vec3 v_world_position;
 in vec3 v_normal;
 in vec2 v_uv;
 in vec4 v_color;
 
-uniform vec4 u_color;
 uniform sampler2D u_texture;
-uniform float u_time;
-uniform float u_alpha_cutoff;
-
 uniform sampler2D u_normalmap;
-uniform int u_use_normalmap;
-
 uniform sampler2D u_emissive;
-uniform vec3 u_emissive_factor;
-uniform int u_use_emissive;
-
 uniform sampler2D u_occlusion;
 uniform sampler2D u_metal_roughness;
-uniform int u_use_occlusion;
-uniform int u_use_specular;
-
-uniform vec3 u_ambient_light;
-
-uniform vec3 u_light_pos[MAX_LIGHTS];
-uniform vec3 u_light_front[MAX_LIGHTS];
-uniform vec3 u_light_col[MAX_LIGHTS];
-uniform vec2 u_cone_info[MAX_LIGHTS];
-uniform float u_max_distance[MAX_LIGHTS];
-uniform int u_light_type[MAX_LIGHTS];
-		//NO_LIGHT = 0,
-		//POINT = 1,
-		//SPOT = 2,
-		//DIRECTIONAL = 3
-
-uniform int u_num_lights;
-
-out vec4 FragColor;
 
 mat3 cotangent_frame(vec3 N, vec3 p, vec2 uv)
 {
@@ -181,14 +316,58 @@ vec3 perturbNormal(vec3 N, vec3 WP, vec2 uv, vec3 normal_pixel)
 	return normalize(TBN * normal_pixel);
 }
 
-void main()
+//reads all the material info of this pixel, discards it if it is under the alpha cutoff
+sSurface getSurface()
 {
+	sSurface s;
+	s.position = v_world_position;
 	vec2 uv = v_uv;
-	vec4 color = u_color;
-	color *= texture( u_texture, v_uv );
+	vec4 color = u_color * texture( u_texture, uv );
+	if(color.a < u_alpha_cutoff)
+		discard;
+	s.albedo = color.xyz;
+	s.alpha = color.a;
+
+	s.N = normalize(v_normal);
+	if(u_use_normalmap != 0)
+		s.N = perturbNormal(s.N, v_world_position, uv, texture( u_normalmap, uv ).xyz);
+	s.V = normalize(u_camera_position - v_world_position);
+
+	vec3 metal_roughness = texture( u_metal_roughness, uv ).xyz;
+	s.roughness = u_metallic_roughness.y * metal_roughness.g;
+	s.metalness = u_metallic_roughness.x * metal_roughness.b;
+	s.occlusion = u_use_occlusion != 0 ? texture( u_occlusion, uv ).x : 1.0;
+	s.emissive = u_use_emissive != 0 ? u_emissive_factor * texture( u_emissive, uv ).xyz : vec3(0.0);
+	return s;
+}
+
+\lightSP.fs
 
-	FragColor.xyz = vec3(0);
-	FragColor.a = color.a;
+#version 330 core
+
+const int MAX_LIGHTS = 10;
+
+#include "lighting.fs"
+#include "light_block.glsl"
+
+uniform int u_light_list[MAX_LIGHTS]; //indices in the light block
+uniform int u_num_lights;
+
+out vec4 FragColor;
+
+void main()
+{
+	sSurface s = getSurface();
+
+	vec3 color = computeAmbient(s);
+	for(int i = 0; i < MAX_LIGHTS; ++i)
+	{
+		if(i >= u_num_lights)
+			break;
+		color += computeBlockLight(s, u_light_list[i]);
+	}
+
+	FragColor = vec4(color, s.alpha);
 }
 
 
@@ -196,48 +375,78 @@ void main()
 
 #version 330 core
 
-in vec3 v_position;
-in vec3 v_world_position;
-in vec3 v_normal;
-in vec2 v_uv;
-in vec4 v_color;
+#include "lighting.fs"
+#include "light_block.glsl"
 
-uniform vec4 u_color;
-uniform sampler2D u_texture;
-uniform float u_time;
-uniform float u_alpha_cutoff;
+uniform int u_light_index; //index in the light block, -1 for the ambient pass
 
-uniform vec3 u_ambient_light;
+out vec4 FragColor;
 
-uniform vec3 u_light_pos;
-uniform vec3 u_light_front;
-uniform vec3 u_light_col;
-uniform vec2 u_cone_info;
-uniform float u_max_distance;
-uniform int u_light_type;
-		//NO_LIGHT = 0,
-		//POINT = 1,
-		//SPOT = 2,
-		//DIRECTIONAL = 3
-		//AMBIENT = 4
+void main()
+{
+	sSurface s = getSurface();
 
-uniform int u_num_lights;
+	vec3 color;
+	if(u_light_index < 0) //first pass
+		color = computeAmbient(s);
+	else
+		color = computeBlockLight(s, u_light_index);
+
+	FragColor = vec4(color, s.alpha);
+}
+
+
+\lightClustered.fs
+
+#version 330 core
+
+#include "lighting.fs"
+
+//4 texels per light: position and max distance, color and type, front and cos(cone start), cos(cone end)
+uniform samplerBuffer u_lights_data;
+//offset and count in u_cluster_lights of every cluster
+uniform usamplerBuffer u_cluster_ranges;
+uniform usamplerBuffer u_cluster_lights;
+
+uniform vec3 u_cluster_dims;
+uniform vec2 u_cluster_zparams; //slice = log(depth) * x + y
+uniform vec4 u_viewport;
+uniform int u_num_global_lights; //directional lights at the beginning of the buffer, they affect every cluster
 
 out vec4 FragColor;
 
+vec3 computeBufferLight(sSurface s, int index)
+{
+	vec4 position_range = texelFetch( u_lights_data, index * 4 );
+	vec4 color_type = texelFetch( u_lights_data, index * 4 + 1 );
+	vec4 front_cone = texelFetch( u_lights_data, index * 4 + 2 );
+	float cone_end = texelFetch( u_lights_data, index * 4 + 3 ).x;
+	return computeLight(s, int(color_type.w), position_range.xyz, front_cone.xyz, color_type.xyz, vec2(front_cone.w, cone_end), position_range.w);
+}
+
 void main()
 {
-	vec2 uv = v_uv;
-	vec4 color = u_color;
-	color *= texture( u_texture, v_uv );
+	sSurface s = getSurface();
 
-	if(color.a < u_alpha_cutoff)
-		discard;
+	vec3 color = computeAmbient(s);
+	for(int i = 0; i < u_num_global_lights; ++i)
+		color += computeBufferLight(s, i);
+
+	//find the cluster of this fragment
+	ivec3 dims = ivec3(u_cluster_dims);
+	float depth = max(dot(v_world_position - u_camera_position, u_camera_front), 0.0001);
+	int slice = clamp(int(floor(log(depth) * u_cluster_zparams.x + u_cluster_zparams.y)), 0, dims.z - 1);
+	ivec2 tile = clamp(ivec2((gl_FragCoord.xy - u_viewport.xy) / u_viewport.zw * vec2(dims.xy)), ivec2(0), dims.xy - 1);
+	int cluster = (slice * dims.y + tile.y) * dims.x + tile.x;
+
+	uvec2 range = texelFetch( u_cluster_ranges, cluster ).xy;
+	for(uint i = 0u; i < range.y; ++i)
+		color += computeBufferLight(s, int(texelFetch( u_cluster_lights, int(range.x + i) ).x));
 
-	FragColor.xyz = vec3(0);
-	FragColor.a = color.a;
+	FragColor = vec4(color, s.alpha);
 }
 
+
 \skybox.fs
 
 #version 330 core
@@ -318,31 +527,270 @@ void main()
 in vec3 a_vertex;
 in vec3 a_normal;
 in vec2 a_coord;
+in vec4 a_color;
 
+//per instance attribute, takes 4 consecutive locations
 in mat4 u_model;
 
-uniform vec3 u_camera_pos;
+#include "vertex_decode.glsl"
 
-uniform mat4 u_viewprojection;
+#ifdef USE_UBO
+	#include "frame_block.glsl"
+#else
+	uniform mat4 u_viewprojection;
+	uniform float u_time;
+#endif
 
 //this will store the color for the pixel shader
 out vec3 v_position;
 out vec3 v_world_position;
 out vec3 v_normal;
 out vec2 v_uv;
+out vec4 v_color;
 
 void main()
 {	
 	//calcule the normal in camera space (the NormalMatrix is like ViewMatrix but without traslation)
-	v_normal = (u_model * vec4( a_normal, 0.0) ).xyz;
+	v_normal = (u_model * vec4( decodeNormal(a_normal), 0.0) ).xyz;
 	
 	//calcule the vertex in object space
-	v_position = a_vertex;
-	v_world_position = (u_model * vec4( a_vertex, 1.0) ).xyz;
+	v_position = decodePosition(a_vertex);
+	v_world_position = (u_model * vec4( v_position, 1.0) ).xyz;
 	
+	//store the color in the varying var to use it from the pixel shader
+	v_color = a_color;
+
 	//store the texture coordinates
-	v_uv = a_coord;
+	v_uv = decodeUV(a_coord);
 
 	//calcule the position of the vertex using the matrices
 	gl_Position = u_viewprojection * vec4( v_world_position, 1.0 );
-}
\ No newline at end of file
+}
+
+
+\gbuffer.fs
+
+#version 330 core
+
+#include "lighting.fs"
+
+//albedo, normal, metalness roughness occlusion and emissive, depth goes in the depth texture
+layout(location = 0) out vec4 GBuffer0;
+layout(location = 1) out vec4 GBuffer1;
+layout(location = 2) out vec4 GBuffer2;
+layout(location = 3) out vec4 GBuffer3;
+
+void main()
+{
+	sSurface s = getSurface();
+	GBuffer0 = vec4(s.albedo, 1.0);
+	GBuffer1 = vec4(s.N * 0.5 + 0.5, 1.0);
+	GBuffer2 = vec4(s.metalness, s.roughness, s.occlusion, 1.0);
+	GBuffer3 = vec4(s.emissive, 1.0);
+}
+
+
+\deferred.fs
+
+#version 330 core
+
+#include "light_eval.fs"
+
+uniform sampler2D u_gbuffer0;
+uniform sampler2D u_gbuffer1;
+uniform sampler2D u_gbuffer2;
+uniform sampler2D u_gbuffer3;
+uniform sampler2D u_gbuffer_depth;
+uniform mat4 u_inverse_viewprojection;
+uniform vec2 u_iRes; //1 / gbuffers size
+uniform vec3 u_camera_position;
+
+uniform vec3 u_light_pos;
+uniform vec3 u_light_front;
+uniform vec3 u_light_col;
+uniform vec2 u_cone_info;
+uniform float u_max_distance;
+uniform int u_light_type;
+
+out vec4 FragColor;
+
+void main()
+{
+	vec2 uv = gl_FragCoord.xy * u_iRes;
+	float depth = texture( u_gbuffer_depth, uv ).x;
+	if(depth == 1.0)
+		discard; //nothing rendered here
+
+	//world position from the depth
+	vec4 clip_pos = vec4(uv * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+	vec4 world_pos = u_inverse_viewprojection * clip_pos;
+
+	sSurface s;
+	s.position = world_pos.xyz / world_pos.w;
+	s.albedo = texture( u_gbuffer0, uv ).xyz;
+	s.alpha = 1.0;
+	s.N = normalize(texture( u_gbuffer1, uv ).xyz * 2.0 - 1.0);
+	s.V = normalize(u_camera_position - s.position);
+	vec3 material = texture( u_gbuffer2, uv ).xyz;
+	s.metalness = material.x;
+	s.roughness = material.y;
+	s.occlusion = material.z;
+	s.emissive = texture( u_gbuffer3, uv ).xyz;
+
+#ifdef GLOBAL_PASS
+	//first pass fills the depth of the screen so the blended objects can be rendered on top
+	gl_FragDepth = depth;
+	FragColor = vec4(computeAmbient(s), 1.0);
+#else
+	FragColor = vec4(computeLight(s, u_light_type, u_light_pos, u_light_front, u_light_col, u_cone_info, u_max_distance), 1.0);
+#endif
+}
+
+
+\impostor_bake.fs
+
+#version 330 core
+
+in vec3 v_world_position;
+in vec3 v_normal;
+in vec2 v_uv;
+
+uniform vec4 u_color;
+uniform sampler2D u_texture;
+uniform float u_alpha_cutoff;
+
+//albedo with the coverage, normal in the space of the prefab with the depth of the view
+layout(location = 0) out vec4 Albedo;
+layout(location = 1) out vec4 NormalDepth;
+
+void main()
+{
+	vec4 color = u_color * texture( u_texture, v_uv );
+	if(color.a < u_alpha_cutoff)
+		discard;
+	Albedo = vec4(color.xyz, 1.0);
+	NormalDepth = vec4(normalize(v_normal) * 0.5 + 0.5, gl_FragCoord.z);
+}
+
+
+\impostor.vs
+
+#version 330 core
+
+in vec3 a_vertex;
+in vec2 a_coord;
+
+//per instance attribute, takes 4 consecutive locations
+in mat4 u_model;
+
+#include "frame_block.glsl"
+
+uniform vec3 u_impostor_center; //center of the views in the space of the prefab
+uniform float u_impostor_radius; //half of the side of a view
+uniform float u_impostor_frames; //views per side of the atlas
+
+out vec3 v_world_position;
+out vec2 v_uv;
+out vec3 v_depth_axis; //world offset from the quad to the points with depth 0 in the view
+out mat3 v_normal_matrix;
+
+vec2 signNotZero(vec2 v)
+{
+	return vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+//must match Impostor::getViewDirection
+vec3 octahedronToDirection(vec2 uv)
+{
+	vec2 f = uv * 2.0 - 1.0;
+	vec3 n = vec3(f, 1.0 - abs(f.x) - abs(f.y));
+	if(n.z < 0.0)
+		n.xy = (1.0 - abs(n.yx)) * signNotZero(n.xy);
+	return normalize(n);
+}
+
+vec2 directionToOctahedron(vec3 n)
+{
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	if(n.z < 0.0)
+		n.xy = (1.0 - abs(n.yx)) * signNotZero(n.xy);
+	return n.xy * 0.5 + 0.5;
+}
+
+void main()
+{
+	//view of the atlas closest to the direction of the camera, in the space of the prefab
+	mat3 rotation = mat3(u_model);
+	vec3 world_center = (u_model * vec4(u_impostor_center, 1.0)).xyz;
+	vec3 view = normalize(inverse(rotation) * (u_camera_position - world_center));
+	vec2 frame = clamp(floor(directionToOctahedron(view) * u_impostor_frames), 0.0, u_impostor_frames - 1.0);
+	vec3 D = octahedronToDirection((frame + 0.5) / u_impostor_frames);
+
+	//same basis than Impostor::getViewProjection, the quad covers the view
+	vec3 up_reference = abs(D.y) > 0.99 ? vec3(0.0, 0.0, 1.0) : vec3(0.0, 1.0, 0.0);
+	vec3 right = normalize(cross(up_reference, D));
+	vec3 up = cross(D, right);
+	vec3 position = u_impostor_center + (right * a_vertex.x + up * a_vertex.y) * u_impostor_radius;
+
+	v_world_position = (u_model * vec4(position, 1.0)).xyz;
+	v_depth_axis = rotation * D * u_impostor_radius;
+	v_normal_matrix = rotation;
+	v_uv = (frame + a_coord) / u_impostor_frames;
+	gl_Position = u_viewprojection * vec4( v_world_position, 1.0 );
+}
+
+
+\impostor.fs
+
+#version 330 core
+
+const int MAX_LIGHTS = 10;
+
+#include "frame_block.glsl"
+const int u_use_specular = 0; //the atlas has no material parameters
+#include "light_eval.fs"
+#include "light_block.glsl"
+
+in vec3 v_world_position;
+in vec2 v_uv;
+in vec3 v_depth_axis;
+in mat3 v_normal_matrix;
+
+uniform sampler2D u_texture; //albedo, alpha is the coverage
+uniform sampler2D u_normalmap; //normal in the space of the prefab, alpha is the depth in the view
+uniform int u_light_list[MAX_LIGHTS]; //indices in the light block
+uniform int u_num_lights;
+
+out vec4 FragColor;
+
+void main()
+{
+	vec4 albedo = texture( u_texture, v_uv );
+	if(albedo.a < 0.5)
+		discard;
+	vec4 normal_depth = texture( u_normalmap, v_uv );
+
+	//the depth of the view moves the pixel from the quad to the surface
+	sSurface s;
+	s.position = v_world_position + v_depth_axis * (1.0 - 2.0 * normal_depth.a);
+	s.albedo = albedo.xyz;
+	s.alpha = 1.0;
+	s.N = normalize(v_normal_matrix * (normal_depth.xyz * 2.0 - 1.0));
+	s.V = normalize(u_camera_position - s.position);
+	s.emissive = vec3(0.0);
+	s.occlusion = 1.0;
+	s.metalness = 0.0;
+	s.roughness = 1.0;
+
+	vec3 color = computeAmbient(s);
+	for(int i = 0; i < MAX_LIGHTS; ++i)
+	{
+		if(i >= u_num_lights)
+			break;
+		color += computeBlockLight(s, u_light_list[i]);
+	}
+	FragColor = vec4(color, 1.0);
+
+	vec4 clip = u_viewprojection * vec4(s.position, 1.0);
+	gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+}
@@ -48,6 +48,7 @@ void CORE::init()
 	SDL_Init(SDL_INIT_EVERYTHING);
 	Input::init();
 	TaskManager::background.startThread();
+	TaskManager::workers.startThreads(std::max((int)std::thread::hardware_concurrency() - 1, 1));
 }
 
 //create a window using SDL
@@ -1601,6 +1601,21 @@ bool BoundingBoxSphereOverlap(const BoundingBox& box, const Vector3f& center, fl
 	return false; //OUTSIDE;
 }
 
+//from "Cull that cone!" (Bart Wronski)
+bool ConeSphereOverlap(const Vector3f& cone_pos, const Vector3f& cone_dir, float cone_cos, float cone_range, const Vector3f& center, float radius)
+{
+	Vector3f v = center - cone_pos;
+	float v_len_sq = dot(v, v);
+	float v1_len = dot(v, cone_dir);
+	float cone_sin = sqrt(std::max(1.0f - cone_cos * cone_cos, 0.0f));
+	float distance_closest_point = cone_cos * sqrt(std::max(v_len_sq - v1_len * v1_len, 0.0f)) - v1_len * cone_sin;
+	if (distance_closest_point > radius)
+		return false;
+	if (v1_len < -radius || v1_len > cone_range + radius)
+		return false;
+	return true;
+}
+
 
 std::ostream& operator<<(std::ostream& os, const Vector3f& v)
 {
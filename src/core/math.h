@@ -413,6 +413,7 @@ bool RaySphereCollision(const Vector3f& center, const float& radius, const Vecto
 bool RayPlaneCollision( const Vector3f& plane_pos, const Vector3f& plane_normal, const Vector3f& ray_origin, const Vector3f& ray_dir, Vector3f& result );
 bool RayBoundingBoxCollision(const BoundingBox& box, const Vector3f& ray_origin, const Vector3f& ray_dir, Vector3f& coll);
 bool BoundingBoxSphereOverlap(const BoundingBox& box, const Vector3f& center, float radius );
+bool ConeSphereOverlap(const Vector3f& cone_pos, const Vector3f& cone_dir, float cone_cos, float cone_range, const Vector3f& center, float radius); //cone_dir normalized, cone_cos of the half angle
 inline Vector3f reflect(const Vector3f& I, const Vector3f& N) { return I - N * 2.0f * dot(N, I); }
 
 //value between 0 and 1
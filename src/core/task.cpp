@@ -3,9 +3,12 @@
 #include <thread>         // std::thread
 #include <chrono>		  //ms
 #include <cassert>
+#include <atomic>
+#include <algorithm>
 
 TaskManager TaskManager::foreground;
 TaskManager TaskManager::background;
+TaskManager TaskManager::workers;
 
 TaskManager::TaskManager()
 {
@@ -13,6 +16,11 @@ TaskManager::TaskManager()
 	_thread = NULL;
 }
 
+TaskManager::~TaskManager()
+{
+	stopThreads();
+}
+
 void TaskManager::loop()
 {
 	using namespace std::chrono_literals;
@@ -22,7 +30,9 @@ void TaskManager::loop()
 	{
 		if (pending_tasks.empty())
 		{
-			std::this_thread::sleep_for(10ms);
+			//sleep until a task is added (timeout just in case)
+			std::unique_lock<std::mutex> lock(tasks_mutex);
+			tasks_condition.wait_for(lock, 10ms, [this] { return !pending_tasks.empty() || !must_loop; });
 			continue;
 		}
 
@@ -32,7 +42,7 @@ void TaskManager::loop()
 	std::cout << "Ending Task Manager" << std::endl;
 }
 
-void TaskManager::fetchTask()
+bool TaskManager::fetchTask()
 {
 	Task* task = NULL;
 	try
@@ -40,7 +50,7 @@ void TaskManager::fetchTask()
 		//lock
 		const std::lock_guard<std::mutex> lock(tasks_mutex);
 		if (pending_tasks.empty())
-			return;
+			return false;
 		task = pending_tasks.front();
 		pending_tasks.pop_front();
 		//unlock after finishing scope
@@ -49,12 +59,12 @@ void TaskManager::fetchTask()
 		std::cout << "[exception caught]\n";
 	}
 
-	if (task)
-	{
-		task->onExecute();
-		delete task;
-		task = NULL;
-	}
+	if (!task)
+		return false;
+
+	task->onExecute();
+	delete task;
+	return true;
 }
 
 void thread_loop_func(TaskManager* manager)
@@ -70,10 +80,71 @@ void TaskManager::startThread()
 	_thread = new std::thread(thread_loop_func, this);
 }
 
+void TaskManager::startThreads(int num_threads)
+{
+	assert(!_thread && !_workers.size() && "TaskManager already has threads");
+	must_loop = true;
+	for (int i = 0; i < num_threads; ++i)
+		_workers.push_back(new std::thread(thread_loop_func, this));
+}
+
+void TaskManager::stopThreads()
+{
+	{
+		const std::lock_guard<std::mutex> lock(tasks_mutex);
+		must_loop = false;
+	}
+	tasks_condition.notify_all();
+
+	if (_thread)
+		_workers.push_back(_thread);
+	for (std::thread* thread : _workers)
+	{
+		if (thread->joinable())
+			thread->join();
+		delete thread;
+	}
+	_workers.clear();
+	_thread = NULL;
+}
+
+void TaskManager::parallelFor(int count, std::function<void(int start, int end)> func, int min_chunk_size)
+{
+	if (count <= 0)
+		return;
+
+	//one chunk per thread (the caller counts as one), never smaller than min_chunk_size
+	int num_chunks = std::min(workers.getNumThreads() + 1, (count + min_chunk_size - 1) / std::max(min_chunk_size, 1));
+	if (num_chunks <= 1 || !workers.must_loop)
+	{
+		func(0, count);
+		return;
+	}
+
+	int chunk_size = (count + num_chunks - 1) / num_chunks;
+	std::atomic<int> pending(0);
+	for (int start = chunk_size; start < count; start += chunk_size)
+	{
+		int end = std::min(start + chunk_size, count);
+		pending++;
+		workers.addTask(new Task([&func, &pending, start, end]() {
+			func(start, end);
+			pending--;
+		}));
+	}
+
+	//first chunk in this thread, then help with the rest
+	func(0, std::min(chunk_size, count));
+	while (pending > 0)
+		if (!workers.fetchTask())
+			std::this_thread::yield();
+}
+
 void TaskManager::addTask(Task* task)
 {
 	//block pending_tasks
 	const std::lock_guard<std::mutex> lock(tasks_mutex);
 	pending_tasks.push_back(task);
+	tasks_condition.notify_one();
 	//release pending_tasks automatically
 }
\ No newline at end of file
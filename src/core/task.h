@@ -3,6 +3,7 @@
 #include <vector>
 #include <list>
 #include <mutex>
+#include <condition_variable>
 #include <thread>         // std::thread
 #include <functional>
 
@@ -20,15 +21,25 @@ class TaskManager {
 public:
 	std::list<Task*> pending_tasks;
 	std::mutex tasks_mutex;  // protects pending_tasks
+	std::condition_variable tasks_condition; //wakes up the threads when a task is added
 	bool must_loop;
 	std::thread* _thread;
+	std::vector<std::thread*> _workers; //extra threads when started with startThreads
 
 	static TaskManager foreground;
 	static TaskManager background;
+	static TaskManager workers; //pool used to split heavy work of the frame (see parallelFor)
 
 	TaskManager();
+	~TaskManager(); //stops and joins the threads
 	void addTask(Task* task);
-	void fetchTask();
+	bool fetchTask(); //returns false if there was nothing to do
 	void loop();
 	void startThread();
+	void startThreads(int num_threads);
+	void stopThreads();
+	int getNumThreads() { return (_thread ? 1 : 0) + (int)_workers.size(); }
+
+	//calls func(start, end) for chunks of [0, count) in the worker threads, the calling thread helps and it returns when all are done
+	static void parallelFor(int count, std::function<void(int start, int end)> func, int min_chunk_size = 1);
 };
\ No newline at end of file
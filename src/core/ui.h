@@ -30,7 +30,7 @@ namespace UI {
 	void DrawIcon(int iconx, int icony, float size = 0,float alpha = 1.0f);
 	bool ButtonIcon(int iconx, int icony, float size = 0, float alpha = 1.0f);
 
-	void inspectObject(Matrix44& matrix);
+	bool inspectObject(Matrix44& matrix); //returns true if it was changed
 
 	void Layers(const char* text, uint8* layers);
 	bool Filename(const char* text, std::string& filename, std::string base_folder);
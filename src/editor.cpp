@@ -122,6 +122,8 @@ void SceneEditor::render(Camera* camera)
 		{
 			static bool was_used = false;
 			bool used = UI::manipulateMatrix(SCN::BaseEntity::s_selected->root.model, camera);
+			if (used)
+				SCN::BaseEntity::s_selected->root.markDirty();
 			if (!was_used && used)
 				saveUndo();
 			was_used = used;
@@ -325,7 +327,8 @@ void SceneEditor::inspectEntity(SCN::BaseEntity* entity)
 	ImGui::Checkbox("Visible", &entity->visible);
 	UI::Layers("Layers", &entity->layers);
 
-	UI::inspectObject(entity->root.model);//Model edit
+	if (UI::inspectObject(entity->root.model))//Model edit
+		entity->root.markDirty();
 #endif
 }
 
@@ -340,6 +343,7 @@ void SceneEditor::inspectEntity(SCN::PrefabEntity* entity)
 	{
 		entity->loadPrefab(entity->filename.c_str());
 	}
+	ImGui::Checkbox("Static", &entity->is_static);
 
 #endif
 }
@@ -495,7 +499,8 @@ void SceneEditor::inspectObject(SCN::Node* node)
 	ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.75f, 0.75f, 0.75f, 1.0f));
 
 	//Model edit
-	UI::inspectObject(node->model);
+	if (UI::inspectObject(node->model))
+		node->markDirty();
 
 	//Material
 	if (node->material && ImGui::TreeNode(node->material, "Material"))
@@ -557,12 +562,15 @@ void SceneEditor::inspectObject(Camera* camera)
 void SceneEditor::inspectObject(SCN::Material* material)
 {
 #ifndef SKIP_IMGUI
+	bool changed = false;
 	ImGui::Text("Name: %s", material->name.c_str()); // Show String
-	ImGui::Checkbox("Two sided", &material->two_sided);
-	ImGui::Combo("AlphaMode", (int*)&material->alpha_mode, "NO_ALPHA\0MASK\0BLEND", 3);
-	ImGui::SliderFloat("Alpha Cutoff", &material->alpha_cutoff, 0.0f, 1.0f);
-	ImGui::ColorEdit4("Color", material->color.v); // Edit 4 floats representing a color + alpha
-	ImGui::ColorEdit3("Emissive", material->emissive_factor.v);
+	changed |= ImGui::Checkbox("Two sided", &material->two_sided);
+	changed |= ImGui::Combo("AlphaMode", (int*)&material->alpha_mode, "NO_ALPHA\0MASK\0BLEND", 3);
+	changed |= ImGui::SliderFloat("Alpha Cutoff", &material->alpha_cutoff, 0.0f, 1.0f);
+	changed |= ImGui::ColorEdit4("Color", material->color.v); // Edit 4 floats representing a color + alpha
+	changed |= ImGui::ColorEdit3("Emissive", material->emissive_factor.v);
+	if (changed)
+		material->version++;
 	for (size_t i = 0; i < SCN::eTextureChannel::ALL; ++i)
 	{
 		if (material->textures[i].texture && ImGui::TreeNode( &material->textures[i], SCN::texture_channel_str[i] ))
@@ -14,6 +14,7 @@ namespace GFX
 
 		renderbuffer_color = 0;
 		renderbuffer_depth = 0;
+		prev_viewport[0] = prev_viewport[1] = prev_viewport[2] = prev_viewport[3] = 0;
 		num_color_textures = 0;
 		owns_textures = false;
 		width = 0;
@@ -68,7 +69,7 @@ namespace GFX
 		for (int i = 0; i < num_textures; ++i)
 		{
 			Texture* colortex = textures[i] = new Texture(width, height, format, type, false); //,NULL, format == GL_RGBA ? GL_RGBA8 : GL_RGB8 
-			glBindTexture(colortex->texture_type, colortex->texture_id);	//we activate this id to tell opengl we are going to use this texture
+			bindTextureToActiveUnit(colortex->texture_type, colortex->texture_id);	//we activate this id to tell opengl we are going to use this texture
 			glTexParameteri(colortex->texture_type, GL_TEXTURE_MAG_FILTER, GL_NEAREST);	//set the min filter
 			glTexParameteri(colortex->texture_type, GL_TEXTURE_MIN_FILTER, GL_NEAREST);   //set the mag filter
 			glTexParameteri(colortex->texture_type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
@@ -232,7 +233,7 @@ namespace GFX
 		assert(tex && "framebuffer without texture");
 		glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo_id);
 		checkGLErrors();
-		glPushAttrib(GL_VIEWPORT_BIT);
+		glGetIntegerv(GL_VIEWPORT, prev_viewport); //glPushAttrib is not available in core profile
 		glDrawBuffers(4, bufs);
 		glViewport(0, 0, (int)tex->width, (int)tex->height);
 		assert(glGetError() == GL_NO_ERROR);
@@ -243,8 +244,8 @@ namespace GFX
 	void FBO::unbind()
 	{
 		// output goes to the FBO and its attached buffers
-		glPopAttrib();
 		glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+		glViewport(prev_viewport[0], prev_viewport[1], prev_viewport[2], prev_viewport[3]);
 		//glDrawBuffers(1, &one_buffer);
 		assert(glGetError() == GL_NO_ERROR);
 	}
@@ -22,6 +22,7 @@ namespace GFX {
 
 		GLuint renderbuffer_color;
 		GLuint renderbuffer_depth;//not used
+		int prev_viewport[4]; //restored in unbind
 
 		FBO();
 		~FBO();
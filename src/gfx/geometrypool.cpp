@@ -0,0 +1,254 @@
+#include "geometrypool.h"
+
+#include "../core/includes.h"
+#include "gfx.h"
+#include "shader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+
+using namespace GFX;
+
+std::vector<GeometryPool*> GeometryPool::pools;
+bool GeometryPool::use_pools = true;
+
+#define POOL_INITIAL_VERTICES (64 * 1024)
+#define POOL_INITIAL_INDICES (256 * 1024)
+
+GeometryPool::GeometryPool(const sVertexLayout& layout, unsigned int index_type)
+{
+	this->layout = layout;
+	this->index_type = index_type;
+	vertex_buffer_id = index_buffer_id = 0;
+	vertex_capacity = index_capacity = 0;
+	used_vertices = used_indices = 0;
+	num_meshes = 0;
+	generation = 0;
+	vao_id = draw_data_buffer_id = indirect_buffer_id = 0;
+	vao_generation = 0;
+}
+
+GeometryPool::~GeometryPool()
+{
+	if (vertex_buffer_id)
+		glDeleteBuffers(1, &vertex_buffer_id);
+	if (index_buffer_id)
+		glDeleteBuffers(1, &index_buffer_id);
+	if (vao_id)
+		glDeleteVertexArrays(1, &vao_id);
+	if (draw_data_buffer_id)
+		glDeleteBuffers(1, &draw_data_buffer_id);
+	if (indirect_buffer_id)
+		glDeleteBuffers(1, &indirect_buffer_id);
+}
+
+GeometryPool* GeometryPool::Get(const sVertexLayout& layout, unsigned int index_type)
+{
+	for (GeometryPool* pool : pools)
+		if (pool->index_type == index_type && pool->layout.stride == layout.stride && memcmp(pool->layout.formats, layout.formats, VA_COUNT) == 0)
+			return pool;
+	GeometryPool* pool = new GeometryPool(layout, index_type);
+	pools.push_back(pool);
+	return pool;
+}
+
+void GeometryPool::Release()
+{
+	for (GeometryPool* pool : pools)
+		delete pool;
+	pools.clear();
+}
+
+std::string GeometryPool::getStats()
+{
+	std::string result;
+	char line[128];
+	for (GeometryPool* pool : pools)
+	{
+		size_t index_size = pool->index_type == GL_UNSIGNED_SHORT ? 2 : 4;
+		snprintf(line, sizeof(line), "Pool %dB/%dbit: %d meshes, %.1f/%.1f MB\n", pool->layout.stride, (int)index_size * 8, pool->num_meshes,
+			(pool->used_vertices * pool->layout.stride + pool->used_indices * index_size) / (1024.0f * 1024.0f),
+			(pool->vertex_capacity * pool->layout.stride + pool->index_capacity * index_size) / (1024.0f * 1024.0f));
+		result += line;
+	}
+	return result;
+}
+
+bool GeometryPool::takeRange(std::vector<sFreeRange>& free_ranges, uint32 count, uint32& start)
+{
+	for (size_t i = 0; i < free_ranges.size(); ++i)
+	{
+		sFreeRange& range = free_ranges[i];
+		if (range.count < count)
+			continue;
+		start = range.start;
+		range.start += count;
+		range.count -= count;
+		if (!range.count)
+			free_ranges.erase(free_ranges.begin() + i);
+		return true;
+	}
+	return false;
+}
+
+void GeometryPool::giveRange(std::vector<sFreeRange>& free_ranges, uint32 start, uint32 count)
+{
+	if (!count)
+		return;
+
+	//sorted by start, joined with the neighbours
+	auto it = std::lower_bound(free_ranges.begin(), free_ranges.end(), start, [](const sFreeRange& range, uint32 value) { return range.start < value; });
+	size_t i = it - free_ranges.begin();
+	free_ranges.insert(it, { start, count });
+	if (i + 1 < free_ranges.size() && free_ranges[i].start + free_ranges[i].count == free_ranges[i + 1].start)
+	{
+		free_ranges[i].count += free_ranges[i + 1].count;
+		free_ranges.erase(free_ranges.begin() + i + 1);
+	}
+	if (i > 0 && free_ranges[i - 1].start + free_ranges[i - 1].count == free_ranges[i].start)
+	{
+		free_ranges[i - 1].count += free_ranges[i].count;
+		free_ranges.erase(free_ranges.begin() + i);
+	}
+}
+
+void GeometryPool::grow(unsigned int target, unsigned int& buffer_id, uint32& capacity, uint32 element_size, uint32 min_capacity, std::vector<sFreeRange>& free_ranges)
+{
+	uint32 new_capacity = std::max(capacity * 2, target == GL_ARRAY_BUFFER ? (uint32)POOL_INITIAL_VERTICES : (uint32)POOL_INITIAL_INDICES);
+	while (new_capacity < min_capacity)
+		new_capacity *= 2;
+
+	//the copy targets do not touch the bindings of the vertex arrays
+	GLuint new_buffer_id = 0;
+	glGenBuffers(1, &new_buffer_id);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, new_buffer_id);
+	glBufferData(GL_COPY_WRITE_BUFFER, (size_t)new_capacity * element_size, NULL, GL_STATIC_DRAW);
+	if (buffer_id)
+	{
+		glBindBuffer(GL_COPY_READ_BUFFER, buffer_id);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, (size_t)capacity * element_size);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		glDeleteBuffers(1, &buffer_id);
+	}
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	giveRange(free_ranges, capacity, new_capacity - capacity);
+	buffer_id = new_buffer_id;
+	capacity = new_capacity;
+	generation++;
+	checkGLErrors();
+}
+
+bool GeometryPool::allocate(uint32 num_vertices, uint32 num_indices, sPoolRange& range)
+{
+	if (!num_vertices || !num_indices)
+		return false;
+
+	if (!takeRange(free_vertices, num_vertices, range.vertex_start))
+	{
+		grow(GL_ARRAY_BUFFER, vertex_buffer_id, vertex_capacity, layout.stride, vertex_capacity + num_vertices, free_vertices);
+		takeRange(free_vertices, num_vertices, range.vertex_start);
+	}
+	if (!takeRange(free_indices, num_indices, range.index_start))
+	{
+		grow(GL_ELEMENT_ARRAY_BUFFER, index_buffer_id, index_capacity, index_type == GL_UNSIGNED_SHORT ? 2 : 4, index_capacity + num_indices, free_indices);
+		takeRange(free_indices, num_indices, range.index_start);
+	}
+	range.num_vertices = num_vertices;
+	range.num_indices = num_indices;
+	used_vertices += num_vertices;
+	used_indices += num_indices;
+	num_meshes++;
+	return true;
+}
+
+void GeometryPool::release(const sPoolRange& range)
+{
+	giveRange(free_vertices, range.vertex_start, range.num_vertices);
+	giveRange(free_indices, range.index_start, range.num_indices);
+	used_vertices -= range.num_vertices;
+	used_indices -= range.num_indices;
+	num_meshes--;
+}
+
+void GeometryPool::upload(const sPoolRange& range, const void* vertices, const void* indices)
+{
+	size_t index_size = index_type == GL_UNSIGNED_SHORT ? 2 : 4;
+	glBindBuffer(GL_COPY_WRITE_BUFFER, vertex_buffer_id);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, (size_t)range.vertex_start * layout.stride, (size_t)range.num_vertices * layout.stride, vertices);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, index_buffer_id);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, (size_t)range.index_start * index_size, (size_t)range.num_indices * index_size, indices);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	checkGLErrors();
+}
+
+bool GeometryPool::supportsIndirect()
+{
+	static int supported = -1;
+	if (supported == -1)
+	{
+		GLint gl_major = 0, gl_minor = 0;
+		glGetIntegerv(GL_MAJOR_VERSION, &gl_major);
+		glGetIntegerv(GL_MINOR_VERSION, &gl_minor);
+		supported = gl_major * 10 + gl_minor >= 43;
+	}
+	return supported == 1;
+}
+
+unsigned int GeometryPool::getVAO()
+{
+	if (vao_id && vao_generation == generation)
+		return vao_id;
+
+	//created again when the buffers grow, the orphaning of the draw data keeps its name so it does not change it
+	if (!vao_id)
+	{
+		glGenVertexArrays(1, &vao_id);
+		glGenBuffers(1, &draw_data_buffer_id);
+		glGenBuffers(1, &indirect_buffer_id);
+	}
+	vao_generation = generation;
+	glBindVertexArray(vao_id);
+	Mesh::enablePackedAttributes(layout, vertex_buffer_id, 0, NULL);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer_id);
+
+	//per draw attributes in the fixed locations of Shader, a mat4 takes 4 of them
+	glBindBuffer(GL_ARRAY_BUFFER, draw_data_buffer_id);
+	for (int k = 0; k < 7; ++k)
+	{
+		GLuint location = k < 4 ? DRAW_MODEL_LOCATION + k : DRAW_DECODE_LOCATION + k - 4;
+		glEnableVertexAttribArray(location);
+		glVertexAttribPointer(location, 4, GL_FLOAT, false, sizeof(sPerDrawData), (void*)(k * sizeof(Vector4f)));
+		glVertexAttribDivisor(location, 1);
+	}
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	checkGLErrors();
+	return vao_id;
+}
+
+void GeometryPool::drawIndirect(Shader* shader, const sDrawIndirectCommand* commands, int num_commands, const sPerDrawData* draw_data, int num_draws)
+{
+	//the vao only works with the programs that have the attributes in the fixed locations, the ones of the atlas do
+	assert(shader->fixed_attributes);
+	if (!num_commands || !num_draws || !shader->fixed_attributes)
+		return;
+
+	glBindVertexArray(getVAO());
+	glBindBuffer(GL_ARRAY_BUFFER, draw_data_buffer_id);
+	glBufferData(GL_ARRAY_BUFFER, num_draws * sizeof(sPerDrawData), draw_data, GL_STREAM_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer_id);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, num_commands * sizeof(sDrawIndirectCommand), commands, GL_STREAM_DRAW);
+	glMultiDrawElementsIndirect(GL_TRIANGLES, index_type, NULL, num_commands, 0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	glBindVertexArray(0);
+	checkGLErrors();
+
+	for (int i = 0; i < num_commands; ++i)
+	{
+		Mesh::num_triangles_rendered += commands[i].count / 3 * commands[i].instance_count;
+		Mesh::num_meshes_rendered++;
+	}
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <vector>
+#include <string>
+
+#include "mesh.h"
+
+namespace GFX {
+
+	class Shader;
+
+	//same layout than the command of glMultiDrawElementsIndirect
+	struct sDrawIndirectCommand
+	{
+		uint32 count;
+		uint32 instance_count;
+		uint32 first_index;
+		int32 base_vertex;
+		uint32 base_instance; //first record of the per draw data
+	};
+
+	//per draw data of the multi draws, read as instanced attributes so every command reads its own ones with base_instance
+	struct sPerDrawData
+	{
+		Matrix44 model;
+		Vector4f vertex_offset; //dequantization of the mesh, see vertex_decode.glsl
+		Vector4f vertex_scale;
+		Vector4f uv_transform;
+	};
+
+	//Big vertex and index buffers shared by all the static meshes with the same packed layout and index type. The ranges
+	//are sub-allocated (first fit, merged again when released), when full the buffers grow copying the content in the GPU
+	//so the ranges stay valid. Binding a pool once allows to draw any number of its meshes with a single multi draw.
+	class GeometryPool
+	{
+	public:
+		static std::vector<GeometryPool*> pools;
+		static bool use_pools; //packed indexed meshes are uploaded to the pools instead of their own buffers
+
+		sVertexLayout layout;
+		unsigned int index_type;
+		unsigned int vertex_buffer_id;
+		unsigned int index_buffer_id;
+		uint32 vertex_capacity; //in vertices
+		uint32 index_capacity; //in indices
+		uint32 used_vertices;
+		uint32 used_indices;
+		int num_meshes;
+		uint32 generation; //changes every time the buffers are replaced by bigger ones
+		unsigned int vao_id; //pool vertices, indices and per draw data in the fixed locations of the shaders
+		uint32 vao_generation; //the vao points to the buffers of this generation
+		unsigned int draw_data_buffer_id; //per draw data and commands of the multi draws, orphaned every time
+		unsigned int indirect_buffer_id;
+
+		GeometryPool(const sVertexLayout& layout, unsigned int index_type);
+		~GeometryPool();
+
+		//the pool of the layout (packed, with the offsets and stride already set) and index type, created if it does not exist
+		static GeometryPool* Get(const sVertexLayout& layout, unsigned int index_type);
+		static void Release();
+		static std::string getStats();
+
+		bool allocate(uint32 num_vertices, uint32 num_indices, sPoolRange& range);
+		void release(const sPoolRange& range);
+		void upload(const sPoolRange& range, const void* vertices, const void* indices);
+
+		//true if the GPU can do glMultiDrawElementsIndirect with base instance (GL 4.3)
+		static bool supportsIndirect();
+
+		//binds the vao with the pool vertices and the per draw data as instanced attributes (u_model and the decode of
+		//vertex_decode.glsl with PER_DRAW_DECODE), then draws all the commands in one glMultiDrawElementsIndirect
+		void drawIndirect(Shader* shader, const sDrawIndirectCommand* commands, int num_commands, const sPerDrawData* draw_data, int num_draws);
+
+	private:
+		struct sFreeRange {
+			uint32 start;
+			uint32 count;
+		};
+		std::vector<sFreeRange> free_vertices;
+		std::vector<sFreeRange> free_indices;
+
+		unsigned int getVAO();
+		void grow(unsigned int target, unsigned int& buffer_id, uint32& capacity, uint32 element_size, uint32 min_capacity, std::vector<sFreeRange>& free_ranges);
+		static bool takeRange(std::vector<sFreeRange>& free_ranges, uint32 count, uint32& start);
+		static void giveRange(std::vector<sFreeRange>& free_ranges, uint32 start, uint32 count);
+	};
+
+};
@@ -37,9 +37,21 @@ namespace GFX {
 			nCurAvailMemoryInKB = 0;
 		}
 
-		std::string str = "FPS: " + std::to_string(CORE::BaseApplication::instance->fps) + " Time: " + std::to_string(gpu_frame_microseconds) + "us DCS: " + std::to_string(Mesh::num_meshes_rendered) + " Tris: " + std::to_string(long(Mesh::num_triangles_rendered * 0.001)) + "Ks  VRAM: " + std::to_string(int((nTotalMemoryInKB - nCurAvailMemoryInKB) * 0.001)) + "MBs / " + std::to_string(int(nTotalMemoryInKB * 0.001)) + "MBs";
+		//triangles of every detail level, only when the simplified ones are used
+		std::string lods;
+		if (Mesh::num_triangles_rendered != Mesh::num_triangles_rendered_lod[0])
+		{
+			lods = " (LODs";
+			for (int i = 0; i < MAX_MESH_LODS; ++i)
+				lods += (i ? "/" : " ") + std::to_string(long(Mesh::num_triangles_rendered_lod[i] * 0.001));
+			lods += "Ks)";
+		}
+
+		std::string str = "FPS: " + std::to_string(CORE::BaseApplication::instance->fps) + " Time: " + std::to_string(gpu_frame_microseconds) + "us DCS: " + std::to_string(Mesh::num_meshes_rendered) + " Tris: " + std::to_string(long(Mesh::num_triangles_rendered * 0.001)) + "Ks" + lods + "  VRAM: " + std::to_string(int((nTotalMemoryInKB - nCurAvailMemoryInKB) * 0.001)) + "MBs / " + std::to_string(int(nTotalMemoryInKB * 0.001)) + "MBs";
 		Mesh::num_meshes_rendered = 0;
 		Mesh::num_triangles_rendered = 0;
+		for (int i = 0; i < MAX_MESH_LODS; ++i)
+			Mesh::num_triangles_rendered_lod[i] = 0;
 		return str;
 	}
 
@@ -76,9 +88,7 @@ namespace GFX {
 		}
 
 		glLineWidth(1);
-		glEnable(GL_BLEND);
-		glDepthMask(false);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		setGPUState(GFX_STATE_WRITE_RGB | GFX_STATE_WRITE_A | GFX_STATE_DEPTH_TEST_LESS | GFX_STATE_BLEND_FUNC(GFX_STATE_BLEND_SRC_ALPHA, GFX_STATE_BLEND_INV_SRC_ALPHA));
 		Shader* grid_shader = Shader::getDefaultShader("grid");
 		grid_shader->enable();
 		Matrix44 m;
@@ -88,8 +98,7 @@ namespace GFX {
 		grid_shader->setUniform("u_camera_position", Camera::current->eye);
 		grid_shader->setUniform("u_viewprojection", Camera::current->viewprojection_matrix);
 		grid->render(GL_LINES); //background grid
-		glDisable(GL_BLEND);
-		glDepthMask(true);
+		setGPUState(GFX_STATE_DEFAULT);
 		grid_shader->disable();
 	}
 
@@ -209,7 +218,7 @@ namespace GFX {
 		GFX::checkGLErrors();
 		if (!handler)
 			glGenQueries(1, &handler);
-		glBeginQuery(GL_TIME_ELAPSED, handler);
+		glBeginQuery(type, handler);
 		waiting = true;
 		GFX::checkGLErrors();
 	}
@@ -218,7 +227,7 @@ namespace GFX {
 	{
 		if (!handler)
 			return;
-		glEndQuery(GL_TIME_ELAPSED);
+		glEndQuery(type);
 	}
 
 	bool GPUQuery::isReady()
@@ -237,12 +246,151 @@ namespace GFX {
 	}
 };
 
-/*
-uint64 gpu_current_state = GFX_STATE_DEFAULT;
+//GPU STATE CACHE
+
+namespace GFX {
+
+	sGPUStateStats gpu_state_stats;
+	uint64 gpu_current_state = GFX_STATE_DEFAULT;
+	bool gpu_state_valid = false; //false when the GL state is unknown
+
+	//GFX_STATE_BLEND_* values, GFX_STATE_DEPTH_TEST_* values and GFX_STATE_BLEND_EQUATION_* values in GL
+	static const GLenum gl_blend_factors[] = { GL_ZERO, GL_ZERO, GL_ONE, GL_SRC_COLOR, GL_ONE_MINUS_SRC_COLOR, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA,
+		GL_DST_ALPHA, GL_ONE_MINUS_DST_ALPHA, GL_DST_COLOR, GL_ONE_MINUS_DST_COLOR, GL_SRC_ALPHA_SATURATE, GL_CONSTANT_COLOR, GL_ONE_MINUS_CONSTANT_COLOR, GL_ZERO, GL_ZERO };
+	static const GLenum gl_depth_funcs[] = { GL_ALWAYS, GL_LESS, GL_LEQUAL, GL_EQUAL, GL_GEQUAL, GL_GREATER, GL_NOTEQUAL, GL_NEVER, GL_ALWAYS };
+	static const GLenum gl_blend_equations[] = { GL_FUNC_ADD, GL_FUNC_SUBTRACT, GL_FUNC_REVERSE_SUBTRACT, GL_MIN, GL_MAX, GL_FUNC_ADD, GL_FUNC_ADD, GL_FUNC_ADD };
+
+	static void setCapability(GLenum cap, bool enabled)
+	{
+		if (enabled)
+			glEnable(cap);
+		else
+			glDisable(cap);
+	}
+
+	void setGPUState(uint64 state)
+	{
+		uint64 changed = gpu_state_valid ? (state ^ gpu_current_state) : GFX_STATE_MASK;
+		if (!changed)
+		{
+			gpu_state_stats.state_skipped++;
+			return;
+		}
+		gpu_state_stats.state_changes++;
 
-void setGPUState(uint64 state)
-{
-	//TODO
-}
-*/
+		if (changed & (GFX_STATE_WRITE_RGB | GFX_STATE_WRITE_A))
+			glColorMask((state & GFX_STATE_WRITE_R) != 0, (state & GFX_STATE_WRITE_G) != 0, (state & GFX_STATE_WRITE_B) != 0, (state & GFX_STATE_WRITE_A) != 0);
+		if (changed & GFX_STATE_WRITE_Z)
+			glDepthMask((state & GFX_STATE_WRITE_Z) != 0);
+
+		if (changed & GFX_STATE_DEPTH_TEST_MASK)
+		{
+			int func = (int)((state & GFX_STATE_DEPTH_TEST_MASK) >> GFX_STATE_DEPTH_TEST_SHIFT);
+			setCapability(GL_DEPTH_TEST, func != 0);
+			if (func)
+				glDepthFunc(gl_depth_funcs[func]);
+		}
+
+		if (changed & (GFX_STATE_BLEND_MASK | GFX_STATE_BLEND_EQUATION_MASK))
+		{
+			uint64 blend = (state & GFX_STATE_BLEND_MASK) >> GFX_STATE_BLEND_SHIFT;
+			setCapability(GL_BLEND, blend != 0);
+			if (blend)
+			{
+				uint64 equation = (state & GFX_STATE_BLEND_EQUATION_MASK) >> GFX_STATE_BLEND_EQUATION_SHIFT;
+				glBlendFuncSeparate(gl_blend_factors[blend & 0xF], gl_blend_factors[(blend >> 4) & 0xF], gl_blend_factors[(blend >> 8) & 0xF], gl_blend_factors[(blend >> 12) & 0xF]);
+				glBlendEquationSeparate(gl_blend_equations[equation & 0x7], gl_blend_equations[(equation >> 3) & 0x7]);
+			}
+		}
+
+		if (changed & GFX_STATE_CULL_MASK)
+		{
+			uint64 cull = state & GFX_STATE_CULL_MASK;
+			setCapability(GL_CULL_FACE, cull != 0);
+			if (cull)
+				glCullFace(cull == GFX_STATE_CULL_CW ? GL_BACK : GL_FRONT);
+		}
+
+		if (changed & GFX_STATE_BLEND_ALPHA_TO_COVERAGE)
+			setCapability(GL_SAMPLE_ALPHA_TO_COVERAGE, (state & GFX_STATE_BLEND_ALPHA_TO_COVERAGE) != 0);
+		if (changed & GFX_STATE_MSAA)
+			setCapability(GL_MULTISAMPLE, (state & GFX_STATE_MSAA) != 0);
+		if (changed & GFX_STATE_LINEAA)
+			setCapability(GL_LINE_SMOOTH, (state & GFX_STATE_LINEAA) != 0);
+		if (changed & GFX_STATE_POINT_SIZE_MASK)
+		{
+			int size = (int)((state & GFX_STATE_POINT_SIZE_MASK) >> GFX_STATE_POINT_SIZE_SHIFT);
+			glPointSize((float)(size ? size : 1));
+		}
+		if (changed & GFX_STATE_WIREFRAME)
+			glPolygonMode(GL_FRONT_AND_BACK, (state & GFX_STATE_WIREFRAME) ? GL_LINE : GL_FILL);
+
+		gpu_current_state = state;
+		gpu_state_valid = true;
+	}
 
+	uint64 getGPUState()
+	{
+		return gpu_current_state;
+	}
+
+	void invalidateGPUState()
+	{
+		gpu_state_valid = false;
+	}
+
+	//TEXTURE UNITS CACHE
+
+	#define GFX_MAX_TEXTURE_UNITS 32
+
+	struct sBoundTexture {
+		GLenum target;
+		GLuint id;
+	};
+	sBoundTexture bound_textures[GFX_MAX_TEXTURE_UNITS];
+	int active_texture_unit = -1; //-1 if unknown
+
+	void setActiveTextureUnit(int unit)
+	{
+		if (unit == active_texture_unit)
+			return;
+		glActiveTexture(GL_TEXTURE0 + unit);
+		active_texture_unit = unit;
+	}
+
+	void bindTexture(int unit, GLenum target, GLuint texture_id)
+	{
+		assert(unit >= 0 && unit < GFX_MAX_TEXTURE_UNITS);
+		sBoundTexture& bound = bound_textures[unit];
+		if (bound.target == target && bound.id == texture_id)
+		{
+			gpu_state_stats.texture_binds_skipped++;
+			return;
+		}
+		setActiveTextureUnit(unit);
+		glBindTexture(target, texture_id);
+		bound.target = target;
+		bound.id = texture_id;
+		gpu_state_stats.texture_binds++;
+	}
+
+	void bindTextureToActiveUnit(GLenum target, GLuint texture_id)
+	{
+		if (active_texture_unit == -1)
+			setActiveTextureUnit(0);
+		bindTexture(active_texture_unit, target, texture_id);
+	}
+
+	void releaseTexture(GLuint texture_id)
+	{
+		for (sBoundTexture& bound : bound_textures)
+			if (bound.id == texture_id)
+				bound.id = 0;
+	}
+
+	void invalidateTextureCache()
+	{
+		memset(bound_textures, 0, sizeof(bound_textures));
+		active_texture_unit = -1;
+	}
+};
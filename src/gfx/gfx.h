@@ -30,6 +30,7 @@ namespace GFX {
 
 	void displaceMesh(Mesh* mesh, ::Image* heightmap, float altitude);
 
+	//GL_TIME_ELAPSED or an occlusion query (GL_ANY_SAMPLES_PASSED...), isReady does not block and stores the result in value
 	class GPUQuery
 	{
 	public:
@@ -37,7 +38,7 @@ namespace GFX {
 		GLuint handler;
 		GLuint64 value;
 		bool waiting;
-		GPUQuery(GLuint type);
+		GPUQuery(GLuint type = GL_TIME_ELAPSED);
 		~GPUQuery();
 		void start();
 		void finish();
@@ -47,9 +48,8 @@ namespace GFX {
 };
 
 
-//GPU state representation from BGFX
+//GPU state representation from BGFX, use GFX::setGPUState to apply it
 
-/*
 //Color RGB/alpha/depth write. When it's not specified write will be disabled.
 
 #define GFX_STATE_WRITE_R                        UINT64_C(0x0000000000000001) //!< Enable R write.
@@ -103,6 +103,12 @@ namespace GFX {
 #define GFX_STATE_BLEND_SHIFT                    12                           //!< Blend state bit shift
 #define GFX_STATE_BLEND_MASK                     UINT64_C(0x000000000ffff000) //!< Blend state bit mask
 
+#define GFX_STATE_BLEND_FUNC_SEPARATE(_srcRGB, _dstRGB, _srcA, _dstA) (UINT64_C(0) \
+	| ( ( (uint64_t)(_srcRGB) | ( (uint64_t)(_dstRGB) << 4) ) ) \
+	| ( ( (uint64_t)(_srcA  ) | ( (uint64_t)(_dstA  ) << 4) ) << 8) \
+	)
+#define GFX_STATE_BLEND_FUNC(_src, _dst) GFX_STATE_BLEND_FUNC_SEPARATE(_src, _dst, _src, _dst)
+
 //Use GFX_STATE_BLEND_EQUATION(_equation) or GFX_STATE_BLEND_EQUATION_SEPARATE(_equationRGB, _equationA)
 //helper macros.
 #define GFX_STATE_BLEND_EQUATION_ADD             UINT64_C(0x0000000000000000) //!< Blend add: src + dst.
@@ -113,6 +119,9 @@ namespace GFX {
 #define GFX_STATE_BLEND_EQUATION_SHIFT           28                           //!< Blend equation bit shift
 #define GFX_STATE_BLEND_EQUATION_MASK            UINT64_C(0x00000003f0000000) //!< Blend equation bit mask
 
+#define GFX_STATE_BLEND_EQUATION_SEPARATE(_equationRGB, _equationA) ( (uint64_t)(_equationRGB) | ( (uint64_t)(_equationA) << 3) )
+#define GFX_STATE_BLEND_EQUATION(_equation) GFX_STATE_BLEND_EQUATION_SEPARATE(_equation, _equation)
+
 //Cull state. When `GFX_STATE_CULL_*` is not specified culling will be disabled.
 #define GFX_STATE_CULL_CW                        UINT64_C(0x0000001000000000) //!< Cull clockwise triangles.
 #define GFX_STATE_CULL_CCW                       UINT64_C(0x0000002000000000) //!< Cull counter-clockwise triangles.
@@ -146,6 +155,7 @@ namespace GFX {
 #define GFX_STATE_FRONT_CCW                      UINT64_C(0x0000008000000000) //!< Front counter-clockwise (default is clockwise).
 #define GFX_STATE_BLEND_INDEPENDENT              UINT64_C(0x0000000400000000) //!< Enable blend independent.
 #define GFX_STATE_BLEND_ALPHA_TO_COVERAGE        UINT64_C(0x0000000800000000) //!< Enable alpha to coverage.
+#define GFX_STATE_WIREFRAME                      UINT64_C(0x0800000000000000) //!< Polygons as lines (not in BGFX).
        /// Default state is write to RGB, alpha, and depth with depth test less enabled, with clockwise
        /// culling and MSAA (when writing into MSAA frame buffer, otherwise this flag is ignored).
 #define GFX_STATE_DEFAULT (0 \
@@ -159,5 +169,32 @@ namespace GFX {
 
 #define GFX_STATE_MASK                           UINT64_C(0xffffffffffffffff) //!< State bit mask
 
-void setGPUState(uint64 state);
-*/
+namespace GFX {
+
+	//changes of the frame, reset them when you want
+	struct sGPUStateStats {
+		int state_changes;		//setGPUState calls that changed something
+		int state_skipped;		//setGPUState calls with the state already applied
+		int texture_binds;
+		int texture_binds_skipped;
+		int program_binds;
+	};
+	extern sGPUStateStats gpu_state_stats;
+
+	//only the GL calls for the bits that differ from the current state are issued,
+	//cull CW means the back faces with the default GL front face (CCW), primitive type and alpha ref are not GL state so they are ignored
+	void setGPUState(uint64 state);
+	uint64 getGPUState();
+	//call it after changing the state with direct GL calls, the next setGPUState applies everything
+	void invalidateGPUState();
+
+	//binds the texture to the unit only if it is not already there
+	void bindTexture(int unit, GLenum target, GLuint texture_id);
+	void setActiveTextureUnit(int unit);
+	//binds to the active unit through the cache, for the code that creates, uploads or unbinds textures
+	void bindTextureToActiveUnit(GLenum target, GLuint texture_id);
+	//after glDeleteTextures, the units that had it go back to 0 and the id can be reused
+	void releaseTexture(GLuint texture_id);
+	//call it after binding textures with direct GL calls
+	void invalidateTextureCache();
+};
@@ -1,6 +1,7 @@
 #include "mesh.h"
 #include "../extra/textparser.h"
 #include "../utils/utils.h"
+#include "../utils/compression.h"
 #include "shader.h"
 #include "../core/includes.h"
 #include "math.h"
@@ -9,10 +10,14 @@
 #include <cassert>
 #include <iostream>
 #include <limits>
+#include <numeric>
 #include <sys/stat.h>
 
 #include "../pipeline/camera.h" //??
 #include "texture.h"
+#include "simplify.h"
+#include "optimize.h"
+#include "geometrypool.h"
 //#include "animation.h"
 #include "../extra/coldet/coldet.h"
 
@@ -23,11 +28,42 @@ namespace GFX {
 bool Mesh::use_binary = false;			//checks if there is .wbin, it there is one tries to read it instead of the other file
 bool Mesh::auto_upload_to_vram = true;	//uploads the mesh to the GPU VRAM to speed up rendering
 bool Mesh::interleave_meshes = true;	//places the geometry in an interleaved array
-bool Mesh::use_vao = false;	//places the geometry in an interleaved array
+bool Mesh::use_vao = true;
 
 std::map<std::string, Mesh*> Mesh::sMeshesLoaded;
 long Mesh::num_meshes_rendered = 0;
 long Mesh::num_triangles_rendered = 0;
+long Mesh::num_triangles_rendered_lod[MAX_MESH_LODS] = { 0 };
+bool Mesh::generate_lods = true;
+bool Mesh::optimize_meshes = true;
+bool Mesh::compress_bins = false;
+bool Mesh::generate_meshlets = true;
+sVertexLayout Mesh::asset_layout(VF_UNORM16, VF_OCT16, VF_UNORM16, VF_UNORM8, VF_UNORM8); //16 bytes instead of 32 for position, normal and uv
+
+const UniformHandle u_vertex_offset("u_vertex_offset");
+const UniformHandle u_vertex_scale("u_vertex_scale");
+const UniformHandle u_uv_transform("u_uv_transform");
+const UniformHandle u_octahedral_normals("u_octahedral_normals");
+
+sVertexLayout::sVertexLayout(uint8 position, uint8 normal, uint8 uv, uint8 color, uint8 weights)
+{
+	memset(this, 0, sizeof(sVertexLayout));
+	formats[VA_POSITION] = position;
+	formats[VA_NORMAL] = normal;
+	formats[VA_UV] = uv;
+	formats[VA_UV1] = uv == VF_HALF ? VF_HALF : VF_FLOAT; //it has no range of its own
+	formats[VA_COLOR] = color;
+	formats[VA_BONES] = VF_FLOAT;
+	formats[VA_WEIGHTS] = weights;
+}
+
+bool sVertexLayout::isPacked() const
+{
+	for (int i = 0; i < VA_COUNT; ++i)
+		if (formats[i] != VF_FLOAT)
+			return true;
+	return false;
+}
 uint32 Mesh::s_last_index = 0;
 
 #define FORMAT_ASE 1
@@ -39,8 +75,10 @@ Mesh::Mesh()
 {
 	index = s_last_index++;
 	radius = 0;
-	vao_id = vertices_vbo_id = uvs_vbo_id = uvs1_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = 0;
+	vertices_vbo_id = uvs_vbo_id = uvs1_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = 0;
 	collision_model = NULL;
+	bin_file = NULL;
+	pool = NULL;
 
 	clear();
 }
@@ -53,6 +91,9 @@ Mesh::~Mesh()
 
 void Mesh::clear()
 {
+	releasePool();
+	releaseVAOs();
+
 	//Free VBOs
 	#ifdef USE_OPENGL_EXT
 		if (vertices_vbo_id)
@@ -74,8 +115,6 @@ void Mesh::clear()
 		if (uvs1_vbo_id)
 			glDeleteBuffersARB(1, &uvs1_vbo_id);
     #else
-	if(vao_id)
-		glDeleteVertexArrays(1, &vao_id);
 	if (vertices_vbo_id)
 		glDeleteBuffers(1,&vertices_vbo_id);
 	if (uvs_vbo_id)
@@ -98,7 +137,12 @@ void Mesh::clear()
 
 
 	//GPU Buffers ids set to 0
-	vao_id = vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = weights_vbo_id = bones_vbo_id = uvs1_vbo_id = 0;
+	vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = weights_vbo_id = bones_vbo_id = uvs1_vbo_id = 0;
+	index_type = GL_UNSIGNED_INT;
+
+	vertex_offset.set(0, 0, 0);
+	vertex_scale.set(1, 1, 1);
+	uv_transform.set(0, 0, 1, 1);
 
 	//buffers
 	vertices.clear();
@@ -107,12 +151,24 @@ void Mesh::clear()
 	colors.clear();
 	interleaved.clear();
 	m_indices.clear();
+	lods.clear();
+	meshlets.clear();
 	bones.clear();
 	weights.clear();
 	m_uvs1.clear();
 
+	optimized = false;
+
 	if (collision_model)
 		delete (CollisionModel3D*)collision_model;
+	collision_model = NULL;
+
+	if (bin_file)
+	{
+		unmapFile(*bin_file);
+		delete bin_file;
+		bin_file = NULL;
+	}
 }
 
 #define glGenBuffersARB glGenBuffers
@@ -125,22 +181,34 @@ void Mesh::uploadToVRAM()
 {
 	assert(vertices.size() || interleaved.size());
 
-	/*
-	if (use_vao)
-	{
-		if (vao_id == 0)
-			glGenVertexArrays(1, &vao_id);
-		glBindVertexArray(vao_id);
-	}
-	*/
-
 	if (glGenBuffersARB == nullptr)
 	{
 		std::cout << "Error: your graphics cards dont support VBOs. Sorry." << std::endl;
 		exit(0);
 	}
 
-	if (interleaved.size())
+	releasePool();
+	releaseVAOs(); //they point to the old buffers
+	bool packed = vertex_layout.isPacked();
+	vertex_layout.stride = 0;
+	vertex_offset.set(0, 0, 0);
+	vertex_scale.set(1, 1, 1);
+	uv_transform.set(0, 0, 1, 1);
+
+	//the packed streams of the bin, no need to convert them
+	if (bin_file)
+	{
+		bool uploaded = uploadFromBin();
+		unmapFile(*bin_file);
+		delete bin_file;
+		bin_file = NULL;
+		if (uploaded)
+			return;
+	}
+
+	if (packed)
+		uploadPackedVertices();
+	else if (interleaved.size())
 	{
 		// Vertex,Normal,UV
 		if (interleaved_vbo_id == 0)
@@ -176,7 +244,7 @@ void Mesh::uploadToVRAM()
 	}
 
 	// UVs
-	if (m_uvs1.size())
+	if (m_uvs1.size() && !packed)
 	{
 		if (uvs1_vbo_id == 0)
 			glGenBuffersARB(1, &uvs1_vbo_id);
@@ -185,7 +253,7 @@ void Mesh::uploadToVRAM()
 	}
 
 	// Colors
-	if (colors.size())
+	if (colors.size() && !packed)
 	{
 		if (colors_vbo_id == 0)
 			glGenBuffersARB(1, &colors_vbo_id);
@@ -193,14 +261,14 @@ void Mesh::uploadToVRAM()
 		glBufferDataARB(GL_ARRAY_BUFFER_ARB, colors.size() * sizeof(Vector4f), &colors[0], GL_STATIC_DRAW_ARB);
 	}
 
-	if (bones.size())
+	if (bones.size() && !packed)
 	{
 		if (bones_vbo_id == 0)
 			glGenBuffersARB(1, &bones_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, bones_vbo_id);
 		glBufferDataARB(GL_ARRAY_BUFFER_ARB, bones.size() * sizeof(Vector4ub), &bones[0], GL_STATIC_DRAW_ARB);
 	}
-	if (weights.size())
+	if (weights.size() && !packed)
 	{
 		if (weights_vbo_id == 0)
 			glGenBuffersARB(1, &weights_vbo_id);
@@ -210,26 +278,234 @@ void Mesh::uploadToVRAM()
 
 	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
 
-	// Indices
-	if (m_indices.size())
+	// Indices, the pooled ones are already in the pool
+	if (m_indices.size() && !pool)
 	{
 		if (indices_vbo_id == 0)
 			glGenBuffersARB(1, &indices_vbo_id);
 		glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-		glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, m_indices.size() * sizeof(unsigned int), &m_indices[0], GL_STATIC_DRAW_ARB);
+		//half the memory and bandwidth for small meshes, the CPU copy stays in 32 bits
+		if (getNumVertices() < 65536)
+		{
+			std::vector<uint16> indices16(m_indices.begin(), m_indices.end());
+			glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, indices16.size() * sizeof(uint16), &indices16[0], GL_STATIC_DRAW_ARB);
+			index_type = GL_UNSIGNED_SHORT;
+		}
+		else
+		{
+			glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, m_indices.size() * sizeof(unsigned int), &m_indices[0], GL_STATIC_DRAW_ARB);
+			index_type = GL_UNSIGNED_INT;
+		}
 	}
 	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, 0);
 
-	/*
-	if (use_vao)
+	checkGLErrors();
+	//clear buffers to save memory
+}
+
+//name in the shaders and components in RAM of every attribute, without shader the location is the attribute index
+static const char* attribute_names[VA_COUNT] = { "a_vertex", "a_normal", "a_coord", "a_coord1", "a_color", "a_bones", "a_weights" };
+static const int attribute_components[VA_COUNT] = { 3, 3, 2, 2, 4, 4, 4 };
+
+static uint16 floatToHalf(float value)
+{
+	uint32 f;
+	memcpy(&f, &value, sizeof(f));
+	uint32 sign = (f >> 16) & 0x8000;
+	int exponent = (int)((f >> 23) & 0xFF) - 127 + 15;
+	uint32 mantissa = f & 0x7FFFFF;
+	if (exponent <= 0)
+		return (uint16)sign; //too small, zero
+	if (exponent >= 31)
+		return (uint16)(sign | 0x7C00); //too big, infinite
+	return (uint16)((sign | (exponent << 10) | (mantissa >> 13)) + ((mantissa >> 12) & 1)); //rounded, it can carry to the exponent
+}
+
+//bytes of the attribute in the packed vertex, multiple of 4 so all of them are aligned
+static int getAttributeSize(int attribute, uint8 format)
+{
+	int components = attribute_components[attribute];
+	int bytes = components * 4;
+	if (attribute == VA_BONES || format == VF_OCT16)
+		bytes = 4;
+	else if (format == VF_HALF || format == VF_UNORM16)
+		bytes = components * 2;
+	else if (format == VF_UNORM8)
+		bytes = components;
+	return (bytes + 3) & ~3;
+}
+
+static void writeAttribute(uint8* dst, uint8 format, const float* values, int components)
+{
+	for (int i = 0; i < components; ++i)
+		switch (format)
+		{
+		case VF_FLOAT: ((float*)dst)[i] = values[i]; break;
+		case VF_HALF: ((uint16*)dst)[i] = floatToHalf(values[i]); break;
+		case VF_UNORM16: ((uint16*)dst)[i] = (uint16)(clamp(values[i], 0.0f, 1.0f) * 65535.0f + 0.5f); break;
+		case VF_OCT16: ((int16*)dst)[i] = (int16)floorf(clamp(values[i], -1.0f, 1.0f) * 32767.0f + 0.5f); break;
+		case VF_UNORM8: dst[i] = (uint8)(clamp(values[i], 0.0f, 1.0f) * 255.0f + 0.5f); break;
+		}
+}
+
+//must match decodeNormal in vertex_decode.glsl
+static void encodeOctahedral(Vector3f n, float* result)
+{
+	n = n * (1.0f / std::max(fabsf(n.x) + fabsf(n.y) + fabsf(n.z), 1e-20f));
+	result[0] = n.x;
+	result[1] = n.y;
+	if (n.z < 0.0f)
 	{
-		enableBuffers(nullptr);
-		glBindVertexArray(0);
+		result[0] = (1.0f - fabsf(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f);
+		result[1] = (1.0f - fabsf(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f);
 	}
-	*/
+}
 
-	checkGLErrors();
-	//clear buffers to save memory
+void Mesh::packVertices(std::vector<uint8>& data)
+{
+	int num_vertices = getNumVertices();
+	bool is_interleaved = interleaved.size() > 0;
+	bool has_attribute[VA_COUNT] = { true, is_interleaved || normals.size() > 0, is_interleaved || uvs.size() > 0, m_uvs1.size() > 0, colors.size() > 0, bones.size() > 0, weights.size() > 0 };
+	const uint8* formats = vertex_layout.formats;
+
+	int stride = 0;
+	for (int i = 0; i < VA_COUNT; ++i)
+	{
+		vertex_layout.offsets[i] = 0xFF; //not in the mesh
+		if (!has_attribute[i])
+			continue;
+		vertex_layout.offsets[i] = (uint8)stride;
+		stride += getAttributeSize(i, formats[i]);
+	}
+	vertex_layout.stride = (uint8)stride;
+
+	//range of the positions and uvs for the quantization
+	Vector3f min(3.4e+38f, 3.4e+38f, 3.4e+38f), max(-3.4e+38f, -3.4e+38f, -3.4e+38f);
+	Vector2f uv_min(3.4e+38f, 3.4e+38f), uv_max(-3.4e+38f, -3.4e+38f);
+	for (int i = 0; i < num_vertices; ++i)
+	{
+		min.setMin(is_interleaved ? interleaved[i].vertex : vertices[i]);
+		max.setMax(is_interleaved ? interleaved[i].vertex : vertices[i]);
+		if (!has_attribute[VA_UV])
+			continue;
+		const Vector2f& uv = is_interleaved ? interleaved[i].uv : uvs[i];
+		uv_min.set(std::min(uv_min.x, uv.x), std::min(uv_min.y, uv.y));
+		uv_max.set(std::max(uv_max.x, uv.x), std::max(uv_max.y, uv.y));
+	}
+	if (formats[VA_POSITION] == VF_UNORM16)
+	{
+		vertex_offset = min;
+		vertex_scale = max - min;
+	}
+	else if (formats[VA_POSITION] == VF_HALF)
+	{
+		vertex_offset = (max + min) * 0.5f;
+		vertex_scale = (max - min) * 0.5f;
+	}
+	if (formats[VA_UV] == VF_UNORM16 && has_attribute[VA_UV])
+		uv_transform.set(uv_min.x, uv_min.y, uv_max.x - uv_min.x, uv_max.y - uv_min.y);
+	Vector3f inv_scale(vertex_scale.x ? 1.0f / vertex_scale.x : 0.0f, vertex_scale.y ? 1.0f / vertex_scale.y : 0.0f, vertex_scale.z ? 1.0f / vertex_scale.z : 0.0f);
+	Vector2f inv_uv_scale(uv_transform.z ? 1.0f / uv_transform.z : 0.0f, uv_transform.w ? 1.0f / uv_transform.w : 0.0f);
+
+	data.assign((size_t)num_vertices * stride, 0);
+	for (int i = 0; i < num_vertices; ++i)
+	{
+		uint8* vertex = &data[(size_t)i * stride];
+		const uint8* offsets = vertex_layout.offsets;
+
+		Vector3f position = (is_interleaved ? interleaved[i].vertex : vertices[i]) - vertex_offset;
+		position.set(position.x * inv_scale.x, position.y * inv_scale.y, position.z * inv_scale.z);
+		writeAttribute(vertex + offsets[VA_POSITION], formats[VA_POSITION], position.v, 3);
+
+		if (has_attribute[VA_NORMAL])
+		{
+			const Vector3f& normal = is_interleaved ? interleaved[i].normal : normals[i];
+			float octahedral[2];
+			if (formats[VA_NORMAL] == VF_OCT16)
+				encodeOctahedral(normal, octahedral);
+			writeAttribute(vertex + offsets[VA_NORMAL], formats[VA_NORMAL], formats[VA_NORMAL] == VF_OCT16 ? octahedral : normal.v, formats[VA_NORMAL] == VF_OCT16 ? 2 : 3);
+		}
+		if (has_attribute[VA_UV])
+		{
+			Vector2f uv = (is_interleaved ? interleaved[i].uv : uvs[i]) - Vector2f(uv_transform.x, uv_transform.y);
+			uv.set(uv.x * inv_uv_scale.x, uv.y * inv_uv_scale.y);
+			writeAttribute(vertex + offsets[VA_UV], formats[VA_UV], &uv.x, 2);
+		}
+		if (has_attribute[VA_UV1])
+			writeAttribute(vertex + offsets[VA_UV1], formats[VA_UV1], &m_uvs1[i].x, 2);
+		if (has_attribute[VA_COLOR])
+			writeAttribute(vertex + offsets[VA_COLOR], formats[VA_COLOR], &colors[i].x, 4);
+		if (has_attribute[VA_BONES])
+			memcpy(vertex + offsets[VA_BONES], &bones[i], sizeof(Vector4ub));
+		if (has_attribute[VA_WEIGHTS])
+			writeAttribute(vertex + offsets[VA_WEIGHTS], formats[VA_WEIGHTS], &weights[i].x, 4);
+	}
+}
+
+void Mesh::uploadPackedVertices()
+{
+	std::vector<uint8> data;
+	packVertices(data);
+	if (uploadToPool(&data[0]))
+		return;
+	if (interleaved_vbo_id == 0)
+		glGenBuffersARB(1, &interleaved_vbo_id);
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, interleaved_vbo_id);
+	glBufferDataARB(GL_ARRAY_BUFFER_ARB, data.size(), &data[0], GL_STATIC_DRAW_ARB);
+}
+
+bool Mesh::uploadToPool(const void* vertices)
+{
+	releasePool();
+	if (!GeometryPool::use_pools || !m_indices.size() || !vertex_layout.stride)
+		return false;
+
+	//same index type than the own buffers, 16 bits when the vertices fit
+	index_type = getNumVertices() < 65536 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+	GeometryPool* target = GeometryPool::Get(vertex_layout, index_type);
+	if (!target->allocate(getNumVertices(), (uint32)m_indices.size(), pool_range))
+		return false;
+	pool = target;
+	if (index_type == GL_UNSIGNED_SHORT)
+	{
+		std::vector<uint16> indices16(m_indices.begin(), m_indices.end());
+		pool->upload(pool_range, vertices, &indices16[0]);
+	}
+	else
+		pool->upload(pool_range, vertices, &m_indices[0]);
+	return true;
+}
+
+void Mesh::releasePool()
+{
+	if (!pool)
+		return;
+	pool->release(pool_range);
+	pool = NULL;
+	releaseVAOs();
+}
+
+unsigned int Mesh::getVertexBuffer() const
+{
+	return pool ? pool->vertex_buffer_id : interleaved_vbo_id;
+}
+
+unsigned int Mesh::getIndexBuffer() const
+{
+	return pool ? pool->index_buffer_id : indices_vbo_id;
+}
+
+size_t Mesh::getIndexOffset() const
+{
+	return pool ? pool_range.index_start * (index_type == GL_UNSIGNED_SHORT ? sizeof(uint16) : sizeof(unsigned int)) : 0;
+}
+
+void Mesh::setDecodeUniforms(Shader* shader)
+{
+	shader->setUniform(u_vertex_offset, vertex_offset);
+	shader->setUniform(u_vertex_scale, vertex_scale);
+	shader->setUniform(u_uv_transform, uv_transform);
+	shader->setUniform(u_octahedral_normals, vertex_layout.stride && vertex_layout.formats[VA_NORMAL] == VF_OCT16 ? 1 : 0);
 }
 
 int vertex_location = -1;
@@ -239,9 +515,49 @@ int uv1_location = -1;
 int color_location = -1;
 int bones_location = -1;
 int weights_location = -1;
+bool vao_bound = false; //the bound vao has the index buffer, the draws do not bind it
+
+void Mesh::enablePackedAttributes(const sVertexLayout& vertex_layout, unsigned int buffer_id, size_t offset, Shader* sh)
+{
+	int* locations[VA_COUNT] = { &vertex_location, &normal_location, &uv_location, &uv1_location, &color_location, &bones_location, &weights_location };
+	glBindBuffer(GL_ARRAY_BUFFER, buffer_id);
+	for (int i = 0; i < VA_COUNT; ++i)
+	{
+		*locations[i] = -1;
+		if (vertex_layout.offsets[i] == 0xFF)
+			continue;
+		int location = !sh ? i : sh->getAttribLocation(attribute_names[i]);
+		if (location == -1)
+			continue;
+		*locations[i] = location;
+
+		uint8 format = vertex_layout.formats[i];
+		int components = format == VF_OCT16 ? 2 : attribute_components[i];
+		GLenum type = GL_FLOAT;
+		if (i == VA_BONES || format == VF_UNORM8)
+			type = GL_UNSIGNED_BYTE;
+		else if (format == VF_HALF)
+			type = GL_HALF_FLOAT;
+		else if (format == VF_UNORM16)
+			type = GL_UNSIGNED_SHORT;
+		else if (format == VF_OCT16)
+			type = GL_SHORT;
+		GLboolean normalized = i != VA_BONES && format != VF_FLOAT && format != VF_HALF;
+		glEnableVertexAttribArray(location);
+		glVertexAttribPointer(location, components, type, normalized, vertex_layout.stride, (void*)(offset + vertex_layout.offsets[i]));
+	}
+	checkGLErrors();
+}
 
 void Mesh::enableBuffers(Shader* sh)
 {
+	//packed: every attribute from the single buffer with its format, the pooled ones start at their range
+	if (vertex_layout.stride && getVertexBuffer())
+	{
+		enablePackedAttributes(vertex_layout, getVertexBuffer(), pool ? (size_t)pool_range.vertex_start * vertex_layout.stride : 0, sh);
+		return;
+	}
+
 	vertex_location = !sh ? 0 : sh->getAttribLocation("a_vertex");
 	/*
 	assert(vertex_location != -1 && "No a_vertex found in shader");
@@ -380,7 +696,7 @@ void Mesh::enableBuffers(Shader* sh)
 
 }
 
-void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
+void Mesh::render(unsigned int primitive, int submesh_id, int num_instances, int lod)
 {
     //return;
 
@@ -393,23 +709,68 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 	assert((interleaved.size() || vertices.size()) && "No vertices in this mesh");
 
 	//bind buffers to attribute locations
-	enableBuffers(shader);
+	setDecodeUniforms(shader);
+	bindAttributes(shader);
 	checkGLErrors();
 
 	//draw call
-	drawCall(primitive, submesh_id, num_instances);
+	drawCall(primitive, submesh_id, num_instances, lod);
 	checkGLErrors();
 
 	//unbind them
-	disableBuffers(shader);
+	unbindAttributes(shader);
+	checkGLErrors();
+}
+
+void Mesh::renderRanges(unsigned int primitive, const uint32* starts, const int* counts, int num_ranges)
+{
+	Shader* shader = Shader::current;
+	if (!shader || !shader->compiled)
+	{
+		assert(0 && "no shader or shader not compiled or enabled");
+		return;
+	}
+
+	setDecodeUniforms(shader);
+	bindAttributes(shader);
+	drawRanges(primitive, starts, counts, num_ranges);
 	checkGLErrors();
+	unbindAttributes(shader);
+}
+
+void Mesh::drawRanges(unsigned int primitive, const uint32* starts, const int* counts, int num_ranges)
+{
+	assert(m_indices.size() && getIndexBuffer() && "ranges need the indices in the GPU");
+	if (num_ranges <= 0)
+		return;
+
+	size_t index_size = index_type == GL_UNSIGNED_SHORT ? sizeof(uint16) : sizeof(unsigned int);
+	std::vector<const void*> offsets(num_ranges);
+	int size = 0;
+	for (int i = 0; i < num_ranges; ++i)
+	{
+		offsets[i] = (const void*)(getIndexOffset() + starts[i] * index_size);
+		size += counts[i];
+	}
+
+	if (!vao_bound)
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, getIndexBuffer());
+	glMultiDrawElements(primitive, counts, index_type, &offsets[0], num_ranges);
+	if (!vao_bound)
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	num_triangles_rendered += size / 3;
+	num_triangles_rendered_lod[0] += size / 3;
+	num_meshes_rendered++;
 }
 
 void Mesh::getSubmeshStartAndSize(int submesh_id, unsigned int& start, unsigned int& size)
 {
 	start = 0; //in primitives
 	size = (int)vertices.size();
-	if (m_indices.size())
+	if (lods.size())
+		size = lods[0].length; //the simplified levels are after the whole mesh
+	else if (m_indices.size())
 		size = (int)m_indices.size();
 	else
 		if (interleaved.size())
@@ -423,60 +784,73 @@ void Mesh::getSubmeshStartAndSize(int submesh_id, unsigned int& start, unsigned
 	}
 }
 
-void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
+void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances, int lod)
 {
 	unsigned int start;
 	unsigned int size;
 	getSubmeshStartAndSize(submesh_id, start, size);
 
+	//bytes to the first index, submeshes start in primitives. The indices in RAM are always 32 bits
+	unsigned int index_buffer_id = getIndexBuffer();
+	size_t index_size = index_buffer_id && index_type == GL_UNSIGNED_SHORT ? sizeof(uint16) : sizeof(unsigned int);
+	size_t index_offset = start * 3 * index_size;
+	if (submesh_id < 0 && lod > 0 && lod < (int)lods.size())
+	{
+		index_offset = lods[lod].start * index_size;
+		size = lods[lod].length;
+	}
+	else
+		lod = 0;
+	index_offset += getIndexOffset(); //to the range in the pool
+
 	//DRAW
 	if (m_indices.size())
 	{
 		if (num_instances > 0)
 		{
-			assert(indices_vbo_id && "indices must be uploaded to the GPU");
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-			#ifdef OPENGL_ES3
-				glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start * sizeof(Vector3u)), num_instances);
-            #else
-				assert(0 && "not supported in OpenGL ES2");
-            #endif
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+			assert(index_buffer_id && "indices must be uploaded to the GPU");
+			if (!vao_bound)
+				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer_id);
+			glDrawElementsInstanced(primitive, size, index_type, (void*)index_offset, num_instances);
+			if (!vao_bound)
+				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 		}
 		else
 		{
-			if (indices_vbo_id)
+			if (index_buffer_id)
 			{
 				/*if (size != 90)*/ {
-					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-					glDrawElements(primitive, size, GL_UNSIGNED_INT,(void *) (start * sizeof(Vector3u)));
-					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+					if (!vao_bound)
+						glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer_id);
+					glDrawElements(primitive, size, index_type, (void*)index_offset);
+					if (!vao_bound)
+						glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 				}
 				checkGLErrors();
 			}
 			else
-				glDrawElements(primitive, size, GL_UNSIGNED_INT, (void*)(&m_indices[0] + start)); //no multiply, its a vector3u pointer)
+				glDrawElements(primitive, size, GL_UNSIGNED_INT, (void*)((char*)&m_indices[0] + index_offset));
 		}
 	}
 	else //not indexed
 	{
 		if (num_instances > 0)
-		{
-			#ifdef OPENGL_ES3
-				glDrawArraysInstanced(primitive, start, size, num_instances);
-            #else
-				assert(0 && "not supported in OpenGL ES2");
-            #endif
-		}
+			glDrawArraysInstanced(primitive, start, size, num_instances);
 		else
 			glDrawArrays(primitive, start, size);
 	}
 
 	num_triangles_rendered += (size / 3) * (num_instances ? num_instances : 1);
+	num_triangles_rendered_lod[lod] += (size / 3) * (num_instances ? num_instances : 1);
 	num_meshes_rendered++;
 }
 
 void Mesh::disableBuffers(Shader* shader)
+{
+	disableAttributes();
+}
+
+void Mesh::disableAttributes()
 {
 	if (vertex_location != -1) glDisableVertexAttribArray(vertex_location);
 	if (normal_location != -1) glDisableVertexAttribArray(normal_location);
@@ -489,46 +863,94 @@ void Mesh::disableBuffers(Shader* shader)
 	checkGLErrors();
 }
 
-void Mesh::drawUsingVAO(unsigned int primitive, int submesh_id)
+unsigned int Mesh::getVAO(Shader* shader)
 {
-	unsigned int start;
-	unsigned int size;
-	getSubmeshStartAndSize( submesh_id, start, size );
+	uint8 signature = shader ? shader->attribute_mask : 0xFF;
+	uint32 generation = pool ? pool->generation : 0;
+	sVertexArray* vertex_array = NULL;
+	for (sVertexArray& it : vertex_arrays)
+		if (it.signature == signature)
+			vertex_array = &it;
+	if (vertex_array && vertex_array->pool_generation == generation)
+		return vertex_array->vao_id;
+
+	//new signature or the pool buffers were replaced when it grew, the attributes are in the fixed locations
+	if (!vertex_array)
+	{
+		sVertexArray new_array = { signature, generation, 0 };
+		glGenVertexArrays(1, &new_array.vao_id);
+		vertex_arrays.push_back(new_array);
+		vertex_array = &vertex_arrays.back();
+	}
+	vertex_array->pool_generation = generation;
+	glBindVertexArray(vertex_array->vao_id);
+	enableBuffers(shader);
+	if (getIndexBuffer())
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, getIndexBuffer());
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	checkGLErrors();
+	return vertex_array->vao_id;
+}
 
-	if (vao_id == 0) //upload
-	{
-		assert(vertices_vbo_id || interleaved_vbo_id); //geometry is not in the VRAM
-		glGenVertexArrays(1, &vao_id);
-		glBindVertexArray(vao_id);
-		enableBuffers(nullptr);
-		//enable also indices buffer
-		if (indices_vbo_id != 0)
-		{
-			glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-			glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, m_indices.size() * sizeof(unsigned int), &m_indices[0], GL_STATIC_DRAW_ARB);
-		}
-		glBindVertexArray(0);
-	}
+void Mesh::releaseVAOs()
+{
+	for (sVertexArray& vertex_array : vertex_arrays)
+		glDeleteVertexArrays(1, &vertex_array.vao_id);
+	vertex_arrays.clear();
+}
 
-	glBindVertexArray(vao_id);
-	if (indices_vbo_id)
+//the core profile has no vao 0, the buffers enabled one by one go in this one
+static unsigned int getDefaultVAO()
+{
+	static unsigned int default_vao_id = 0;
+	if (!default_vao_id)
+		glGenVertexArrays(1, &default_vao_id);
+	return default_vao_id;
+}
+
+void Mesh::bindAttributes(Shader* shader)
+{
+	//the arrays in RAM cannot go in a vao, and shaders with other locations would read the wrong attributes
+	bool in_vram = (getVertexBuffer() || vertices_vbo_id) && (m_indices.empty() || getIndexBuffer());
+	if (use_vao && in_vram && shader->fixed_attributes)
 	{
-		glDrawElements(primitive, size, GL_UNSIGNED_INT, (void*)(start * sizeof(Vector3u)));
-		//glDrawElementsBaseVertex(primitive,size, GL_UNSIGNED_INT, (void*)(sizeof(unsigned int) * start), 0); //allows to specify offset for vertex buffers also, not only for indices
+		glBindVertexArray(getVAO(shader));
+		vao_bound = true;
+		return;
 	}
-	else
-		glDrawArrays(primitive, start, size);
+	glBindVertexArray(getDefaultVAO());
+	enableBuffers(shader);
+}
+
+void Mesh::unbindAttributes(Shader* shader)
+{
+	if (!vao_bound)
+		disableBuffers(shader);
 	glBindVertexArray(0);
+	vao_bound = false;
+}
 
-	num_triangles_rendered += (size / 3);
-	num_meshes_rendered++;
+void Mesh::drawUsingVAO(unsigned int primitive, int submesh_id)
+{
+	assert(vertices_vbo_id || getVertexBuffer()); //geometry is not in the VRAM
+
+	//without shader (or with one that moved the attributes) the vao has all of them in the fixed locations
+	Shader* shader = Shader::current;
+	if (shader)
+		setDecodeUniforms(shader);
+	glBindVertexArray(getVAO(shader && shader->fixed_attributes ? shader : nullptr));
+	vao_bound = true;
+	drawCall(primitive, submesh_id);
+	glBindVertexArray(0);
+	vao_bound = false;
 }
 
 GLuint instances_buffer_id = 0;
 unsigned int total_instances = 0;
 
 //should be faster but in some system it is slower
-void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int num_instances)
+void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int num_instances, int lod)
 {
 	if (!num_instances)
 		return;
@@ -536,58 +958,57 @@ void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_mod
 	if (glVertexAttribDivisorARB == nullptr)
 		return;//not suported
 
-	#ifdef OPENGL_ES3
-		Shader* shader = Shader::current;
-		assert(shader && "shader must be enabled");
+	Shader* shader = Shader::current;
+	assert(shader && "shader must be enabled");
 
-		//initialize global buffer for models so we dont resize every time
+	//initialize global buffer for models so we dont resize every time
+	if (instances_buffer_id == 0 || total_instances < num_instances)
+	{
 		if (instances_buffer_id == 0)
 		{
 			glGenBuffersARB(1, &instances_buffer_id);
-			glBindBufferARB(GL_ARRAY_BUFFER_ARB, instances_buffer_id);
 			total_instances = 256;
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, total_instances * sizeof(Matrix44), nullptr, GL_STREAM_DRAW_ARB);
-			//glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_instances * sizeof(Matrix44), instanced_models, GL_STREAM_DRAW_ARB);
 		}
-		else if (total_instances < num_instances)
-		{
+		while (total_instances < num_instances)
 			total_instances *= 2;
-			glBindBufferARB(GL_ARRAY_BUFFER_ARB, instances_buffer_id);
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, total_instances * sizeof(Matrix44), nullptr, GL_STREAM_DRAW_ARB);
-		}
-
-		//upload models
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, instances_buffer_id);
-		glBufferSubDataARB(GL_ARRAY_BUFFER_ARB, 0, total_instances * sizeof(Matrix44), instanced_models);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, total_instances * sizeof(Matrix44), nullptr, GL_STREAM_DRAW_ARB);
+	}
 
-		int attribLocation = shader->getAttribLocation("u_model");
-		assert(attribLocation != -1 && "shader must have attribute mat4 u_model (not a uniform)");
-		if (attribLocation == -1)
-			return; //this shader doesnt support instanced model
+	int attribLocation = shader->getAttribLocation("u_model");
+	assert(attribLocation != -1 && "shader must have attribute mat4 u_model (not a uniform)");
+	if (attribLocation == -1)
+		return; //this shader doesnt support instanced model
 
-		//mat4 count as 4 different attributes of vec4... (thanks opengl...)
-		for (int k = 0; k < 4; ++k)
-		{
-			glEnableVertexAttribArray(attribLocation + k );
-			int offset = sizeof(float) * 4 * k;
-			const Uint8* addr = (Uint8*) offset;
-			glVertexAttribPointer(attribLocation + k, 4, GL_FLOAT, false, sizeof(Matrix44), addr);
-			glVertexAttribDivisorARB(attribLocation + k, 1); // This makes it instanced!
-		}
+	//the mesh attributes first, the instanced ones go in the same vao and are disabled before unbinding it
+	setDecodeUniforms(shader);
+	bindAttributes(shader);
 
-		//regular render
-		render(primitive, -1, num_instances);
+	//upload models
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, instances_buffer_id);
+	glBufferSubDataARB(GL_ARRAY_BUFFER_ARB, 0, num_instances * sizeof(Matrix44), instanced_models);
 
-		//disable instanced attribs
-		for (int k = 0; k < 4; ++k)
-		{
-			glDisableVertexAttribArray(attribLocation + k);
-			glVertexAttribDivisorARB(attribLocation + k, 0);
-		}
-		
-    #else
-		assert(0 && "not supported");
-    #endif
+	//mat4 count as 4 different attributes of vec4... (thanks opengl...)
+	for (int k = 0; k < 4; ++k)
+	{
+		glEnableVertexAttribArray(attribLocation + k );
+		int offset = sizeof(float) * 4 * k;
+		const Uint8* addr = (Uint8*) offset;
+		glVertexAttribPointer(attribLocation + k, 4, GL_FLOAT, false, sizeof(Matrix44), addr);
+		glVertexAttribDivisorARB(attribLocation + k, 1); // This makes it instanced!
+	}
+
+	//regular draw
+	drawCall(primitive, -1, num_instances, lod);
+	checkGLErrors();
+
+	//disable instanced attribs
+	for (int k = 0; k < 4; ++k)
+	{
+		glDisableVertexAttribArray(attribLocation + k);
+		glVertexAttribDivisorARB(attribLocation + k, 0);
+	}
+	unbindAttributes(shader);
 }
 
 /*
@@ -619,10 +1040,11 @@ bool Mesh::createCollisionModel(bool is_static)
 
 	if (m_indices.size()) //indexed
 	{
-		collision_model->setTriangleNumber((int)m_indices.size() / 3);
+		unsigned int num_indices = lods.size() ? lods[0].length : (unsigned int)m_indices.size(); //only the whole mesh
+		collision_model->setTriangleNumber((int)num_indices / 3);
 
 		if (interleaved.size())
-			for (unsigned int i = 0; i < m_indices.size(); i+=3)
+			for (unsigned int i = 0; i < num_indices; i+=3)
 			{
 				auto v1 = interleaved[m_indices[i+0]];
 				auto v2 = interleaved[m_indices[i+1]];
@@ -630,7 +1052,7 @@ bool Mesh::createCollisionModel(bool is_static)
 				collision_model->addTriangle(v1.vertex.v, v2.vertex.v, v3.vertex.v);
 			}
 		else
-		for (unsigned int i = 0; i < m_indices.size(); i+=3)
+		for (unsigned int i = 0; i < num_indices; i+=3)
 		{
 			auto v1 = vertices[m_indices[i+0]];
 			auto v2 = vertices[m_indices[i+1]];
@@ -763,6 +1185,222 @@ bool Mesh::interleaveBuffers()
 	return true;
 }
 
+bool Mesh::generateLODs(int max_lods, float reduction, float max_error)
+{
+	lods.clear();
+	//submeshes are ranges of the indices, the levels would break them
+	if (!m_indices.size() || submeshes.size() > 1 || m_indices.size() < 256 * 3)
+		return false;
+
+	const Vector3f* positions = interleaved.size() ? &interleaved[0].vertex : (vertices.size() ? &vertices[0] : NULL);
+	size_t stride = interleaved.size() ? sizeof(tInterleaved) : sizeof(Vector3f);
+	int num_vertices = (int)(interleaved.size() ? interleaved.size() : vertices.size());
+	if (!positions)
+		return false;
+
+	sMeshLOD lod0 = { 0, (uint32)m_indices.size() };
+	lods.push_back(lod0);
+
+	//every level is simplified from the previous one, the error allowed grows with the level
+	float size = box.halfsize.length();
+	std::vector<uint32> result;
+	for (int level = 1; level < max_lods; ++level)
+	{
+		const sMeshLOD& prev = lods.back();
+		int target = ((int)(prev.length * reduction) / 3) * 3;
+		float error_limit = max_error * size * (1 << (level - 1));
+		simplifyIndices(positions, stride, num_vertices, &m_indices[prev.start], prev.length, target, error_limit, result);
+		if (result.size() > prev.length * 0.8f) //not worth another level
+			break;
+		sMeshLOD lod = { (uint32)m_indices.size(), (uint32)result.size() };
+		m_indices.insert(m_indices.end(), result.begin(), result.end());
+		lods.push_back(lod);
+	}
+
+	if (lods.size() == 1)
+		lods.clear();
+	return lods.size() > 0;
+}
+
+template<typename T> static void remapStream(std::vector<T>& stream, const std::vector<uint32>& remap, int count)
+{
+	if (stream.empty())
+		return;
+	std::vector<T> result(count);
+	for (size_t i = 0; i < remap.size(); ++i)
+		if (remap[i] != ~0u)
+			result[remap[i]] = stream[i];
+	stream.swap(result);
+}
+
+template<typename T> static void appendStream(std::vector<uint8>& data, int vertex_size, const std::vector<T>& stream, int& offset)
+{
+	if (stream.empty())
+		return;
+	for (size_t i = 0; i < stream.size(); ++i)
+		memcpy(&data[i * vertex_size + offset], &stream[i], sizeof(T));
+	offset += sizeof(T);
+}
+
+bool Mesh::optimize(sVertexCacheStats* before, sVertexCacheStats* after)
+{
+	if (interleaved.size() || !vertices.size())
+		return false;
+
+	const int cache_size = 16;
+	int num_vertices = (int)vertices.size();
+	std::vector<uint32> indices = m_indices;
+	if (indices.empty())
+	{
+		indices.resize(num_vertices);
+		std::iota(indices.begin(), indices.end(), 0);
+	}
+	int num_indices = lods.size() ? (int)lods[0].length : (int)indices.size();
+	if (before)
+		*before = analyzeVertexCache(&indices[0], num_indices, num_vertices, cache_size);
+
+	//welding, all the attributes of the vertex must be equal
+	int vertex_size = sizeof(Vector3f) + (normals.size() ? sizeof(Vector3f) : 0) + (uvs.size() ? sizeof(Vector2f) : 0) + (m_uvs1.size() ? sizeof(Vector2f) : 0)
+		+ (colors.size() ? sizeof(Vector4f) : 0) + (bones.size() ? sizeof(Vector4ub) : 0) + (weights.size() ? sizeof(Vector4f) : 0);
+	std::vector<uint8> data((size_t)num_vertices * vertex_size);
+	int offset = 0;
+	appendStream(data, vertex_size, vertices, offset);
+	appendStream(data, vertex_size, normals, offset);
+	appendStream(data, vertex_size, uvs, offset);
+	appendStream(data, vertex_size, m_uvs1, offset);
+	appendStream(data, vertex_size, colors, offset);
+	appendStream(data, vertex_size, bones, offset);
+	appendStream(data, vertex_size, weights, offset);
+
+	std::vector<uint32> remap;
+	num_vertices = generateVertexRemap(&data[0], vertex_size, num_vertices, remap);
+	std::vector<uint8>().swap(data);
+	for (uint32& index : indices)
+		index = remap[index];
+	m_indices.swap(indices);
+	remapStream(vertices, remap, num_vertices);
+	remapStream(normals, remap, num_vertices);
+	remapStream(uvs, remap, num_vertices);
+	remapStream(m_uvs1, remap, num_vertices);
+	remapStream(colors, remap, num_vertices);
+	remapStream(bones, remap, num_vertices);
+	remapStream(weights, remap, num_vertices);
+
+	if (generate_lods && lods.empty())
+		generateLODs();
+
+	//submeshes are ranges of the indices, the triangles cannot move between them
+	if (submeshes.size() <= 1)
+	{
+		std::vector<sMeshLOD> ranges = lods;
+		if (ranges.empty())
+			ranges.push_back({ 0, (uint32)m_indices.size() });
+		std::vector<uint32> clusters;
+		for (const sMeshLOD& range : ranges)
+		{
+			optimizeVertexCache(&m_indices[range.start], range.length, num_vertices, cache_size, clusters);
+			optimizeOverdraw(&m_indices[range.start], range.length, &vertices[0], sizeof(Vector3f), num_vertices, clusters, cache_size);
+		}
+	}
+
+	num_vertices = optimizeVertexFetch(&m_indices[0], (int)m_indices.size(), num_vertices, remap);
+	remapStream(vertices, remap, num_vertices);
+	remapStream(normals, remap, num_vertices);
+	remapStream(uvs, remap, num_vertices);
+	remapStream(m_uvs1, remap, num_vertices);
+	remapStream(colors, remap, num_vertices);
+	remapStream(bones, remap, num_vertices);
+	remapStream(weights, remap, num_vertices);
+
+	num_indices = lods.size() ? (int)lods[0].length : (int)m_indices.size();
+	if (after)
+		*after = analyzeVertexCache(&m_indices[0], num_indices, num_vertices, cache_size);
+	optimized = true;
+	return true;
+}
+
+bool Mesh::buildMeshlets(int max_vertices, int max_triangles)
+{
+	meshlets.clear();
+	if (!m_indices.size() || submeshes.size() > 1)
+		return false;
+
+	const Vector3f* positions = interleaved.size() ? &interleaved[0].vertex : &vertices[0];
+	size_t stride = interleaved.size() ? sizeof(tInterleaved) : sizeof(Vector3f);
+	auto position = [positions, stride](uint32 i) -> const Vector3f& { return *(const Vector3f*)((const char*)positions + i * stride); };
+	uint32 num_indices = lods.size() ? lods[0].length : (uint32)m_indices.size();
+
+	//the meshlet every vertex was last added to, to count the different vertices
+	std::vector<int> vertex_meshlet(getNumVertices(), -1);
+	sMeshlet meshlet;
+	meshlet.start = 0;
+	int num_vertices = 0;
+	for (uint32 i = 0; i + 2 < num_indices; i += 3)
+	{
+		int id = (int)meshlets.size();
+		int new_vertices = 0;
+		for (int k = 0; k < 3; ++k)
+			new_vertices += vertex_meshlet[m_indices[i + k]] != id;
+		if (num_vertices + new_vertices > max_vertices || (int)(i - meshlet.start) / 3 >= max_triangles)
+		{
+			meshlet.length = i - meshlet.start;
+			meshlets.push_back(meshlet);
+			meshlet.start = i;
+			num_vertices = 0;
+			id++;
+		}
+		for (int k = 0; k < 3; ++k)
+			if (vertex_meshlet[m_indices[i + k]] != id)
+			{
+				vertex_meshlet[m_indices[i + k]] = id;
+				num_vertices++;
+			}
+	}
+	meshlet.length = num_indices / 3 * 3 - meshlet.start;
+	if (meshlet.length)
+		meshlets.push_back(meshlet);
+
+	//sphere around the box of the vertices and cone of the normals of the triangles
+	for (sMeshlet& m : meshlets)
+	{
+		Vector3f min(3.4e+38f, 3.4e+38f, 3.4e+38f);
+		Vector3f max(-3.4e+38f, -3.4e+38f, -3.4e+38f);
+		Vector3f axis(0, 0, 0);
+		for (uint32 i = m.start; i < m.start + m.length; ++i)
+		{
+			min.setMin(position(m_indices[i]));
+			max.setMax(position(m_indices[i]));
+		}
+		m.center = (min + max) * 0.5f;
+		m.radius = 0;
+		for (uint32 i = m.start; i < m.start + m.length; ++i)
+			m.radius = std::max(m.radius, (position(m_indices[i]) - m.center).length());
+
+		std::vector<Vector3f> normals;
+		for (uint32 i = m.start; i < m.start + m.length; i += 3)
+		{
+			const Vector3f& p0 = position(m_indices[i]);
+			Vector3f normal = cross(position(m_indices[i + 1]) - p0, position(m_indices[i + 2]) - p0);
+			float length = normal.length();
+			if (length <= 0)
+				continue;
+			normal = normal * (1.0f / length);
+			normals.push_back(normal);
+			axis = axis + normal;
+		}
+
+		//the cone must contain all the normals, wider than 84 degrees from the axis is not worth testing
+		float axis_length = axis.length();
+		float min_dot = axis_length > 0 ? 1.0f : -1.0f;
+		m.cone_axis = axis_length > 0 ? axis * (1.0f / axis_length) : Vector3f(0, 0, 1);
+		for (const Vector3f& normal : normals)
+			min_dot = std::min(min_dot, dot(normal, m.cone_axis));
+		m.cone_cutoff = min_dot <= 0.1f ? 1.0f : sqrtf(1.0f - min_dot * min_dot);
+	}
+	return true;
+}
+
+//version 11 header, after the MBIN watermark
 typedef struct 
 {
 	int version;
@@ -778,129 +1416,393 @@ typedef struct
 	int num_submeshes;
 	Matrix44 bind_matrix;
 	char streams[8]; //Vertex/Interlaved|Normal|Uvs|Color|Indices|Bones|Weights|Extra|Uvs1
-	char extra[32]; //unused
+	int num_lods;
+	uint32 lod_lengths[MAX_MESH_LODS]; //indices of every level, they are one after the other in the indices stream
+	int optimized; //went through Mesh::optimize
+	char extra[8]; //unused
 } sMeshInfo;
 
-bool Mesh::readBin(const char* filename)
+//version 13 and newer (MESH_BIN_VERSION): the header, the chunk table and the chunks, all of them start aligned to MESH_BIN_ALIGNMENT
+typedef struct
 {
-	FILE *f;
-	assert(filename);
-
-	struct stat stbuffer;
+	char magic[4]; //MBIN
+	int version; //in the same place than in older versions
+	int header_bytes;
+	int num_chunks;
+	int num_vertices;
+	int num_indices;
+	int num_bones;
+	int num_submeshes;
+	Vector3f aabb_min;
+	Vector3f aabb_max;
+	Vector3f center;
+	Vector3f halfsize;
+	float radius;
+	int num_lods;
+	uint32 lod_lengths[MAX_MESH_LODS];
+	int optimized;
+	Matrix44 bind_matrix;
+	sVertexLayout gpu_layout; //of the GPUV chunk
+	Vector3f vertex_offset; //dequantization of the GPUV chunk
+	Vector3f vertex_scale;
+	Vector4f uv_transform;
+	uint32 gpu_index_type; //GL_UNSIGNED_SHORT if there is a GPUI chunk, otherwise the INDX chunk is uploaded
+} sMeshBinHeader;
+
+typedef struct
+{
+	char id[4];
+	uint32 offset; //from the start of the file
+	uint32 size; //in bytes, as it is stored
+	uint32 raw_size; //in bytes once decompressed
+	uint16 codec; //eStreamCodec
+	uint16 element_size; //bytes of every vertex or index, for the compression filter
+	uint32 reserved[3];
+} sMeshBinChunk;
+
+static uint32 alignBin(size_t offset) { return (uint32)((offset + MESH_BIN_ALIGNMENT - 1) & ~(size_t)(MESH_BIN_ALIGNMENT - 1)); }
+
+static const sMeshBinChunk* findChunk(const sMappedFile& file, const char* id)
+{
+	const sMeshBinHeader* header = (const sMeshBinHeader*)file.data;
+	const sMeshBinChunk* chunks = (const sMeshBinChunk*)(file.data + alignBin(sizeof(sMeshBinHeader)));
+	for (int i = 0; i < header->num_chunks; ++i)
+		if (memcmp(chunks[i].id, id, 4) == 0)
+			return &chunks[i];
+	return NULL;
+}
 
-	stat(filename,&stbuffer);
-	f = fopen(filename,"rb");
-	if (f == NULL)
+//the compressed ones are added to decodes, to decompress all of them at once, false if the size does not fit the stream
+template<typename T> static bool readChunk(std::vector<T>& stream, const sMappedFile& file, const char* id, std::vector<sStreamDecode>& decodes)
+{
+	const sMeshBinChunk* chunk = findChunk(file, id);
+	if (!chunk)
+		return true;
+	if (chunk->raw_size < sizeof(T) || chunk->raw_size % sizeof(T))
 		return false;
+	stream.resize(chunk->raw_size / sizeof(T));
+	if (chunk->codec == CODEC_NONE)
+		memcpy((void*)&stream[0], file.data + chunk->offset, stream.size() * sizeof(T));
+	else
+	{
+		sStreamDecode decode = { file.data + chunk->offset, chunk->size, (uint8*)&stream[0], stream.size() * sizeof(T), chunk->element_size };
+		decodes.push_back(decode);
+	}
+	return true;
+}
 
-	unsigned int size = (unsigned int)stbuffer.st_size;
-	char* data = new char[size];
-	fread(data,size,1,f);
-	fclose(f);
-
-	//watermark
-	if ( memcmp(data,"MBIN",4) != 0 )
+//uploads the chunk to the buffer, the compressed ones are decompressed in the buffer memory
+static bool uploadChunk(GLenum target, unsigned int& buffer_id, const sMappedFile& file, const sMeshBinChunk* chunk)
+{
+	if (buffer_id == 0)
+		glGenBuffersARB(1, &buffer_id);
+	glBindBufferARB(target, buffer_id);
+	bool uploaded = true;
+	if (chunk->codec == CODEC_NONE)
+		glBufferDataARB(target, chunk->size, file.data + chunk->offset, GL_STATIC_DRAW_ARB);
+	else
 	{
-		std::cout << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
-		return false;
+		glBufferDataARB(target, chunk->raw_size, NULL, GL_STATIC_DRAW_ARB);
+		uint8* data = (uint8*)glMapBufferRange(target, 0, chunk->raw_size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		sStreamDecode decode = { file.data + chunk->offset, chunk->size, data, chunk->raw_size, chunk->element_size };
+		uploaded = data && decompressStreams(std::vector<sStreamDecode>(1, decode));
+		if (data)
+			uploaded = glUnmapBuffer(target) && uploaded; //the content can be lost while it is mapped
 	}
+	glBindBufferARB(target, 0);
+	return uploaded;
+}
 
-	char* pos = data + 4;
-	sMeshInfo info;
-	memcpy(&info,pos,sizeof(sMeshInfo));
-	pos += sizeof(sMeshInfo);
+template<typename T> static void readStream(std::vector<T>& stream, const char*& pos, int count)
+{
+	stream.resize(count);
+	if (count)
+		memcpy((void*)&stream[0], pos, sizeof(T) * count);
+	pos += sizeof(T) * count;
+}
 
-	if(info.version != MESH_BIN_VERSION || info.header_bytes != sizeof(sMeshInfo) )
-	{
-		std::cout << "[WARN] loading BIN: old version: " << filename << std::endl;
+//the content of the version 11 after the watermark
+static bool readBinV11(Mesh* mesh, const char* data, size_t size)
+{
+	sMeshInfo info;
+	if (size < 4 + sizeof(sMeshInfo))
 		return false;
-	}
+	memcpy(&info, data + 4, sizeof(sMeshInfo));
+	if (info.version != 11 || info.header_bytes != sizeof(sMeshInfo))
+		return false;
+	const char* pos = data + 4 + sizeof(sMeshInfo);
 
 	if (info.streams[0] == 'I')
+		readStream(mesh->interleaved, pos, info.size);
+	else if (info.streams[0] == 'V')
+		readStream(mesh->vertices, pos, info.size);
+	if (info.streams[1] == 'N')
+		readStream(mesh->normals, pos, info.size);
+	if (info.streams[2] == 'U')
+		readStream(mesh->uvs, pos, info.size);
+	if (info.streams[3] == 'C')
+		readStream(mesh->colors, pos, info.size);
+
+	if (info.streams[4] == 'I')
 	{
-		interleaved.resize(info.size);
-		memcpy((void*)&interleaved[0], pos, sizeof(tInterleaved) * info.size);
-		pos += sizeof(tInterleaved) * info.size;
+		readStream(mesh->m_indices, pos, info.num_indices);
+
+		//old files have zeros here
+		uint32 lods_start = 0;
+		for (int i = 0; i < info.num_lods && i < MAX_MESH_LODS; ++i)
+		{
+			sMeshLOD lod = { lods_start, info.lod_lengths[i] };
+			mesh->lods.push_back(lod);
+			lods_start += info.lod_lengths[i];
+		}
+		if (lods_start != (uint32)info.num_indices)
+			mesh->lods.clear();
 	}
-	else if (info.streams[0] == 'V')
+
+	if (info.streams[5] == 'B')
+		readStream(mesh->bones, pos, info.size);
+	if (info.streams[6] == 'W')
+		readStream(mesh->weights, pos, info.size);
+
+	//in the order writeBin wrote them: bones info before the second uvs
+	readStream(mesh->bones_info, pos, info.num_bones);
+	if (info.streams[7] == 'u')
+		readStream(mesh->m_uvs1, pos, info.size);
+
+	mesh->aabb_max = info.aabb_max;
+	mesh->aabb_min = info.aabb_min;
+	mesh->box.center = info.center;
+	mesh->box.halfsize = info.halfsize;
+	mesh->radius = info.radius;
+	mesh->bind_matrix = info.bind_matrix;
+	mesh->optimized = info.optimized != 0;
+	readStream(mesh->submeshes, pos, info.num_submeshes);
+	return true;
+}
+
+bool Mesh::readBin(const char* filename)
+{
+	assert(filename);
+	sMappedFile file;
+	if (!mapFile(filename, file))
+		return false;
+
+	//watermark, the version goes after it in all of them
+	if (file.size < 8 || memcmp(file.data, "MBIN", 4) != 0)
 	{
-		vertices.resize(info.size);
-		memcpy((void*)&vertices[0], pos, sizeof(Vector3f) * info.size);
-		pos += sizeof(Vector3f) * info.size;
+		std::cout << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
+		unmapFile(file);
+		return false;
 	}
 
-	if (info.streams[1] == 'N')
+	const sMeshBinHeader* header = (const sMeshBinHeader*)file.data;
+	if (header->version == 11)
 	{
-		normals.resize(info.size);
-		memcpy((void*)&normals[0],pos,sizeof(Vector3f) * info.size);
-		pos += sizeof(Vector3f) * info.size;
+		bool loaded = readBinV11(this, (const char*)file.data, file.size);
+		unmapFile(file);
+		return loaded;
 	}
 
-	if (info.streams[2] == 'U')
+	uint32 table_offset = alignBin(sizeof(sMeshBinHeader));
+	bool valid = header->version == MESH_BIN_VERSION && file.size >= sizeof(sMeshBinHeader) && header->header_bytes == sizeof(sMeshBinHeader)
+		&& header->num_chunks >= 0 && table_offset + header->num_chunks * sizeof(sMeshBinChunk) <= file.size;
+	const sMeshBinChunk* chunks = (const sMeshBinChunk*)(file.data + table_offset);
+	for (int i = 0; valid && i < header->num_chunks; ++i)
+		valid = chunks[i].offset % MESH_BIN_ALIGNMENT == 0 && (size_t)chunks[i].offset + chunks[i].size <= file.size
+			&& (chunks[i].codec != CODEC_NONE || chunks[i].raw_size == chunks[i].size) && chunks[i].element_size && chunks[i].raw_size % chunks[i].element_size == 0;
+	if (!valid)
 	{
-		uvs.resize(info.size);
-		memcpy((void*)&uvs[0],pos,sizeof(Vector2f) * info.size);
-		pos += sizeof(Vector2f) * info.size;
+		std::cout << "[WARN] loading BIN: old version: " << filename << std::endl;
+		unmapFile(file);
+		return false;
 	}
 
-	if (info.streams[3] == 'C')
+	std::vector<sStreamDecode> decodes;
+	bool sizes_valid = readChunk(interleaved, file, "INTL", decodes)
+		&& readChunk(vertices, file, "VERT", decodes)
+		&& readChunk(normals, file, "NORM", decodes)
+		&& readChunk(uvs, file, "UVS0", decodes)
+		&& readChunk(m_uvs1, file, "UVS1", decodes)
+		&& readChunk(colors, file, "COLR", decodes)
+		&& readChunk(m_indices, file, "INDX", decodes)
+		&& readChunk(bones, file, "BONE", decodes)
+		&& readChunk(weights, file, "WGHT", decodes)
+		&& readChunk(bones_info, file, "BINF", decodes)
+		&& readChunk(submeshes, file, "SUBM", decodes)
+		&& readChunk(meshlets, file, "MSHL", decodes);
+	if (!sizes_valid || (decodes.size() && !decompressStreams(decodes)))
+	{
+		std::cout << "[ERROR] loading BIN: corrupted stream: " << filename << std::endl;
+		unmapFile(file);
+		clear();
+		return false;
+	}
+
+	uint32 lods_start = 0;
+	for (int i = 0; i < header->num_lods && i < MAX_MESH_LODS; ++i)
 	{
-		colors.resize(info.size);
-		memcpy((void*)&colors[0],pos,sizeof(Vector4f) * info.size);
-		pos += sizeof(Vector4f) * info.size;
+		sMeshLOD lod = { lods_start, header->lod_lengths[i] };
+		lods.push_back(lod);
+		lods_start += header->lod_lengths[i];
 	}
+	if (lods_start != m_indices.size())
+		lods.clear();
 
-	if (info.streams[4] == 'I')
+	aabb_max = header->aabb_max;
+	aabb_min = header->aabb_min;
+	box.center = header->center;
+	box.halfsize = header->halfsize;
+	radius = header->radius;
+	bind_matrix = header->bind_matrix;
+	optimized = header->optimized != 0;
+
+	//the packed vertices go to the GPU straight from the mapping (or decompressed in the buffer)
+	if (findChunk(file, "GPUV"))
 	{
-		m_indices.resize(info.num_indices);
-		memcpy((void*)&m_indices[0], pos, sizeof(unsigned int) * info.num_indices);
-		pos += sizeof(Vector3u) * info.num_indices;
+		bin_file = new sMappedFile(file);
+		return true;
 	}
+	unmapFile(file);
+	return true;
+}
 
-	if (info.streams[5] == 'B')
+bool Mesh::uploadFromBin()
+{
+	const sMeshBinHeader* header = (const sMeshBinHeader*)bin_file->data;
+	const sMeshBinChunk* gpu_vertices = findChunk(*bin_file, "GPUV");
+	if (!gpu_vertices || !vertex_layout.isPacked() || memcmp(header->gpu_layout.formats, vertex_layout.formats, VA_COUNT) != 0)
+		return false;
+
+	vertex_layout = header->gpu_layout;
+	vertex_offset = header->vertex_offset;
+	vertex_scale = header->vertex_scale;
+	uv_transform = header->uv_transform;
+
+	//pooled: the indices come from m_indices, the compressed vertices are decompressed in RAM first
+	if (GeometryPool::use_pools && m_indices.size())
 	{
-		bones.resize(info.size);
-		memcpy((void*)&bones[0], pos, sizeof(Vector4ub) * info.size);
-		pos += sizeof(Vector4ub) * info.size;
+		if (gpu_vertices->codec == CODEC_NONE)
+			return uploadToPool(bin_file->data + gpu_vertices->offset);
+		std::vector<uint8> data(gpu_vertices->raw_size);
+		sStreamDecode decode = { bin_file->data + gpu_vertices->offset, gpu_vertices->size, &data[0], data.size(), gpu_vertices->element_size };
+		return decompressStreams(std::vector<sStreamDecode>(1, decode)) && uploadToPool(&data[0]);
 	}
 
-	if (info.streams[6] == 'W')
+	if (!uploadChunk(GL_ARRAY_BUFFER_ARB, interleaved_vbo_id, *bin_file, gpu_vertices))
+		return false;
+
+	const sMeshBinChunk* gpu_indices = findChunk(*bin_file, header->gpu_index_type == GL_UNSIGNED_SHORT ? "GPUI" : "INDX");
+	if (m_indices.size() && gpu_indices)
 	{
-		weights.resize(info.size);
-		memcpy((void*)&weights[0], pos, sizeof(Vector4f) * info.size);
-		pos += sizeof(Vector4f) * info.size;
+		if (!uploadChunk(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id, *bin_file, gpu_indices))
+			return false;
+		index_type = header->gpu_index_type;
 	}
+	checkGLErrors();
+	return true;
+}
 
-	if (info.streams[7] == 'u')
+bool Mesh::getBinSizes(const char* filename, size_t& stored, size_t& raw)
+{
+	stored = raw = 0;
+	sMappedFile file;
+	if (!mapFile(filename, file))
+		return false;
+	const sMeshBinHeader* header = (const sMeshBinHeader*)file.data;
+	bool valid = file.size >= sizeof(sMeshBinHeader) && memcmp(header->magic, "MBIN", 4) == 0 && header->version == MESH_BIN_VERSION
+		&& alignBin(sizeof(sMeshBinHeader)) + header->num_chunks * sizeof(sMeshBinChunk) <= file.size;
+	const sMeshBinChunk* chunks = (const sMeshBinChunk*)(file.data + alignBin(sizeof(sMeshBinHeader)));
+	for (int i = 0; valid && i < header->num_chunks; ++i)
 	{
-		m_uvs1.resize(info.size);
-		memcpy((void*)&m_uvs1[0], pos, sizeof(Vector2f) * info.size);
-		pos += sizeof(Vector2f) * info.size;
+		stored += chunks[i].size;
+		raw += chunks[i].raw_size;
 	}
+	unmapFile(file);
+	return valid;
+}
+
+static bool writeBinV11(Mesh* mesh, FILE* f)
+{
+	//watermark
+	fwrite("MBIN",sizeof(char),4,f);
+
+	sMeshInfo info;
+	memset(&info, 0, sizeof(info));
+	info.version = 11;
+	info.header_bytes = sizeof(sMeshInfo);
+	info.size = mesh->getNumVertices();
+	info.num_indices = mesh->m_indices.size();
+	info.aabb_max = mesh->aabb_max;
+	info.aabb_min = mesh->aabb_min;
+	info.center = mesh->box.center;
+	info.halfsize = mesh->box.halfsize;
+	info.radius = mesh->radius;
+	info.num_bones = mesh->bones_info.size();
+	info.bind_matrix = mesh->bind_matrix;
+	info.num_submeshes = mesh->submeshes.size();
+	info.num_lods = (int)mesh->lods.size();
+	info.optimized = mesh->optimized;
+	for (size_t i = 0; i < mesh->lods.size() && i < MAX_MESH_LODS; ++i)
+		info.lod_lengths[i] = mesh->lods[i].length;
+
+	info.streams[0] = mesh->interleaved.size() ? 'I' : 'V';
+	info.streams[1] = mesh->normals.size() ? 'N' : ' ';
+	info.streams[2] = mesh->uvs.size() ? 'U' : ' ';
+	info.streams[3] = mesh->colors.size() ? 'C' : ' ';
+	info.streams[4] = mesh->m_indices.size() ? 'I' : ' ';
+	info.streams[5] = mesh->bones.size() ? 'B' : ' ';
+	info.streams[6] = mesh->weights.size() ? 'W' : ' ';
+	info.streams[7] = mesh->m_uvs1.size() ? 'u' : ' '; //uv second set
+
+	//write info
+	fwrite((void*)&info, sizeof(sMeshInfo),1, f);
 
-	if (info.num_bones)
+	//write streams
+	if (mesh->interleaved.size())
+		fwrite((void*)&mesh->interleaved[0], mesh->interleaved.size() * sizeof(Mesh::tInterleaved), 1, f);
+	else
 	{
-		bones_info.resize(info.num_bones);
-		memcpy((void*)&bones_info[0], pos, sizeof(BoneInfo) * info.num_bones);
-		pos += sizeof(BoneInfo) * info.num_bones;
+		fwrite((void*)&mesh->vertices[0], mesh->vertices.size() * sizeof(Vector3f), 1, f);
+		if (mesh->normals.size())
+			fwrite((void*)&mesh->normals[0], mesh->normals.size() * sizeof(Vector3f), 1, f);
+		if (mesh->uvs.size())
+			fwrite((void*)&mesh->uvs[0], mesh->uvs.size() * sizeof(Vector2f), 1, f);
 	}
 
-	aabb_max = info.aabb_max;
-	aabb_min = info.aabb_min;
-	box.center = info.center;
-	box.halfsize = info.halfsize;
-	radius = info.radius;
-	bind_matrix = info.bind_matrix;
+	if (mesh->colors.size())
+		fwrite((void*)&mesh->colors[0], mesh->colors.size() * sizeof(Vector4f), 1, f);
 
-	submeshes.resize(info.num_submeshes);
-	memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
-	pos += sizeof(sSubmeshInfo) * info.num_submeshes;
+	if (mesh->m_indices.size())
+		fwrite((void*)&mesh->m_indices[0], mesh->m_indices.size() * sizeof(unsigned int), 1, f);
 
-	createCollisionModel();
+	if (mesh->bones.size())
+		fwrite((void*)&mesh->bones[0], mesh->bones.size() * sizeof(Vector4ub), 1, f);
+	if (mesh->weights.size())
+		fwrite((void*)&mesh->weights[0], mesh->weights.size() * sizeof(Vector4f), 1, f);
+	if (mesh->bones_info.size())
+		fwrite((void*)&mesh->bones_info[0], mesh->bones_info.size() * sizeof(BoneInfo), 1, f);
+	if (mesh->m_uvs1.size())
+		fwrite((void*)&mesh->m_uvs1[0], mesh->m_uvs1.size() * sizeof(Vector2f), 1, f);
+
+	if (mesh->submeshes.size())
+		fwrite((void*)&mesh->submeshes[0], mesh->submeshes.size() * sizeof(sSubmeshInfo), 1, f);
 	return true;
 }
 
-bool Mesh::writeBin(const char* filename)
+struct sChunkData {
+	const char* id;
+	const void* data;
+	size_t size;
+	int element_size;
+};
+
+template<typename T> static void addChunk(std::vector<sChunkData>& chunks, const char* id, const std::vector<T>& stream, int element_size = sizeof(T))
+{
+	if (stream.size())
+		chunks.push_back({ id, &stream[0], stream.size() * sizeof(T), element_size });
+}
+
+bool Mesh::writeBin(const char* filename, int version)
 {
 	assert( vertices.size() || interleaved.size() );
 	std::string s_filename = filename;
@@ -913,69 +1815,190 @@ bool Mesh::writeBin(const char* filename)
 		return false;
 	}
 
-	//watermark
-	fwrite("MBIN",sizeof(char),4,f);
-
-	sMeshInfo info;
-	memset(&info, 0, sizeof(info));
-	info.version = MESH_BIN_VERSION;
-	info.header_bytes = sizeof(sMeshInfo);
-	info.size = interleaved.size() ? interleaved.size() : vertices.size();
-	info.num_indices = m_indices.size();
-	info.aabb_max = aabb_max;
-	info.aabb_min = aabb_min;
-	info.center = box.center;
-	info.halfsize = box.halfsize;
-	info.radius = radius;
-	info.num_bones = bones_info.size();
-	info.bind_matrix = bind_matrix;
-	info.num_submeshes = submeshes.size();
-
-	info.streams[0] = interleaved.size() ? 'I' : 'V';
-	info.streams[1] = normals.size() ? 'N' : ' ';
-	info.streams[2] = uvs.size() ? 'U' : ' ';
-	info.streams[3] = colors.size() ? 'C' : ' ';
-	info.streams[4] = m_indices.size() ? 'I' : ' ';
-	info.streams[5] = bones.size() ? 'B' : ' ';
-	info.streams[6] = weights.size() ? 'W' : ' ';
-	info.streams[7] = m_uvs1.size() ? 'u' : ' '; //uv second set
-
-	//write info
-	fwrite((void*)&info, sizeof(sMeshInfo),1, f);
-
-	//write streams
-	if (interleaved.size())
-		fwrite((void*)&interleaved[0], interleaved.size() * sizeof(tInterleaved), 1, f);
-	else
+	if (version == 11)
 	{
-		fwrite((void*)&vertices[0], vertices.size() * sizeof(Vector3f), 1, f);
-		if (normals.size())
-			fwrite((void*)&normals[0], normals.size() * sizeof(Vector3f), 1, f);
-		if (uvs.size())
-			fwrite((void*)&uvs[0], uvs.size() * sizeof(Vector2f), 1, f);
+		writeBinV11(this, f);
+		fclose(f);
+		return true;
 	}
 
-	if (colors.size())
-		fwrite((void*)&colors[0], colors.size() * sizeof(Vector4f), 1, f);
+	sMeshBinHeader header;
+	memset((void*)&header, 0, sizeof(header));
+	memcpy(header.magic, "MBIN", 4);
+	header.version = MESH_BIN_VERSION;
+	header.header_bytes = sizeof(sMeshBinHeader);
+	header.num_vertices = getNumVertices();
+	header.num_indices = (int)m_indices.size();
+	header.num_bones = (int)bones_info.size();
+	header.num_submeshes = (int)submeshes.size();
+	header.aabb_min = aabb_min;
+	header.aabb_max = aabb_max;
+	header.center = box.center;
+	header.halfsize = box.halfsize;
+	header.radius = radius;
+	header.num_lods = (int)lods.size();
+	for (size_t i = 0; i < lods.size() && i < MAX_MESH_LODS; ++i)
+		header.lod_lengths[i] = lods[i].length;
+	header.optimized = optimized;
+	header.bind_matrix = bind_matrix;
+	header.gpu_index_type = GL_UNSIGNED_INT;
+
+	std::vector<sChunkData> chunks;
+	addChunk(chunks, "INTL", interleaved);
+	addChunk(chunks, "VERT", vertices);
+	addChunk(chunks, "NORM", normals);
+	addChunk(chunks, "UVS0", uvs);
+	addChunk(chunks, "UVS1", m_uvs1);
+	addChunk(chunks, "COLR", colors);
+	addChunk(chunks, "INDX", m_indices);
+	addChunk(chunks, "BONE", bones);
+	addChunk(chunks, "WGHT", weights);
+	addChunk(chunks, "BINF", bones_info);
+	addChunk(chunks, "SUBM", submeshes);
+	addChunk(chunks, "MSHL", meshlets);
+
+	//the buffers as uploadToVRAM makes them, the packing changes the layout and ranges of the mesh so they are restored
+	//the float streams above are still written: collisions, picking, lods, meshlets and a different asset_layout need them on the CPU
+	std::vector<uint8> gpu_vertices;
+	std::vector<uint16> gpu_indices;
+	if (vertex_layout.isPacked())
+	{
+		sVertexLayout layout = vertex_layout;
+		Vector3f offset = vertex_offset, scale = vertex_scale;
+		Vector4f transform = uv_transform;
+		packVertices(gpu_vertices);
+		header.gpu_layout = vertex_layout;
+		header.vertex_offset = vertex_offset;
+		header.vertex_scale = vertex_scale;
+		header.uv_transform = uv_transform;
+		vertex_layout = layout;
+		vertex_offset = offset;
+		vertex_scale = scale;
+		uv_transform = transform;
+		addChunk(chunks, "GPUV", gpu_vertices, header.gpu_layout.stride);
+
+		if (m_indices.size() && getNumVertices() < 65536)
+		{
+			gpu_indices.assign(m_indices.begin(), m_indices.end());
+			header.gpu_index_type = GL_UNSIGNED_SHORT;
+			addChunk(chunks, "GPUI", gpu_indices);
+		}
+	}
+	header.num_chunks = (int)chunks.size();
 
-	if (m_indices.size())
-		fwrite((void*)&m_indices[0], m_indices.size() * sizeof(unsigned int), 1, f);
+	//table with the offsets, then the chunks
+	std::vector<sMeshBinChunk> table(chunks.size());
+	std::vector<std::vector<uint8>> compressed(chunks.size());
+	uint32 offset = alignBin(alignBin(sizeof(sMeshBinHeader)) + chunks.size() * sizeof(sMeshBinChunk));
+	for (size_t i = 0; i < chunks.size(); ++i)
+	{
+		memset(&table[i], 0, sizeof(sMeshBinChunk));
+		memcpy(table[i].id, chunks[i].id, 4);
+		table[i].raw_size = (uint32)chunks[i].size;
+		table[i].element_size = (uint16)chunks[i].element_size;
+		table[i].codec = CODEC_NONE;
 
-	if (bones.size())
-		fwrite((void*)&bones[0], bones.size() * sizeof(Vector4ub), 1, f);
-	if (weights.size())
-		fwrite((void*)&weights[0], weights.size() * sizeof(Vector4f), 1, f);
-	if (bones_info.size())
-		fwrite((void*)&bones_info[0], bones_info.size() * sizeof(BoneInfo), 1, f);
-	if (m_uvs1.size())
-		fwrite((void*)&m_uvs1[0], m_uvs1.size() * sizeof(Vector2f), 1, f);
+		//only if it saves space, the uncompressed ones are uploaded straight from the file
+		if (compress_bins)
+		{
+			compressStream((const uint8*)chunks[i].data, chunks[i].size, chunks[i].element_size, compressed[i]);
+			if (compressed[i].size() < chunks[i].size * 0.9)
+			{
+				table[i].codec = CODEC_LZ;
+				chunks[i].data = &compressed[i][0];
+				chunks[i].size = compressed[i].size();
+			}
+		}
 
-	fwrite((void*)&submeshes[0], submeshes.size() * sizeof(sSubmeshInfo), 1, f);
+		table[i].offset = offset;
+		table[i].size = (uint32)chunks[i].size;
+		offset = alignBin(offset + chunks[i].size);
+	}
+
+	const char padding[MESH_BIN_ALIGNMENT] = { 0 };
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(padding, alignBin(sizeof(header)) - sizeof(header), 1, f);
+	if (table.size())
+		fwrite(&table[0], table.size() * sizeof(sMeshBinChunk), 1, f);
+	size_t position = alignBin(sizeof(header)) + table.size() * sizeof(sMeshBinChunk);
+	for (size_t i = 0; i < chunks.size(); ++i)
+	{
+		fwrite(padding, table[i].offset - position, 1, f);
+		fwrite(chunks[i].data, chunks[i].size, 1, f);
+		position = table[i].offset + chunks[i].size;
+	}
 
 	fclose(f);
 	return true;
 }
 
+std::string Mesh::benchmarkBinFormats(const std::vector<Mesh*>& meshes, int repetitions)
+{
+	//every mesh is written in every version and loaded like Mesh::Get does it, the files are in the disk cache
+	const int num_formats = 3;
+	const int versions[num_formats] = { 11, MESH_BIN_VERSION, MESH_BIN_VERSION };
+	const bool compressed[num_formats] = { false, false, true };
+	char names[num_formats][16];
+	for (int v = 0; v < num_formats; ++v)
+		snprintf(names[v], sizeof(names[v]), compressed[v] ? "v%d lz" : "v%d", versions[v]);
+	double times[num_formats] = { 0, 0, 0 };
+	size_t bytes[num_formats] = { 0, 0, 0 };
+	int num_meshes = 0;
+	bool compress = compress_bins;
+
+	for (Mesh* source : meshes)
+	{
+		if (!source->getNumVertices())
+			continue;
+		num_meshes++;
+		for (int v = 0; v < num_formats; ++v)
+		{
+			Mesh* copy = new Mesh(*source); //only the streams are used, the copy gets no GPU buffers of the source
+			copy->collision_model = NULL;
+			copy->bin_file = NULL;
+			copy->vertex_arrays.clear();
+			copy->vertices_vbo_id = copy->uvs_vbo_id = copy->uvs1_vbo_id = copy->normals_vbo_id = copy->colors_vbo_id = 0;
+			copy->interleaved_vbo_id = copy->indices_vbo_id = copy->bones_vbo_id = copy->weights_vbo_id = 0;
+			copy->pool = NULL;
+			copy->vertex_layout = asset_layout;
+			compress_bins = compressed[v];
+			copy->writeBin("mesh_benchmark", versions[v]);
+			compress_bins = compress;
+			delete copy;
+
+			const char* filename = "mesh_benchmark.mbin";
+			struct stat info;
+			if (stat(filename, &info) == 0)
+				bytes[v] += info.st_size;
+			for (int r = 0; r < repetitions; ++r)
+			{
+				double start = getPreciseTime();
+				Mesh* mesh = new Mesh();
+				mesh->readBin(filename);
+				if (versions[v] == 11)
+					mesh->createCollisionModel(); //version 11 built it when loading
+				mesh->vertex_layout = asset_layout;
+				mesh->uploadToVRAM();
+				times[v] += getPreciseTime() - start;
+				delete mesh;
+			}
+			remove(filename);
+		}
+	}
+
+	std::string result;
+	char line[128];
+	snprintf(line, sizeof(line), "MBIN load of %d meshes, ms per pass:\n", num_meshes);
+	result += line;
+	for (int v = 0; v < num_formats; ++v)
+	{
+		snprintf(line, sizeof(line), "  %s: %.3f (%d KB, x%.1f faster than v11)\n", names[v], times[v] / repetitions, (int)(bytes[v] / 1024), times[0] / std::max(times[v], 0.0001));
+		result += line;
+	}
+	std::cout << result;
+	return result;
+}
+
 bool Mesh::loadASE(const char* filename)
 {
 	int nVtx,nFcs;
@@ -1451,6 +2474,48 @@ void Mesh::createSphere(float radius, float slices, float arcs)
 }
 
 
+void Mesh::createCone(float radius, float height, int slices)
+{
+	vec3 apex(0, 0, 0);
+	vec3 base_center(0, 0, -height);
+	for (int i = 0; i < slices; ++i)
+	{
+		float u1 = i / (float)slices;
+		float u2 = (i + 1) / (float)slices;
+		float ang1 = u1 * M_PI * 2;
+		float ang2 = u2 * M_PI * 2;
+		vec3 P1(cos(ang1) * radius, sin(ang1) * radius, -height);
+		vec3 P2(cos(ang2) * radius, sin(ang2) * radius, -height);
+
+		//side, counter clockwise seen from outside
+		vec3 N = normalize((P1 - apex).cross(P2 - apex));
+		vertices.push_back(apex);
+		vertices.push_back(P1);
+		vertices.push_back(P2);
+		normals.push_back(N);
+		normals.push_back(N);
+		normals.push_back(N);
+		uvs.push_back(vec2((u1 + u2) * 0.5f, 1));
+		uvs.push_back(vec2(u1, 0));
+		uvs.push_back(vec2(u2, 0));
+
+		//base
+		vertices.push_back(base_center);
+		vertices.push_back(P2);
+		vertices.push_back(P1);
+		normals.push_back(vec3(0, 0, -1));
+		normals.push_back(vec3(0, 0, -1));
+		normals.push_back(vec3(0, 0, -1));
+		uvs.push_back(vec2(0.5f, 0.5f));
+		uvs.push_back(vec2(cos(ang2) * 0.5f + 0.5f, sin(ang2) * 0.5f + 0.5f));
+		uvs.push_back(vec2(cos(ang1) * 0.5f + 0.5f, sin(ang1) * 0.5f + 0.5f));
+	}
+
+	box.center.set(0, 0, -height * 0.5f);
+	box.halfsize.set(radius, radius, height * 0.5f);
+	this->radius = box.halfsize.length();
+}
+
 void Mesh::createWireBox()
 {
 	const float _verts[] = { -1,-1,-1,  1,-1,-1,  -1,1,-1,  1,1,-1, -1,-1,1,  1,-1,1, -1,1,1,  1,1,1,    -1,-1,-1, -1,1,-1, 1,-1,-1, 1,1,-1, -1,-1,1, -1,1,1, 1,-1,1, 1,1,1,   -1,-1,-1, -1,-1,1, 1,-1,-1, 1,-1,1, -1,1,-1, -1,1,1, 1,1,-1, 1,1,1 };
@@ -1710,8 +2775,19 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 	if (file_format != FORMAT_MBIN)
 		binfilename = binfilename + ".mbin";
 
-	//try loading the binary version
-	if (use_binary && m->readBin(binfilename.c_str()) )
+	//try loading the binary version, it is imported again if it was written with other optimize_meshes
+	bool bin_loaded = use_binary && m->readBin(binfilename.c_str());
+	size_t stored_bytes, raw_bytes;
+	if (bin_loaded && getBinSizes(binfilename.c_str(), stored_bytes, raw_bytes) && stored_bytes < raw_bytes)
+		std::cout << "[LZ " << (int)(100 * stored_bytes / raw_bytes) << "%] ";
+	if (bin_loaded && file_format != FORMAT_MBIN && m->optimized != optimize_meshes)
+	{
+		std::cout << "[BIN OUTDATED] ";
+		m->clear();
+		bin_loaded = false;
+	}
+
+	if (bin_loaded)
 	{
 		if (interleave_meshes && m->interleaved.size() == 0)
 		{
@@ -1722,6 +2798,7 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 		if (auto_upload_to_vram)
 		{
 			std::cout << "[VRAM] ";
+			m->vertex_layout = asset_layout;
 			m->uploadToVRAM();
 		}
 
@@ -1746,6 +2823,20 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 		return NULL;
 	}
 
+	sVertexCacheStats before, after;
+	if (optimize_meshes && m->optimize(&before, &after))
+	{
+		char str[64];
+		snprintf(str, sizeof(str), "[OPT ACMR %.2f>%.2f ATVR %.2f>%.2f] ", before.acmr, after.acmr, before.atvr, after.atvr);
+		std::cout << str;
+	}
+	else if (generate_lods)
+		m->generateLODs();
+	if (m->lods.size())
+		std::cout << "[LODS " << m->lods.size() << "] ";
+	if (generate_meshlets && m->buildMeshlets())
+		std::cout << "[MESHLETS " << m->meshlets.size() << "] ";
+
 	//to optimize, interleave the meshes
 	if (interleave_meshes)
 	{
@@ -1757,6 +2848,7 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 	if (auto_upload_to_vram)
 	{
 		std::cout << "[VRAM] ";
+		m->vertex_layout = asset_layout;
 		m->uploadToVRAM();
 	}
 
@@ -7,6 +7,8 @@
 #include <map>
 #include <string>
 
+struct sMappedFile;
+
 struct BoneInfo {
 	char name[32]; //max 32 chars per bone name
 	Matrix44 bind_pose;
@@ -15,10 +17,66 @@ struct BoneInfo {
 namespace GFX {
 
 	class Shader; //for binding
+	class GeometryPool;
 	class Skeleton; //for skinned meshes
+	struct sVertexCacheStats;
+
+	//12: chunk table, 16 bytes aligned chunks and the vertices already packed for the GPU. 13: compressed chunks. 14: meshlets
+#define MESH_BIN_VERSION 14 //this is used to regenerate bins if the format changes
+#define MESH_BIN_ALIGNMENT 16
+#define MAX_MESH_LODS 4
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
 
-	//version from 11/5/2020
-#define MESH_BIN_VERSION 11 //this is used to regenerate bins if the format changes
+	//range of m_indices with the triangles of a detail level
+	struct sMeshLOD
+	{
+		uint32 start;
+		uint32 length;
+	};
+
+	//consecutive triangles of the first level that are culled together, bounds in mesh space
+	struct sMeshlet
+	{
+		Vector3f center; //bounding sphere
+		float radius;
+		Vector3f cone_axis; //average direction the triangles face
+		float cone_cutoff; //sin of the cone half angle, 1 if the triangles face too many directions to cull them
+		uint32 start; //range of m_indices
+		uint32 length;
+	};
+
+	//vertices and indices of a mesh inside a GeometryPool, the indices start at 0 for the first vertex of the range
+	struct sPoolRange
+	{
+		uint32 vertex_start;
+		uint32 num_vertices;
+		uint32 index_start;
+		uint32 num_indices;
+	};
+
+	//formats of the vertex attributes in the GPU
+	enum eVertexFormat : uint8 {
+		VF_FLOAT,	//32 bits per component, as in RAM
+		VF_HALF,	//16 bits floats
+		VF_UNORM16,	//16 bits 0..1 in the range of the attribute, positions and uvs only
+		VF_OCT16,	//unit vector octahedral encoded in two 16 bits snorm, normals only
+		VF_UNORM8	//8 bits 0..1, colors and weights only
+	};
+
+	enum eVertexAttribute { VA_POSITION, VA_NORMAL, VA_UV, VA_UV1, VA_COLOR, VA_BONES, VA_WEIGHTS, VA_COUNT };
+
+	//how the vertices are stored in the GPU. When packed all the attributes go in one buffer, positions relative to the
+	//bounding box and uvs to their range, the shaders restore them with vertex_decode.glsl. Bones are always 4 bytes
+	struct sVertexLayout
+	{
+		uint8 formats[VA_COUNT];
+		uint8 offsets[VA_COUNT]; //in the packed vertex, filled when uploaded
+		uint8 stride;
+
+		sVertexLayout(uint8 position = VF_FLOAT, uint8 normal = VF_FLOAT, uint8 uv = VF_FLOAT, uint8 color = VF_FLOAT, uint8 weights = VF_FLOAT);
+		bool isPacked() const;
+	};
 
 	struct sSubmeshInfo
 	{
@@ -34,14 +92,21 @@ namespace GFX {
 		static std::map<std::string, Mesh*> sMeshesLoaded;
 		static bool use_binary; //always load the binary version of a mesh when possible
 		static bool interleave_meshes; //loaded meshes will me automatically interleaved
-		static bool use_vao; //use vertex array object
+		static bool use_vao; //draws with the cached vertex array objects when the shader has the fixed attribute locations
 		static bool auto_upload_to_vram; //loaded meshes will be stored in the VRAM
 		static long num_meshes_rendered;
 		static long num_triangles_rendered;
+		static long num_triangles_rendered_lod[MAX_MESH_LODS];
+		static bool generate_lods; //indexed meshes get their detail levels when loaded
+		static bool optimize_meshes; //imported meshes are welded and reordered for the vertex cache, overdraw and fetches
+		static sVertexLayout asset_layout; //for the meshes loaded from files and the static batches
+		static bool compress_bins; //the streams of the written bins are compressed when it saves space
+		static bool generate_meshlets; //indexed meshes are split in meshlets when loaded
 		static uint32 s_last_index;
 
 		std::string name;
 		uint32 index; //used internally
+		bool optimized; //went through optimize, stored in the bin
 
 		std::vector<sSubmeshInfo> submeshes; //contains info about every submesh
 
@@ -60,6 +125,8 @@ namespace GFX {
 		std::vector< tInterleaved > interleaved; //to render interleaved
 
 		std::vector<unsigned int> m_indices; //for indexed meshes
+		std::vector<sMeshLOD> lods; //detail levels, the first one is the whole mesh and the simplified ones go after it in m_indices
+		std::vector<sMeshlet> meshlets; //split of the first level, in order
 
 		//for animated meshes
 		std::vector< Vector4ub > bones; //tells which bones afect the vertex (4 max)
@@ -73,7 +140,10 @@ namespace GFX {
 
 		float radius;
 
-		unsigned int vao_id; //Vertex Array Object
+		sVertexLayout vertex_layout; //set it before uploadToVRAM, float by default
+		Vector3f vertex_offset; //dequantization of the packed positions and uvs
+		Vector3f vertex_scale;
+		Vector4f uv_transform; //offset in xy, scale in zw
 
 		unsigned int vertices_vbo_id;
 		unsigned int uvs_vbo_id;
@@ -81,36 +151,67 @@ namespace GFX {
 		unsigned int colors_vbo_id;
 
 		unsigned int indices_vbo_id;
-		unsigned int interleaved_vbo_id;
+		unsigned int index_type; //of the indices in the GPU, GL_UNSIGNED_SHORT when all the vertices fit in 16 bits
+		unsigned int interleaved_vbo_id; //with a packed layout it has all the attributes
 		unsigned int bones_vbo_id;
 		unsigned int weights_vbo_id;
 		unsigned int uvs1_vbo_id;
 
+		GeometryPool* pool; //static indexed packed meshes live in the shared buffers of a pool instead of their own ones
+		sPoolRange pool_range;
+
+		//Vertex Array Objects, one per attribute signature (Shader::attribute_mask) of the shaders that drew the mesh.
+		//Built the first time and released when the mesh is uploaded again
+		struct sVertexArray {
+			uint8 signature;
+			uint32 pool_generation; //the vao points to the pool buffers of this generation
+			unsigned int vao_id;
+		};
+		std::vector<sVertexArray> vertex_arrays;
+
 		Mesh();
 		~Mesh();
 
 		void clear();
 
-		void render(unsigned int primitive, int submesh_id = -1, int num_instances = 0);
-		void renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int number);
+		void render(unsigned int primitive, int submesh_id = -1, int num_instances = 0, int lod = 0);
+		void renderRanges(unsigned int primitive, const uint32* starts, const int* counts, int num_ranges); //see drawRanges
+		void renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int number, int lod = 0);
 		void renderBounding(const Matrix44& model, bool world_bounding = true);
 		void renderFixedPipeline(int primitive); //sloooooooow
 		//void renderAnimated(unsigned int primitive, Skeleton *sk);
 
 		void enableBuffers(Shader* shader); //if shader is null the attrib locations must be POS=0, NORM=1, COORD=2, COORD1=3, COLOR=4, BONES=5, WEIGHTS=6
-		void drawCall(unsigned int primitive, int submesh_id = -1, int num_instances = 0);
+		void drawCall(unsigned int primitive, int submesh_id = -1, int num_instances = 0, int lod = 0);
 		void disableBuffers(Shader* shader);
-
+		static void enablePackedAttributes(const sVertexLayout& layout, unsigned int buffer_id, size_t offset, Shader* shader); //used by enableBuffers and the pools
+		static void disableAttributes(); //the ones enabled by the last enableBuffers
+		void bindAttributes(Shader* shader); //binds the cached vao if it can, if not the buffers one by one in a shared default vao
+		void unbindAttributes(Shader* shader);
+		unsigned int getVAO(Shader* shader); //the vao with the attributes the shader reads, all of them if it is null
+		void releaseVAOs();
+
+		unsigned int getVertexBuffer() const; //the buffer with the packed vertices, the one of the pool if it is pooled
+		unsigned int getIndexBuffer() const;
+		size_t getIndexOffset() const; //bytes to the first index of the mesh in the index buffer
+
+		void drawRanges(unsigned int primitive, const uint32* starts, const int* counts, int num_ranges); //ranges of m_indices in one glMultiDrawElements
 		void getSubmeshStartAndSize(int submesh_id, unsigned int& start, unsigned int& size);
+		void setDecodeUniforms(Shader* shader); //the ones of vertex_decode.glsl, identity if it is not packed
 
+		//the file is mapped in memory, the streams the GPU needs are kept mapped until uploadToVRAM. Version 11 is still read
 		bool readBin(const char* filename);
-		bool writeBin(const char* filename);
+		bool writeBin(const char* filename, int version = MESH_BIN_VERSION);
+		static bool getBinSizes(const char* filename, size_t& stored, size_t& raw); //bytes of the streams, to report the compression
+		static std::string benchmarkBinFormats(const std::vector<Mesh*>& meshes, int repetitions = 5); //loading time of every version
 
 		unsigned int getNumSubmeshes() { return (unsigned int)submeshes.size(); }
+		int getNumLODs() { return lods.size() ? (int)lods.size() : 1; }
 		unsigned int getNumVertices() { return (unsigned int)interleaved.size() ? (unsigned int)interleaved.size() : (unsigned int)vertices.size(); }
 
 		//collision testing
-		void* collision_model;
+		void* collision_model; //created the first time it is tested
+		sMappedFile* bin_file; //mapped by readBin while the GPU streams are not uploaded
 		bool createCollisionModel(bool is_static = false); //is_static sets if the inv matrix should be computed after setTransform (true) or before rayCollision (false)
 		//help: model is the transform of the mesh, ray origin and direction, a Vector3 where to store the collision if found, a Vector3 where to store the normal if there was a collision, max ray distance in case the ray should go to infintiy, and in_object_space to get the collision point in object space or world space
 		bool testRayCollision(Matrix44 model, Vector3f ray_origin, Vector3f ray_direction, Vector3f& collision, Vector3f& normal, float max_ray_dist = 3.4e+38F, bool in_object_space = false);
@@ -127,6 +228,7 @@ namespace GFX {
 		void createSubdividedPlane(float size = 1, int subdivisions = 256, bool centered = false);
 		void createCube(Vector3f size);
 		void createSphere(float radius, float slices = 24,float arcs = 16);
+		void createCone(float radius, float height, int slices = 24); //apex in the origin and base in z = -height, like a spot light looking down -Z
 		void createWireBox();
 		void createGrid(float dist);
 
@@ -136,9 +238,27 @@ namespace GFX {
 
 		//optimize meshes
 		void uploadToVRAM();
+		void uploadPackedVertices(); //converts the attributes to the formats of the vertex_layout
+		bool uploadToPool(const void* vertices); //allocates the mesh in the pool of its layout, the indices come from m_indices
+		void releasePool();
+		void packVertices(std::vector<uint8>& data);
+		bool uploadFromBin(); //uploads the packed streams of the mapped bin if they have the vertex_layout
 		void drawUsingVAO(unsigned int primitive, int submesh_id = -1);
 		bool interleaveBuffers();
 
+		//simplifies the mesh (quadric error) into up to max_lods levels, every one with reduction times the triangles of the previous,
+		//max_error is relative to the size of the mesh and it doubles every level. Only for indexed meshes without submeshes, upload after it
+		bool generateLODs(int max_lods = MAX_MESH_LODS, float reduction = 0.5f, float max_error = 0.01f);
+
+		//import pass: welds the equal vertices (the mesh becomes indexed), generates the LODs if generate_lods, reorders the
+		//triangles of every level for the post transform cache and overdraw and the vertices in the order they are fetched.
+		//Needs the streams separated (before interleaveBuffers), the stats are of the whole mesh before and after
+		bool optimize(sVertexCacheStats* before = NULL, sVertexCacheStats* after = NULL);
+
+		//splits the triangles of the first level in meshlets in the order they are, so the index buffer does not change.
+		//Run it after optimize, the vertex cache order keeps the meshlets compact. Only for indexed meshes without submeshes
+		bool buildMeshlets(int max_vertices = MESHLET_MAX_VERTICES, int max_triangles = MESHLET_MAX_TRIANGLES);
+
 	private:
 		bool loadASE(const char* filename);
 		bool loadOBJ(const char* filename);
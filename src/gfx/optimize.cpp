@@ -0,0 +1,286 @@
+#include "optimize.h"
+
+#include <algorithm>
+#include <numeric>
+#include <cstring>
+
+using namespace GFX;
+
+//fifo cache simulated with the time every vertex entered it, a vertex is in the cache while less than cache_size entered after it
+struct sCacheSimulator {
+	std::vector<uint32> time;
+	uint32 now;
+	int size;
+
+	sCacheSimulator(int num_vertices, int cache_size) : time(num_vertices, 0), now(cache_size + 1), size(cache_size) {}
+
+	bool inCache(uint32 v) const { return now - time[v] <= (uint32)size; }
+
+	//returns true if it was a miss
+	bool access(uint32 v)
+	{
+		if (inCache(v))
+			return false;
+		time[v] = now++;
+		return true;
+	}
+
+	void flush() { now += size + 1; }
+};
+
+sVertexCacheStats GFX::analyzeVertexCache(const uint32* indices, int num_indices, int num_vertices, int cache_size)
+{
+	sVertexCacheStats stats = { 0, 0 };
+	if (!num_indices || !num_vertices)
+		return stats;
+
+	sCacheSimulator cache(num_vertices, cache_size);
+	std::vector<uint8> used(num_vertices, 0);
+	int misses = 0;
+	int num_used = 0;
+	for (int i = 0; i < num_indices; ++i)
+	{
+		misses += cache.access(indices[i]);
+		num_used += !used[indices[i]];
+		used[indices[i]] = 1;
+	}
+
+	stats.acmr = misses / (float)(num_indices / 3);
+	stats.atvr = misses / (float)num_used;
+	return stats;
+}
+
+int GFX::generateVertexRemap(const uint8* vertex_data, int vertex_size, int num_vertices, std::vector<uint32>& remap)
+{
+	remap.assign(num_vertices, 0);
+
+	//open addressing table with the first vertex of every different value, FNV-1a of the bytes
+	size_t table_size = 1;
+	while (table_size < (size_t)num_vertices * 2)
+		table_size *= 2;
+	std::vector<uint32> table(table_size, ~0u);
+
+	int num_unique = 0;
+	for (int i = 0; i < num_vertices; ++i)
+	{
+		const uint8* vertex = vertex_data + (size_t)i * vertex_size;
+		uint32 hash = 2166136261u;
+		for (int k = 0; k < vertex_size; ++k)
+			hash = (hash ^ vertex[k]) * 16777619u;
+
+		size_t slot = hash & (table_size - 1);
+		while (table[slot] != ~0u && memcmp(vertex_data + (size_t)table[slot] * vertex_size, vertex, vertex_size) != 0)
+			slot = (slot + 1) & (table_size - 1);
+
+		if (table[slot] == ~0u)
+		{
+			table[slot] = i;
+			remap[i] = num_unique++;
+		}
+		else
+			remap[i] = remap[table[slot]];
+	}
+	return num_unique;
+}
+
+void GFX::optimizeVertexCache(uint32* indices, int num_indices, int num_vertices, int cache_size, std::vector<uint32>& clusters)
+{
+	clusters.clear();
+	int num_triangles = num_indices / 3;
+	if (!num_triangles)
+		return;
+
+	//triangles around every vertex
+	std::vector<uint32> offsets(num_vertices + 1, 0);
+	for (int i = 0; i < num_indices; ++i)
+		offsets[indices[i] + 1]++;
+	for (int v = 0; v < num_vertices; ++v)
+		offsets[v + 1] += offsets[v];
+	std::vector<uint32> adjacency(num_indices);
+	std::vector<uint32> cursor(offsets.begin(), offsets.end() - 1);
+	for (int i = 0; i < num_indices; ++i)
+		adjacency[cursor[indices[i]]++] = i / 3;
+
+	std::vector<int> live(num_vertices);
+	for (int v = 0; v < num_vertices; ++v)
+		live[v] = offsets[v + 1] - offsets[v];
+
+	sCacheSimulator cache(num_vertices, cache_size);
+	std::vector<uint8> emitted(num_triangles, 0);
+	std::vector<uint32> result;
+	result.reserve(num_indices);
+	std::vector<uint32> dead_end; //recently used vertices, where to continue when the candidates are exhausted
+	std::vector<uint32> candidates;
+	int next_vertex = 0; //to find vertices with triangles left when everything else fails
+
+	int fanning = 0;
+	clusters.push_back(0);
+	while (fanning >= 0)
+	{
+		//emit all the triangles of the fanning vertex
+		candidates.clear();
+		for (uint32 a = offsets[fanning]; a < offsets[fanning + 1]; ++a)
+		{
+			uint32 t = adjacency[a];
+			if (emitted[t])
+				continue;
+			emitted[t] = 1;
+			for (int k = 0; k < 3; ++k)
+			{
+				uint32 v = indices[t * 3 + k];
+				result.push_back(v);
+				dead_end.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+				cache.access(v);
+			}
+		}
+
+		//the candidate that will still be in the cache after emitting its triangles, the oldest one in it
+		int best = -1;
+		int best_priority = -1;
+		for (uint32 v : candidates)
+		{
+			if (live[v] <= 0)
+				continue;
+			int priority = 0;
+			int age = (int)(cache.now - cache.time[v]);
+			if (cache.inCache(v) && age + 2 * live[v] <= cache_size)
+				priority = age;
+			if (priority > best_priority)
+			{
+				best_priority = priority;
+				best = (int)v;
+			}
+		}
+
+		if (best == -1)
+		{
+			//dead end, the most recent vertex with triangles left or any other one (a new cluster)
+			while (dead_end.size() && best == -1)
+			{
+				uint32 v = dead_end.back();
+				dead_end.pop_back();
+				if (live[v] > 0)
+					best = (int)v;
+			}
+			if (best == -1)
+			{
+				while (next_vertex < num_vertices && live[next_vertex] <= 0)
+					next_vertex++;
+				if (next_vertex < num_vertices)
+				{
+					best = next_vertex;
+					clusters.push_back((uint32)result.size() / 3);
+				}
+			}
+		}
+		fanning = best;
+	}
+
+	memcpy(indices, &result[0], num_indices * sizeof(uint32));
+}
+
+void GFX::optimizeOverdraw(uint32* indices, int num_indices, const Vector3f* positions, size_t stride, int num_vertices,
+	const std::vector<uint32>& clusters, int cache_size, float threshold)
+{
+	auto position = [positions, stride](uint32 i) -> const Vector3f& { return *(const Vector3f*)((const char*)positions + i * stride); };
+	int num_triangles = num_indices / 3;
+	if (!num_triangles || clusters.empty())
+		return;
+
+	//more clusters: a cluster can be split where the acmr of the part before is as good as the one of the whole cluster
+	std::vector<uint32> splits;
+	sCacheSimulator cache(num_vertices, cache_size);
+	for (size_t c = 0; c < clusters.size(); ++c)
+	{
+		uint32 start = clusters[c];
+		uint32 end = c + 1 < clusters.size() ? clusters[c + 1] : (uint32)num_triangles;
+
+		cache.flush();
+		int misses = 0;
+		for (uint32 i = start * 3; i < end * 3; ++i)
+			misses += cache.access(indices[i]);
+		float limit = threshold * misses / (float)(end - start);
+
+		cache.flush();
+		splits.push_back(start);
+		misses = 0;
+		for (uint32 t = start; t < end; ++t)
+		{
+			for (int k = 0; k < 3; ++k)
+				misses += cache.access(indices[t * 3 + k]);
+			if (t + 1 < end && misses <= limit * (t + 1 - splits.back()))
+			{
+				splits.push_back(t + 1);
+				cache.flush();
+				misses = 0;
+			}
+		}
+	}
+
+	//the center of the mesh weighted by the area of the triangles
+	Vector3f mesh_center(0, 0, 0);
+	float mesh_area = 0;
+	std::vector<float> sort_keys(splits.size());
+	std::vector<Vector3f> centers(splits.size());
+	std::vector<Vector3f> normals(splits.size());
+	for (size_t c = 0; c < splits.size(); ++c)
+	{
+		uint32 end = c + 1 < splits.size() ? splits[c + 1] : (uint32)num_triangles;
+		Vector3f center(0, 0, 0);
+		Vector3f normal(0, 0, 0);
+		float area = 0;
+		for (uint32 t = splits[c]; t < end; ++t)
+		{
+			const Vector3f& p0 = position(indices[t * 3]);
+			const Vector3f& p1 = position(indices[t * 3 + 1]);
+			const Vector3f& p2 = position(indices[t * 3 + 2]);
+			Vector3f n = cross(p1 - p0, p2 - p0);
+			float triangle_area = n.length();
+			center = center + (p0 + p1 + p2) * (triangle_area / 3.0f);
+			normal = normal + n;
+			area += triangle_area;
+		}
+		mesh_center = mesh_center + center;
+		mesh_area += area;
+		centers[c] = area > 0 ? center * (1.0f / area) : position(indices[splits[c] * 3]);
+		normals[c] = normal;
+	}
+	if (mesh_area > 0)
+		mesh_center = mesh_center * (1.0f / mesh_area);
+
+	//how far out the cluster is along the direction it faces
+	for (size_t c = 0; c < splits.size(); ++c)
+	{
+		float length = normals[c].length();
+		sort_keys[c] = length > 0 ? dot(centers[c] - mesh_center, normals[c] * (1.0f / length)) : 0.0f;
+	}
+
+	std::vector<uint32> order(splits.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&](uint32 a, uint32 b) { return sort_keys[a] > sort_keys[b]; });
+
+	std::vector<uint32> result;
+	result.reserve(num_indices);
+	for (uint32 c : order)
+	{
+		uint32 end = c + 1 < splits.size() ? splits[c + 1] : (uint32)num_triangles;
+		result.insert(result.end(), indices + splits[c] * 3, indices + end * 3);
+	}
+	memcpy(indices, &result[0], num_indices * sizeof(uint32));
+}
+
+int GFX::optimizeVertexFetch(uint32* indices, int num_indices, int num_vertices, std::vector<uint32>& remap)
+{
+	remap.assign(num_vertices, ~0u);
+	int num_used = 0;
+	for (int i = 0; i < num_indices; ++i)
+	{
+		uint32& index = indices[i];
+		if (remap[index] == ~0u)
+			remap[index] = num_used++;
+		index = remap[index];
+	}
+	return num_used;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <vector>
+
+#include "../core/math.h"
+
+namespace GFX {
+
+	//post transform cache efficiency of an index buffer simulating a FIFO cache of cache_size vertices
+	struct sVertexCacheStats {
+		float acmr;	//average cache miss ratio: vertices transformed per triangle (0.5 is the best, 3 is not indexed)
+		float atvr;	//average transformed vertex ratio: vertices transformed per vertex used (1 is the best)
+	};
+
+	sVertexCacheStats analyzeVertexCache(const uint32* indices, int num_indices, int num_vertices, int cache_size = 16);
+
+	//welding: vertices with the same bytes get the same index. vertex_data has vertex_size bytes per vertex,
+	//remap gets the new index of every vertex (in order of first appearance), returns the number of unique vertices
+	int generateVertexRemap(const uint8* vertex_data, int vertex_size, int num_vertices, std::vector<uint32>& remap);
+
+	//Tipsify (Sander et al. 2007): reorders the triangles so the vertices are reused while they are in the cache.
+	//clusters gets the first triangle of every group of triangles that starts with a cold cache
+	void optimizeVertexCache(uint32* indices, int num_indices, int num_vertices, int cache_size, std::vector<uint32>& clusters);
+
+	//splits the clusters where the cache efficiency allows it (threshold is the acmr allowed relative to the cluster one) and
+	//sorts them so the outer ones facing out are drawn first, they tend to occlude the rest
+	void optimizeOverdraw(uint32* indices, int num_indices, const Vector3f* positions, size_t stride, int num_vertices,
+		const std::vector<uint32>& clusters, int cache_size, float threshold = 1.05f);
+
+	//renumbers the vertices in the order they are used so the fetches go forward in memory, remap gets the new index of
+	//every vertex (-1 if it is not used) and the indices are updated, returns the number of vertices used
+	int optimizeVertexFetch(uint32* indices, int num_indices, int num_vertices, std::vector<uint32>& remap);
+};
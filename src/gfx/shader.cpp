@@ -63,7 +63,18 @@ std::map<std::string, Shader::UberShader*> Shader::s_ubershaders;
 std::map<std::string,Shader*> Shader::s_Shaders;
 bool Shader::s_ready = false;
 Shader* Shader::current = NULL;
+GLuint Shader::s_bound_program = 0;
 std::vector<char> Shader::lines_with_error;
+sUniformStats Shader::s_uniform_stats = { 0, 0 };
+std::vector<const char*> Shader::s_uniform_names;
+std::map<uint32, int> Shader::s_uniform_indices;
+
+int UniformHandle::getIndex() const
+{
+	if (index == -1)
+		index = Shader::registerUniform(name, hash);
+	return index;
+}
 
 Shader::Shader()
 {
@@ -72,6 +83,8 @@ Shader::Shader()
 	program = vs = fs = cs = 0;
 	compiled = false;
 	from_atlas = false;
+	attribute_mask = 0;
+	fixed_attributes = false;
 
 }
 
@@ -195,6 +208,14 @@ bool Shader::hasInfoLog() const
 
 // ******************************************
 
+//the first ones are the mesh attributes in the order of eVertexAttribute, the rest the per instance and per draw ones
+struct sFixedAttribute { const char* name; GLuint location; };
+static const sFixedAttribute fixed_attribute_locations[] = {
+	{ "a_vertex", 0 }, { "a_normal", 1 }, { "a_coord", 2 }, { "a_coord1", 3 }, { "a_color", 4 }, { "a_bones", 5 }, { "a_weights", 6 },
+	{ "u_model", DRAW_MODEL_LOCATION }, { "a_vertex_offset", DRAW_DECODE_LOCATION }, { "a_vertex_scale", DRAW_DECODE_LOCATION + 1 }, { "a_uv_transform", DRAW_DECODE_LOCATION + 2 }
+};
+#define NUM_MESH_ATTRIBUTES 7
+
 bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 {
 	assert(glGetError() == GL_NO_ERROR);
@@ -222,6 +243,8 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 		return false;
 	}
 
+	for (const sFixedAttribute& attribute : fixed_attribute_locations)
+		glBindAttribLocation(program, attribute.location, attribute.name);
 	glLinkProgram(program);
 	assert (glGetError() == GL_NO_ERROR);
 
@@ -243,6 +266,20 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 
 	compiled = true;
 	locations.clear(); //regenerate table
+	uniform_slots.clear();
+
+	attribute_mask = 0;
+	fixed_attributes = true;
+	for (int i = 0; i < (int)(sizeof(fixed_attribute_locations) / sizeof(sFixedAttribute)); ++i)
+	{
+		GLint location = glGetAttribLocation(program, fixed_attribute_locations[i].name);
+		if (location == -1)
+			continue;
+		if (location != (GLint)fixed_attribute_locations[i].location)
+			fixed_attributes = false;
+		else if (i < NUM_MESH_ATTRIBUTES)
+			attribute_mask |= 1 << i;
+	}
 
 	return true;
 }
@@ -355,12 +392,15 @@ void Shader::release()
 
 	if (program)
 	{
+		if (program == s_bound_program)
+			disableShaders(); //the id could be reused by the next program
 		glDeleteProgram(program);
 		assert (glGetError() == GL_NO_ERROR);
 		program = 0;
 	}
 
 	locations.clear();
+	uniform_slots.clear();
 
 	compiled = false;
 }
@@ -373,9 +413,15 @@ void Shader::enable()
 
 	current = this;
 
-	glUseProgram(program);
-    GLuint err = glGetError();
-	assert (err == GL_NO_ERROR);
+	//the program stays bound after disable, so enabling it again is free
+	if (program != s_bound_program)
+	{
+		glUseProgram(program);
+		s_bound_program = program;
+		gpu_state_stats.program_binds++;
+		GLuint err = glGetError();
+		assert (err == GL_NO_ERROR);
+	}
 
 	last_slot = 0;
 }
@@ -384,14 +430,12 @@ void Shader::enable()
 void Shader::disable()
 {
 	current = NULL;
-
-	glUseProgram(0);
-	//glActiveTexture(GL_TEXTURE0);
-	assert (glGetError() == GL_NO_ERROR);
 }
 
 void Shader::disableShaders()
 {
+	current = NULL;
+	s_bound_program = 0;
 	glUseProgram(0);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -520,10 +564,8 @@ int Shader::getUniformBlockLocation(const char* varname)
 
 void Shader::setTexture(const char* varname, Texture* tex, int slot)
 {
-	glActiveTexture(GL_TEXTURE0 + slot);
-	glBindTexture(tex->texture_type, tex->texture_id);
+	bindTexture(slot, tex->texture_type, tex->texture_id);
 	setUniform1(varname, slot);
-	glActiveTexture(GL_TEXTURE0 + slot);
 }
 
 /*
@@ -541,6 +583,7 @@ void Shader::setUniform1(const char* varname, bool input1)
 {
 	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc, varname);
+	uniformUploaded(varname);
 	glUniform1i(loc, input1);
 	assert(glGetError() == GL_NO_ERROR);
 }
@@ -549,6 +592,7 @@ void Shader::setUniform1(const char* varname, int input1)
 {
 	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
+	uniformUploaded(varname);
 	glUniform1i(loc, input1);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -557,6 +601,7 @@ void Shader::setUniform2(const char* varname, int input1, int input2)
 {
 	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
+	uniformUploaded(varname);
 	glUniform2i(loc, input1, input2);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -565,6 +610,7 @@ void Shader::setUniform3(const char* varname, int input1, int input2, int input3
 {
 	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
+	uniformUploaded(varname);
 	glUniform3i(loc, input1, input2, input3);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -573,6 +619,7 @@ void Shader::setUniform4(const char* varname, const int input1, const int input2
 {
 	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
+	uniformUploaded(varname);
 	glUniform4i(loc, input1, input2, input3, input4);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -581,6 +628,7 @@ void Shader::setUniform1Array(const char* varname, const int* input, const int c
 {
 	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
+	uniformUploaded(varname);
 	glUniform1iv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -589,6 +637,7 @@ void Shader::setUniform2Array(const char* varname, const int* input, const int c
 {
 	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
+	uniformUploaded(varname);
 	glUniform2iv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -597,6 +646,7 @@ void Shader::setUniform3Array(const char* varname, const int* input, const int c
 {
 	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
+	uniformUploaded(varname);
 	glUniform3iv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -605,6 +655,7 @@ void Shader::setUniform4Array(const char* varname, const int* input, const int c
 {
 	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
+	uniformUploaded(varname);
 	glUniform4iv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -613,6 +664,7 @@ void Shader::setUniform1(const char* varname, const float input1)
 {
 	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
+	uniformUploaded(varname);
 	glUniform1f(loc, input1);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -621,6 +673,7 @@ void Shader::setUniform2(const char* varname, const float input1, const float in
 {
 	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
+	uniformUploaded(varname);
 	glUniform2f(loc, input1, input2);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -629,6 +682,7 @@ void Shader::setUniform3(const char* varname, const float input1, const float in
 {
 	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
+	uniformUploaded(varname);
 	glUniform3f(loc, input1, input2, input3);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -637,6 +691,7 @@ void Shader::setUniform4(const char* varname, const float input1, const float in
 {
 	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
+	uniformUploaded(varname);
 	glUniform4f(loc, input1, input2, input3, input4);
 	checkGLErrors();
 }
@@ -645,6 +700,7 @@ void Shader::setUniform1Array(const char* varname, const float* input, const int
 {
 	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
+	uniformUploaded(varname);
 	glUniform1fv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -653,6 +709,7 @@ void Shader::setUniform2Array(const char* varname, const float* input, const int
 {
 	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
+	uniformUploaded(varname);
 	glUniform2fv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -661,6 +718,7 @@ void Shader::setUniform3Array(const char* varname, const float* input, const int
 {
 	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
+	uniformUploaded(varname);
 	glUniform3fv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -669,6 +727,7 @@ void Shader::setUniform4Array(const char* varname, const float* input, const int
 {
 	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
+	uniformUploaded(varname);
 	glUniform4fv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -677,6 +736,7 @@ void Shader::setMatrix44(const char* varname, const float* m)
 {
 	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
+	uniformUploaded(varname);
 	glUniformMatrix4fv(loc, 1, GL_FALSE, m);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -685,6 +745,7 @@ void Shader::setMatrix44( const char* varname, const Matrix44 &m )
 {
 	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc,varname);
+	uniformUploaded(varname);
 	glUniformMatrix4fv(loc, 1, GL_FALSE, m.m);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -693,10 +754,83 @@ void Shader::setMatrix44Array( const char* varname, Matrix44* m_array, int num )
 {
 	GLint loc = getLocation(varname);
 	CHECK_SHADER_VAR(loc, varname);
+	uniformUploaded(varname);
 	glUniformMatrix4fv(loc, num, GL_FALSE, (GLfloat*)m_array);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
+int Shader::registerUniform(const char* name, uint32 hash)
+{
+	auto it = s_uniform_indices.find(hash);
+	if (it != s_uniform_indices.end())
+	{
+		assert(strcmp(s_uniform_names[it->second], name) == 0 && "two uniform names with the same hash");
+		return it->second;
+	}
+	int index = (int)s_uniform_names.size();
+	s_uniform_names.push_back(name);
+	s_uniform_indices[hash] = index;
+	return index;
+}
+
+void Shader::uniformUploaded(const char* varname)
+{
+	s_uniform_stats.uploads++;
+	if (uniform_slots.empty())
+		return;
+	auto it = s_uniform_indices.find(hashUniformName(varname));
+	if (it != s_uniform_indices.end() && it->second < (int)uniform_slots.size())
+		uniform_slots[it->second].size = 0;
+}
+
+void Shader::setUniformData(const UniformHandle& handle, GLenum type, const void* data, int size)
+{
+	int index = handle.getIndex();
+	if (index >= (int)uniform_slots.size())
+	{
+		sUniformSlot empty;
+		empty.location = -2;
+		empty.size = 0;
+		uniform_slots.resize(index + 1, empty);
+	}
+
+	sUniformSlot& slot = uniform_slots[index];
+	if (slot.location == -2)
+		slot.location = glGetUniformLocation(program, handle.name);
+	if (slot.location == -1)
+		return;
+
+	//same value than last time
+	if (slot.size == size && memcmp(slot.value, data, size * sizeof(uint32)) == 0)
+	{
+		s_uniform_stats.skipped++;
+		return;
+	}
+	memcpy(slot.value, data, size * sizeof(uint32));
+	slot.size = size;
+	s_uniform_stats.uploads++;
+
+	const GLfloat* values = (const GLfloat*)data;
+	switch (type)
+	{
+		case GL_INT: glUniform1i(slot.location, *(const GLint*)data); break;
+		case GL_FLOAT: glUniform1f(slot.location, values[0]); break;
+		case GL_FLOAT_VEC2: glUniform2fv(slot.location, 1, values); break;
+		case GL_FLOAT_VEC3: glUniform3fv(slot.location, 1, values); break;
+		case GL_FLOAT_VEC4: glUniform4fv(slot.location, 1, values); break;
+		case GL_FLOAT_MAT4: glUniformMatrix4fv(slot.location, 1, GL_FALSE, values); break;
+		default: assert(0 && "uniform type not supported");
+	}
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform(const UniformHandle& handle, Texture* texture, int slot)
+{
+	assert(current == this);
+	bindTexture(slot, texture->texture_type, texture->texture_id);
+	setUniformData(handle, GL_INT, &slot, 1);
+}
+
 void Shader::init()
 {
 	static bool firsttime = true;
@@ -1213,6 +1347,7 @@ Shader::UberShader* Shader::GetUberShader(const char* name)
 BufferObject::BufferObject()
 {
 	id = 0;
+	texture_id = 0;
 	size = 0;
 	type = GL_UNIFORM_BUFFER;
 }
@@ -1220,6 +1355,7 @@ BufferObject::BufferObject()
 BufferObject::BufferObject(const char* name)
 {
 	id = 0;
+	texture_id = 0;
 	size = 0;
 	type = GL_UNIFORM_BUFFER;
 	if(name)
@@ -1233,6 +1369,12 @@ BufferObject::~BufferObject()
 
 void BufferObject::deallocate()
 {
+	if (texture_id)
+	{
+		glDeleteTextures(1, &texture_id);
+		GFX::releaseTexture(texture_id);
+	}
+	texture_id = 0;
 	if (!id)
 		return;
 	glDeleteBuffers(1, &id);
@@ -1273,6 +1415,14 @@ void BufferObject::updateFromPointer(const void* data, int size)
 	glBindBuffer(type, 0);
 }
 
+void BufferObject::updateRange(const void* data, int start, int size)
+{
+	assert(size && id && start >= 0 && (start + size) <= (int)this->size);
+	glBindBuffer(type, id);
+	glBufferSubData(type, start, size, data);
+	glBindBuffer(type, 0);
+}
+
 void BufferObject::readToPointer(void* data, int size)
 {
 	assert(size && id);
@@ -1307,5 +1457,17 @@ void BufferObject::bind(Shader* shader, int index, int start, int length)
 	}
 }
 
+void BufferObject::bindTexture(Shader* shader, int slot, GLenum format)
+{
+	assert(size && type == GL_TEXTURE_BUFFER);
+	if (!texture_id)
+		glGenTextures(1, &texture_id);
+	GFX::bindTexture(slot, GL_TEXTURE_BUFFER, texture_id);
+	GFX::setActiveTextureUnit(slot);
+	glTexBuffer(GL_TEXTURE_BUFFER, format, id); //cheap, and the buffer id changes when it is resized
+	if (shader && name.size())
+		shader->setUniform1(name.c_str(), slot);
+}
+
 
 };
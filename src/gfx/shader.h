@@ -20,11 +20,40 @@
 	#define CHECK_SHADER_VAR(a,b) if (a == -1) return
 #endif
 
+//fixed locations of the per instance and per draw attributes, the mesh ones go from 0 in the order of eVertexAttribute
+#define DRAW_MODEL_LOCATION 8 //u_model, a mat4 takes 4 locations
+#define DRAW_DECODE_LOCATION 12 //a_vertex_offset, a_vertex_scale and a_uv_transform
+
 namespace GFX {
 
 	class Texture;
 	class UBO;
 
+	//FNV-1a of the uniform name, constexpr so handles declared as constants are hashed at compile time
+	constexpr uint32 hashUniformName(const char* str, uint32 hash = 2166136261u) {
+		return *str ? hashUniformName(str + 1, (hash ^ (uint32)(uint8)*str) * 16777619u) : hash;
+	}
+
+	//pre-resolved uniform name, declare it once (global or static) and use it instead of the string:
+	//  static const GFX::UniformHandle u_model("u_model");
+	//  shader->setUniform(u_model, model);
+	//every name gets a dense index the first time it is used, shaders keep its location and last value in that index
+	class UniformHandle {
+	public:
+		const char* name;
+		uint32 hash;
+		mutable int index; //-1 until registered
+
+		explicit constexpr UniformHandle(const char* name) : name(name), hash(hashUniformName(name)), index(-1) {}
+		int getIndex() const;
+	};
+
+	//uniform calls of the frame, reset them when you want
+	struct sUniformStats {
+		int uploads;	//glUniform* calls issued
+		int skipped;	//calls avoided because the shader already had that value
+	};
+
 	class Shader
 	{
 		int last_slot;
@@ -33,6 +62,7 @@ namespace GFX {
 
 	public:
 		static Shader* current;
+		static GLuint s_bound_program; //program in GL, it is not unbound when a shader is disabled
 
 		Shader();
 		~Shader();
@@ -50,7 +80,7 @@ namespace GFX {
 		void disable();
 
 		static void init();
-		static void disableShaders();
+		static void disableShaders(); //unbinds the program
 
 		//check
 		bool IsUniform(const char* varname) { return (getUniformLocation(varname) != -1); } //uniform exist
@@ -69,6 +99,15 @@ namespace GFX {
 		//for textures you must specify an slot (a number from 0 to 16) where this texture is stored in the shader
 		void setUniform(const char* varname, Texture* texture, int slot) { assert(current == this); setTexture(varname, texture, slot); }
 
+		//same using handles, the call is skipped if the shader already has the value
+		void setUniform(const UniformHandle& handle, int input) { assert(current == this); setUniformData(handle, GL_INT, &input, 1); }
+		void setUniform(const UniformHandle& handle, float input) { assert(current == this); setUniformData(handle, GL_FLOAT, &input, 1); }
+		void setUniform(const UniformHandle& handle, const Vector2f& input) { assert(current == this); setUniformData(handle, GL_FLOAT_VEC2, &input.x, 2); }
+		void setUniform(const UniformHandle& handle, const Vector3f& input) { assert(current == this); setUniformData(handle, GL_FLOAT_VEC3, &input.x, 3); }
+		void setUniform(const UniformHandle& handle, const Vector4f& input) { assert(current == this); setUniformData(handle, GL_FLOAT_VEC4, &input.x, 4); }
+		void setUniform(const UniformHandle& handle, const Matrix44& input) { assert(current == this); setUniformData(handle, GL_FLOAT_MAT4, input.m, 16); }
+		void setUniform(const UniformHandle& handle, Texture* texture, int slot);
+
 
 		void setInt(const char* varname, const int& input) { setUniform1(varname, input); }
 		void setFloat(const char* varname, const float& input) { setUniform1(varname, input); }
@@ -113,6 +152,9 @@ namespace GFX {
 
 		void setMacros(const char* macros);
 
+		static sUniformStats s_uniform_stats;
+		static int registerUniform(const char* name, uint32 hash); //returns the dense index of the name
+
 		static Shader* Get(const char* vsf, const char* psf = NULL, const char* macros = NULL);
 		static void ReloadAll();
 		static std::map<std::string, Shader*> s_Shaders;
@@ -123,6 +165,11 @@ namespace GFX {
 		bool compiled;
 		bool from_atlas;
 
+		//the vertex attributes are bound to fixed locations before linking (a_vertex = 0, a_normal = 1... as Mesh::enableBuffers
+		//without shader, u_model = 8) so the vertex array objects of a mesh work with every program that reads the same ones
+		uint8 attribute_mask; //bit i set if the program reads the mesh attribute i (eVertexAttribute)
+		bool fixed_attributes; //false if the program placed them somewhere else (layout qualifiers)
+
 		GLuint vs;
 		GLuint fs;
 		GLuint cs; //compute
@@ -149,6 +196,19 @@ namespace GFX {
 		GLint getLocation(const char* varname, bool is_block = false);
 		loctable locations;
 
+		//location and last value of every registered uniform name, indexed by UniformHandle::index
+		struct sUniformSlot {
+			GLint location; //-2 until it is asked to GL
+			int size;		//values in the cache, 0 if unknown
+			uint32 value[16];
+		};
+		std::vector<sUniformSlot> uniform_slots;
+		static std::vector<const char*> s_uniform_names;
+		static std::map<uint32, int> s_uniform_indices; //hash to index
+
+		void setUniformData(const UniformHandle& handle, GLenum type, const void* data, int size);
+		void uniformUploaded(const char* varname); //counts a call by name and forgets the cached value
+
 		//Shader Atlas stuff ************************
 		//to know more about the file format, it is based in this https://github.com/jagenjo/rendeer.js/tree/master/guides#the-shaders but with tiny differences
 		//this is a way to load a single file that contains all the shaders 
@@ -194,6 +254,7 @@ namespace GFX {
 	public:
 		GLuint type;
 		GLuint id;
+		GLuint texture_id; //only for GL_TEXTURE_BUFFER, texture used to read the buffer in the shader
 		size_t size;
 		std::string name;
 		BufferObject();
@@ -206,9 +267,12 @@ namespace GFX {
 		template <typename T>
 		void read(T& obj) { readToPointer(&obj, sizeof(T)); }
 		void updateFromPointer(const void* data, int size);
+		void updateRange(const void* data, int start, int size); //must be allocated, keeps the rest of the buffer
 		void readToPointer(void* data, int size);
 		//the global index behaves similar to slots in textures, you bind a UBO to an index, and a block to the same index
 		void bind(Shader* shader, int global_index, int start = 0, int length = -1);
+		//for GL_TEXTURE_BUFFER: binds it as a samplerBuffer in a texture slot, the uniform is the name of the buffer
+		void bindTexture(Shader* shader, int slot, GLenum format);
 	};
 
 };
\ No newline at end of file
@@ -0,0 +1,220 @@
+#include "simplify.h"
+
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <cstring>
+
+//symmetric 4x4 matrix of the squared distance to a set of planes, weighted by the area of the triangles
+struct sQuadric {
+	double a00, a01, a02, a11, a12, a22;
+	double b0, b1, b2;
+	double c;
+	double weight;
+};
+
+static void addPlane(sQuadric& q, double nx, double ny, double nz, double d, double w)
+{
+	q.a00 += w * nx * nx; q.a01 += w * nx * ny; q.a02 += w * nx * nz;
+	q.a11 += w * ny * ny; q.a12 += w * ny * nz; q.a22 += w * nz * nz;
+	q.b0 += w * nx * d; q.b1 += w * ny * d; q.b2 += w * nz * d;
+	q.c += w * d * d;
+	q.weight += w;
+}
+
+static void addQuadric(sQuadric& q, const sQuadric& other)
+{
+	q.a00 += other.a00; q.a01 += other.a01; q.a02 += other.a02;
+	q.a11 += other.a11; q.a12 += other.a12; q.a22 += other.a22;
+	q.b0 += other.b0; q.b1 += other.b1; q.b2 += other.b2;
+	q.c += other.c;
+	q.weight += other.weight;
+}
+
+//mean squared distance of the point to the planes
+static double evaluateQuadric(const sQuadric& q, const Vector3f& p)
+{
+	double x = p.x, y = p.y, z = p.z;
+	double error = q.a00 * x * x + q.a11 * y * y + q.a22 * z * z + 2.0 * (q.a01 * x * y + q.a02 * x * z + q.a12 * y * z)
+		+ 2.0 * (q.b0 * x + q.b1 * y + q.b2 * z) + q.c;
+	return q.weight > 0 ? std::max(error / q.weight, 0.0) : 0.0;
+}
+
+struct sCollapse {
+	float cost;
+	uint32 from;
+	uint32 to;
+};
+
+float GFX::simplifyIndices(const Vector3f* positions, size_t stride, int num_vertices, const uint32* indices, int num_indices,
+	int target_indices, float max_error, std::vector<uint32>& result)
+{
+	auto position = [positions, stride](uint32 i) -> const Vector3f& { return *(const Vector3f*)((const char*)positions + i * stride); };
+
+	//vertices with the same position are the same point of the surface, they share the quadric
+	std::vector<uint32> order(num_vertices);
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(), [&](uint32 a, uint32 b) {
+		const Vector3f& pa = position(a);
+		const Vector3f& pb = position(b);
+		return pa.x != pb.x ? pa.x < pb.x : (pa.y != pb.y ? pa.y < pb.y : pa.z < pb.z);
+	});
+	std::vector<uint32> group(num_vertices);
+	std::vector<int> group_size;
+	for (int i = 0; i < num_vertices; ++i)
+	{
+		const Vector3f& p = position(order[i]);
+		if (!i || p.x != position(order[i - 1]).x || p.y != position(order[i - 1]).y || p.z != position(order[i - 1]).z)
+			group_size.push_back(0);
+		group[order[i]] = (uint32)group_size.size() - 1;
+		group_size.back()++;
+	}
+	int num_groups = (int)group_size.size();
+
+	//seams, borders (edges with one triangle) and non manifold edges are locked
+	std::vector<uint8> locked(num_groups, 0);
+	for (int g = 0; g < num_groups; ++g)
+		locked[g] = group_size[g] > 1;
+	std::vector<uint64> edges;
+	edges.reserve(num_indices);
+	for (int i = 0; i < num_indices; i += 3)
+		for (int k = 0; k < 3; ++k)
+		{
+			uint64 a = group[indices[i + k]];
+			uint64 b = group[indices[i + (k + 1) % 3]];
+			if (a != b)
+				edges.push_back(a < b ? (a << 32) | b : (b << 32) | a);
+		}
+	std::sort(edges.begin(), edges.end());
+	for (size_t i = 0; i < edges.size();)
+	{
+		size_t j = i;
+		while (j < edges.size() && edges[j] == edges[i])
+			j++;
+		if (j - i != 2)
+			locked[edges[i] >> 32] = locked[edges[i] & 0xFFFFFFFF] = 1;
+		i = j;
+	}
+
+	std::vector<sQuadric> quadrics(num_groups);
+	memset(&quadrics[0], 0, quadrics.size() * sizeof(sQuadric));
+	for (int i = 0; i < num_indices; i += 3)
+	{
+		const Vector3f& p0 = position(indices[i]);
+		Vector3f n = cross(position(indices[i + 1]) - p0, position(indices[i + 2]) - p0);
+		double length = n.length();
+		if (length <= 0)
+			continue;
+		double nx = n.x / length, ny = n.y / length, nz = n.z / length;
+		double d = -(nx * p0.x + ny * p0.y + nz * p0.z);
+		for (int k = 0; k < 3; ++k)
+			addPlane(quadrics[group[indices[i + k]]], nx, ny, nz, d, length * 0.5);
+	}
+
+	result.assign(indices, indices + num_indices);
+	double max_error_sq = (double)max_error * max_error;
+	double reached = 0;
+	std::vector<uint32> offsets, adjacency, remap(num_vertices);
+	std::vector<uint8> touched(num_vertices);
+	std::vector<sCollapse> collapses;
+
+	//every pass does the cheapest collapses that do not share triangles, then the triangle list is rebuilt
+	while ((int)result.size() > target_indices)
+	{
+		int num_triangles = (int)result.size() / 3;
+
+		//triangles around every vertex
+		offsets.assign(num_vertices + 1, 0);
+		for (uint32 index : result)
+			offsets[index + 1]++;
+		for (int v = 0; v < num_vertices; ++v)
+			offsets[v + 1] += offsets[v];
+		adjacency.resize(result.size());
+		std::vector<uint32> cursor(offsets.begin(), offsets.end() - 1);
+		for (size_t i = 0; i < result.size(); ++i)
+			adjacency[cursor[result[i]]++] = (uint32)(i / 3);
+
+		//best neighbour of every vertex that can be removed, skipping the ones that would flip a triangle
+		collapses.clear();
+		for (int v = 0; v < num_vertices; ++v)
+		{
+			if (offsets[v] == offsets[v + 1] || locked[group[v]])
+				continue;
+			sCollapse best = { 1e30f, (uint32)v, (uint32)v };
+			for (uint32 a = offsets[v]; a < offsets[v + 1]; ++a)
+				for (int k = 0; k < 3; ++k)
+				{
+					uint32 other = result[adjacency[a] * 3 + k];
+					if (other == (uint32)v)
+						continue;
+					sQuadric q = quadrics[group[v]];
+					addQuadric(q, quadrics[group[other]]);
+					float cost = (float)evaluateQuadric(q, position(other));
+					if (cost >= best.cost)
+						continue;
+
+					bool flips = false;
+					const Vector3f& target = position(other);
+					for (uint32 b = offsets[v]; b < offsets[v + 1] && !flips; ++b)
+					{
+						const uint32* tri = &result[adjacency[b] * 3];
+						if (tri[0] == other || tri[1] == other || tri[2] == other)
+							continue; //removed by the collapse
+						Vector3f p[3] = { position(tri[0]), position(tri[1]), position(tri[2]) };
+						Vector3f normal = cross(p[1] - p[0], p[2] - p[0]);
+						for (int t = 0; t < 3; ++t)
+							if (tri[t] == (uint32)v)
+								p[t] = target;
+						flips = dot(normal, cross(p[1] - p[0], p[2] - p[0])) <= 0;
+					}
+					if (!flips)
+						best = { cost, (uint32)v, other };
+				}
+			if (best.to != (uint32)v)
+				collapses.push_back(best);
+		}
+		if (collapses.empty())
+			break;
+		std::sort(collapses.begin(), collapses.end(), [](const sCollapse& a, const sCollapse& b) { return a.cost < b.cost; });
+
+		std::iota(remap.begin(), remap.end(), 0);
+		std::fill(touched.begin(), touched.end(), 0);
+		int removed = 0;
+		int to_remove = num_triangles - target_indices / 3;
+		for (const sCollapse& collapse : collapses)
+		{
+			if (collapse.cost > max_error_sq || removed >= to_remove)
+				break;
+			if (touched[collapse.from] || touched[collapse.to])
+				continue;
+
+			//the vertices of the triangles that change cannot be used again in this pass
+			for (uint32 a = offsets[collapse.from]; a < offsets[collapse.from + 1]; ++a)
+			{
+				const uint32* tri = &result[adjacency[a] * 3];
+				touched[tri[0]] = touched[tri[1]] = touched[tri[2]] = 1;
+				if (tri[0] == collapse.to || tri[1] == collapse.to || tri[2] == collapse.to)
+					removed++;
+			}
+			remap[collapse.from] = collapse.to;
+			addQuadric(quadrics[group[collapse.to]], quadrics[group[collapse.from]]);
+			reached = std::max(reached, (double)collapse.cost);
+		}
+		if (!removed)
+			break;
+
+		size_t count = 0;
+		for (size_t i = 0; i < result.size(); i += 3)
+		{
+			uint32 a = remap[result[i]], b = remap[result[i + 1]], c = remap[result[i + 2]];
+			if (a == b || b == c || a == c)
+				continue;
+			result[count++] = a;
+			result[count++] = b;
+			result[count++] = c;
+		}
+		result.resize(count);
+	}
+
+	return (float)sqrt(reached);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <vector>
+
+#include "../core/math.h"
+
+namespace GFX {
+
+	//Quadric error metric simplification (Garland & Heckbert) using half edge collapses: a vertex is only merged into one of its
+	//neighbours so the attributes of the remaining vertices stay valid. Vertices in borders, non manifold edges or attribute seams
+	//(same position in several vertices) are never removed.
+	//positions are read with the stride in bytes, result gets the indices of the simplified triangles (target_indices or a bit less
+	//if the error allows it), returns the biggest error of the collapses done (distance in the units of the positions)
+	float simplifyIndices(const Vector3f* positions, size_t stride, int num_vertices, const uint32* indices, int num_indices,
+		int target_indices, float max_error, std::vector<uint32>& result);
+};
@@ -107,11 +107,14 @@ namespace GFX
 	{
 		if (texture_id)
 		{
-			glBindTexture(this->texture_type, 0);
+			bindTextureToActiveUnit(this->texture_type, 0);
 
 			//external textures are handled by an outside system (like Android OS)
 			if (texture_type != GL_TEXTURE_EXTERNAL_OES)
+			{
 				glDeleteTextures(1, &texture_id);
+				releaseTexture(texture_id);
+			}
 
 			if (!loading) //when loading the texture of 1x1 is replaced with the new one
 				stdlog("Destroy texture: " + filename);
@@ -225,7 +228,7 @@ namespace GFX
 		if (texture_id == 0)
 			glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
 
-		glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+		bindTextureToActiveUnit(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 		uploadCubemap(format, type, mipmaps, data, internal_format);
 	}
 
@@ -343,14 +346,14 @@ namespace GFX
 		// We have to synchronously upload for now because Image class is not ref-counted
 		create(image->width, image->height, (image->num_channels == 3 ? GL_RGB : GL_RGBA), type, mipmaps, image->data, 0);
 
-		glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+		bindTextureToActiveUnit(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 		glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, (this->mipmaps && wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
 		glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, (this->mipmaps && wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
 		//glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, GL_REPEAT);
 		//glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, GL_REPEAT);
 		//if (mipmaps)
 		//	generateMipmaps();
-		glBindTexture(GL_TEXTURE_2D, 0);
+		bindTextureToActiveUnit(GL_TEXTURE_2D, 0);
 	}
 
 	void Texture::upload(::Image* img)
@@ -371,7 +374,7 @@ namespace GFX
 		assert(texture_id && "Must create texture before uploading data.");
 		assert(texture_type == GL_TEXTURE_2D && "Texture type does not match.");
 
-		glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+		bindTextureToActiveUnit(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 
 		if (internal_format == 0)
 		{
@@ -392,7 +395,7 @@ namespace GFX
 		if (data && this->mipmaps)
 			generateMipmaps(); //glGenerateMipmapEXT(GL_TEXTURE_2D); 
 
-		glBindTexture(this->texture_type, 0);
+		bindTextureToActiveUnit(this->texture_type, 0);
 		assert(checkGLErrors() && "Error uploading texture");
 	}
 
@@ -425,7 +428,7 @@ namespace GFX
 		assert(texture_type == GL_TEXTURE_CUBE_MAP && "Texture type does not match.");
 		//assert(glGetError() == GL_NO_ERROR);
 
-		glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+		bindTextureToActiveUnit(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 		glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
 
 		int w = ((int)this->width) >> level;
@@ -466,7 +469,7 @@ namespace GFX
 			//	generateMipmaps();
 		}
 
-		glBindTexture(this->texture_type, 0);
+		bindTextureToActiveUnit(this->texture_type, 0);
 		assert(glGetError() == GL_NO_ERROR && "Error creating texture");
 	}
 
@@ -526,7 +529,7 @@ namespace GFX
 		assert(glGetError() == GL_NO_ERROR);
 		if (texture_id == 0)
 			glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
-		glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+		bindTextureToActiveUnit(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 		glTexImage3D(this->texture_type, 0, format, width, height, num_textures, 0, dataFormat, type, data);
 		assert(glGetError() == GL_NO_ERROR);
 
@@ -570,7 +573,7 @@ namespace GFX
 
 		if (texture_id == 0)
 			glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
-		glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+		bindTextureToActiveUnit(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 
 		for (int mip = 0; mip < tc.num_mips; mip++) {
 			ddsktx_sub_data sub_data;
@@ -592,13 +595,13 @@ namespace GFX
 	void Texture::bind()
 	{
 		//glEnable(this->texture_type); //enable the textures 
-		glBindTexture(this->texture_type, texture_id);	//enable the id of the texture we are going to use
+		bindTextureToActiveUnit(this->texture_type, texture_id);	//enable the id of the texture we are going to use
 	}
 
 	void Texture::unbind()
 	{
 		//glDisable(this->texture_type); //disable the textures 
-		glBindTexture(this->texture_type, 0);	//disable the id of the texture we are going to use
+		bindTextureToActiveUnit(this->texture_type, 0);	//disable the id of the texture we are going to use
 	}
 
 	void Texture::UnbindAll()
@@ -606,9 +609,9 @@ namespace GFX
 		glDisable(GL_TEXTURE_CUBE_MAP);
 		glDisable(GL_TEXTURE_2D);
 		glDisable(GL_TEXTURE_3D);
-		glBindTexture(GL_TEXTURE_2D, 0);
-		glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
-		glBindTexture(GL_TEXTURE_3D, 0);
+		bindTextureToActiveUnit(GL_TEXTURE_2D, 0);
+		bindTextureToActiveUnit(GL_TEXTURE_CUBE_MAP, 0);
+		bindTextureToActiveUnit(GL_TEXTURE_3D, 0);
 	}
 
 	void Texture::generateMipmaps()
@@ -617,7 +620,7 @@ namespace GFX
 		if (!glGenerateMipmapEXT)
 			return;
 
-		glBindTexture(this->texture_type, texture_id);	//enable the id of the texture we are going to use
+		bindTextureToActiveUnit(this->texture_type, texture_id);	//enable the id of the texture we are going to use
 		glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, Texture::default_min_filter); //set the mag filter
 		if (this->texture_type == GL_TEXTURE_CUBE_MAP)
 		{
@@ -626,7 +629,7 @@ namespace GFX
 		}
 		glGenerateMipmapEXT(this->texture_type);
 #else
-		glBindTexture(this->texture_type, texture_id);	//enable the id of the texture we are going to use
+		bindTextureToActiveUnit(this->texture_type, texture_id);	//enable the id of the texture we are going to use
 		glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, Texture::default_min_filter);
 		glGenerateMipmap(this->texture_type);
 #endif
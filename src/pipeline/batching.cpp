@@ -0,0 +1,296 @@
+#include "batching.h"
+
+#include "scene.h"
+#include "prefab.h"
+#include "material.h"
+#include "../gfx/mesh.h"
+#include "../utils/utils.h"
+
+#include <cmath>
+
+using namespace SCN;
+
+StaticBatcher::StaticBatcher(float cell_size)
+{
+	this->cell_size = cell_size;
+	rebuild_delay = 30;
+	num_batches = 0;
+	num_sources = 0;
+	cells_rebuilt = 0;
+	rebuild_time = 0;
+	update_count = 0;
+}
+
+StaticBatcher::~StaticBatcher()
+{
+	clear();
+}
+
+void StaticBatcher::clear()
+{
+	for (auto& it : cells)
+		releaseBatches(it.second);
+	cells.clear();
+	entities.clear();
+	num_batches = 0;
+	num_sources = 0;
+}
+
+void StaticBatcher::releaseBatches(sStaticCell& cell)
+{
+	//the merged meshes belong to the batch, the nodes have no children
+	for (sStaticBatch& batch : cell.batches)
+	{
+		delete batch.node->mesh;
+		delete batch.node;
+	}
+	cell.batches.clear();
+	cell.loose_nodes.clear();
+}
+
+uint64 StaticBatcher::getCellKey(const Vector3f& position)
+{
+	uint32 x = (uint32)(int32)floorf(position.x / cell_size);
+	uint32 z = (uint32)(int32)floorf(position.z / cell_size);
+	return ((uint64)x << 32) | z;
+}
+
+bool StaticBatcher::isBatched(PrefabEntity* entity)
+{
+	auto it = entities.find(entity);
+	return it != entities.end() && !it->second.moving;
+}
+
+//what the transforms do not track but changes the batches: hidden nodes and replaced or edited materials
+uint32 StaticBatcher::hashNodes(Node* node, uint32 hash)
+{
+	uint64 values[4] = { (uint64)node->visible, (uint64)(size_t)node->mesh, (uint64)(size_t)node->material, node->material ? node->material->version : 0 };
+	const uint8* bytes = (const uint8*)values;
+	for (size_t i = 0; i < sizeof(values); ++i)
+		hash = (hash ^ bytes[i]) * 16777619u;
+	for (size_t i = 0; i < node->children.size(); ++i)
+		hash = hashNodes(node->children[i], hash);
+	return hash;
+}
+
+void StaticBatcher::update(Scene* scene)
+{
+	double start_time = getPreciseTime();
+	update_count++;
+	cells_rebuilt = 0;
+
+	for (BaseEntity* ent : scene->entities)
+	{
+		if (ent->getType() != eEntityType::PREFAB)
+			continue;
+		PrefabEntity* pent = (PrefabEntity*)ent;
+		if (!pent->is_static || !pent->prefab)
+			continue;
+		pent->root.updateTransforms(); //the batched ones are not updated by the renderer
+		if (!pent->root.has_subtree_aabb)
+			continue;
+		uint64 key = getCellKey(pent->root.subtree_aabb.center);
+		uint32 content_hash = hashNodes(&pent->root);
+
+		auto it = entities.find(pent);
+		if (it == entities.end())
+		{
+			sStaticEntity& entry = entities[pent];
+			entry.cell = key;
+			entry.subtree_version = pent->root.subtree_version;
+			entry.content_hash = content_hash;
+			entry.visible = pent->visible;
+			entry.moving = false;
+			entry.still_updates = 0;
+			entry.last_seen = update_count;
+			cells[key].dirty = true;
+			continue;
+		}
+
+		sStaticEntity& entry = it->second;
+		entry.last_seen = update_count;
+		if (entry.subtree_version != pent->root.subtree_version || entry.content_hash != content_hash || entry.cell != key || entry.visible != pent->visible)
+		{
+			//out of the batches while it keeps changing (the editor moves it every frame)
+			if (!entry.moving)
+				cells[entry.cell].dirty = true;
+			entry.moving = true;
+			entry.still_updates = 0;
+			entry.cell = key;
+			entry.subtree_version = pent->root.subtree_version;
+			entry.content_hash = content_hash;
+			entry.visible = pent->visible;
+		}
+		else if (entry.moving && ++entry.still_updates >= rebuild_delay)
+		{
+			entry.moving = false;
+			cells[key].dirty = true;
+		}
+	}
+
+	//removed from the scene or not static anymore, the pointer is not used
+	for (auto it = entities.begin(); it != entities.end();)
+	{
+		if (it->second.last_seen == update_count)
+		{
+			++it;
+			continue;
+		}
+		if (!it->second.moving)
+			cells[it->second.cell].dirty = true;
+		it = entities.erase(it);
+	}
+
+	for (auto it = cells.begin(); it != cells.end();)
+	{
+		sStaticCell& cell = it->second;
+		if (cell.dirty)
+		{
+			buildCell(it->first, cell);
+			cells_rebuilt++;
+		}
+		if (cell.batches.empty() && cell.loose_nodes.empty())
+			it = cells.erase(it);
+		else
+			++it;
+	}
+
+	if (!cells_rebuilt)
+		return;
+	num_batches = 0;
+	num_sources = 0;
+	for (auto& it : cells)
+		for (sStaticBatch& batch : it.second.batches)
+		{
+			num_batches++;
+			num_sources += batch.num_sources;
+		}
+	rebuild_time = (float)(getPreciseTime() - start_time);
+}
+
+void StaticBatcher::addNode(Node* node, sStaticCell& cell, std::unordered_map<Material*, std::vector<Node*>>& nodes_by_material)
+{
+	if (!node->visible)
+		return;
+
+	if (node->mesh && node->material && node->mesh->getNumVertices())
+	{
+		//blended ones need their own depth in the sort, skinned ones move
+		if (node->material->alpha_mode == eAlphaMode::BLEND || node->mesh->bones.size())
+			cell.loose_nodes.push_back(node);
+		else
+			nodes_by_material[node->material].push_back(node);
+	}
+
+	for (size_t i = 0; i < node->children.size(); ++i)
+		addNode(node->children[i], cell, nodes_by_material);
+}
+
+//appends the whole mesh (first detail level) transformed by the model, the secondary streams only if some source of the
+//batch has them (with_colors, with_uvs1), the sources without them get white and zero
+static void appendMesh(GFX::Mesh* batch, GFX::Mesh* source, const Matrix44& model, bool with_colors, bool with_uvs1)
+{
+	uint32 base = (uint32)batch->vertices.size();
+	int num_vertices = source->getNumVertices();
+	bool interleaved = source->interleaved.size() > 0;
+	bool has_colors = (int)source->colors.size() == num_vertices;
+	bool has_uvs1 = (int)source->m_uvs1.size() == num_vertices;
+
+	Matrix44 normal_model = model;
+	normal_model.inverse();
+	normal_model.transpose();
+
+	for (int i = 0; i < num_vertices; ++i)
+	{
+		Vector3f position = interleaved ? source->interleaved[i].vertex : source->vertices[i];
+		Vector3f normal = interleaved ? source->interleaved[i].normal : (source->normals.size() ? source->normals[i] : Vector3f(0, 1, 0));
+		Vector2f uv = interleaved ? source->interleaved[i].uv : (source->uvs.size() ? source->uvs[i] : Vector2f(0, 0));
+		batch->vertices.push_back(model * position);
+		batch->normals.push_back(normal_model.rotateVector(normal).normalize());
+		batch->uvs.push_back(uv);
+		if (with_colors)
+			batch->colors.push_back(has_colors ? source->colors[i] : Vector4f(1, 1, 1, 1));
+		if (with_uvs1)
+			batch->m_uvs1.push_back(has_uvs1 ? source->m_uvs1[i] : Vector2f(0, 0));
+	}
+
+	//a mirroring model flips the winding
+	Vector3f right = Vector3f(model.m[0], model.m[1], model.m[2]);
+	Vector3f top = Vector3f(model.m[4], model.m[5], model.m[6]);
+	Vector3f front = Vector3f(model.m[8], model.m[9], model.m[10]);
+	bool flip = dot(cross(right, top), front) < 0.0f;
+
+	uint32 num_indices = source->m_indices.size() ? (source->lods.size() ? source->lods[0].length : (uint32)source->m_indices.size()) : (uint32)num_vertices;
+	for (uint32 i = 0; i + 2 < num_indices; i += 3)
+	{
+		uint32 a = source->m_indices.size() ? source->m_indices[i] : i;
+		uint32 b = source->m_indices.size() ? source->m_indices[i + 1] : i + 1;
+		uint32 c = source->m_indices.size() ? source->m_indices[i + 2] : i + 2;
+		batch->m_indices.push_back(base + a);
+		batch->m_indices.push_back(base + (flip ? c : b));
+		batch->m_indices.push_back(base + (flip ? b : c));
+	}
+}
+
+void StaticBatcher::buildCell(uint64 key, sStaticCell& cell)
+{
+	releaseBatches(cell);
+	cell.dirty = false;
+
+	std::unordered_map<Material*, std::vector<Node*>> nodes_by_material;
+	for (auto& it : entities)
+		if (it.second.cell == key && !it.second.moving && it.second.visible)
+			addNode(&it.first->root, cell, nodes_by_material);
+
+	bool has_bounding = false;
+	for (Node* node : cell.loose_nodes)
+	{
+		cell.bounding = has_bounding ? mergeBoundingBoxes(cell.bounding, node->aabb) : node->aabb;
+		has_bounding = true;
+	}
+
+	for (auto& group : nodes_by_material)
+	{
+		bool with_colors = false, with_uvs1 = false;
+		for (Node* node : group.second)
+		{
+			with_colors = with_colors || node->mesh->colors.size();
+			with_uvs1 = with_uvs1 || node->mesh->m_uvs1.size();
+		}
+		GFX::Mesh* mesh = new GFX::Mesh();
+		for (Node* node : group.second)
+			appendMesh(mesh, node->mesh, node->global_model, with_colors, with_uvs1);
+
+		mesh->aabb_min.set(3.4e+38f, 3.4e+38f, 3.4e+38f);
+		mesh->aabb_max.set(-3.4e+38f, -3.4e+38f, -3.4e+38f);
+		for (const Vector3f& v : mesh->vertices)
+		{
+			mesh->aabb_min.setMin(v);
+			mesh->aabb_max.setMax(v);
+		}
+		mesh->box.center = (mesh->aabb_max + mesh->aabb_min) * 0.5f;
+		mesh->box.halfsize = mesh->aabb_max - mesh->box.center;
+		mesh->radius = mesh->box.halfsize.length();
+
+		//the merged mesh gets its own simplified levels, far cells are drawn with less triangles (hlod)
+		if (GFX::Mesh::generate_lods)
+			mesh->generateLODs();
+		if (GFX::Mesh::generate_meshlets)
+			mesh->buildMeshlets();
+		mesh->interleaveBuffers();
+		mesh->vertex_layout = GFX::Mesh::asset_layout;
+		mesh->uploadToVRAM();
+
+		sStaticBatch batch;
+		batch.node = new Node();
+		batch.node->name = "static_batch";
+		batch.node->mesh = mesh;
+		batch.node->material = group.first;
+		batch.node->updateTransforms();
+		batch.num_sources = (int)group.second.size();
+		cell.batches.push_back(batch);
+
+		cell.bounding = has_bounding ? mergeBoundingBoxes(cell.bounding, batch.node->aabb) : batch.node->aabb;
+		has_bounding = true;
+	}
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+
+#include "../core/math.h"
+
+namespace SCN {
+
+	class Scene;
+	class Node;
+	class PrefabEntity;
+	class Material;
+
+	//geometry of the static nodes of a cell that share a material, already in world space. The node has the merged
+	//mesh with an identity model so it goes through the render queue like any other
+	struct sStaticBatch {
+		Node* node;
+		int num_sources;	//nodes merged in it
+	};
+
+	//static entities are grouped by the cell of the grid (xz plane) where the center of their box is
+	struct sStaticCell {
+		std::vector<sStaticBatch> batches;
+		std::vector<Node*> loose_nodes;	//blended or skinned nodes of the entities, they are drawn one by one
+		BoundingBox bounding;	//of all the batches and loose nodes
+		bool dirty;				//an entity of the cell was added, removed or changed
+		sStaticCell() : dirty(false) {}
+	};
+
+	//state of a static entity when the batches were built
+	struct sStaticEntity {
+		uint64 cell;
+		uint32 subtree_version;	//root subtree_version, changes when anything of the entity moves or is replaced
+		uint32 content_hash;	//visibility, meshes and materials (and their versions) of the nodes, see hashNodes
+		bool visible;
+		bool moving;			//changed recently, it is out of the batches and rendered with its nodes
+		int still_updates;		//updates since its last change
+		int last_seen;			//last update it was found in the scene
+	};
+
+	//Static batching: the prefab entities marked as static are merged per cell and material in world space meshes,
+	//so every cell costs a draw call per material instead of one per node. The entities stay in the scene for picking
+	//and editing, if they change they are rendered apart until they are still again and then the cell is rebuilt.
+	class StaticBatcher {
+	public:
+		float cell_size;		//side of the cells in world units
+		int rebuild_delay;		//updates an entity must be still to go back to the batches
+
+		std::unordered_map<uint64, sStaticCell> cells;
+		std::unordered_map<PrefabEntity*, sStaticEntity> entities;
+
+		//counters of the last update
+		int num_batches;
+		int num_sources;		//nodes merged in the batches
+		int cells_rebuilt;
+		float rebuild_time;		//ms spent merging in the last update
+
+		StaticBatcher(float cell_size = 200.0f);
+		~StaticBatcher();
+
+		//finds the static entities that appeared, changed or were removed and rebuilds their cells, call it once per frame
+		void update(Scene* scene);
+
+		//true if the entity is drawn by the batches, otherwise its nodes must be rendered
+		bool isBatched(PrefabEntity* entity);
+
+		void clear();
+
+		uint64 getCellKey(const Vector3f& position);
+
+	private:
+		int update_count;
+		void buildCell(uint64 key, sStaticCell& cell);
+		void addNode(Node* node, sStaticCell& cell, std::unordered_map<Material*, std::vector<Node*>>& nodes_by_material);
+		static void releaseBatches(sStaticCell& cell);
+		static uint32 hashNodes(Node* node, uint32 hash = 2166136261u);
+	};
+};
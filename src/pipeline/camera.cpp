@@ -338,32 +338,24 @@ char Camera::testSphereInFrustum( const Vector3f& v, float radius)
 
 char Camera::testBoxInFrustum(const Vector3f& center, const Vector3f& halfsize)
 {
-	int flag = 0, o = 0;
-
-	flag = planeBoxOverlap( (Vector4f&)frustum[0], center,halfsize );
-	if (flag == CLIP_OUTSIDE)
-		return CLIP_OUTSIDE;
-	o += flag;
-	flag = planeBoxOverlap((Vector4f&)frustum[1], center, halfsize);
-	if (flag == CLIP_OUTSIDE)
-		return CLIP_OUTSIDE;
-	o += flag;
-	flag = planeBoxOverlap((Vector4f&)frustum[2], center, halfsize);
-	if (flag == CLIP_OUTSIDE)
-		return CLIP_OUTSIDE;
-	o += flag;
-	flag = planeBoxOverlap((Vector4f&)frustum[3], center, halfsize);
-	if (flag == CLIP_OUTSIDE)
-		return CLIP_OUTSIDE;
-	o += flag;
-	flag = planeBoxOverlap((Vector4f&)frustum[4], center, halfsize);
-	if (flag == CLIP_OUTSIDE)
-		return CLIP_OUTSIDE;
-	o += flag;
-	flag = planeBoxOverlap((Vector4f&)frustum[5], center, halfsize);
-	if (flag == CLIP_OUTSIDE)
-		return CLIP_OUTSIDE;
-	o += flag;
-	return o == 0 ? CLIP_INSIDE : CLIP_OVERLAP;
+	uint8 plane_mask = FRUSTUM_ALL_PLANES;
+	return testBoxInFrustum(center, halfsize, plane_mask);
+}
+
+char Camera::testBoxInFrustum(const Vector3f& center, const Vector3f& halfsize, uint8& plane_mask)
+{
+	uint8 straddled = 0;
+	for (int p = 0; p < 6; ++p)
+	{
+		if (!(plane_mask & (1 << p)))
+			continue;
+		int flag = planeBoxOverlap((Vector4f&)frustum[p], center, halfsize);
+		if (flag == CLIP_OUTSIDE)
+			return CLIP_OUTSIDE;
+		if (flag == CLIP_OVERLAP)
+			straddled |= 1 << p;
+	}
+	plane_mask = straddled;
+	return straddled ? CLIP_OVERLAP : CLIP_INSIDE;
 }
 
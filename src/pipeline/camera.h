@@ -9,6 +9,8 @@
 
 #include "../core/math.h"
 
+#define FRUSTUM_ALL_PLANES 0x3F //plane mask with the 6 planes
+
 class Camera
 {
 public:
@@ -81,6 +83,8 @@ public:
 	bool testPointInFrustum( Vector3f v );
 	char testSphereInFrustum( const Vector3f& v, float radius);
 	char testBoxInFrustum( const Vector3f& center, const Vector3f& halfsize );
+	//only tests the planes in the mask (bit i is frustum[i]) and leaves in it the planes the box crosses, so the boxes inside it only test those
+	char testBoxInFrustum( const Vector3f& center, const Vector3f& halfsize, uint8& plane_mask );
 };
 
 
@@ -0,0 +1,271 @@
+#include "culling.h"
+
+#include "camera.h"
+#include "../gfx/mesh.h"
+#include "../core/task.h"
+#include "../utils/utils.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <cmath>
+#include <cstring>
+#include <cassert>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(_M_IX86) || (defined(__i386__) && defined(__SSE__))
+	#define CULLING_SIMD
+	#include <immintrin.h>
+	#ifdef _MSC_VER
+		#include <intrin.h>
+		#define CULLING_TARGET_AVX
+	#else
+		#define CULLING_TARGET_AVX __attribute__((target("avx")))
+	#endif
+#endif
+
+using namespace SCN;
+
+void sBoxArrays::resize(int num)
+{
+	center_x.resize(num); center_y.resize(num); center_z.resize(num);
+	half_x.resize(num); half_y.resize(num); half_z.resize(num);
+}
+
+void sBoxArrays::set(int index, const BoundingBox& box)
+{
+	center_x[index] = box.center.x; center_y[index] = box.center.y; center_z[index] = box.center.z;
+	half_x[index] = box.halfsize.x; half_y[index] = box.halfsize.y; half_z[index] = box.halfsize.z;
+}
+
+eCullingPath SCN::getBestCullingPath()
+{
+#ifdef CULLING_SIMD
+	#ifdef _MSC_VER
+		//avx needs the cpu flag and the os saving the ymm registers (osxsave + xcr0)
+		int info[4];
+		__cpuid(info, 1);
+		bool avx = (info[2] & (1 << 28)) && (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+	#else
+		bool avx = __builtin_cpu_supports("avx");
+	#endif
+	return avx ? CULL_AVX : CULL_SSE;
+#else
+	return CULL_SCALAR;
+#endif
+}
+
+const char* SCN::getCullingPathName(eCullingPath path)
+{
+	const char* names[] = { "scalar", "SSE", "AVX" };
+	return names[path];
+}
+
+//one box at a time, used for the tails and when there is no simd
+static void cullBoxesScalar(const float planes[6][4], const sBoxArrays& boxes, int start, int end, uint32* visibility)
+{
+	for (int i = start; i < end; ++i)
+	{
+		bool outside = false;
+		for (int p = 0; p < 6 && !outside; ++p)
+		{
+			const float* plane = planes[p];
+			float radius = fabsf(boxes.half_x[i] * plane[0]) + fabsf(boxes.half_y[i] * plane[1]) + fabsf(boxes.half_z[i] * plane[2]);
+			float distance = plane[0] * boxes.center_x[i] + plane[1] * boxes.center_y[i] + plane[2] * boxes.center_z[i] + plane[3];
+			outside = distance <= -radius;
+		}
+		if (!outside)
+			visibility[i >> 5] |= 1u << (i & 31);
+	}
+}
+
+#ifdef CULLING_SIMD
+
+//4 boxes per iteration, every lane is a box
+static int cullBoxesSSE(const float planes[6][4], const sBoxArrays& boxes, int start, int end, uint32* visibility)
+{
+	__m128 sign_mask = _mm_set1_ps(-0.0f);
+	int i = start;
+	for (; i + 4 <= end; i += 4)
+	{
+		__m128 cx = _mm_loadu_ps(&boxes.center_x[i]), cy = _mm_loadu_ps(&boxes.center_y[i]), cz = _mm_loadu_ps(&boxes.center_z[i]);
+		__m128 hx = _mm_loadu_ps(&boxes.half_x[i]), hy = _mm_loadu_ps(&boxes.half_y[i]), hz = _mm_loadu_ps(&boxes.half_z[i]);
+		__m128 outside = _mm_setzero_ps();
+		for (int p = 0; p < 6; ++p)
+		{
+			__m128 nx = _mm_set1_ps(planes[p][0]), ny = _mm_set1_ps(planes[p][1]), nz = _mm_set1_ps(planes[p][2]);
+			__m128 radius = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(sign_mask, _mm_mul_ps(hx, nx)), _mm_andnot_ps(sign_mask, _mm_mul_ps(hy, ny))), _mm_andnot_ps(sign_mask, _mm_mul_ps(hz, nz)));
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, cx), _mm_mul_ps(ny, cy)), _mm_mul_ps(nz, cz)), _mm_set1_ps(planes[p][3]));
+			outside = _mm_or_ps(outside, _mm_cmple_ps(distance, _mm_xor_ps(radius, sign_mask)));
+		}
+		uint32 mask = (uint32)(~_mm_movemask_ps(outside) & 0xF);
+		visibility[i >> 5] |= mask << (i & 31);
+	}
+	return i;
+}
+
+//8 boxes per iteration, only float operations so avx is enough
+CULLING_TARGET_AVX static int cullBoxesAVX(const float planes[6][4], const sBoxArrays& boxes, int start, int end, uint32* visibility)
+{
+	__m256 sign_mask = _mm256_set1_ps(-0.0f);
+	int i = start;
+	for (; i + 8 <= end; i += 8)
+	{
+		__m256 cx = _mm256_loadu_ps(&boxes.center_x[i]), cy = _mm256_loadu_ps(&boxes.center_y[i]), cz = _mm256_loadu_ps(&boxes.center_z[i]);
+		__m256 hx = _mm256_loadu_ps(&boxes.half_x[i]), hy = _mm256_loadu_ps(&boxes.half_y[i]), hz = _mm256_loadu_ps(&boxes.half_z[i]);
+		__m256 outside = _mm256_setzero_ps();
+		for (int p = 0; p < 6; ++p)
+		{
+			__m256 nx = _mm256_set1_ps(planes[p][0]), ny = _mm256_set1_ps(planes[p][1]), nz = _mm256_set1_ps(planes[p][2]);
+			__m256 radius = _mm256_add_ps(_mm256_add_ps(_mm256_andnot_ps(sign_mask, _mm256_mul_ps(hx, nx)), _mm256_andnot_ps(sign_mask, _mm256_mul_ps(hy, ny))), _mm256_andnot_ps(sign_mask, _mm256_mul_ps(hz, nz)));
+			__m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, cx), _mm256_mul_ps(ny, cy)), _mm256_mul_ps(nz, cz)), _mm256_set1_ps(planes[p][3]));
+			outside = _mm256_or_ps(outside, _mm256_cmp_ps(distance, _mm256_xor_ps(radius, sign_mask), _CMP_LE_OQ));
+		}
+		uint32 mask = (uint32)(~_mm256_movemask_ps(outside) & 0xFF);
+		visibility[i >> 5] |= mask << (i & 31);
+	}
+	return i;
+}
+
+#endif
+
+void SCN::cullBoxes(const float planes[6][4], const sBoxArrays& boxes, int start, int end, uint32* visibility, eCullingPath path)
+{
+	assert((start & 31) == 0);
+	memset(visibility + (start >> 5), 0, ((end - start + 31) >> 5) * sizeof(uint32));
+
+	//groups of 4 or 8 never cross a word because start is aligned to 32
+	int i = start;
+#ifdef CULLING_SIMD
+	if (path == CULL_AVX)
+		i = cullBoxesAVX(planes, boxes, start, end, visibility);
+	else if (path == CULL_SSE)
+		i = cullBoxesSSE(planes, boxes, start, end, visibility);
+#endif
+	cullBoxesScalar(planes, boxes, i, end, visibility);
+}
+
+void SCN::cullBoxesParallel(const float planes[6][4], const sBoxArrays& boxes, std::vector<uint32>& visibility, eCullingPath path)
+{
+	int num_boxes = boxes.size();
+	int num_words = (num_boxes + 31) / 32;
+	visibility.resize(std::max(num_words, 1));
+
+	//threads work on whole words so they never write the same one, 64 words (2048 boxes) is not worth a task
+	TaskManager::parallelFor(num_words, [&](int start, int end) {
+		cullBoxes(planes, boxes, start * 32, std::min(end * 32, num_boxes), &visibility[0], path);
+	}, 64);
+}
+
+int SCN::cullMeshlets(const GFX::sMeshlet* meshlets, int num_meshlets, const Matrix44& model, const float planes[6][4], const Vector3f& eye,
+	bool cull_backfaces, std::vector<uint32>& starts, std::vector<int>& counts)
+{
+	starts.clear();
+	counts.clear();
+
+	//spheres and cones are transformed to world, the radius grows with the biggest scale
+	Vector3f axes[3] = { Vector3f(model.m[0], model.m[1], model.m[2]), Vector3f(model.m[4], model.m[5], model.m[6]), Vector3f(model.m[8], model.m[9], model.m[10]) };
+	float scale_min = std::min(axes[0].length(), std::min(axes[1].length(), axes[2].length()));
+	float scale_max = std::max(axes[0].length(), std::max(axes[1].length(), axes[2].length()));
+	bool mirrored = dot(cross(axes[0], axes[1]), axes[2]) < 0.0f; //the winding is flipped
+	bool test_cones = cull_backfaces && !mirrored && scale_min > 0 && scale_max < scale_min * 1.01f;
+	float inv_scale = scale_max > 0 ? 1.0f / scale_max : 0.0f;
+
+	int culled = 0;
+	for (int i = 0; i < num_meshlets; ++i)
+	{
+		const GFX::sMeshlet& meshlet = meshlets[i];
+		Vector3f center = model * meshlet.center;
+		float radius = meshlet.radius * scale_max;
+
+		bool visible = true;
+		for (int p = 0; p < 6 && visible; ++p)
+			visible = planes[p][0] * center.x + planes[p][1] * center.y + planes[p][2] * center.z + planes[p][3] > -radius;
+
+		//all the triangles face away if the eye is outside the cone widened by the sphere
+		if (visible && test_cones && meshlet.cone_cutoff < 1.0f)
+		{
+			Vector3f axis = model.rotateVector(meshlet.cone_axis) * inv_scale;
+			Vector3f to_center = center - eye;
+			visible = dot(to_center, axis) < meshlet.cone_cutoff * to_center.length() + radius;
+		}
+
+		if (!visible)
+		{
+			culled++;
+			continue;
+		}
+
+		//consecutive meshlets are consecutive in the indices
+		if (counts.size() && starts.back() + counts.back() == meshlet.start)
+			counts.back() += (int)meshlet.length;
+		else
+		{
+			starts.push_back(meshlet.start);
+			counts.push_back((int)meshlet.length);
+		}
+	}
+	return culled;
+}
+
+std::string SCN::benchmarkFrustumCulling(Camera* camera, int num_boxes, int repetitions)
+{
+	//random boxes around the camera, about half of them inside the frustum
+	sBoxArrays boxes;
+	boxes.resize(num_boxes);
+	float range = std::min(camera->far_plane, 1000.0f);
+	for (int i = 0; i < num_boxes; ++i)
+	{
+		BoundingBox box;
+		box.center = camera->eye + camera->front * random(range) + Vector3f(random(range) - range * 0.5f, random(range) - range * 0.5f, random(range) - range * 0.5f);
+		box.halfsize.set(random(10.0f) + 0.1f, random(10.0f) + 0.1f, random(10.0f) + 0.1f);
+		boxes.set(i, box);
+	}
+
+	//reference: the camera test one box at a time
+	std::vector<uint32> reference((num_boxes + 31) / 32 + 1);
+	double start_time = getPreciseTime();
+	for (int r = 0; r < repetitions; ++r)
+	{
+		std::fill(reference.begin(), reference.end(), 0);
+		for (int i = 0; i < num_boxes; ++i)
+			if (camera->testBoxInFrustum(Vector3f(boxes.center_x[i], boxes.center_y[i], boxes.center_z[i]), Vector3f(boxes.half_x[i], boxes.half_y[i], boxes.half_z[i])) != CLIP_OUTSIDE)
+				reference[i >> 5] |= 1u << (i & 31);
+	}
+	double reference_time = (getPreciseTime() - start_time) / repetitions;
+
+	int num_visible = 0;
+	for (int i = 0; i < num_boxes; ++i)
+		num_visible += isBoxVisible(reference, i);
+
+	char line[256];
+	snprintf(line, sizeof(line), "Frustum culling of %d boxes (%d visible), ms per pass:\n  testBoxInFrustum: %.3f\n", num_boxes, num_visible, reference_time);
+	std::string result = line;
+
+	eCullingPath best_path = getBestCullingPath();
+	std::vector<uint32> visibility(reference.size());
+	for (int path = CULL_SCALAR; path <= best_path + 1; ++path)
+	{
+		bool parallel = path > best_path; //last run is the best path with threads
+		eCullingPath kernel_path = parallel ? best_path : (eCullingPath)path;
+		start_time = getPreciseTime();
+		for (int r = 0; r < repetitions; ++r)
+		{
+			if (parallel)
+				cullBoxesParallel(camera->frustum, boxes, visibility, kernel_path);
+			else
+				cullBoxes(camera->frustum, boxes, 0, num_boxes, &visibility[0], kernel_path);
+		}
+		double time = (getPreciseTime() - start_time) / repetitions;
+
+		int mismatches = 0;
+		for (int i = 0; i < num_boxes; ++i)
+			mismatches += isBoxVisible(visibility, i) != isBoxVisible(reference, i);
+
+		snprintf(line, sizeof(line), "  %s%s: %.3f (x%.1f)%s\n", getCullingPathName(kernel_path), parallel ? " threads" : "", time,
+			reference_time / std::max(time, 0.0001), mismatches ? " MISMATCH" : "");
+		result += line;
+	}
+
+	std::cout << result;
+	return result;
+}
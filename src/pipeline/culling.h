@@ -0,0 +1,51 @@
+#pragma once
+
+#include <vector>
+#include <string>
+
+#include "../core/math.h"
+
+class Camera;
+namespace GFX { struct sMeshlet; }
+
+namespace SCN {
+
+	//instruction set used by the batch culling kernel
+	enum eCullingPath {
+		CULL_SCALAR = 0,
+		CULL_SSE = 1,	//4 boxes per iteration
+		CULL_AVX = 2	//8 boxes per iteration
+	};
+
+	//world boxes as structure of arrays so the kernel can load the same component of several boxes at once
+	struct sBoxArrays {
+		std::vector<float> center_x, center_y, center_z;
+		std::vector<float> half_x, half_y, half_z;
+
+		int size() const { return (int)center_x.size(); }
+		void resize(int num);
+		void set(int index, const BoundingBox& box);
+	};
+
+	//best path supported by this cpu (and compiled in this build)
+	eCullingPath getBestCullingPath();
+	const char* getCullingPathName(eCullingPath path);
+
+	//tests the boxes in [start, end) against the 6 planes, bit (i % 32) of visibility[i / 32] is set if box i is not outside.
+	//same test as Camera::testBoxInFrustum, start must be a multiple of 32 and the words of the range are overwritten
+	void cullBoxes(const float planes[6][4], const sBoxArrays& boxes, int start, int end, uint32* visibility, eCullingPath path);
+
+	//all the boxes, split in chunks of words between the worker threads when there are many, visibility is resized to fit them
+	void cullBoxesParallel(const float planes[6][4], const sBoxArrays& boxes, std::vector<uint32>& visibility, eCullingPath path);
+
+	inline bool isBoxVisible(const std::vector<uint32>& visibility, int index) { return (visibility[index >> 5] >> (index & 31)) & 1; }
+
+	//meshlets of a mesh drawn with model that are not outside the planes nor (if cull_backfaces) facing away from the eye,
+	//merged in ranges of consecutive indices of the mesh for a multi draw. The cone test is skipped if the model mirrors or
+	//does not scale all the axes the same. Returns the number of meshlets culled
+	int cullMeshlets(const GFX::sMeshlet* meshlets, int num_meshlets, const Matrix44& model, const float planes[6][4], const Vector3f& eye,
+		bool cull_backfaces, std::vector<uint32>& starts, std::vector<int>& counts);
+
+	//times Camera::testBoxInFrustum against every path of the kernel with random boxes around the camera, prints and returns the results
+	std::string benchmarkFrustumCulling(Camera* camera, int num_boxes, int repetitions = 10);
+};
@@ -0,0 +1,261 @@
+#include "impostor.h"
+
+#include "../core/includes.h"
+#include "prefab.h"
+#include "material.h"
+#include "../gfx/gfx.h"
+#include "../gfx/fbo.h"
+#include "../gfx/mesh.h"
+#include "../gfx/shader.h"
+#include "../gfx/texture.h"
+#include "../utils/utils.h"
+
+#include <sys/stat.h>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+
+using namespace SCN;
+
+const GFX::UniformHandle u_alpha_cutoff("u_alpha_cutoff");
+const GFX::UniformHandle u_color("u_color");
+const GFX::UniformHandle u_model("u_model");
+const GFX::UniformHandle u_texture("u_texture");
+const GFX::UniformHandle u_viewprojection("u_viewprojection");
+
+std::map<std::string, Impostor*> Impostor::sImpostorsLoaded;
+int Impostor::default_frames = 8;
+int Impostor::default_frame_size = 128;
+
+typedef struct
+{
+	char magic[4]; //IMPB
+	int version;
+	int frames;
+	int frame_size;
+	Vector3f center;
+	Vector3f halfsize;
+	float radius;
+} sImpostorInfo;
+
+Impostor::Impostor()
+{
+	frames = 0;
+	frame_size = 0;
+	radius = 0;
+	albedo = nullptr;
+	normal_depth = nullptr;
+}
+
+Impostor::~Impostor()
+{
+	delete albedo;
+	delete normal_depth;
+}
+
+//sign that is never 0 so both sides of the octahedron folds are covered
+static float signNotZero(float v) { return v >= 0.0f ? 1.0f : -1.0f; }
+
+//must match octahedronToDirection in impostor.vs
+Vector3f Impostor::getViewDirection(int x, int y, int frames)
+{
+	float fx = (x + 0.5f) / frames * 2.0f - 1.0f;
+	float fy = (y + 0.5f) / frames * 2.0f - 1.0f;
+	Vector3f n(fx, fy, 1.0f - fabsf(fx) - fabsf(fy));
+	if (n.z < 0.0f)
+	{
+		float nx = (1.0f - fabsf(n.y)) * signNotZero(n.x);
+		float ny = (1.0f - fabsf(n.x)) * signNotZero(n.y);
+		n.x = nx;
+		n.y = ny;
+	}
+	return n.normalize();
+}
+
+//must match the basis in impostor.vs, right and up of the view are the x and y of the cell
+Matrix44 Impostor::getViewProjection(const Vector3f& center, float radius, const Vector3f& direction)
+{
+	Vector3f up_reference = fabsf(direction.y) > 0.99f ? Vector3f(0, 0, 1) : Vector3f(0, 1, 0);
+	Vector3f right = normalize(cross(up_reference, direction));
+	Vector3f up = cross(direction, right);
+
+	//x and y along right and up, depth grows away from the camera
+	float inv = 1.0f / radius;
+	Matrix44 m;
+	m.m[0] = right.x * inv; m.m[1] = up.x * inv; m.m[2] = -direction.x * inv; m.m[3] = 0;
+	m.m[4] = right.y * inv; m.m[5] = up.y * inv; m.m[6] = -direction.y * inv; m.m[7] = 0;
+	m.m[8] = right.z * inv; m.m[9] = up.z * inv; m.m[10] = -direction.z * inv; m.m[11] = 0;
+	m.m[12] = -dot(right, center) * inv; m.m[13] = -dot(up, center) * inv; m.m[14] = dot(direction, center) * inv; m.m[15] = 1;
+	return m;
+}
+
+Impostor* Impostor::Get(Prefab* prefab)
+{
+	assert(prefab);
+	//failed ones are stored too, so they are not baked every frame
+	auto it = sImpostorsLoaded.find(prefab->name);
+	if (it != sImpostorsLoaded.end())
+		return it->second;
+
+	Impostor* impostor = new Impostor();
+	std::string filename = prefab->name + ".impostor";
+
+	//the cache is only valid if it is newer than the prefab
+	struct stat prefab_stat, cache_stat;
+	bool cached = stat(filename.c_str(), &cache_stat) == 0 && (stat(prefab->name.c_str(), &prefab_stat) != 0 || cache_stat.st_mtime >= prefab_stat.st_mtime);
+	if (!cached || !impostor->load(filename.c_str()))
+	{
+		double time = getTime();
+		if (impostor->bake(prefab, default_frames, default_frame_size))
+		{
+			std::cout << " + Impostor baked: " << prefab->name << " " << impostor->frames << "x" << impostor->frames << " views in " << (getTime() - time) << "ms" << std::endl;
+			impostor->save(filename.c_str());
+		}
+		else
+		{
+			delete impostor;
+			impostor = nullptr;
+		}
+	}
+
+	if (impostor)
+		impostor->createTextures();
+	sImpostorsLoaded[prefab->name] = impostor;
+	return impostor;
+}
+
+void Impostor::renderNode(Node* node, GFX::Shader* shader)
+{
+	if (!node->visible)
+		return;
+
+	if (node->mesh && node->material)
+	{
+		Material* material = node->material;
+		GFX::Texture* texture = material->textures[eTextureChannel::ALBEDO].texture;
+		if (!texture)
+			texture = GFX::Texture::getWhiteTexture();
+
+		//blended materials are stored as opaque, the impostor is alpha tested
+		GFX::setGPUState(material->two_sided ? (GFX_STATE_DEFAULT & ~GFX_STATE_CULL_MASK) : GFX_STATE_DEFAULT);
+		shader->setUniform(u_model, node->global_model);
+		shader->setUniform(u_color, material->color);
+		shader->setUniform(u_texture, texture, 0);
+		shader->setUniform(u_alpha_cutoff, material->alpha_mode == eAlphaMode::MASK ? material->alpha_cutoff : 0.001f);
+		node->mesh->render(GL_TRIANGLES);
+	}
+
+	for (size_t i = 0; i < node->children.size(); ++i)
+		renderNode(node->children[i], shader);
+}
+
+bool Impostor::bake(Prefab* prefab, int frames, int frame_size)
+{
+	GFX::Shader* shader = GFX::Shader::Get("impostor_bake");
+	if (!shader)
+		return false;
+
+	//the prefab root is not rendered by anyone else, its global matrices are the ones of the impostor space
+	prefab->root.updateTransforms();
+	prefab->updateBounding();
+	bounding = prefab->bounding;
+	radius = bounding.halfsize.length();
+	if (radius <= 0.0f)
+		return false;
+
+	this->frames = frames;
+	this->frame_size = frame_size;
+	int size = frames * frame_size;
+
+	GFX::FBO fbo;
+	fbo.create(size, size, 2, GL_RGBA, GL_UNSIGNED_BYTE, true);
+	fbo.bind();
+	GFX::setGPUState(GFX_STATE_DEFAULT); //writes enabled for the clear
+	glClearColor(0, 0, 0, 0);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	shader->enable();
+	for (int y = 0; y < frames; ++y)
+		for (int x = 0; x < frames; ++x)
+		{
+			glViewport(x * frame_size, y * frame_size, frame_size, frame_size);
+			shader->setUniform(u_viewprojection, getViewProjection(bounding.center, radius, getViewDirection(x, y, frames)));
+			renderNode(&prefab->root, shader);
+		}
+	shader->disable();
+	fbo.unbind();
+	GFX::setGPUState(GFX_STATE_DEFAULT);
+
+	::Image image;
+	image.resize(size, size, 4);
+	image.fromTexture(fbo.color_textures[0]);
+	albedo_data.assign(image.data, image.data + size * size * 4);
+	image.fromTexture(fbo.color_textures[1]);
+	normal_depth_data.assign(image.data, image.data + size * size * 4);
+	return true;
+}
+
+bool Impostor::save(const char* filename)
+{
+	FILE* f = fopen(filename, "wb");
+	if (f == NULL)
+		return false;
+
+	sImpostorInfo info;
+	memcpy(info.magic, "IMPB", 4);
+	info.version = IMPOSTOR_BIN_VERSION;
+	info.frames = frames;
+	info.frame_size = frame_size;
+	info.center = bounding.center;
+	info.halfsize = bounding.halfsize;
+	info.radius = radius;
+	fwrite(&info, sizeof(info), 1, f);
+	fwrite(&albedo_data[0], albedo_data.size(), 1, f);
+	fwrite(&normal_depth_data[0], normal_depth_data.size(), 1, f);
+	fclose(f);
+	return true;
+}
+
+bool Impostor::load(const char* filename)
+{
+	FILE* f = fopen(filename, "rb");
+	if (f == NULL)
+		return false;
+
+	sImpostorInfo info;
+	bool valid = fread(&info, sizeof(info), 1, f) == 1 && memcmp(info.magic, "IMPB", 4) == 0 && info.version == IMPOSTOR_BIN_VERSION
+		&& info.frames == default_frames && info.frame_size == default_frame_size;
+	if (valid)
+	{
+		size_t size = (size_t)info.frames * info.frame_size;
+		albedo_data.resize(size * size * 4);
+		normal_depth_data.resize(size * size * 4);
+		valid = fread(&albedo_data[0], albedo_data.size(), 1, f) == 1 && fread(&normal_depth_data[0], normal_depth_data.size(), 1, f) == 1;
+	}
+	fclose(f);
+	if (!valid)
+	{
+		std::cout << "[WARN] Impostor cache outdated: " << filename << std::endl;
+		return false;
+	}
+
+	frames = info.frames;
+	frame_size = info.frame_size;
+	bounding.center = info.center;
+	bounding.halfsize = info.halfsize;
+	radius = info.radius;
+	return true;
+}
+
+void Impostor::createTextures()
+{
+	//no mipmaps, they would mix the neighbour views
+	int size = frames * frame_size;
+	albedo = new GFX::Texture();
+	albedo->create(size, size, GL_RGBA, GL_UNSIGNED_BYTE, false, &albedo_data[0]);
+	normal_depth = new GFX::Texture();
+	normal_depth->create(size, size, GL_RGBA, GL_UNSIGNED_BYTE, false, &normal_depth_data[0]);
+
+	std::vector<uint8>().swap(albedo_data);
+	std::vector<uint8>().swap(normal_depth_data);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <map>
+
+#include "../core/math.h"
+
+namespace GFX {
+	class Texture;
+	class Shader;
+}
+
+namespace SCN {
+
+	class Prefab;
+	class Node;
+
+#define IMPOSTOR_BIN_VERSION 1 //cached atlases with other version are baked again
+
+	//Octahedral impostor: the prefab is rendered from frames x frames directions spread over the sphere with an octahedral
+	//mapping, every view is stored in a cell of two atlases: albedo (alpha is the coverage) and normal (in the space of the
+	//prefab) with the depth of the view in the alpha. Far instances are drawn as a quad oriented like the closest view.
+	class Impostor {
+	public:
+		static std::map<std::string, Impostor*> sImpostorsLoaded;
+		static int default_frames;		//views per side of the atlas
+		static int default_frame_size;	//pixels per side of a view
+
+		int frames;
+		int frame_size;
+		BoundingBox bounding;	//of the prefab in the space of its root, the views are centered on it
+		float radius;			//half of the side of a view
+
+		GFX::Texture* albedo;
+		GFX::Texture* normal_depth;
+
+		Impostor();
+		~Impostor();
+
+		//loads the atlases cached next to the prefab file or bakes them (and saves them), null if the prefab cannot be baked
+		static Impostor* Get(Prefab* prefab);
+
+		//renders the views of the prefab in the atlases, it changes the GL state
+		bool bake(Prefab* prefab, int frames, int frame_size);
+
+		bool load(const char* filename);
+		bool save(const char* filename);
+
+		//direction from the center to the camera of the view in the cell x,y
+		static Vector3f getViewDirection(int x, int y, int frames);
+		//orthographic projection of the view, the box of side 2 * radius around center fills it
+		static Matrix44 getViewProjection(const Vector3f& center, float radius, const Vector3f& direction);
+
+	private:
+		std::vector<uint8> albedo_data;		//pixels of the atlases while baking or loading, released when uploaded
+		std::vector<uint8> normal_depth_data;
+
+		void renderNode(Node* node, GFX::Shader* shader);
+		void createTextures();
+	};
+};
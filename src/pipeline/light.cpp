@@ -61,4 +61,13 @@ void SCN::LightEntity::serialize(cJSON* json)
 		writeJSONString(json, "light_type", "DIRECTIONAL");
 }
 
-
+void SCN::LightEntity::getLightData(sLightData& data)
+{
+	Vector3f pos = root.model.getTranslation();
+	Vector3f front = root.model.frontVector().normalize();
+	Vector3f final_color = color * intensity;
+	data.position_range.set(pos.x, pos.y, pos.z, max_distance);
+	data.color_type.set(final_color.x, final_color.y, final_color.z, (float)light_type);
+	data.front_cone.set(front.x, front.y, front.z, (float)cos(cone_info.x * DEG2RAD));
+	data.cone_end.set((float)cos(cone_info.y * DEG2RAD), 0, 0, 0);
+}
@@ -12,6 +12,14 @@ namespace SCN {
 		AMBIENT = 4
 	};
 
+	//light info as stored in GPU buffers (light block and light grid), 4 vec4 per light
+	struct sLightData {
+		Vector4f position_range;	//xyz position, w max distance
+		Vector4f color_type;		//rgb color * intensity, w light type
+		Vector4f front_cone;		//xyz front, w cos(cone_start)
+		Vector4f cone_end;			//x cos(cone_end)
+	};
+
 	class LightEntity : public BaseEntity
 	{
 	public:
@@ -32,6 +40,8 @@ namespace SCN {
 
 		void configure(cJSON* json);
 		void serialize(cJSON* json);
+
+		void getLightData(sLightData& data);
 	};
 
 };
@@ -0,0 +1,246 @@
+#include "lightgrid.h"
+
+#include "camera.h"
+#include "light.h"
+#include "../core/task.h"
+#include "../utils/utils.h"
+
+#include <algorithm>
+
+using namespace SCN;
+
+//screen and depth bounds of a light in cluster coordinates
+struct sLightClusterRange {
+	int min[3];
+	int max[3];
+};
+
+std::vector<sLightClusterRange> light_ranges;
+
+LightGrid::LightGrid(int tiles_x, int tiles_y, int slices) :
+	lights_buffer("u_lights_data"), ranges_buffer("u_cluster_ranges"), indices_buffer("u_cluster_lights")
+{
+	dims[0] = tiles_x;
+	dims[1] = tiles_y;
+	dims[2] = slices;
+	num_global_lights = num_local_lights = num_light_indices = 0;
+	build_time = 0;
+	lights_buffer.type = ranges_buffer.type = indices_buffer.type = GL_TEXTURE_BUFFER;
+	cluster_boxes.resize(getNumClusters());
+	cluster_spheres.resize(getNumClusters());
+	cluster_lights.resize(getNumClusters());
+	cluster_ranges.resize(getNumClusters() * 2);
+}
+
+//world position of a point of the grid, depth is the distance along the camera front
+static Vector3f gridPoint(Camera* camera, float ndc_x, float ndc_y, float depth)
+{
+	Vector3f pos = camera->eye + camera->front * depth;
+	Vector4f clip = camera->viewprojection_matrix * Vector4f(pos.x, pos.y, pos.z, 1.0f);
+	Vector4f world = camera->inverse_viewprojection_matrix * Vector4f(ndc_x, ndc_y, clip.z / clip.w, 1.0f);
+	return Vector3f(world.x, world.y, world.z) * (1.0f / world.w);
+}
+
+static int clampIndex(int v, int size)
+{
+	return v < 0 ? 0 : (v >= size ? size - 1 : v);
+}
+
+static float sliceDepth(Camera* camera, int slice, int num_slices)
+{
+	return camera->near_plane * (float)pow(camera->far_plane / camera->near_plane, slice / (float)num_slices);
+}
+
+void LightGrid::build(Camera* camera, const std::vector<LightEntity*>& lights)
+{
+	double start_time = getPreciseTime();
+
+	GLint vp[4];
+	glGetIntegerv(GL_VIEWPORT, vp);
+	viewport.set((float)vp[0], (float)vp[1], (float)vp[2], (float)vp[3]);
+
+	float log_range = (float)log(camera->far_plane / camera->near_plane);
+	zparams.set(dims[2] / log_range, -dims[2] * (float)log(camera->near_plane) / log_range);
+
+	//directional lights first, then the rest
+	lights_data.clear();
+	light_ranges.clear();
+	for (int pass = 0; pass < 2; ++pass)
+		for (size_t i = 0; i < lights.size(); ++i)
+		{
+			LightEntity* light = lights[i];
+			bool is_global = light->light_type == eLightType::DIRECTIONAL;
+			if (is_global != (pass == 0) || light->light_type == eLightType::AMBIENT)
+				continue;
+
+			sLightData data;
+			light->getLightData(data);
+			Vector3f pos(data.position_range.x, data.position_range.y, data.position_range.z);
+
+			if (is_global)
+			{
+				lights_data.push_back(data);
+				continue;
+			}
+
+			//skip lights outside the frustum, they cannot affect any cluster
+			float radius = light->max_distance;
+			if (camera->testSphereInFrustum(pos, radius) == CLIP_OUTSIDE)
+				continue;
+
+			//slices from the depth range of the sphere
+			sLightClusterRange range;
+			float depth = dot(pos - camera->eye, camera->front);
+			float min_depth = std::max(depth - radius, camera->near_plane);
+			float max_depth = std::min(depth + radius, camera->far_plane);
+			if (min_depth > max_depth)
+				continue;
+			range.min[2] = clampIndex((int)floor(log(min_depth) * zparams.x + zparams.y), dims[2]);
+			range.max[2] = clampIndex((int)floor(log(max_depth) * zparams.x + zparams.y), dims[2]);
+
+			//tiles from the projection of the sphere bounding box, the whole screen if it crosses the camera plane
+			range.min[0] = range.min[1] = 0;
+			range.max[0] = dims[0] - 1;
+			range.max[1] = dims[1] - 1;
+			if (depth - radius > camera->near_plane)
+			{
+				Vector2f ndc_min(1, 1), ndc_max(-1, -1);
+				for (int j = 0; j < 8; ++j)
+				{
+					Vector3f corner = pos + Vector3f(j & 1 ? radius : -radius, j & 2 ? radius : -radius, j & 4 ? radius : -radius);
+					Vector4f clip = camera->viewprojection_matrix * Vector4f(corner.x, corner.y, corner.z, 1.0f);
+					Vector2f ndc(clip.x / clip.w, clip.y / clip.w);
+					ndc_min.set(std::min(ndc_min.x, ndc.x), std::min(ndc_min.y, ndc.y));
+					ndc_max.set(std::max(ndc_max.x, ndc.x), std::max(ndc_max.y, ndc.y));
+				}
+				range.min[0] = clampIndex((int)floor((ndc_min.x * 0.5f + 0.5f) * dims[0]), dims[0]);
+				range.max[0] = clampIndex((int)floor((ndc_max.x * 0.5f + 0.5f) * dims[0]), dims[0]);
+				range.min[1] = clampIndex((int)floor((ndc_min.y * 0.5f + 0.5f) * dims[1]), dims[1]);
+				range.max[1] = clampIndex((int)floor((ndc_max.y * 0.5f + 0.5f) * dims[1]), dims[1]);
+			}
+
+			lights_data.push_back(data);
+			light_ranges.push_back(range);
+		}
+	num_local_lights = (int)light_ranges.size();
+	num_global_lights = (int)lights_data.size() - num_local_lights;
+
+	//every thread computes the bounds and lists of its own slices
+	TaskManager::parallelFor(dims[2], [this, camera](int start, int end) {
+		computeClusterBounds(camera, start, end);
+		binLights(camera, start, end);
+	});
+
+	//flatten lists, cluster index is (slice * tiles_y + y) * tiles_x + x
+	cluster_indices.clear();
+	for (int i = 0; i < getNumClusters(); ++i)
+	{
+		std::vector<uint16>& list = cluster_lights[i];
+		cluster_ranges[i * 2] = (uint32)cluster_indices.size();
+		cluster_ranges[i * 2 + 1] = (uint32)list.size();
+		cluster_indices.insert(cluster_indices.end(), list.begin(), list.end());
+	}
+	num_light_indices = (int)cluster_indices.size();
+	if (cluster_indices.empty())
+		cluster_indices.push_back(0); //buffers cannot be empty
+	if (lights_data.empty())
+		lights_data.resize(1);
+
+	//upload
+	lights_buffer.updateFromPointer(&lights_data[0], (int)(lights_data.size() * sizeof(sLightData)));
+	ranges_buffer.updateFromPointer(&cluster_ranges[0], (int)(cluster_ranges.size() * sizeof(uint32)));
+	indices_buffer.updateFromPointer(&cluster_indices[0], (int)(cluster_indices.size() * sizeof(uint32)));
+
+	build_time = (float)(getPreciseTime() - start_time);
+}
+
+void LightGrid::computeClusterBounds(Camera* camera, int first_slice, int last_slice)
+{
+	//grid points of the slices, (tiles + 1) in every axis
+	int points_x = dims[0] + 1;
+	int points_y = dims[1] + 1;
+	int num_slices = last_slice - first_slice + 1;
+	std::vector<Vector3f> points(points_x * points_y * num_slices);
+	for (int k = 0; k < num_slices; ++k)
+	{
+		float depth = sliceDepth(camera, first_slice + k, dims[2]);
+		for (int j = 0; j < points_y; ++j)
+			for (int i = 0; i < points_x; ++i)
+				points[(k * points_y + j) * points_x + i] = gridPoint(camera, (i / (float)dims[0]) * 2.0f - 1.0f, (j / (float)dims[1]) * 2.0f - 1.0f, depth);
+	}
+
+	for (int z = first_slice; z < last_slice; ++z)
+		for (int y = 0; y < dims[1]; ++y)
+			for (int x = 0; x < dims[0]; ++x)
+			{
+				Vector3f min_pos(1e10, 1e10, 1e10), max_pos(-1e10, -1e10, -1e10);
+				Vector3f corners[8];
+				for (int c = 0; c < 8; ++c)
+				{
+					int k = z - first_slice + (c & 4 ? 1 : 0);
+					Vector3f& p = points[(k * points_y + y + (c & 2 ? 1 : 0)) * points_x + x + (c & 1)];
+					corners[c] = p;
+					min_pos.set(std::min(min_pos.x, p.x), std::min(min_pos.y, p.y), std::min(min_pos.z, p.z));
+					max_pos.set(std::max(max_pos.x, p.x), std::max(max_pos.y, p.y), std::max(max_pos.z, p.z));
+				}
+				int index = (z * dims[1] + y) * dims[0] + x;
+				BoundingBox& box = cluster_boxes[index];
+				box.center = (min_pos + max_pos) * 0.5f;
+				box.halfsize = (max_pos - min_pos) * 0.5f;
+				float radius = 0;
+				for (int c = 0; c < 8; ++c)
+					radius = std::max(radius, box.center.distance(corners[c]));
+				cluster_spheres[index].set(box.center.x, box.center.y, box.center.z, radius);
+			}
+}
+
+void LightGrid::binLights(Camera* camera, int first_slice, int last_slice)
+{
+	int num_per_slice = dims[0] * dims[1];
+	for (int i = first_slice * num_per_slice; i < last_slice * num_per_slice; ++i)
+		cluster_lights[i].clear();
+
+	for (int i = 0; i < num_local_lights; ++i)
+	{
+		const sLightClusterRange& range = light_ranges[i];
+		int z0 = std::max(range.min[2], first_slice);
+		int z1 = std::min(range.max[2], last_slice - 1);
+		if (z0 > z1)
+			continue;
+
+		uint16 light_index = (uint16)(num_global_lights + i);
+		const sLightData& light = lights_data[light_index];
+		Vector3f pos(light.position_range.x, light.position_range.y, light.position_range.z);
+		float radius = light.position_range.w;
+		bool is_spot = (int)light.color_type.w == eLightType::SPOT;
+		Vector3f dir(-light.front_cone.x, -light.front_cone.y, -light.front_cone.z); //front points from the scene to the light
+		float cone_cos = light.cone_end.x;
+
+		for (int z = z0; z <= z1; ++z)
+			for (int y = range.min[1]; y <= range.max[1]; ++y)
+				for (int x = range.min[0]; x <= range.max[0]; ++x)
+				{
+					int index = (z * dims[1] + y) * dims[0] + x;
+					if (!BoundingBoxSphereOverlap(cluster_boxes[index], pos, radius))
+						continue;
+
+					//cone against the cluster bounding sphere
+					const Vector4f& sphere = cluster_spheres[index];
+					if (is_spot && !ConeSphereOverlap(pos, dir, cone_cos, radius, Vector3f(sphere.x, sphere.y, sphere.z), sphere.w))
+						continue;
+
+					cluster_lights[index].push_back(light_index);
+				}
+	}
+}
+
+void LightGrid::bind(GFX::Shader* shader, int first_slot)
+{
+	lights_buffer.bindTexture(shader, first_slot, GL_RGBA32F);
+	ranges_buffer.bindTexture(shader, first_slot + 1, GL_RG32UI);
+	indices_buffer.bindTexture(shader, first_slot + 2, GL_R32UI);
+	shader->setUniform("u_cluster_dims", Vector3f((float)dims[0], (float)dims[1], (float)dims[2]));
+	shader->setUniform("u_cluster_zparams", zparams);
+	shader->setUniform("u_viewport", viewport);
+	shader->setUniform("u_num_global_lights", num_global_lights);
+}
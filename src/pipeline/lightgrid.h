@@ -0,0 +1,55 @@
+#pragma once
+
+#include <vector>
+
+#include "../core/math.h"
+#include "../gfx/shader.h"
+
+class Camera;
+
+namespace SCN {
+
+	class LightEntity;
+	struct sLightData;
+
+	//Clustered light assignment: the view frustum is split in a grid of froxels (tiles in screen, exponential slices in depth)
+	//and every froxel stores the list of lights that can reach it, so every fragment only evaluates the lights of its froxel.
+	//Directional lights reach everything so they are stored first in the lights buffer and are not binned.
+	class LightGrid {
+	public:
+		int dims[3];				//tiles in x, y and slices in z
+		int num_global_lights;		//directional lights, stored at the beginning of lights_data
+		int num_local_lights;
+		int num_light_indices;		//total references to lights in the clusters
+		float build_time;			//ms spent in the last build
+		Vector4f viewport;			//x, y, width, height of the viewport used to build it
+		Vector2f zparams;			//slice = log(depth) * zparams.x + zparams.y
+
+		std::vector<sLightData> lights_data;	//4 texels per light
+		std::vector<uint32> cluster_ranges;		//offset and count in cluster_indices for every cluster
+		std::vector<uint32> cluster_indices;	//light indices of every cluster one after the other
+
+		GFX::BufferObject lights_buffer;
+		GFX::BufferObject ranges_buffer;
+		GFX::BufferObject indices_buffer;
+
+		LightGrid(int tiles_x = 16, int tiles_y = 9, int slices = 24);
+
+		int getNumClusters() { return dims[0] * dims[1] * dims[2]; }
+
+		//bins the lights using the camera and the current viewport, and uploads the buffers
+		void build(Camera* camera, const std::vector<LightEntity*>& lights);
+
+		//sends the buffers and grid info to a shader using texture slots [first_slot, first_slot + 2]
+		void bind(GFX::Shader* shader, int first_slot);
+
+	private:
+		std::vector<BoundingBox> cluster_boxes;		//world space bounds of every cluster
+		std::vector<Vector4f> cluster_spheres;		//world space bounding sphere of every cluster
+		std::vector<std::vector<uint16>> cluster_lights; //per cluster lists while binning
+
+		void computeClusterBounds(Camera* camera, int first_slice, int last_slice);
+		void binLights(Camera* camera, int first_slice, int last_slice);
+	};
+
+};
@@ -50,6 +50,7 @@ namespace SCN {
 		static Material default_material;
 		std::string name;
 		uint32 index;
+		uint32 version;			//increase it when a parameter changes, so cached data (like the material uniform block) is rebuilt
 		void registerMaterial(const char* name);
 
 		//parameters to control transparency
@@ -70,6 +71,7 @@ namespace SCN {
 		Material() : alpha_mode(NO_ALPHA), alpha_cutoff(0.5), color(1, 1, 1, 1), two_sided(false), roughness_factor(1), metallic_factor(0) {
 			//color_texture = emissive_texture = metallic_roughness_texture = occlusion_texture = normal_texture = NULL;
 			index = s_last_index++;
+			version = 0;
 		}
 		virtual ~Material();
 
@@ -0,0 +1,309 @@
+#include "occlusion.h"
+
+#include "camera.h"
+#include "../gfx/mesh.h"
+#include "../core/task.h"
+#include "../utils/utils.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(_M_IX86) || (defined(__i386__) && defined(__SSE__))
+	#define OCCLUSION_SSE
+	#include <emmintrin.h>
+#endif
+
+using namespace SCN;
+
+OcclusionBuffer::OcclusionBuffer(int width, int height)
+{
+	this->width = (width + 3) & ~3; //rows are rasterized 4 pixels at a time
+	this->height = height;
+	max_occluders = 64;
+	max_occluder_triangles = 8192;
+	min_occluder_size = 0.1f;
+	num_occluders = num_triangles = 0;
+	raster_time = 0;
+
+	//every level is half the previous one (rounded up, so odd sizes keep their last row and column) until 1x1
+	int w = this->width, h = height;
+	while (true)
+	{
+		levels.push_back(std::vector<float>(w * h, 1.0f));
+		if (w == 1 && h == 1)
+			break;
+		w = (w + 1) / 2;
+		h = (h + 1) / 2;
+	}
+}
+
+bool OcclusionBuffer::canOcclude(GFX::Mesh* mesh)
+{
+	int num_vertices = mesh->getNumVertices();
+	if (!num_vertices)
+		return false;
+	int num_triangles = (int)(mesh->lods.size() ? mesh->lods[0].length : (mesh->m_indices.size() ? mesh->m_indices.size() : num_vertices)) / 3;
+	return num_triangles <= max_occluder_triangles;
+}
+
+//clip space vertex, the polygon is clipped against the near plane (z >= -w)
+static int clipNear(const Vector4f* input, Vector4f* output)
+{
+	int count = 0;
+	for (int i = 0; i < 3; ++i)
+	{
+		const Vector4f& a = input[i];
+		const Vector4f& b = input[(i + 1) % 3];
+		float da = a.z + a.w;
+		float db = b.z + b.w;
+		if (da >= 0)
+			output[count++] = a;
+		if ((da >= 0) != (db >= 0))
+		{
+			float t = da / (da - db);
+			output[count++] = a * (1.0f - t) + b * t;
+		}
+	}
+	return count;
+}
+
+static void setupTriangle(sOccluderTriangle& tri, const Vector4f* clip, int width, int height)
+{
+	tri.min_x = tri.min_y = 0;
+	tri.max_x = tri.max_y = -1;
+
+	float x[3], y[3], z[3];
+	for (int i = 0; i < 3; ++i)
+	{
+		float inv_w = 1.0f / clip[i].w;
+		x[i] = (clip[i].x * inv_w * 0.5f + 0.5f) * width;
+		y[i] = (clip[i].y * inv_w * 0.5f + 0.5f) * height;
+		z[i] = clip[i].z * inv_w;
+	}
+
+	//both faces are rasterized, counter clockwise order so the inside is positive
+	float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+	if (fabsf(area) < 1e-6f)
+		return;
+	if (area < 0)
+	{
+		std::swap(x[1], x[2]); std::swap(y[1], y[2]); std::swap(z[1], z[2]);
+		area = -area;
+	}
+
+	//pixel centers inside the bounds, clamped to the buffer
+	float min_x = std::max(std::min(x[0], std::min(x[1], x[2])), 0.0f);
+	float max_x = std::min(std::max(x[0], std::max(x[1], x[2])), (float)width);
+	float min_y = std::max(std::min(y[0], std::min(y[1], y[2])), 0.0f);
+	float max_y = std::min(std::max(y[0], std::max(y[1], y[2])), (float)height);
+	if (min_x > max_x || min_y > max_y)
+		return;
+	tri.min_x = (int)ceilf(min_x - 0.5f);
+	tri.max_x = std::min((int)floorf(max_x - 0.5f), width - 1);
+	tri.min_y = (int)ceilf(min_y - 0.5f);
+	tri.max_y = std::min((int)floorf(max_y - 0.5f), height - 1);
+
+	for (int i = 0; i < 3; ++i)
+	{
+		int j = (i + 1) % 3;
+		float a = y[i] - y[j];
+		float b = x[j] - x[i];
+		tri.edges[i][0] = a;
+		tri.edges[i][1] = b;
+		tri.edges[i][2] = -(a * x[i] + b * y[i]);
+	}
+
+	float dzdx = ((z[1] - z[0]) * (y[2] - y[0]) - (z[2] - z[0]) * (y[1] - y[0])) / area;
+	float dzdy = ((z[2] - z[0]) * (x[1] - x[0]) - (z[1] - z[0]) * (x[2] - x[0])) / area;
+	tri.depth[0] = dzdx;
+	tri.depth[1] = dzdy;
+	tri.depth[2] = z[0] - dzdx * x[0] - dzdy * y[0];
+}
+
+void OcclusionBuffer::render(Camera* camera, const std::vector<GFX::Mesh*>& meshes, const std::vector<Matrix44>& models)
+{
+	double start_time = getPreciseTime();
+	std::fill(levels[0].begin(), levels[0].end(), 1.0f);
+
+	//every source triangle has room for the two triangles it can become after clipping
+	num_occluders = (int)meshes.size();
+	std::vector<int> offsets(num_occluders + 1, 0);
+	for (int i = 0; i < num_occluders; ++i)
+	{
+		GFX::Mesh* mesh = meshes[i];
+		//only the whole mesh, the simplified levels are not conservative
+		int num_indices = (int)(mesh->lods.size() ? mesh->lods[0].length : (mesh->m_indices.size() ? mesh->m_indices.size() : mesh->getNumVertices()));
+		offsets[i + 1] = offsets[i] + (num_indices / 3) * 2;
+	}
+	triangles.resize(offsets[num_occluders]);
+	num_triangles = offsets[num_occluders] / 2;
+
+	TaskManager::parallelFor(num_occluders, [&](int start, int end) {
+		for (int i = start; i < end; ++i)
+		{
+			GFX::Mesh* mesh = meshes[i];
+			Matrix44 mvp = models[i] * camera->viewprojection_matrix;
+			const Vector3f* positions = mesh->interleaved.size() ? &mesh->interleaved[0].vertex : &mesh->vertices[0];
+			size_t stride = mesh->interleaved.size() ? sizeof(GFX::Mesh::tInterleaved) : sizeof(Vector3f);
+			int num_indices = (offsets[i + 1] - offsets[i]) / 2 * 3;
+			sOccluderTriangle* output = &triangles[offsets[i]];
+
+			for (int t = 0; t < num_indices; t += 3)
+			{
+				Vector4f clip[3], clipped[4];
+				for (int k = 0; k < 3; ++k)
+				{
+					int index = mesh->m_indices.size() ? mesh->m_indices[t + k] : t + k;
+					const Vector3f& v = *(const Vector3f*)((const char*)positions + index * stride);
+					clip[k] = mvp * Vector4f(v.x, v.y, v.z, 1.0f);
+				}
+				int count = clipNear(clip, clipped);
+				sOccluderTriangle* pair = output + (t / 3) * 2;
+				pair[0].min_x = pair[1].min_x = 0;
+				pair[0].max_x = pair[1].max_x = -1;
+				if (count >= 3)
+					setupTriangle(pair[0], clipped, width, height);
+				if (count == 4)
+				{
+					Vector4f second[3] = { clipped[0], clipped[2], clipped[3] };
+					setupTriangle(pair[1], second, width, height);
+				}
+			}
+		}
+	});
+
+	TaskManager::parallelFor(height, [this](int start, int end) { rasterizeRows(start, end); }, 8);
+	buildPyramid();
+
+	raster_time = (float)(getPreciseTime() - start_time);
+}
+
+void OcclusionBuffer::rasterizeRows(int first_row, int last_row)
+{
+	float* depth_buffer = &levels[0][0];
+	for (size_t i = 0; i < triangles.size(); ++i)
+	{
+		const sOccluderTriangle& tri = triangles[i];
+		int y0 = std::max(tri.min_y, first_row);
+		int y1 = std::min(tri.max_y, last_row - 1);
+		if (tri.min_x > tri.max_x || y0 > y1)
+			continue;
+
+		for (int y = y0; y <= y1; ++y)
+		{
+			float py = y + 0.5f;
+			float* row = depth_buffer + y * width;
+#ifdef OCCLUSION_SSE
+			//4 pixels at a time, the blocks are aligned so they never leave the row
+			__m128 e0_row = _mm_set1_ps(tri.edges[0][1] * py + tri.edges[0][2]);
+			__m128 e1_row = _mm_set1_ps(tri.edges[1][1] * py + tri.edges[1][2]);
+			__m128 e2_row = _mm_set1_ps(tri.edges[2][1] * py + tri.edges[2][2]);
+			__m128 z_row = _mm_set1_ps(tri.depth[1] * py + tri.depth[2]);
+			__m128 e0_dx = _mm_set1_ps(tri.edges[0][0]), e1_dx = _mm_set1_ps(tri.edges[1][0]), e2_dx = _mm_set1_ps(tri.edges[2][0]);
+			__m128 z_dx = _mm_set1_ps(tri.depth[0]);
+			__m128 zero = _mm_setzero_ps();
+			for (int x = tri.min_x & ~3; x <= tri.max_x; x += 4)
+			{
+				__m128 px = _mm_add_ps(_mm_set1_ps(x + 0.5f), _mm_setr_ps(0, 1, 2, 3));
+				__m128 inside = _mm_and_ps(_mm_and_ps(
+					_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(e0_dx, px), e0_row), zero),
+					_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(e1_dx, px), e1_row), zero)),
+					_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(e2_dx, px), e2_row), zero));
+				__m128 old_depth = _mm_loadu_ps(row + x);
+				__m128 depth = _mm_min_ps(old_depth, _mm_add_ps(_mm_mul_ps(z_dx, px), z_row));
+				_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, depth), _mm_andnot_ps(inside, old_depth)));
+			}
+#else
+			for (int x = tri.min_x; x <= tri.max_x; ++x)
+			{
+				float px = x + 0.5f;
+				if (tri.edges[0][0] * px + tri.edges[0][1] * py + tri.edges[0][2] < 0 ||
+					tri.edges[1][0] * px + tri.edges[1][1] * py + tri.edges[1][2] < 0 ||
+					tri.edges[2][0] * px + tri.edges[2][1] * py + tri.edges[2][2] < 0)
+					continue;
+				row[x] = std::min(row[x], tri.depth[0] * px + tri.depth[1] * py + tri.depth[2]);
+			}
+#endif
+		}
+	}
+}
+
+void OcclusionBuffer::buildPyramid()
+{
+	int src_w = width, src_h = height;
+	for (size_t l = 1; l < levels.size(); ++l)
+	{
+		int w = (src_w + 1) / 2;
+		int h = (src_h + 1) / 2;
+		const std::vector<float>& src = levels[l - 1];
+		std::vector<float>& dst = levels[l];
+		for (int y = 0; y < h; ++y)
+			for (int x = 0; x < w; ++x)
+			{
+				int x0 = x * 2, x1 = std::min(x * 2 + 1, src_w - 1);
+				int y0 = y * 2, y1 = std::min(y * 2 + 1, src_h - 1);
+				dst[y * w + x] = std::max(std::max(src[y0 * src_w + x0], src[y0 * src_w + x1]), std::max(src[y1 * src_w + x0], src[y1 * src_w + x1]));
+			}
+		src_w = w;
+		src_h = h;
+	}
+}
+
+//ndc bounds of the box, false if it crosses the near plane
+static bool projectBox(Camera* camera, const BoundingBox& box, Vector3f& ndc_min, Vector3f& ndc_max)
+{
+	ndc_min.set(1e10f, 1e10f, 1e10f);
+	ndc_max.set(-1e10f, -1e10f, -1e10f);
+	for (int i = 0; i < 8; ++i)
+	{
+		Vector3f corner = box.center + Vector3f(i & 1 ? box.halfsize.x : -box.halfsize.x, i & 2 ? box.halfsize.y : -box.halfsize.y, i & 4 ? box.halfsize.z : -box.halfsize.z);
+		Vector4f clip = camera->viewprojection_matrix * Vector4f(corner.x, corner.y, corner.z, 1.0f);
+		if (clip.w <= 1e-5f || clip.z < -clip.w)
+			return false;
+		Vector3f ndc(clip.x / clip.w, clip.y / clip.w, clip.z / clip.w);
+		ndc_min.set(std::min(ndc_min.x, ndc.x), std::min(ndc_min.y, ndc.y), std::min(ndc_min.z, ndc.z));
+		ndc_max.set(std::max(ndc_max.x, ndc.x), std::max(ndc_max.y, ndc.y), std::max(ndc_max.z, ndc.z));
+	}
+	return true;
+}
+
+float OcclusionBuffer::getScreenSize(Camera* camera, const BoundingBox& box)
+{
+	Vector3f ndc_min, ndc_max;
+	if (!projectBox(camera, box, ndc_min, ndc_max))
+		return 1.0f;
+	return std::max(ndc_max.x - ndc_min.x, ndc_max.y - ndc_min.y) * 0.5f;
+}
+
+bool OcclusionBuffer::testBox(Camera* camera, const BoundingBox& box)
+{
+	Vector3f ndc_min, ndc_max;
+	if (!projectBox(camera, box, ndc_min, ndc_max))
+		return true;
+
+	//pixels touched by the box, clamped to the buffer
+	int x0 = std::max((int)floorf((ndc_min.x * 0.5f + 0.5f) * width), 0);
+	int x1 = std::min((int)floorf((ndc_max.x * 0.5f + 0.5f) * width), width - 1);
+	int y0 = std::max((int)floorf((ndc_min.y * 0.5f + 0.5f) * height), 0);
+	int y1 = std::min((int)floorf((ndc_max.y * 0.5f + 0.5f) * height), height - 1);
+	if (x0 > x1 || y0 > y1)
+		return true;
+
+	//coarsest level where the rect is at most 4x4 texels
+	size_t level = 0;
+	int w = width;
+	while ((x1 - x0 > 3 || y1 - y0 > 3) && level + 1 < levels.size())
+	{
+		x0 >>= 1; x1 >>= 1; y0 >>= 1; y1 >>= 1;
+		w = (w + 1) / 2;
+		level++;
+	}
+
+	//visible if the nearest point of the box is in front of the farthest occluder depth of any texel
+	const std::vector<float>& depth = levels[level];
+	for (int y = y0; y <= y1; ++y)
+		for (int x = x0; x <= x1; ++x)
+			if (ndc_min.z <= depth[y * w + x])
+				return true;
+	return false;
+}
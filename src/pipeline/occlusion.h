@@ -0,0 +1,57 @@
+#pragma once
+
+#include <vector>
+
+#include "../core/math.h"
+
+class Camera;
+
+namespace GFX {
+	class Mesh;
+}
+
+namespace SCN {
+
+	//triangle of an occluder already projected to the depth buffer, as edge functions and depth plane in pixel coordinates
+	struct sOccluderTriangle {
+		float edges[3][3];	//a * x + b * y + c >= 0 inside
+		float depth[3];		//ndc depth = a * x + b * y + c
+		int min_x, min_y, max_x, max_y; //pixels it can touch, min_x > max_x if it was clipped away
+	};
+
+	//Software occlusion: a few big occluders are rasterized in a small depth buffer on the cpu, then a max depth pyramid
+	//of it is used to reject the boxes that are behind them. No GL involved so it works headless.
+	class OcclusionBuffer {
+	public:
+		int width;
+		int height;
+		int max_occluders;			//biggest ones on screen are used
+		int max_occluder_triangles;	//meshes with more triangles are not used as occluders
+		float min_occluder_size;	//fraction of the screen height the box of an occluder must cover
+
+		std::vector<std::vector<float>> levels; //max depth pyramid, level 0 is the depth buffer (ndc depth, 1 is far)
+		std::vector<sOccluderTriangle> triangles;
+
+		int num_occluders;
+		int num_triangles;	//triangles rasterized in the last frame
+		float raster_time;	//ms spent rasterizing and building the pyramid
+
+		OcclusionBuffer(int width = 256, int height = 128);
+
+		//clears the buffer, rasterizes the meshes with their models and builds the pyramid
+		void render(Camera* camera, const std::vector<GFX::Mesh*>& meshes, const std::vector<Matrix44>& models);
+
+		//the mesh has its positions in memory and is not too heavy to be rasterized
+		bool canOcclude(GFX::Mesh* mesh);
+
+		//false if the box is behind the occluders
+		bool testBox(Camera* camera, const BoundingBox& box);
+
+		//size of the box on screen as a fraction of the screen height, 1 if it crosses the near plane
+		static float getScreenSize(Camera* camera, const BoundingBox& box);
+
+		//rows [first_row, last_row) of the depth buffer, every thread rasterizes all the triangles in its band
+		void rasterizeRows(int first_row, int last_row);
+		void buildPyramid();
+	};
+};
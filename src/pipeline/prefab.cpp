@@ -22,6 +22,12 @@ Node::Node() : parent(nullptr), mesh(nullptr), material(nullptr), visible(true)
 {
 	m_Id = s_NodeID++;
 	distance_to_camera = NULL;
+	dirty = true;
+	dirty_children = false;
+	version = 0;
+	subtree_version = 0;
+	has_subtree_aabb = false;
+	lod = 0;
 }
 
 Node::~Node()
@@ -53,13 +59,75 @@ void Node::clear()
 
 BoundingBox Node::getBoundingBox()
 {
-	aabb.center.set(0, 0, 0);
-	aabb.halfsize.set(0, 0, 0);
+	BoundingBox box;
+	box.center.set(0, 0, 0);
+	box.halfsize.set(0, 0, 0);
 	if (mesh)
-		aabb = mesh->box;
+		box = mesh->box;
 	for (int i = 0; i < children.size(); ++i)
-		aabb = mergeBoundingBoxes( children[i]->getBoundingBox(), aabb );
-	return transformBoundingBox(model, aabb);
+		box = mergeBoundingBoxes( children[i]->getBoundingBox(), box );
+	return transformBoundingBox(model, box);
+}
+
+void Node::markDirty()
+{
+	dirty = true;
+	//so the update can skip the clean branches
+	for (Node* node = parent; node && !node->dirty_children; node = node->parent)
+		node->dirty_children = true;
+}
+
+void Node::updateTransforms(bool parent_changed)
+{
+	bool changed = dirty || parent_changed;
+	if (!changed && !dirty_children)
+		return;
+
+	if (changed)
+	{
+		global_model = parent ? model * parent->global_model : model;
+		if (mesh)
+			aabb = transformBoundingBox(global_model, mesh->box);
+		version++;
+		dirty = false;
+	}
+	dirty_children = false;
+
+	for (int i = 0; i < children.size(); ++i)
+		children[i]->updateTransforms(changed);
+
+	//something below changed, merge again
+	subtree_version++;
+	has_subtree_aabb = mesh != nullptr;
+	if (mesh)
+		subtree_aabb = aabb;
+	for (int i = 0; i < children.size(); ++i)
+	{
+		Node* child = children[i];
+		if (!child->has_subtree_aabb)
+			continue;
+		subtree_aabb = has_subtree_aabb ? mergeBoundingBoxes(subtree_aabb, child->subtree_aabb) : child->subtree_aabb;
+		has_subtree_aabb = true;
+	}
+}
+
+Matrix44 Node::getGlobalMatrix(bool fast)
+{
+	if (fast)
+	{
+		global_model = parent ? model * parent->global_model : model;
+		return global_model;
+	}
+
+	//the cached one is valid if nothing from here to the root changed
+	bool valid = version > 0;
+	for (Node* node = this; node && valid; node = node->parent)
+		valid = !node->dirty;
+	if (valid)
+		return global_model;
+
+	global_model = parent ? model * parent->getGlobalMatrix() : model;
+	return global_model;
 }
 
 void Node::removeChild(Node* child)
@@ -138,6 +206,7 @@ void Node::operator = (const Node& node)
 	visible = node.visible;
 	model = node.model;
 	aabb = node.aabb;
+	markDirty();
 
 	//clone children
 	for (int i = 0; i < node.children.size(); ++i)
@@ -41,12 +41,22 @@ namespace SCN {
 		GFX::Mesh* mesh;
 		Material* material;
 
-		Matrix44 model;	//the matrix that defines where is the object (in relation to its parent)
-		Matrix44 global_model;	//the matrix that defines where is the object (in relation to the world)
+		Matrix44 model;	//the matrix that defines where is the object (in relation to its parent), call markDirty after changing it (or use setModel)
+		Matrix44 global_model;	//the matrix that defines where is the object (in relation to the world), valid after updateTransforms
 
 		float distance_to_camera;
 
-		BoundingBox aabb; //node bounding box in world space
+		BoundingBox aabb; //mesh bounding box in world space, valid after updateTransforms
+		BoundingBox subtree_aabb; //world space box of the meshes of this node and all its children, used to cull whole branches
+		bool has_subtree_aabb; //false if there is no mesh in the subtree
+
+		//transform cache
+		bool dirty;				//model changed, global_model and aabb of the subtree must be recomputed
+		bool dirty_children;	//some node below is dirty
+		uint32 version;			//increased every time global_model or aabb change
+		uint32 subtree_version;	//increased every time something in this node or below is updated
+
+		int lod;				//detail level of the mesh in the last frame it was rendered
 
 		//info to create the tree
 		Node* parent;
@@ -59,8 +69,15 @@ namespace SCN {
 		virtual ~Node();
 		void clear();
 
+		//bounding box of the subtree in the space of the parent
 		BoundingBox getBoundingBox();
 
+		void setModel(const Matrix44& m) { model = m; markDirty(); }
+		void markDirty();
+
+		//recomputes global_model and aabb of the dirty nodes, call it once per frame from the root
+		void updateTransforms(bool parent_changed = false);
+
 		Node* findNode(const char* name);
 
 		//add node to children list
@@ -69,17 +86,13 @@ namespace SCN {
 			assert(child->parent == NULL);
 			children.push_back(child);
 			child->parent = this;
+			child->markDirty();
 		}
 		void removeChild(Node* child);
 
-		//compute the global matrix taking into account its parent
-		Matrix44 getGlobalMatrix(bool fast = false) { 
-			if (parent)
-				global_model = model * (fast ? parent->global_model : parent->getGlobalMatrix());
-			else
-				global_model = model;
-			return global_model;
-		}
+		//compute the global matrix taking into account its parent, fast uses the parent global_model as it is,
+		//otherwise it is only recomputed if something above is dirty
+		Matrix44 getGlobalMatrix(bool fast = false);
 
 		bool testRay(const Ray& ray, Vector3f& result, int layers = 0xFF, float max_dist = 3.4e+38F);
 		Vector3f localToGlobal(Vector3f v) { return global_model * v; }
@@ -6,6 +6,7 @@
 #include "../gfx/gfx.h"
 #include "../gfx/shader.h"
 #include "../gfx/mesh.h"
+#include "../gfx/geometrypool.h"
 #include "../gfx/texture.h"
 #include "../gfx/fbo.h"
 #include "../pipeline/prefab.h"
@@ -16,25 +17,123 @@
 #include "../core/ui.h"
 
 #include "scene.h"
+#include "lightgrid.h"
+#include "occlusion.h"
+#include "impostor.h"
+#include "batching.h"
+#include "../core/task.h"
 
 using namespace SCN;
 
+//handles of the uniforms sent by the renderer, the shaders skip the values they already have
+const GFX::UniformHandle u_alpha_cutoff("u_alpha_cutoff");
+const GFX::UniformHandle u_ambient_light("u_ambient_light");
+const GFX::UniformHandle u_camera_front("u_camera_front");
+const GFX::UniformHandle u_camera_position("u_camera_position");
+const GFX::UniformHandle u_color("u_color");
+const GFX::UniformHandle u_cone_info("u_cone_info");
+const GFX::UniformHandle u_emissive("u_emissive");
+const GFX::UniformHandle u_gbuffer0("u_gbuffer0");
+const GFX::UniformHandle u_gbuffer1("u_gbuffer1");
+const GFX::UniformHandle u_gbuffer2("u_gbuffer2");
+const GFX::UniformHandle u_gbuffer3("u_gbuffer3");
+const GFX::UniformHandle u_gbuffer_depth("u_gbuffer_depth");
+const GFX::UniformHandle u_iRes("u_iRes");
+const GFX::UniformHandle u_impostor_center("u_impostor_center");
+const GFX::UniformHandle u_impostor_frames("u_impostor_frames");
+const GFX::UniformHandle u_impostor_radius("u_impostor_radius");
+const GFX::UniformHandle u_inverse_viewprojection("u_inverse_viewprojection");
+const GFX::UniformHandle u_light_col("u_light_col");
+const GFX::UniformHandle u_light_front("u_light_front");
+const GFX::UniformHandle u_light_index("u_light_index");
+const GFX::UniformHandle u_light_pos("u_light_pos");
+const GFX::UniformHandle u_light_type("u_light_type");
+const GFX::UniformHandle u_max_distance("u_max_distance");
+const GFX::UniformHandle u_metal_roughness("u_metal_roughness");
+const GFX::UniformHandle u_model("u_model");
+const GFX::UniformHandle u_normalmap("u_normalmap");
+const GFX::UniformHandle u_num_lights("u_num_lights");
+const GFX::UniformHandle u_occlusion("u_occlusion");
+const GFX::UniformHandle u_texture("u_texture");
+const GFX::UniformHandle u_time("u_time");
+const GFX::UniformHandle u_use_specular("u_use_specular");
+const GFX::UniformHandle u_viewprojection("u_viewprojection");
+
 //some globals
 GFX::Mesh sphere;
+GFX::Mesh cone; //spot light volume
+GFX::Mesh cube; //box of the occlusion queries
 
-//struct sRenderable {
-//	Material* material;
-//	GFX::Mesh* mesh;
-//	mat4 model;
-//	float distanceToCamera;
-//};
-
-std::vector<SCN::Node*> default_objects;
-std::vector<SCN::Node*> semitransparent_objects;
 std::vector<LightEntity*> lights;
+std::vector<sSortItem> sort_temp; //scratch memory for the radix sort
+SCN::Material* current_material = nullptr; //material whose uniforms are in the current shader
+std::vector<Matrix44> instance_models; //models of the instances drawn together
+int current_lod = 0; //detail level of the meshes drawn from the render queue
+bool use_meshlet_ranges = false; //the single draws only draw the visible meshlets of these ranges
+std::vector<uint32> meshlet_starts;
+std::vector<int> meshlet_counts;
+bool use_multidraw_batch = false; //the draw is the multi draw of these commands in the pool of the mesh
+std::vector<GFX::sDrawIndirectCommand> batch_commands;
+std::vector<GFX::sPerDrawData> batch_draw_data;
+
+//influence of a light, used to skip and scissor the multipass light passes
+struct sLightVolume {
+	bool visible;		//false if it cannot light anything on screen
+	bool is_local;		//point and spot lights, the rest reach everything
+	bool use_scissor;
+	Vector3f position;
+	Vector3f direction;	//where a spot light points
+	float radius;
+	float cone_cos;
+	int scissor[4];		//x, y, width, height in pixels
+};
+std::vector<sLightVolume> light_volumes; //same order than lights
+uint16 current_light_list[MAX_LIGHTS_SP]; //light list in the current shader
+int current_num_lights = -1; //-1 when the shader has no list
+
+//how much a light can contribute to the box, used to keep the most important ones
+static float lightInfluence(LightEntity* light, const sLightVolume& volume, const BoundingBox& box)
+{
+	float power = std::max(std::max(light->color.x, light->color.y), light->color.z) * light->intensity;
+	if (!volume.is_local)
+		return power;
+	Vector3f closest = volume.position;
+	closest.setMax(box.center - box.halfsize);
+	closest.setMin(box.center + box.halfsize);
+	float attenuation = clamp(1.0f - volume.position.distance(closest) / volume.radius, 0.0f, 1.0f);
+	return power * attenuation * attenuation;
+}
 
-bool compareDist(Node* s1, Node* s2) { 
-	return s1->distance_to_camera > s2->distance_to_camera;
+//true if the light can reach something inside the box
+static bool lightAffectsBox(const sLightVolume& volume, const BoundingBox& box)
+{
+	if (!volume.visible)
+		return false;
+	if (!volume.is_local)
+		return true;
+	if (!BoundingBoxSphereOverlap(box, volume.position, volume.radius))
+		return false;
+	if (volume.cone_cos > -1.0f && !ConeSphereOverlap(volume.position, volume.direction, volume.cone_cos, volume.radius, box.center, box.halfsize.length()))
+		return false;
+	return true;
+}
+
+//draws the mesh once or instanced, the shader must match
+void drawMeshInstances(GFX::Mesh* mesh, const Matrix44* models, int num_instances)
+{
+	if (use_multidraw_batch)
+	{
+		if (batch_commands.empty())
+			return; //all the meshlets culled
+		mesh->setDecodeUniforms(GFX::Shader::current); //only the normals flag is used, the rest comes per draw
+		mesh->pool->drawIndirect(GFX::Shader::current, &batch_commands[0], (int)batch_commands.size(), &batch_draw_data[0], (int)batch_draw_data.size());
+	}
+	else if (num_instances > 1)
+		mesh->renderInstanced(GL_TRIANGLES, models, num_instances, current_lod);
+	else if (use_meshlet_ranges)
+		mesh->renderRanges(GL_TRIANGLES, &meshlet_starts[0], &meshlet_counts[0], (int)meshlet_starts.size());
+	else
+		mesh->render(GL_TRIANGLES, -1, 0, current_lod);
 }
 
 Renderer::Renderer(const char* shader_atlas_filename)
@@ -46,6 +145,31 @@ Renderer::Renderer(const char* shader_atlas_filename)
 	use_multipass = false;
 	render_lights = true;
 	disable_lights = false;
+	use_instancing = true;
+	use_clustered = false;
+	use_light_culling = true;
+	use_light_lists = false;
+	use_hierarchical_culling = true;
+	use_batch_culling = false;
+	culling_path = getBestCullingPath();
+	use_occlusion_culling = false;
+	use_gpu_occlusion = false;
+	gpu_occlusion_min_triangles = 1000;
+	gpu_occlusion_retest_frames = 16;
+	frame_number = 0;
+	use_lods = true;
+	lod_screen_size = 20.0f;
+	lod_hysteresis = 0.1f;
+	use_impostors = false;
+	impostor_screen_size = 3.0f;
+	use_static_batching = true;
+	use_meshlet_culling = true;
+	use_multidraw = true;
+	static_batcher = new StaticBatcher();
+	render_mode = RENDER_FORWARD;
+	gbuffers = nullptr;
+	rendering_gbuffers = false;
+	memset(&stats, 0, sizeof(stats));
 
 	if (!GFX::Shader::LoadAtlas(shader_atlas_filename))
 		exit(1);
@@ -53,6 +177,36 @@ Renderer::Renderer(const char* shader_atlas_filename)
 
 	sphere.createSphere(1.0f);
 	sphere.uploadToVRAM();
+	cone.createCone(1.0f, 1.0f);
+	cube.createCube(Vector3f(2, 2, 2));
+	cube.uploadToVRAM();
+
+	//the conservative query is cheaper but needs GL 4.3
+	GLint gl_major = 0, gl_minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &gl_major);
+	glGetIntegerv(GL_MINOR_VERSION, &gl_minor);
+	occlusion_query_type = GL_ANY_SAMPLES_PASSED;
+#ifdef GL_ANY_SAMPLES_PASSED_CONSERVATIVE
+	if (gl_major * 10 + gl_minor >= 43)
+		occlusion_query_type = GL_ANY_SAMPLES_PASSED_CONSERVATIVE;
+#endif
+	cone.uploadToVRAM();
+
+	light_grid = new LightGrid();
+	occlusion_buffer = new OcclusionBuffer();
+
+	//uniform blocks, the material one grows when there are more materials
+	frame_block = new GFX::BufferObject("FrameBlock");
+	frame_block->allocate(sizeof(sFrameBlock));
+	light_block = new GFX::BufferObject("LightBlock");
+	light_block->allocate(sizeof(sLightData) * MAX_BLOCK_LIGHTS);
+	material_blocks = new GFX::BufferObject("MaterialBlock");
+	GLint alignment = 256;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	material_block_stride = (((int)sizeof(sMaterialBlock) + alignment - 1) / alignment) * alignment;
+	material_block_versions.resize(64, 0);
+	material_blocks->allocate(material_block_stride * (int)material_block_versions.size());
+	material_block_flags = 0;
 
 	for (int i = 0; i < 30; i++) {
 		std::cout << " " << std::endl;
@@ -72,13 +226,20 @@ void Renderer::renderScene(SCN::Scene* scene, Camera* camera)
 {
 	this->scene = scene;
 	setupScene();
-	//clear lights and semitransparent nodes
+	//clear lights and the render queue
 	lights.clear();
-	semitransparent_objects.clear();
-	default_objects.clear();
-
-	glDisable(GL_BLEND);
-	glEnable(GL_DEPTH_TEST);
+	render_queue.clear();
+	cull_candidates.clear();
+	for (auto& it : impostor_instances)
+		it.second.clear();
+	memset(&stats, 0, sizeof(stats));
+	memset(&GFX::Shader::s_uniform_stats, 0, sizeof(GFX::Shader::s_uniform_stats));
+	memset(&GFX::gpu_state_stats, 0, sizeof(GFX::gpu_state_stats));
+
+	//other code may have changed the GL state since the last frame
+	GFX::invalidateGPUState();
+	GFX::invalidateTextureCache();
+	GFX::setGPUState(GFX_STATE_DEFAULT);
 
 	//set the clear color (the background color)
 	glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
@@ -91,7 +252,13 @@ void Renderer::renderScene(SCN::Scene* scene, Camera* camera)
 	if(skybox_cubemap)
 		renderSkybox(skybox_cubemap);
 
-	//pass 1: store entities in containers
+	//static entities that changed since the last frame are rebuilt in their cells
+	if (use_static_batching)
+		static_batcher->update(scene);
+	else if (static_batcher->cells.size())
+		static_batcher->clear();
+
+	//pass 1: store visible nodes in the render queue
 	for (int i = 0; i < scene->entities.size(); ++i)
 	{
 		BaseEntity* ent = scene->entities[i];
@@ -102,42 +269,61 @@ void Renderer::renderScene(SCN::Scene* scene, Camera* camera)
 		if (ent->getType() == eEntityType::PREFAB) //prefabs
 		{
 			PrefabEntity* pent = (SCN::PrefabEntity*)ent;
-			if (pent->prefab)
-				categorizeNodes(&pent->root, camera);
+			if (pent->prefab && !(use_static_batching && static_batcher->isBatched(pent)))
+			{
+				pent->root.updateTransforms(); //only the nodes that moved
+				if (!use_impostors || !addImpostorInstance(pent, camera))
+					categorizeNodes(&pent->root, camera);
+			}
 		}
 		else if (ent->getType() == eEntityType::LIGHT && !disable_lights) { //light objects
 			//IDEA: test sphere in frustum to cull invisible point (+spot) lights
 			//IDEA: test spheres to bounding boxes and cull invisible lights
-			//TO-DO: pasar primero antes de render!! otro bucle!
 			//downcast to EntityLight and store in light array
 			LightEntity* light = (SCN::LightEntity*)ent; 
 			lights.push_back(light);
 		}
 	}
-	//pass 2: render entities
-	for (int i = 0; i < default_objects.size(); i++)
-	{
-		renderNode(default_objects[i], camera);
-	}
-	//render semitransparent entities
-	//sort blending vector - sorts nodes by distance in descending order
-	std::sort(std::begin(semitransparent_objects), std::end(semitransparent_objects), compareDist);
-	for (int i = 0; i < semitransparent_objects.size(); i++)
+
+	if (use_static_batching)
+		categorizeStaticCells(camera);
+	if (use_batch_culling)
+		cullCandidates(camera);
+	if (use_occlusion_culling)
+		cullOccludedItems(camera);
+	if (use_gpu_occlusion)
+		applyOcclusionQueries(camera);
+
+	//assign lights to clusters once we know them all
+	if (use_clustered && render_lights)
+		light_grid->build(camera, lights);
+	if (render_lights && (use_multipass || usingLightLists() || render_mode == RENDER_DEFERRED))
+		computeLightVolumes(camera);
+	if (usingLightLists())
+		assignLightLists(camera);
+	if (render_lights)
+		updateFrameBlocks(camera);
+
+	//pass 2: sort by key (opaque front to back grouped by state, then blended back to front) and render
+	sortRenderQueue();
+	if (render_mode == RENDER_DEFERRED && render_lights)
+		renderDeferred(camera); //impostors included, before the blended items
+	else
 	{
-		renderNode(semitransparent_objects[i], camera);
+		//impostors are alpha tested, they go before the blended items
+		renderRenderQueue(camera, PASS_OPAQUE, PASS_MASK);
+		renderImpostors(camera);
+		if (use_gpu_occlusion)
+			issueOcclusionQueries(camera);
+		renderRenderQueue(camera, PASS_BLEND, PASS_BLEND);
 	}
 }
 
-
 void Renderer::renderSkybox(GFX::Texture* cubemap)
 {
 	Camera* camera = Camera::current;
 
-	glDisable(GL_BLEND);
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_CULL_FACE);
-	if (render_wireframe)
-		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+	GFX::setGPUState(GFX_STATE_WRITE_RGB | GFX_STATE_WRITE_A | (render_wireframe ? GFX_STATE_WIREFRAME : 0));
 
 	GFX::Shader* shader = GFX::Shader::Get("skybox");
 	if (!shader)
@@ -147,13 +333,11 @@ void Renderer::renderSkybox(GFX::Texture* cubemap)
 	Matrix44 m;
 	m.setTranslation(camera->eye.x, camera->eye.y, camera->eye.z);
 	m.scale(10, 10, 10);
-	shader->setUniform("u_model", m);
+	shader->setUniform(u_model, m);
 	cameraToShader(camera, shader);
-	shader->setUniform("u_texture", cubemap, 0);
+	shader->setUniform(u_texture, cubemap, 0);
 	sphere.render(GL_TRIANGLES);
 	shader->disable();
-	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-	glEnable(GL_DEPTH_TEST);
 }
 
 //renders a node of the prefab and its children
@@ -162,14 +346,13 @@ void Renderer::renderNode(SCN::Node* node, Camera* camera)
 	if (!node->visible)
 		return;
 
-	//compute global matrix
-	Matrix44 node_model = node->getGlobalMatrix(true);
+	//global matrix and world bounding box are updated by updateTransforms
+	Matrix44& node_model = node->global_model;
 
 	//does this node have a mesh? then we must render it
 	if (node->mesh && node->material)
 	{
-		//compute the bounding box of the object in world space (by using the mesh bounding box transformed to world space)
-		BoundingBox world_bounding = transformBoundingBox(node_model,node->mesh->box);
+		const BoundingBox& world_bounding = node->aabb;
 		
 		//if bounding box is inside the camera frustum then the object is probably visible
 		if (camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize) )
@@ -181,26 +364,733 @@ void Renderer::renderNode(SCN::Node* node, Camera* camera)
 	}
 }
 
-void Renderer::categorizeNodes(SCN::Node* node, Camera* camera) { //adds node and children nodes to their respective container
+void Renderer::categorizeNodes(SCN::Node* node, Camera* camera, uint8 plane_mask) { //adds node and children nodes to the render queue
 
-	if (node->material && node->material->alpha_mode == SCN::eAlphaMode::BLEND) { //objects with transparency
-		Matrix44 global_model = node->getGlobalMatrix(); //'fast' option does not work - global_model not set correctly?
-		float dist = std::sqrt(std::pow(global_model.getTranslation().x - camera->eye.x, 2) + std::pow(global_model.getTranslation().y - camera->eye.y, 2) + std::pow(global_model.getTranslation().z - camera->eye.z, 2));
-		node->distance_to_camera = dist;
-		semitransparent_objects.push_back(node);
+	//the whole branch against the planes the parent crosses, nothing below is tested if it is inside
+	if (use_hierarchical_culling)
+	{
+		if (!node->has_subtree_aabb)
+			return;
+		if (plane_mask)
+		{
+			stats.cull_tests++;
+			if (camera->testBoxInFrustum(node->subtree_aabb.center, node->subtree_aabb.halfsize, plane_mask) == CLIP_OUTSIDE)
+			{
+				stats.culled_subtrees++;
+				return;
+			}
+		}
 	}
-	else //other objects
+	else
+		plane_mask = FRUSTUM_ALL_PLANES;
+
+	if (node->visible && node->mesh && node->material)
 	{
-		//distance is only really used for semitransparent nodes, ignore here to optimize resources
-		/*Matrix44 global_model = node->getGlobalMatrix();
-		float dist = std::sqrt(std::pow(global_model.getTranslation().x - camera->eye.x, 2) + std::pow(global_model.getTranslation().y - camera->eye.y, 2) + std::pow(global_model.getTranslation().z - camera->eye.z, 2));
-		node->distance_to_camera = dist; */
-		default_objects.push_back(node);
+		//only the nodes inside the camera frustum go to the queue, the branch inside it needs no test
+		uint8 node_mask = plane_mask;
+		if (!plane_mask)
+			addDrawCall(node, camera);
+		else if (use_batch_culling)
+			cull_candidates.push_back(node);
+		else
+		{
+			stats.cull_tests++;
+			if (camera->testBoxInFrustum(node->aabb.center, node->aabb.halfsize, node_mask) != CLIP_OUTSIDE)
+				addDrawCall(node, camera);
+		}
 	}
+
 	//iterate recursively with children
 	for (int i = 0; i < node->children.size(); ++i) {
-		categorizeNodes(node->children[i], camera);
+		categorizeNodes(node->children[i], camera, plane_mask);
+	}
+}
+
+void Renderer::addDrawCall(SCN::Node* node, Camera* camera)
+{
+	sDrawCall dc;
+	//world bounding box cached by updateTransforms
+	dc.world_bounding = node->aabb;
+	dc.mesh = node->mesh;
+	dc.material = node->material;
+	dc.node = node;
+	dc.model = node->global_model;
+	dc.distance_to_camera = camera->eye.distance(dc.world_bounding.center);
+	node->distance_to_camera = dc.distance_to_camera;
+	dc.lod = use_lods ? selectLOD(node, camera) : 0;
+	dc.key = computeDrawKey(dc, camera);
+	dc.num_lights = 0;
+	render_queue.push_back(dc);
+}
+
+int Renderer::selectLOD(SCN::Node* node, Camera* camera)
+{
+	int num_lods = node->mesh->getNumLODs();
+	int lod = std::min(node->lod, num_lods - 1);
+
+	//level l is used below lod_screen_size / 2^(l-1), the hysteresis keeps it when the size is close to a threshold
+	float scale = camera->getProjectedScale(node->aabb.center, node->aabb.halfsize.length());
+	while (lod + 1 < num_lods && scale < lod_screen_size / (1 << lod) * (1.0f - lod_hysteresis))
+		lod++;
+	while (lod > 0 && scale > lod_screen_size / (1 << (lod - 1)) * (1.0f + lod_hysteresis))
+		lod--;
+	node->lod = lod;
+	return lod;
+}
+
+void Renderer::categorizeStaticCells(Camera* camera)
+{
+	//the cell first, its batches are only tested if it crosses the frustum
+	for (auto& it : static_batcher->cells)
+	{
+		sStaticCell& cell = it.second;
+		stats.cull_tests++;
+		char clip = camera->testBoxInFrustum(cell.bounding.center, cell.bounding.halfsize);
+		if (clip == CLIP_OUTSIDE)
+		{
+			stats.culled_subtrees++;
+			continue;
+		}
+
+		for (sStaticBatch& batch : cell.batches)
+		{
+			if (clip == CLIP_OVERLAP && camera->testBoxInFrustum(batch.node->aabb.center, batch.node->aabb.halfsize) == CLIP_OUTSIDE)
+				continue;
+			addDrawCall(batch.node, camera);
+		}
+		for (SCN::Node* node : cell.loose_nodes)
+		{
+			if (clip == CLIP_OVERLAP && camera->testBoxInFrustum(node->aabb.center, node->aabb.halfsize) == CLIP_OUTSIDE)
+				continue;
+			addDrawCall(node, camera);
+		}
+		stats.cull_tests += clip == CLIP_OVERLAP ? (int)(cell.batches.size() + cell.loose_nodes.size()) : 0;
+		stats.static_batches += (int)cell.batches.size();
+	}
+}
+
+bool Renderer::addImpostorInstance(SCN::PrefabEntity* entity, Camera* camera)
+{
+	//the impostor shader reads the frame and light blocks, they are only updated when rendering with lights
+	SCN::Node& root = entity->root;
+	if (!render_lights || !root.has_subtree_aabb)
+		return false;
+	const BoundingBox& box = root.subtree_aabb;
+	if (camera->getProjectedScale(box.center, box.halfsize.length()) >= impostor_screen_size)
+		return false;
+	Impostor* impostor = Impostor::Get(entity->prefab);
+	if (!impostor)
+		return false;
+
+	stats.cull_tests++;
+	if (camera->testBoxInFrustum(box.center, box.halfsize) != CLIP_OUTSIDE)
+		impostor_instances[impostor].push_back(root.global_model);
+	return true;
+}
+
+void Renderer::renderImpostors(Camera* camera)
+{
+	GFX::Shader* shader = GFX::Shader::Get("impostor");
+	if (!shader)
+		return;
+	GFX::Mesh* quad = GFX::Mesh::getQuad();
+
+	bool enabled = false;
+	for (auto& it : impostor_instances)
+	{
+		Impostor* impostor = it.first;
+		std::vector<Matrix44>& models = it.second;
+		if (!models.size())
+			continue;
+		if (!enabled)
+		{
+			shader->enable();
+			frame_block->bind(shader, 0);
+			light_block->bind(shader, 1);
+			lightToShaderSP(shader);
+			GFX::setGPUState(GFX_STATE_DEFAULT & ~GFX_STATE_CULL_MASK);
+			stats.shader_changes++;
+			enabled = true;
+		}
+
+		//all the instances of the prefab in one draw call
+		shader->setUniform(u_impostor_center, impostor->bounding.center);
+		shader->setUniform(u_impostor_radius, impostor->radius);
+		shader->setUniform(u_impostor_frames, (float)impostor->frames);
+		shader->setUniform(u_texture, impostor->albedo, 0);
+		shader->setUniform(u_normalmap, impostor->normal_depth, 1);
+		quad->renderInstanced(GL_TRIANGLES, &models[0], (int)models.size());
+		stats.impostors += (int)models.size();
+		stats.impostor_draws++;
+	}
+
+	if (enabled)
+	{
+		shader->disable();
+		current_material = nullptr;
+		GFX::setGPUState(GFX_STATE_DEFAULT);
+	}
+}
+
+void Renderer::cullCandidates(Camera* camera)
+{
+	double start_time = getPreciseTime();
+	int num = (int)cull_candidates.size();
+	cull_boxes.resize(num);
+	for (int i = 0; i < num; ++i)
+		cull_boxes.set(i, cull_candidates[i]->aabb);
+	cullBoxesParallel(camera->frustum, cull_boxes, cull_visibility, culling_path);
+	stats.cull_tests += num;
+	stats.batch_cull_time = (float)(getPreciseTime() - start_time);
+
+	for (int i = 0; i < num; ++i)
+		if (isBoxVisible(cull_visibility, i))
+			addDrawCall(cull_candidates[i], camera);
+}
+
+void Renderer::cullOccludedItems(Camera* camera)
+{
+	double start_time = getPreciseTime();
+
+	//biggest opaque items on screen, masked and blended ones have holes
+	std::vector<std::pair<float, int>> candidates;
+	for (size_t i = 0; i < render_queue.size(); ++i)
+	{
+		sDrawCall& dc = render_queue[i];
+		if (dc.material->alpha_mode != SCN::eAlphaMode::NO_ALPHA || !occlusion_buffer->canOcclude(dc.mesh))
+			continue;
+		float size = OcclusionBuffer::getScreenSize(camera, dc.world_bounding);
+		if (size >= occlusion_buffer->min_occluder_size)
+			candidates.push_back(std::make_pair(size, (int)i));
+	}
+	std::sort(candidates.begin(), candidates.end(), [](const std::pair<float, int>& a, const std::pair<float, int>& b) { return a.first > b.first; });
+	candidates.resize(std::min((int)candidates.size(), occlusion_buffer->max_occluders));
+
+	std::vector<GFX::Mesh*> meshes;
+	std::vector<Matrix44> models;
+	for (auto& candidate : candidates)
+	{
+		meshes.push_back(render_queue[candidate.second].mesh);
+		models.push_back(render_queue[candidate.second].model);
+	}
+	occlusion_buffer->render(camera, meshes, models);
+	stats.occluders = (int)meshes.size();
+
+	//the occluders pass the test, their nearest point is never behind themselves
+	if (meshes.size())
+	{
+		size_t num_visible = 0;
+		for (size_t i = 0; i < render_queue.size(); ++i)
+			if (occlusion_buffer->testBox(camera, render_queue[i].world_bounding))
+				render_queue[num_visible++] = render_queue[i];
+		stats.occluded_items = (int)(render_queue.size() - num_visible);
+		render_queue.resize(num_visible);
+	}
+	stats.occlusion_time = (float)(getPreciseTime() - start_time);
+}
+
+void Renderer::applyOcclusionQueries(Camera* camera)
+{
+	frame_number++;
+	query_nodes.clear();
+
+	size_t num_visible = 0;
+	for (size_t i = 0; i < render_queue.size(); ++i)
+	{
+		sDrawCall& dc = render_queue[i];
+		GFX::Mesh* mesh = dc.mesh;
+		int num_triangles = (int)(mesh->lods.size() ? mesh->lods[dc.lod].length : (mesh->m_indices.size() ? mesh->m_indices.size() : mesh->getNumVertices())) / 3;
+		if (num_triangles < gpu_occlusion_min_triangles)
+		{
+			render_queue[num_visible++] = dc;
+			continue;
+		}
+
+		sOcclusionQuery& state = occlusion_queries[dc.node->m_Id];
+		if (state.last_frame == -1) //new node, the retests of the visible ones are spread between frames
+			state.last_test_frame = frame_number - dc.node->m_Id % gpu_occlusion_retest_frames;
+		if (state.pending && state.query.isReady())
+		{
+			state.pending = false;
+			state.visible = state.query.value != 0;
+		}
+
+		//a node that was out of the queue (or the camera is inside its box) is assumed visible, the old result is not valid
+		bool camera_inside = BoundingBoxSphereOverlap(dc.world_bounding, camera->eye, camera->near_plane * 2.0f);
+		if (state.last_frame != frame_number - 1 || camera_inside)
+			state.visible = true;
+		state.last_frame = frame_number;
+
+		if (!state.pending && !camera_inside && (!state.visible || frame_number - state.last_test_frame >= gpu_occlusion_retest_frames))
+			query_nodes.push_back(dc.node);
+
+		if (state.visible)
+			render_queue[num_visible++] = dc;
+	}
+	stats.gpu_occluded_items = (int)(render_queue.size() - num_visible);
+	render_queue.resize(num_visible);
+
+	//forget the nodes that are not rendered anymore
+	if (frame_number % 256 == 0)
+		for (auto it = occlusion_queries.begin(); it != occlusion_queries.end();)
+			it = frame_number - it->second.last_frame > 256 && !it->second.pending ? occlusion_queries.erase(it) : ++it;
+}
+
+void Renderer::issueOcclusionQueries(Camera* camera)
+{
+	if (query_nodes.empty())
+		return;
+	GFX::Shader* shader = GFX::Shader::Get("flat");
+	if (!shader)
+		return;
+
+	//no color or depth writes and both faces, only the depth test
+	GFX::setGPUState(GFX_STATE_DEPTH_TEST_LESS);
+	shader->enable();
+	shader->setUniform(u_viewprojection, camera->viewprojection_matrix);
+	shader->setUniform(u_color, Vector4f(1, 1, 1, 1));
+
+	for (SCN::Node* node : query_nodes)
+	{
+		//slightly bigger so the faces do not fight with the surfaces of the object
+		const BoundingBox& box = node->aabb;
+		Matrix44 model;
+		model.translate(box.center.x, box.center.y, box.center.z);
+		model.scale(box.halfsize.x * 1.01f + 0.01f, box.halfsize.y * 1.01f + 0.01f, box.halfsize.z * 1.01f + 0.01f);
+		shader->setUniform(u_model, model);
+
+		sOcclusionQuery& state = occlusion_queries[node->m_Id];
+		state.query.type = occlusion_query_type;
+		state.query.start();
+		cube.render(GL_TRIANGLES);
+		state.query.finish();
+		state.pending = true;
+		state.last_test_frame = frame_number;
+	}
+	shader->disable();
+	stats.occlusion_queries = (int)query_nodes.size();
+}
+
+uint64 Renderer::computeDrawKey(const sDrawCall& dc, Camera* camera)
+{
+	SCN::Material* material = dc.material;
+	uint64 pass = PASS_OPAQUE;
+	if (material->alpha_mode == SCN::eAlphaMode::BLEND)
+		pass = PASS_BLEND;
+	else if (material->alpha_mode == SCN::eAlphaMode::MASK)
+		pass = PASS_MASK;
+
+	GFX::Shader* shader = getMaterialShader(material);
+	uint64 shader_id = shader ? (shader->program & 0x3F) : 0;
+	uint64 material_id = material->index & 0xFFFF;
+	uint64 mesh_id = dc.mesh->index & 0xFFFF;
+	uint64 depth = (uint64)(clamp(dc.distance_to_camera / camera->far_plane, 0.0f, 1.0f) * 0xFFFFFF);
+
+	//semitransparent: pass(2) | far to near depth(24) | shader(6) | material(16) | mesh(16)
+	if (pass == PASS_BLEND)
+		return (pass << 62) | ((0xFFFFFF - depth) << 38) | (shader_id << 32) | (material_id << 16) | mesh_id;
+
+	//opaque: pass(2) | shader(6) | material(16) | mesh(16) | near to far depth(24)
+	return (pass << 62) | (shader_id << 56) | (material_id << 40) | (mesh_id << 24) | depth;
+}
+
+//LSD radix sort, 8 bits per iteration, skips the bytes that are the same in every key
+void Renderer::sortRenderQueue()
+{
+	size_t num = render_queue.size();
+	sorted_queue.resize(num);
+	if (!num)
+		return;
+	sort_temp.resize(num);
+
+	uint32 histograms[8][256];
+	memset(histograms, 0, sizeof(histograms));
+	for (size_t i = 0; i < num; ++i)
+	{
+		uint64 key = render_queue[i].key;
+		sorted_queue[i].key = key;
+		sorted_queue[i].index = (uint32)i;
+		for (int b = 0; b < 8; ++b)
+			histograms[b][(key >> (b * 8)) & 0xFF]++;
+	}
+
+	sSortItem* src = &sorted_queue[0];
+	sSortItem* dst = &sort_temp[0];
+	for (int b = 0; b < 8; ++b)
+	{
+		uint32* histogram = histograms[b];
+		int shift = b * 8;
+		if (histogram[(src[0].key >> shift) & 0xFF] == num)
+			continue;
+		uint32 offset = 0;
+		for (int i = 0; i < 256; ++i)
+		{
+			uint32 count = histogram[i];
+			histogram[i] = offset;
+			offset += count;
+		}
+		for (size_t i = 0; i < num; ++i)
+			dst[histogram[(src[i].key >> shift) & 0xFF]++] = src[i];
+		std::swap(src, dst);
+	}
+	if (src != &sorted_queue[0])
+		sorted_queue.swap(sort_temp);
+}
+
+bool Renderer::prepareMeshletRanges(const sDrawCall& dc, Camera* camera)
+{
+	//only the first level has meshlets, skinned meshes move away from their bounds
+	GFX::Mesh* mesh = dc.mesh;
+	if (!use_meshlet_culling || !dc.material || dc.lod != 0 || mesh->meshlets.size() < 2 || !mesh->getIndexBuffer() || mesh->bones.size())
+		return false;
+
+	int culled = cullMeshlets(&mesh->meshlets[0], (int)mesh->meshlets.size(), dc.model, camera->frustum, camera->eye, !dc.material->two_sided, meshlet_starts, meshlet_counts);
+	stats.meshlets += (int)mesh->meshlets.size();
+	stats.meshlets_culled += culled;
+	stats.meshlet_ranges += (int)meshlet_starts.size();
+	return true;
+}
+
+size_t Renderer::prepareMultiDraw(size_t first, size_t end, Camera* camera, bool light_lists)
+{
+	//multipass draws every item once per light, skinned meshes have their own bones
+	sDrawCall& dc = render_queue[sorted_queue[first].index];
+	GFX::GeometryPool* pool = dc.mesh->pool;
+	bool multipass = use_multipass && !use_clustered && !rendering_gbuffers;
+	if (!use_multidraw || multipass || !pool || dc.mesh->bones.size() || !GFX::GeometryPool::supportsIndirect())
+		return first;
+
+	size_t batch_end = first + 1;
+	while (batch_end < end)
+	{
+		sDrawCall& next = render_queue[sorted_queue[batch_end].index];
+		if (next.mesh->pool != pool || next.material != dc.material || next.mesh->bones.size())
+			break;
+		if (light_lists && (next.num_lights != dc.num_lights || memcmp(next.lights, dc.lights, dc.num_lights * sizeof(uint16))))
+			break;
+		batch_end++;
+	}
+	if (batch_end - first < 2)
+		return first;
+
+	batch_commands.clear();
+	batch_draw_data.clear();
+	for (size_t i = first; i < batch_end;)
+	{
+		sDrawCall& item = render_queue[sorted_queue[i].index];
+		GFX::Mesh* mesh = item.mesh;
+		if (render_boundaries && i > first)
+			mesh->renderBounding(item.model, true);
+
+		//the same mesh and level one after the other are the instances of one command
+		size_t run_end = i + 1;
+		while (run_end < batch_end && render_queue[sorted_queue[run_end].index].mesh == mesh && render_queue[sorted_queue[run_end].index].lod == item.lod)
+			run_end++;
+
+		GFX::sDrawIndirectCommand command;
+		command.instance_count = (uint32)(run_end - i);
+		command.base_vertex = (int32)mesh->pool_range.vertex_start;
+		command.base_instance = (uint32)batch_draw_data.size();
+		for (size_t j = i; j < run_end; ++j)
+		{
+			GFX::sPerDrawData data;
+			data.model = render_queue[sorted_queue[j].index].model;
+			data.vertex_offset.set(mesh->vertex_offset.x, mesh->vertex_offset.y, mesh->vertex_offset.z, 0.0f);
+			data.vertex_scale.set(mesh->vertex_scale.x, mesh->vertex_scale.y, mesh->vertex_scale.z, 0.0f);
+			data.uv_transform = mesh->uv_transform;
+			batch_draw_data.push_back(data);
+		}
+
+		//an item alone gets a command per range of visible meshlets
+		if (run_end - i == 1 && prepareMeshletRanges(item, camera))
+		{
+			for (size_t r = 0; r < meshlet_starts.size(); ++r)
+			{
+				command.count = (uint32)meshlet_counts[r];
+				command.first_index = mesh->pool_range.index_start + meshlet_starts[r];
+				batch_commands.push_back(command);
+			}
+			if (meshlet_starts.empty())
+				batch_draw_data.pop_back();
+			i = run_end;
+			continue;
+		}
+
+		command.first_index = mesh->pool_range.index_start;
+		command.count = mesh->lods.size() ? mesh->lods[0].length : (uint32)mesh->m_indices.size();
+		if (item.lod > 0 && item.lod < (int)mesh->lods.size())
+		{
+			command.first_index += mesh->lods[item.lod].start;
+			command.count = mesh->lods[item.lod].length;
+		}
+		batch_commands.push_back(command);
+		i = run_end;
+	}
+	return batch_end;
+}
+
+void Renderer::renderRenderQueue(Camera* camera, int first_pass, int last_pass)
+{
+	current_material = nullptr;
+	bool light_lists = usingLightLists() && !rendering_gbuffers;
+
+	//the queue is sorted by pass so the range is contiguous
+	size_t start = 0;
+	size_t end = sorted_queue.size();
+	while (start < end && (int)(sorted_queue[start].key >> 62) < first_pass)
+		start++;
+	while (end > start && (int)(sorted_queue[end - 1].key >> 62) > last_pass)
+		end--;
+	stats.draw_items += (int)(end - start);
+
+	for (size_t i = start; i < end; ++i)
+	{
+		sDrawCall& dc = render_queue[sorted_queue[i].index];
+		if (render_boundaries)
+			dc.mesh->renderBounding(dc.model, true);
+		current_lod = dc.lod;
+
+		if (!render_lights)
+		{
+			renderMeshWithMaterial(dc.model, dc.mesh, dc.material);
+			continue;
+		}
+
+		//items of the same material that live in the same pool go in one multi draw, whatever their mesh
+		size_t batch_end = prepareMultiDraw(i, end, camera, light_lists);
+		if (batch_end > i)
+		{
+			BoundingBox batch_bounding = dc.world_bounding;
+			for (size_t j = i + 1; j < batch_end; ++j)
+				batch_bounding = mergeBoundingBoxes(batch_bounding, render_queue[sorted_queue[j].index].world_bounding);
+			use_multidraw_batch = true;
+			renderMeshWithMaterialLights(&dc.model, 1, dc.mesh, dc.material, batch_bounding, light_lists ? dc.lights : nullptr, dc.num_lights);
+			use_multidraw_batch = false;
+			stats.multidraws++;
+			stats.multidraw_items += (int)(batch_end - i);
+			i = batch_end - 1;
+			continue;
+		}
+
+		//consecutive items with the same mesh and material (and so the same pass) are drawn as instances,
+		//blended ones are only grouped when nothing else is in between so the order is kept
+		size_t group_end = i + 1;
+		if (use_instancing)
+			while (group_end < end)
+			{
+				sDrawCall& next = render_queue[sorted_queue[group_end].index];
+				if (next.mesh != dc.mesh || next.material != dc.material || next.lod != dc.lod)
+					break;
+				if (light_lists && (next.num_lights != dc.num_lights || memcmp(next.lights, dc.lights, dc.num_lights * sizeof(uint16))))
+					break;
+				if (render_boundaries)
+					next.mesh->renderBounding(next.model, true);
+				group_end++;
+			}
+
+		int num_instances = (int)(group_end - i);
+		if (num_instances == 1)
+		{
+			use_meshlet_ranges = prepareMeshletRanges(dc, camera);
+			if (use_meshlet_ranges && meshlet_starts.empty())
+			{
+				use_meshlet_ranges = false;
+				continue; //all of them culled
+			}
+			renderMeshWithMaterialLights(&dc.model, 1, dc.mesh, dc.material, dc.world_bounding, light_lists ? dc.lights : nullptr, dc.num_lights);
+			use_meshlet_ranges = false;
+			continue;
+		}
+
+		instance_models.resize(num_instances);
+		BoundingBox group_bounding = dc.world_bounding;
+		for (int j = 0; j < num_instances; ++j)
+		{
+			sDrawCall& instance = render_queue[sorted_queue[i + j].index];
+			instance_models[j] = instance.model;
+			group_bounding = mergeBoundingBoxes(group_bounding, instance.world_bounding);
+		}
+		renderMeshWithMaterialLights(&instance_models[0], num_instances, dc.mesh, dc.material, group_bounding, light_lists ? dc.lights : nullptr, dc.num_lights);
+		stats.instanced_draws++;
+		stats.instances += num_instances;
+		i = group_end - 1;
 	}
+
+	//set the render state as it was before to avoid problems with future renders
+	if (GFX::Shader::current)
+		GFX::Shader::current->disable();
+	current_material = nullptr;
+	current_lod = 0;
+	GFX::setGPUState(GFX_STATE_DEFAULT);
+}
+
+void Renderer::renderDeferred(Camera* camera)
+{
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+
+	//gbuffers of the size of the screen, 8 bits per channel is enough for the material info
+	if (!gbuffers || gbuffers->width != viewport[2] || gbuffers->height != viewport[3])
+	{
+		delete gbuffers;
+		gbuffers = new GFX::FBO();
+		gbuffers->create(viewport[2], viewport[3], 4, GL_RGBA, GL_UNSIGNED_BYTE, true);
+	}
+
+	//geometry pass, opaque and masked items
+	gbuffers->bind();
+	GFX::setGPUState(GFX_STATE_DEFAULT); //depth writes for the clear
+	glClearColor(0, 0, 0, 0);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	rendering_gbuffers = true;
+	renderRenderQueue(camera, PASS_OPAQUE, PASS_MASK);
+	rendering_gbuffers = false;
+	gbuffers->unbind();
+
+	//ambient and emissive, it also copies the depth so the volumes and the blended items are tested against the scene
+	GFX::Mesh* quad = GFX::Mesh::getQuad();
+	GFX::Shader* shader = GFX::Shader::Get("deferred_global");
+	if (!shader)
+		return;
+	shader->enable();
+	gbuffersToShader(camera, shader);
+	shader->setUniform(u_ambient_light, scene->ambient_light);
+	GFX::setGPUState(GFX_STATE_WRITE_RGB | GFX_STATE_WRITE_A | GFX_STATE_WRITE_Z | GFX_STATE_DEPTH_TEST_ALWAYS);
+	quad->render(GL_TRIANGLES);
+
+	//lights are accumulated
+	uint64 light_state = GFX_STATE_WRITE_RGB | GFX_STATE_WRITE_A | GFX_STATE_BLEND_FUNC(GFX_STATE_BLEND_ONE, GFX_STATE_BLEND_ONE);
+
+	//directional lights affect every pixel
+	shader = GFX::Shader::Get("deferred_light_quad");
+	if (shader)
+	{
+		shader->enable();
+		gbuffersToShader(camera, shader);
+		GFX::setGPUState(light_state);
+		for (size_t i = 0; i < lights.size(); ++i)
+		{
+			if (light_volumes[i].is_local)
+				continue;
+			lightToShaderMP(lights[i], shader);
+			quad->render(GL_TRIANGLES);
+			stats.light_passes++;
+		}
+	}
+
+	//local lights render the back faces of their volume where the scene is in front of them,
+	//depth clamp keeps the volumes crossing the far plane
+	shader = GFX::Shader::Get("deferred_light");
+	if (shader)
+	{
+		shader->enable();
+		gbuffersToShader(camera, shader);
+		cameraToShader(camera, shader);
+		GFX::setGPUState(light_state | GFX_STATE_DEPTH_TEST_GEQUAL | GFX_STATE_CULL_CCW);
+		glEnable(GL_DEPTH_CLAMP);
+		for (size_t i = 0; i < lights.size(); ++i)
+		{
+			const sLightVolume& volume = light_volumes[i];
+			if (!volume.is_local)
+				continue;
+			if (!volume.visible)
+			{
+				stats.light_passes_skipped++;
+				continue;
+			}
+			if (volume.use_scissor)
+			{
+				glEnable(GL_SCISSOR_TEST);
+				glScissor(volume.scissor[0], volume.scissor[1], volume.scissor[2], volume.scissor[3]);
+			}
+			else
+				glDisable(GL_SCISSOR_TEST);
+
+			//the meshes are slightly inside the surface they approximate
+			LightEntity* light = lights[i];
+			GFX::Mesh* mesh = &sphere;
+			Matrix44 model;
+			model.setTranslation(volume.position.x, volume.position.y, volume.position.z);
+			float cone_angle = light->cone_info.y;
+			if (light->light_type == eLightType::SPOT && cone_angle < 80.0f)
+			{
+				//axes of the light scaled to fit the cone, the cone looks down -Z like the light
+				float cone_radius = volume.radius * (float)tan(cone_angle * DEG2RAD) * 1.05f;
+				Vector3f right = light->root.model.rightVector().normalize() * cone_radius;
+				Vector3f top = light->root.model.topVector().normalize() * cone_radius;
+				Vector3f front = light->root.model.frontVector().normalize() * volume.radius;
+				model.m[0] = right.x; model.m[1] = right.y; model.m[2] = right.z;
+				model.m[4] = top.x; model.m[5] = top.y; model.m[6] = top.z;
+				model.m[8] = front.x; model.m[9] = front.y; model.m[10] = front.z;
+				mesh = &cone;
+			}
+			else
+				model.scale(volume.radius * 1.05f, volume.radius * 1.05f, volume.radius * 1.05f);
+
+			shader->setUniform(u_model, model);
+			lightToShaderMP(light, shader);
+			mesh->render(GL_TRIANGLES);
+			stats.light_passes++;
+		}
+	}
+
+	//back to the usual state
+	glDisable(GL_SCISSOR_TEST);
+	glDisable(GL_DEPTH_CLAMP);
+	if (GFX::Shader::current)
+		GFX::Shader::current->disable();
+
+	//impostors are alpha tested, with the forward path after the lights and before the blended items
+	renderImpostors(camera);
+	if (use_gpu_occlusion)
+		issueOcclusionQueries(camera);
+
+	//blended items with the forward path
+	renderRenderQueue(camera, PASS_BLEND, PASS_BLEND);
+}
+
+void Renderer::gbuffersToShader(Camera* camera, GFX::Shader* shader)
+{
+	shader->setUniform(u_gbuffer0, gbuffers->color_textures[0], 0);
+	shader->setUniform(u_gbuffer1, gbuffers->color_textures[1], 1);
+	shader->setUniform(u_gbuffer2, gbuffers->color_textures[2], 2);
+	shader->setUniform(u_gbuffer3, gbuffers->color_textures[3], 3);
+	shader->setUniform(u_gbuffer_depth, gbuffers->depth_texture, 4);
+	shader->setUniform(u_inverse_viewprojection, camera->inverse_viewprojection_matrix);
+	shader->setUniform(u_iRes, Vector2f(1.0f / gbuffers->width, 1.0f / gbuffers->height));
+	shader->setUniform(u_camera_position, camera->eye);
+	int use_specular = gui_use_specular ? 1 : 0;
+	shader->setUniform(u_use_specular, use_specular);
+}
+
+uint64 Renderer::getMaterialState(SCN::Material* material)
+{
+	uint64 state = GFX_STATE_WRITE_RGB | GFX_STATE_WRITE_A | GFX_STATE_WRITE_Z | GFX_STATE_DEPTH_TEST_LESS;
+
+	//select the blending
+	if (material->alpha_mode == SCN::eAlphaMode::BLEND)
+		state |= GFX_STATE_BLEND_FUNC(GFX_STATE_BLEND_SRC_ALPHA, GFX_STATE_BLEND_INV_SRC_ALPHA);
+	//select if render both sides of the triangles
+	if (!material->two_sided)
+		state |= GFX_STATE_CULL_CW;
+	if (render_wireframe)
+		state |= GFX_STATE_WIREFRAME;
+	return state;
+}
+
+GFX::Shader* Renderer::getMaterialShader(SCN::Material* material, bool instanced, bool indirect)
+{
+	if (!render_lights)
+		return GFX::Shader::Get("texture");
+	if (rendering_gbuffers)
+		return indirect ? GFX::Shader::Get("gbuffer_indirect") : instanced ? GFX::Shader::Get("gbuffer_instanced") : GFX::Shader::Get("gbuffer");
+	if (use_clustered)
+		return indirect ? GFX::Shader::Get("lightClustered_indirect") : instanced ? GFX::Shader::Get("lightClustered_instanced") : GFX::Shader::Get("lightClustered");
+	if (indirect)
+		return GFX::Shader::Get("lightSP_indirect"); //the multi draws are never multipass
+	if (instanced)
+		return use_multipass ? GFX::Shader::Get("lightMP_instanced") : GFX::Shader::Get("lightSP_instanced");
+	return use_multipass ? GFX::Shader::Get("lightMP") : GFX::Shader::Get("lightSP");
 }
 
 //renders a mesh given its transform and material
@@ -224,26 +1114,8 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN
 	if (texture == NULL)
 		texture = GFX::Texture::getWhiteTexture(); //a 1x1 white texture
 
-	//select the blending
-	//lab1: send to global renderable vector, postpone rendering
-	if (material->alpha_mode == SCN::eAlphaMode::BLEND)
-	{
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-	}
-	else {
-		glDisable(GL_BLEND);
-	}
-	//select if render both sides of the triangles
-	if(material->two_sided)
-		glDisable(GL_CULL_FACE);
-	else
-		glEnable(GL_CULL_FACE);
-
-
-    assert(glGetError() == GL_NO_ERROR);
-
-	glEnable(GL_DEPTH_TEST);
+	//blending, culling and depth of the material
+	GFX::setGPUState(getMaterialState(material));
 
 	//chose a shader
 	shader = GFX::Shader::Get("texture");
@@ -256,199 +1128,328 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN
 	shader->enable();
 
 	//upload uniforms
-	shader->setUniform("u_model", model);
+	shader->setUniform(u_model, model);
 	cameraToShader(camera, shader);
 	float t = getTime();
-	shader->setUniform("u_time", t );
+	shader->setUniform(u_time, t );
 
-	shader->setUniform("u_color", material->color);
+	shader->setUniform(u_color, material->color);
 	if(texture)
-		shader->setUniform("u_texture", texture, 0);
+		shader->setUniform(u_texture, texture, 0);
 
 	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
-	shader->setUniform("u_alpha_cutoff", material->alpha_mode == SCN::eAlphaMode::MASK ? material->alpha_cutoff : 0.001f);
-
-	if (render_wireframe)
-		glPolygonMode( GL_FRONT_AND_BACK, GL_LINE );
+	shader->setUniform(u_alpha_cutoff, material->alpha_mode == SCN::eAlphaMode::MASK ? material->alpha_cutoff : 0.001f);
 
 	//do the draw call that renders the mesh into the screen
-	mesh->render(GL_TRIANGLES);
+	mesh->render(GL_TRIANGLES, -1, 0, current_lod);
 
 	//disable shader
 	shader->disable();
-
-	//set the render state as it was before to avoid problems with future renders
-	glDisable(GL_BLEND);
-	glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
 }
 
 
 void Renderer::renderMeshWithMaterialLights(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material)
+{
+	if (mesh)
+		renderMeshWithMaterialLights(&model, 1, mesh, material, transformBoundingBox(model, mesh->box));
+}
+
+void Renderer::renderMeshWithMaterialLights(const Matrix44* models, int num_instances, GFX::Mesh* mesh, SCN::Material* material, const BoundingBox& world_bounding, const uint16* light_list, int num_lights)
 {
 	//in case there is nothing to do
-	if (!mesh || !mesh->getNumVertices() || !material)
+	if (!mesh || !mesh->getNumVertices() || !material || num_instances < 1)
 		return;
 	assert(glGetError() == GL_NO_ERROR);
 
-	//define locals to simplify coding
-	GFX::Shader* shader = NULL;
-	GFX::Texture* colorTexture = NULL;
-	GFX::Texture* normalMap = NULL;
-	GFX::Texture* emissive = NULL;
-	GFX::Texture* occlusion = NULL;
-	GFX::Texture* metal_roughness = NULL; //contains occlusion in red channel
 	Camera* camera = Camera::current;
+	bool instanced = num_instances > 1;
+	bool multipass = use_multipass && !use_clustered && !rendering_gbuffers;
 
-	colorTexture = material->textures[SCN::eTextureChannel::ALBEDO].texture;
-	normalMap = material->textures[SCN::eTextureChannel::NORMALMAP].texture; int useNormalmap = 1;
-	emissive = material->textures[SCN::eTextureChannel::EMISSIVE].texture; int useEmissive = 1;
-	occlusion = material->textures[SCN::eTextureChannel::OCCLUSION].texture; int useOcclusion = 1;
-	metal_roughness = material->textures[SCN::eTextureChannel::METALLIC_ROUGHNESS].texture; int useSpecular = 1;
-	
-	
-	//TO-DO implement all this, check ppt
-	//texture = material->emissive_texture;				//DONE
-	//texture = material->metallic_roughness_texture;	//IN_PROGRESS
-	//texture = material->normal_texture;				//DONE
-	//texture = material->occlusion_texture;			//IN_PROGRESS
+	//chose a shader, the instanced ones read the model as an attribute (and the multi draws also the decode)
+	GFX::Shader* shader = getMaterialShader(material, instanced, use_multidraw_batch);
 
-	//get dummy textures if anything is missing
-	if (colorTexture == NULL) 
-		colorTexture = GFX::Texture::getWhiteTexture(); //a 1x1 white texture
-	if (normalMap == NULL) {
-		normalMap = GFX::Texture::getWhiteTexture();
-		useNormalmap = 0;
-	}
-	if (emissive == NULL) {
-		emissive = GFX::Texture::getWhiteTexture();
-		if (material->emissive_factor.length() == 0.0) { useEmissive = 0; } //some emissive objects dont have emissive textures
-	}
-	if (occlusion == NULL) {
-		occlusion = GFX::Texture::getWhiteTexture();
-		useOcclusion = 0;
+	assert(glGetError() == GL_NO_ERROR);
+
+	//no shader? then nothing to render
+	if (!shader)
+		return;
+
+	//per frame uniforms are only sent when the shader changes and the material ones when the material changes,
+	//the render queue is sorted so consecutive draws share both
+	if (shader != GFX::Shader::current)
+	{
+		shader->enable();
+		frame_block->bind(shader, 0);
+		light_block->bind(shader, 1);
+		material_blocks->bind(shader, 2, 0, sizeof(sMaterialBlock)); //only to link the block to the index, the range is set with the material
+		//the gbuffers have no lights
+		if (use_clustered && !rendering_gbuffers)
+			light_grid->bind(shader, 5);
+		else if (!multipass && !light_list && !rendering_gbuffers)
+			lightToShaderSP(shader);
+		current_material = nullptr;
+		current_num_lights = -1;
+		stats.shader_changes++;
 	}
-	if (metal_roughness == NULL) {
-		metal_roughness = GFX::Texture::getWhiteTexture();
+	if (material != current_material)
+	{
+		materialToShader(material, shader);
+		current_material = material;
+		stats.material_changes++;
 	}
 
-	//select the blending
-	if (material->alpha_mode == SCN::eAlphaMode::BLEND)
+	//the light list is only sent when it changes, neighbours in the queue are often lit by the same lights
+	if (light_list && (num_lights != current_num_lights || memcmp(light_list, current_light_list, num_lights * sizeof(uint16))))
 	{
-			glEnable(GL_BLEND);
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		lightToShaderSP(shader, light_list, num_lights);
+		memcpy(current_light_list, light_list, num_lights * sizeof(uint16));
+		current_num_lights = num_lights;
+		stats.light_list_uploads++;
+	}
+
+	//upload uniforms
+	if (!instanced && !use_multidraw_batch)
+		shader->setUniform(u_model, models[0]);
+
+	//only the bits that differ from the previous draw are applied
+	uint64 state = getMaterialState(material);
+
+	if (multipass) {
+		state = (state & ~GFX_STATE_DEPTH_TEST_MASK) | GFX_STATE_DEPTH_TEST_LEQUAL;
+		GFX::setGPUState(state);
+		baseRenderMP(mesh, shader, models, num_instances);
+		GFX::setGPUState((state & ~GFX_STATE_BLEND_MASK) | GFX_STATE_BLEND_FUNC(GFX_STATE_BLEND_SRC_ALPHA, GFX_STATE_BLEND_ONE));
+		for (int i = 0; i < lights.size() && i < MAX_BLOCK_LIGHTS; i++) {
+			if (use_light_culling)
+			{
+				const sLightVolume& volume = light_volumes[i];
+				if (!lightAffectsBox(volume, world_bounding))
+				{
+					stats.light_passes_skipped++;
+					continue;
+				}
+				//only the pixels the light can reach
+				if (volume.use_scissor)
+				{
+					glEnable(GL_SCISSOR_TEST);
+					glScissor(volume.scissor[0], volume.scissor[1], volume.scissor[2], volume.scissor[3]);
+				}
+				else
+					glDisable(GL_SCISSOR_TEST);
+			}
+			shader->setUniform(u_light_index, i);
+			drawMeshInstances(mesh, models, num_instances);
+			stats.light_passes++;
+		}
+		glDisable(GL_SCISSOR_TEST);
 	}
 	else {
-		glDisable(GL_BLEND);
+		GFX::setGPUState(state);
+		drawMeshInstances(mesh, models, num_instances); //do the draw call that renders the mesh into the screen
 	}
-	//select if render both sides of the triangles
-	if (material->two_sided)
-		glDisable(GL_CULL_FACE);
-	else
-		glEnable(GL_CULL_FACE);
+}
 
+void Renderer::computeLightVolumes(Camera* camera)
+{
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
 
-	assert(glGetError() == GL_NO_ERROR);
+	light_volumes.resize(lights.size());
+	for (size_t i = 0; i < lights.size(); ++i)
+	{
+		LightEntity* light = lights[i];
+		sLightVolume& volume = light_volumes[i];
+		volume.visible = true;
+		volume.use_scissor = false;
+		volume.is_local = light->light_type == eLightType::POINT || light->light_type == eLightType::SPOT;
+		if (!volume.is_local)
+			continue;
 
-	glEnable(GL_DEPTH_TEST);
+		volume.position = light->root.model.getTranslation();
+		volume.direction = light->root.model.frontVector().normalize() * -1.0f; //front points from the scene to the light
+		volume.radius = light->max_distance;
+		volume.cone_cos = light->light_type == eLightType::SPOT ? (float)cos(light->cone_info.y * DEG2RAD) : -1.0f;
 
-	//chose a shader
-	shader = use_multipass ? GFX::Shader::Get("lightMP") : GFX::Shader::Get("lightSP");
+		//a volume outside the frustum cannot light anything visible
+		if (camera->testSphereInFrustum(volume.position, volume.radius) == CLIP_OUTSIDE)
+		{
+			volume.visible = false;
+			continue;
+		}
 
-	assert(glGetError() == GL_NO_ERROR);
+		//project the box of the sphere, only if it is completely in front of the camera
+		float depth = dot(volume.position - camera->eye, camera->front);
+		if (depth - volume.radius <= camera->near_plane)
+			continue;
+		Vector2f ndc_min(1, 1), ndc_max(-1, -1);
+		for (int j = 0; j < 8; ++j)
+		{
+			float r = volume.radius;
+			Vector3f corner = volume.position + Vector3f(j & 1 ? r : -r, j & 2 ? r : -r, j & 4 ? r : -r);
+			Vector4f clip = camera->viewprojection_matrix * Vector4f(corner.x, corner.y, corner.z, 1.0f);
+			ndc_min.set(std::min(ndc_min.x, clip.x / clip.w), std::min(ndc_min.y, clip.y / clip.w));
+			ndc_max.set(std::max(ndc_max.x, clip.x / clip.w), std::max(ndc_max.y, clip.y / clip.w));
+		}
+		ndc_min.set(clamp(ndc_min.x, -1.0f, 1.0f), clamp(ndc_min.y, -1.0f, 1.0f));
+		ndc_max.set(clamp(ndc_max.x, -1.0f, 1.0f), clamp(ndc_max.y, -1.0f, 1.0f));
+		int x0 = (int)floor((ndc_min.x * 0.5f + 0.5f) * viewport[2]);
+		int y0 = (int)floor((ndc_min.y * 0.5f + 0.5f) * viewport[3]);
+		int x1 = (int)ceil((ndc_max.x * 0.5f + 0.5f) * viewport[2]);
+		int y1 = (int)ceil((ndc_max.y * 0.5f + 0.5f) * viewport[3]);
+		volume.use_scissor = true;
+		volume.scissor[0] = viewport[0] + x0;
+		volume.scissor[1] = viewport[1] + y0;
+		volume.scissor[2] = std::max(x1 - x0, 0);
+		volume.scissor[3] = std::max(y1 - y0, 0);
+	}
+}
 
-	//no shader? then nothing to render
-	if (!shader)
-		return;
-	shader->enable();
+void Renderer::assignLightLists(Camera* camera)
+{
+	//every thread ranks the lights of its own items
+	TaskManager::parallelFor((int)render_queue.size(), [this](int start, int end) {
+		std::vector<std::pair<float, uint16>> candidates;
+		for (int i = start; i < end; ++i)
+		{
+			sDrawCall& dc = render_queue[i];
+			candidates.clear();
+			for (size_t j = 0; j < lights.size(); ++j)
+				if (lightAffectsBox(light_volumes[j], dc.world_bounding))
+					candidates.push_back(std::make_pair(lightInfluence(lights[j], light_volumes[j], dc.world_bounding), (uint16)j));
+
+			//keep the most important ones, sorted by index so equal lists can be compared
+			int num = std::min((int)candidates.size(), MAX_LIGHTS_SP);
+			if (num < (int)candidates.size())
+				std::partial_sort(candidates.begin(), candidates.begin() + num, candidates.end(),
+					[](const std::pair<float, uint16>& a, const std::pair<float, uint16>& b) { return a.first > b.first; });
+			for (int j = 0; j < num; ++j)
+				dc.lights[j] = candidates[j].second;
+			std::sort(dc.lights, dc.lights + num);
+			dc.num_lights = num;
+		}
+	}, 64);
 
-	//upload uniforms
-	shader->setUniform("u_model", model);
-	cameraToShader(camera, shader);
-	float t = getTime();
-	shader->setUniform("u_time", t);
-	shader->setUniform("u_ambient_light", scene->ambient_light);
-	shader->setUniform("u_emissive_factor", material->emissive_factor);
-
-	shader->setUniform("u_color", material->color);
-
-	shader->setUniform("u_texture", colorTexture, 0);
-	shader->setUniform("u_normalmap", normalMap, 1);
-	useNormalmap = gui_use_normalmaps ? useNormalmap : 0;
-	shader->setUniform("u_use_normalmap", useNormalmap);
-	shader->setUniform("u_emissive", emissive, 2);
-	useEmissive = gui_use_emissive ? useEmissive : 0;
-	shader->setUniform("u_use_emissive", useEmissive);
-	shader->setUniform("u_occlusion", occlusion, 3);
-	shader->setUniform("u_metal_roughness", metal_roughness, 4);
-	useOcclusion = gui_use_occlusion ? useOcclusion : 0;
-	useSpecular = gui_use_specular ? useSpecular : 0;
-	shader->setUniform("u_use_occlusion", useOcclusion);
-	shader->setUniform("u_use_specular", useSpecular);
-	
+	for (size_t i = 0; i < render_queue.size(); ++i)
+		stats.light_list_lights += render_queue[i].num_lights;
+}
 
-	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
-	shader->setUniform("u_alpha_cutoff", material->alpha_mode == SCN::eAlphaMode::MASK ? material->alpha_cutoff : 0.001f);
+void SCN::Renderer::materialToShader(SCN::Material* material, GFX::Shader* shader)
+{
+	GFX::Texture* colorTexture = material->textures[SCN::eTextureChannel::ALBEDO].texture;
+	GFX::Texture* normalMap = material->textures[SCN::eTextureChannel::NORMALMAP].texture;
+	GFX::Texture* emissive = material->textures[SCN::eTextureChannel::EMISSIVE].texture;
+	GFX::Texture* occlusion = material->textures[SCN::eTextureChannel::OCCLUSION].texture;
+	GFX::Texture* metal_roughness = material->textures[SCN::eTextureChannel::METALLIC_ROUGHNESS].texture; //contains occlusion in red channel
 
-	if (render_wireframe)
-		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+	//get dummy textures if anything is missing, the block says which ones are used
+	if (colorTexture == NULL) 
+		colorTexture = GFX::Texture::getWhiteTexture(); //a 1x1 white texture
+	if (normalMap == NULL)
+		normalMap = GFX::Texture::getWhiteTexture();
+	if (emissive == NULL)
+		emissive = GFX::Texture::getWhiteTexture();
+	if (occlusion == NULL)
+		occlusion = GFX::Texture::getWhiteTexture();
+	if (metal_roughness == NULL)
+		metal_roughness = GFX::Texture::getWhiteTexture();
 
-	if (use_multipass) {
-		if (material->alpha_mode != SCN::eAlphaMode::BLEND) {
-			glDisable(GL_BLEND);
-		}
-		glDepthFunc(GL_LEQUAL);
-		baseRenderMP(mesh, shader);
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-		for (int i = 0; i < lights.size(); i++) {
-			lightToShaderMP(lights[i], shader);
-			mesh->render(GL_TRIANGLES);
-		}
-		glDepthFunc(GL_LESS);
+	bindMaterialBlock(material, nullptr);
+
+	shader->setUniform(u_texture, colorTexture, 0);
+	shader->setUniform(u_normalmap, normalMap, 1);
+	shader->setUniform(u_emissive, emissive, 2);
+	shader->setUniform(u_occlusion, occlusion, 3);
+	shader->setUniform(u_metal_roughness, metal_roughness, 4);
+}
+
+void SCN::Renderer::bindMaterialBlock(SCN::Material* material, GFX::Shader* shader)
+{
+	//grow, the old blocks are lost so all of them are built again
+	if (material->index >= material_block_versions.size())
+	{
+		material_block_versions.assign(std::max((size_t)material->index + 1, material_block_versions.size() * 2), 0);
+		material_blocks->allocate(material_block_stride * (int)material_block_versions.size());
 	}
-	else {
-		lightToShaderSP(shader);
-		mesh->render(GL_TRIANGLES);	//do the draw call that renders the mesh into the screen
+
+	uint32& built_version = material_block_versions[material->index];
+	if (built_version != material->version + 1)
+	{
+		sMaterialBlock block;
+		block.color = material->color;
+		block.emissive_factor = material->emissive_factor;
+		//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
+		block.alpha_cutoff = material->alpha_mode == SCN::eAlphaMode::MASK ? material->alpha_cutoff : 0.001f;
+		block.metallic_roughness.set(material->metallic_factor, material->roughness_factor);
+		block.use_normalmap = gui_use_normalmaps && material->textures[SCN::eTextureChannel::NORMALMAP].texture ? 1 : 0;
+		block.use_emissive = gui_use_emissive && (material->textures[SCN::eTextureChannel::EMISSIVE].texture || material->emissive_factor.length() != 0.0f) ? 1 : 0; //some emissive objects dont have emissive textures
+		block.use_occlusion = gui_use_occlusion && material->textures[SCN::eTextureChannel::OCCLUSION].texture ? 1 : 0;
+		block.use_specular = gui_use_specular ? 1 : 0;
+		block.pad0.set(0, 0);
+		material_blocks->updateRange(&block, material->index * material_block_stride, sizeof(block));
+		built_version = material->version + 1;
+		stats.material_blocks_built++;
 	}
 
-	//disable shader
-	shader->disable();
+	material_blocks->bind(shader, 2, material->index * material_block_stride, sizeof(sMaterialBlock));
+}
 
-	//set the render state as it was before to avoid problems with future renders
-	glDisable(GL_BLEND);
-	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+void SCN::Renderer::updateFrameBlocks(Camera* camera)
+{
+	sFrameBlock frame;
+	frame.viewprojection = camera->viewprojection_matrix;
+	frame.camera_position = camera->eye;
+	frame.time = getTime();
+	frame.camera_front = camera->front;
+	frame.pad0 = 0;
+	frame.ambient_light = scene->ambient_light;
+	frame.pad1 = 0;
+	frame_block->updateRange(&frame, 0, sizeof(frame));
+
+	//same order than the lights so the lists and passes can use the index
+	static sLightData lights_data[MAX_BLOCK_LIGHTS];
+	int num = std::min((int)lights.size(), MAX_BLOCK_LIGHTS);
+	for (int i = 0; i < num; ++i)
+		lights[i]->getLightData(lights_data[i]);
+	stats.lights_dropped = (int)lights.size() - num;
+	static bool dropped_warning = false;
+	if (stats.lights_dropped && !dropped_warning)
+	{
+		std::cout << "Warning: " << lights.size() << " lights in view, only the first " << MAX_BLOCK_LIGHTS << " are rendered" << std::endl;
+		dropped_warning = true;
+	}
+	if (num)
+		light_block->updateRange(lights_data, 0, num * sizeof(sLightData));
+
+	//the material blocks depend on the gui toggles
+	int flags = (gui_use_normalmaps ? 1 : 0) | (gui_use_emissive ? 2 : 0) | (gui_use_occlusion ? 4 : 0) | (gui_use_specular ? 8 : 0);
+	if (flags != material_block_flags)
+	{
+		std::fill(material_block_versions.begin(), material_block_versions.end(), 0);
+		material_block_flags = flags;
+	}
 }
 
 void SCN::Renderer::cameraToShader(Camera* camera, GFX::Shader* shader)
 {
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix );
-	shader->setUniform("u_camera_position", camera->eye);
-}
-
-void SCN::Renderer::lightToShaderSP(GFX::Shader* shader) {
-	Vector3f light_positions[MAX_LIGHTS_SP];
-	Vector3f light_fronts[MAX_LIGHTS_SP];
-	Vector3f light_colors[MAX_LIGHTS_SP];
-	Vector2f cones_info[MAX_LIGHTS_SP];
-	float max_distances[MAX_LIGHTS_SP];
-	int light_types[MAX_LIGHTS_SP];
-	int num_lights = lights.size();
-	for (int i = 0; i < num_lights; i++) {
-		light_positions[i] = lights[i]->root.model.getTranslation();
-		light_fronts[i] = lights[i]->root.model.frontVector().normalize();
-		light_colors[i] = lights[i]->color * lights[i]->intensity;
-		Vector2f currentCone = Vector2f(cos(lights[i]->cone_info.x * (PI/180.0)), cos(lights[i]->cone_info.y * (PI / 180.0)));
-		cones_info[i] = currentCone;
-		max_distances[i] = lights[i]->max_distance;
-		light_types[i] = (int)lights[i]->light_type;
-	}
-	shader->setUniform("u_num_lights", num_lights);
-	shader->setUniform3Array("u_light_pos", (float*)&light_positions, MAX_LIGHTS_SP);
-	shader->setUniform3Array("u_light_front", (float*)&light_fronts, MAX_LIGHTS_SP);
-	shader->setUniform3Array("u_light_col", (float*)&light_colors, MAX_LIGHTS_SP);
-	shader->setUniform2Array("u_cone_info", (float*)&cones_info, MAX_LIGHTS_SP);
-	shader->setUniform1Array("u_max_distance", (float*)&max_distances, MAX_LIGHTS_SP);
-	shader->setUniform1Array("u_light_type", (int*)&light_types, MAX_LIGHTS_SP);
+	shader->setUniform(u_viewprojection, camera->viewprojection_matrix );
+	shader->setUniform(u_camera_position, camera->eye);
+	shader->setUniform(u_camera_front, camera->front);
+}
+
+void SCN::Renderer::lightToShaderSP(GFX::Shader* shader, const uint16* light_list, int num_lights) {
+	//indices in the light block, the lights after MAX_BLOCK_LIGHTS are not in it
+	int light_indices[MAX_LIGHTS_SP];
+	int num = 0;
+	if (!light_list)
+		num_lights = (int)lights.size();
+	for (int i = 0; i < num_lights && num < MAX_LIGHTS_SP; i++) {
+		int index = light_list ? light_list[i] : i;
+		if (index < MAX_BLOCK_LIGHTS)
+			light_indices[num++] = index;
+	}
+	shader->setUniform(u_num_lights, num);
+	if (num)
+		shader->setUniform1Array("u_light_list", light_indices, num);
 }
 
 void SCN::Renderer::lightToShaderMP(LightEntity* light, GFX::Shader* shader) {
@@ -459,18 +1460,18 @@ void SCN::Renderer::lightToShaderMP(LightEntity* light, GFX::Shader* shader) {
 	float max_distance = light->max_distance;
 	int light_type = (int)light->light_type;
 
-	shader->setUniform("u_light_pos", light_position);
-	shader->setUniform("u_light_front", light_front);
-	shader->setUniform("u_light_col", light_color);
-	shader->setUniform("u_cone_info", cone_info);
-	shader->setUniform("u_max_distance", max_distance);
-	shader->setUniform("u_light_type", light_type);
+	shader->setUniform(u_light_pos, light_position);
+	shader->setUniform(u_light_front, light_front);
+	shader->setUniform(u_light_col, light_color);
+	shader->setUniform(u_cone_info, cone_info);
+	shader->setUniform(u_max_distance, max_distance);
+	shader->setUniform(u_light_type, light_type);
 }
 
-void SCN::Renderer::baseRenderMP(GFX::Mesh* mesh, GFX::Shader* shader) {
-	int light_type = 4; //defined as ambient light (u_ambient_light alredy passed to shader)
-	shader->setUniform("u_light_type", light_type);
-	mesh->render(GL_TRIANGLES);
+void SCN::Renderer::baseRenderMP(GFX::Mesh* mesh, GFX::Shader* shader, const Matrix44* models, int num_instances) {
+	int light_index = -1; //ambient light only (u_ambient_light is in the frame block)
+	shader->setUniform(u_light_index, light_index);
+	drawMeshInstances(mesh, models, num_instances);
 }
 
 #ifndef SKIP_IMGUI
@@ -478,6 +1479,7 @@ void SCN::Renderer::baseRenderMP(GFX::Mesh* mesh, GFX::Shader* shader) {
 void Renderer::showUI()
 {
 		
+	ImGui::Combo("Pipeline", (int*)&render_mode, "Forward\0Deferred\0");
 	ImGui::Checkbox("Wireframe", &render_wireframe);
 	ImGui::Checkbox("Boundaries", &render_boundaries);
 	ImGui::Checkbox("Multipass lights", &use_multipass);
@@ -487,6 +1489,90 @@ void Renderer::showUI()
 	ImGui::Checkbox("use emissive", &gui_use_emissive);
 	ImGui::Checkbox("use occlusion", &gui_use_occlusion);
 	ImGui::Checkbox("use specular", &gui_use_specular);
+	ImGui::Checkbox("Instancing", &use_instancing);
+	ImGui::Checkbox("Clustered lights", &use_clustered);
+	ImGui::Checkbox("Cull light passes", &use_light_culling);
+	ImGui::Checkbox("Per object lights", &use_light_lists);
+	ImGui::Checkbox("Hierarchical culling", &use_hierarchical_culling);
+	ImGui::Checkbox("SIMD batch culling", &use_batch_culling);
+	ImGui::Checkbox("Software occlusion", &use_occlusion_culling);
+	ImGui::Checkbox("GPU occlusion queries", &use_gpu_occlusion);
+	ImGui::Checkbox("Mesh LODs", &use_lods);
+	if (use_lods)
+		ImGui::SliderFloat("LOD screen size", &lod_screen_size, 1.0f, 100.0f);
+	ImGui::Checkbox("Static batching", &use_static_batching);
+	ImGui::Checkbox("Impostors", &use_impostors);
+	ImGui::Checkbox("Meshlet culling", &use_meshlet_culling);
+	ImGui::Checkbox("Geometry pools", &GFX::GeometryPool::use_pools); //for the meshes uploaded after changing it
+	ImGui::Checkbox("Vertex array objects", &GFX::Mesh::use_vao);
+	if (GFX::GeometryPool::supportsIndirect())
+		ImGui::Checkbox("Multi draw indirect", &use_multidraw);
+	if (use_impostors)
+		ImGui::SliderFloat("Impostor screen size", &impostor_screen_size, 0.5f, 20.0f);
+	if (use_batch_culling)
+	{
+		ImGui::Combo("Culling path", (int*)&culling_path, "Scalar\0SSE\0AVX\0");
+		culling_path = std::min(culling_path, getBestCullingPath()); //the cpu may not support it
+	}
+	if (ImGui::Button("Benchmark culling"))
+		culling_benchmark = benchmarkFrustumCulling(Camera::current, 100000);
+	if (culling_benchmark.size())
+		ImGui::TextUnformatted(culling_benchmark.c_str());
+	ImGui::Checkbox("Compress mesh cache", &GFX::Mesh::compress_bins);
+	if (ImGui::Button("Benchmark MBIN"))
+	{
+		//the meshes of the prefabs of data/prefabs
+		std::vector<GFX::Mesh*> meshes;
+		std::vector<Node*> pending;
+		for (auto& it : Prefab::sPrefabsLoaded)
+			if (it.second && it.first.find("prefabs/") != std::string::npos)
+				pending.push_back(&it.second->root);
+		while (pending.size())
+		{
+			Node* node = pending.back();
+			pending.pop_back();
+			if (node->mesh && std::find(meshes.begin(), meshes.end(), node->mesh) == meshes.end())
+				meshes.push_back(node->mesh);
+			pending.insert(pending.end(), node->children.begin(), node->children.end());
+		}
+		mesh_bin_benchmark = GFX::Mesh::benchmarkBinFormats(meshes);
+	}
+	if (mesh_bin_benchmark.size())
+		ImGui::TextUnformatted(mesh_bin_benchmark.c_str());
+
+	ImGui::Text("Draw items: %d", stats.draw_items);
+	ImGui::Text("Frustum: %d box tests, %d branches culled", stats.cull_tests, stats.culled_subtrees);
+	if (use_batch_culling)
+		ImGui::Text("Batch culling: %d boxes in %.3f ms (%s)", (int)cull_candidates.size(), stats.batch_cull_time, getCullingPathName(culling_path));
+	if (use_static_batching)
+		ImGui::Text("Static batching: %d batches from %d nodes, %d in view, rebuilt in %.2f ms", static_batcher->num_batches, static_batcher->num_sources, stats.static_batches, static_batcher->rebuild_time);
+	if (use_impostors)
+		ImGui::Text("Impostors: %d in %d draws", stats.impostors, stats.impostor_draws);
+	if (use_meshlet_culling)
+		ImGui::Text("Meshlets: %d culled of %d, %d ranges drawn", stats.meshlets_culled, stats.meshlets, stats.meshlet_ranges);
+	if (use_multidraw && GFX::GeometryPool::supportsIndirect())
+		ImGui::Text("Multi draws: %d items in %d draws", stats.multidraw_items, stats.multidraws);
+	if (GFX::GeometryPool::pools.size())
+		ImGui::TextUnformatted(GFX::GeometryPool::getStats().c_str());
+	if (use_gpu_occlusion)
+		ImGui::Text("Occlusion queries: %d issued, %d items hidden", stats.occlusion_queries, stats.gpu_occluded_items);
+	if (use_occlusion_culling)
+		ImGui::Text("Occlusion: %d occluders (%d tris), %d items hidden, %.3f ms", stats.occluders, occlusion_buffer->num_triangles, stats.occluded_items, stats.occlusion_time);
+	ImGui::Text("Shader changes: %d, material changes: %d", stats.shader_changes, stats.material_changes);
+	ImGui::Text("Uniforms: %d uploaded, %d skipped", GFX::Shader::s_uniform_stats.uploads, GFX::Shader::s_uniform_stats.skipped);
+	ImGui::Text("Material blocks built: %d", stats.material_blocks_built);
+	ImGui::Text("GL state: %d changes, %d skipped", GFX::gpu_state_stats.state_changes, GFX::gpu_state_stats.state_skipped);
+	ImGui::Text("Texture binds: %d, %d skipped, program binds: %d", GFX::gpu_state_stats.texture_binds, GFX::gpu_state_stats.texture_binds_skipped, GFX::gpu_state_stats.program_binds);
+	ImGui::Text("Instances: %d in %d draws (%d draws saved)", stats.instances, stats.instanced_draws, stats.instances - stats.instanced_draws);
+	if ((use_multipass && !use_clustered) || render_mode == RENDER_DEFERRED)
+		ImGui::Text("Light passes: %d rendered, %d skipped", stats.light_passes, stats.light_passes_skipped);
+	if (usingLightLists())
+		ImGui::Text("Light lists: %.1f lights per item, %d uploads", stats.light_list_lights / (float)std::max(stats.draw_items, 1), stats.light_list_uploads);
+	if (stats.lights_dropped)
+		ImGui::TextColored(ImVec4(1, 0.5f, 0, 1), "Lights dropped: %d over the %d of the light block", stats.lights_dropped, MAX_BLOCK_LIGHTS);
+	if (use_clustered)
+		ImGui::Text("Clusters: %d lights + %d global, %.1f per cluster, %.2f ms", light_grid->num_local_lights, light_grid->num_global_lights,
+			light_grid->num_light_indices / (float)light_grid->getNumClusters(), light_grid->build_time);
 
 
 
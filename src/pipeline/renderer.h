@@ -3,8 +3,14 @@
 #include "prefab.h"
 
 #include "light.h"
+#include "culling.h"
+#include "batching.h"
+#include "../gfx/gfx.h"
+
+#include <unordered_map>
 
 #define MAX_LIGHTS_SP 10
+#define MAX_BLOCK_LIGHTS 128 //must match light_block.glsl
 
 //forward declarations
 class Camera;
@@ -13,12 +19,114 @@ namespace GFX {
 	class Shader;
 	class Mesh;
 	class FBO;
+	class BufferObject;
 }
 
 namespace SCN {
 
 	class Prefab;
 	class Material;
+	class LightGrid;
+	class OcclusionBuffer;
+	class Impostor;
+
+	//pass of a draw item, it is the most significant part of the sort key
+	enum eRenderPass {
+		PASS_OPAQUE = 0,
+		PASS_MASK = 1, //alpha tested after the opaque ones so they benefit from early-z
+		PASS_BLEND = 2
+	};
+
+	//how the opaque objects are lit, blended ones always use the forward path
+	enum eRenderMode {
+		RENDER_FORWARD = 0,
+		RENDER_DEFERRED = 1
+	};
+
+	//compact info of something to draw, generated while categorizing the nodes
+	struct sDrawCall {
+		GFX::Mesh* mesh;
+		SCN::Material* material;
+		SCN::Node* node;
+		Matrix44 model;				//world matrix cached during categorization
+		BoundingBox world_bounding;	//mesh box in world space
+		float distance_to_camera;
+		int lod;					//detail level of the mesh
+		uint64 key;					//pass | shader | material | mesh | depth
+		int num_lights;				//lights that reach this item when using per object light lists
+		uint16 lights[MAX_LIGHTS_SP];	//indices in the frame lights, sorted so equal lists can be compared
+	};
+
+	//uniform blocks, std140 layout so they must match the blocks in the shader atlas (vec3 is aligned to 16 bytes)
+	struct sFrameBlock {
+		Matrix44 viewprojection;
+		Vector3f camera_position;
+		float time;
+		Vector3f camera_front;
+		float pad0;
+		Vector3f ambient_light;
+		float pad1;
+	};
+
+	struct sMaterialBlock {
+		Vector4f color;
+		Vector3f emissive_factor;
+		float alpha_cutoff;
+		Vector2f metallic_roughness;
+		int use_normalmap;
+		int use_emissive;
+		int use_occlusion;
+		int use_specular;
+		Vector2f pad0; //std140 rounds the size of the block to 16 bytes
+	};
+	static_assert(sizeof(sMaterialBlock) == 64, "sMaterialBlock must match the std140 size of MaterialBlock");
+
+	//hardware occlusion state of a node, the result of a query is read some frames later when it is ready
+	struct sOcclusionQuery {
+		GFX::GPUQuery query;
+		bool visible;		//last known result
+		bool pending;		//query issued and not read yet
+		int last_frame;		//last frame the node was in the render queue
+		int last_test_frame;
+		sOcclusionQuery() : visible(true), pending(false), last_frame(-1), last_test_frame(0) {}
+	};
+
+	//this is what gets sorted every frame, index points to the render queue
+	struct sSortItem {
+		uint64 key;
+		uint32 index;
+	};
+
+	//counters of the last rendered frame
+	struct sRenderStats {
+		int draw_items;
+		int cull_tests;			//frustum box tests done while categorizing
+		int culled_subtrees;	//branches skipped because their box is outside the frustum
+		float batch_cull_time;	//ms spent in the batch culling kernel
+		int occluders;			//draw items rasterized in the software occlusion buffer
+		int occluded_items;		//draw items removed because they are behind the occluders
+		float occlusion_time;	//ms spent rasterizing the occluders and testing the items
+		int occlusion_queries;	//gpu occlusion queries issued
+		int gpu_occluded_items;	//draw items skipped because their last query found no samples
+		int static_batches;		//merged static batches in cells that are not culled
+		int impostors;			//far prefabs drawn as an impostor quad
+		int impostor_draws;		//instanced draw calls of those quads, one per prefab
+		int meshlets;			//meshlets tested in the draw items with meshlet culling
+		int meshlets_culled;	//outside the frustum or facing away
+		int meshlet_ranges;		//ranges of indices drawn by the multi draws
+		int multidraws;			//indirect multi draws of the geometry pools
+		int multidraw_items;	//draw items rendered inside those multi draws
+		int shader_changes;
+		int material_changes;
+		int instanced_draws;	//draw calls that rendered a group of instances
+		int instances;			//draw items rendered inside those groups
+		int light_passes;		//multipass additive passes (or deferred light volumes) rendered
+		int light_passes_skipped; //multipass additive passes (or deferred light volumes) skipped because the light cannot reach anything
+		int light_list_lights;	//sum of the per object light lists sizes
+		int light_list_uploads;	//times a per object light list was sent to the shader
+		int lights_dropped;		//lights after MAX_BLOCK_LIGHTS, not in the light block so no pass or list can use them
+		int material_blocks_built; //material blocks uploaded because the material was new or edited
+	};
 
 	// This class is in charge of rendering anything in our system.
 	// Separating the render from anything else makes the code cleaner
@@ -30,6 +138,32 @@ namespace SCN {
 		bool use_multipass;
 		bool render_lights;
 		bool disable_lights;
+		bool use_instancing;
+		bool use_clustered; //lights binned in a froxel grid, every pixel only evaluates the lights of its cluster
+		bool use_light_culling; //multipass skips the lights that do not reach the object and scissors the rest
+		bool use_light_lists; //single pass uploads only the most important lights of every object
+		bool use_hierarchical_culling; //branches of the prefabs are culled with the box of the subtree
+		bool use_batch_culling; //nodes are gathered while categorizing and their boxes tested together with the simd kernel
+		eCullingPath culling_path;
+		bool use_occlusion_culling; //big opaque items are rasterized on the cpu and the items behind them are removed from the queue
+		bool use_gpu_occlusion; //expensive items are skipped while the query of their box finds no samples
+		int gpu_occlusion_min_triangles; //cheaper items are always rendered, testing them costs more than drawing them
+		int gpu_occlusion_retest_frames; //visible items are tested again every this number of frames, hidden ones every frame
+		GLenum occlusion_query_type;
+		std::unordered_map<int, sOcclusionQuery> occlusion_queries; //by Node::m_Id, the address of a deleted batch node can be reused
+		std::vector<SCN::Node*> query_nodes; //nodes whose box is tested after rendering this frame
+		int frame_number;
+		bool use_lods; //simplified levels of the meshes are used when they are small on screen
+		float lod_screen_size; //projected scale below which the first simplified level is used, every next level at half of it
+		float lod_hysteresis; //fraction of the threshold the scale must cross to change the level, avoids popping back and forth
+		bool use_static_batching; //static prefab entities are merged per cell and material
+		bool use_meshlet_culling; //items drawn alone only draw the meshlets inside the frustum that face the camera
+		bool use_multidraw; //consecutive items of the same material in the same geometry pool are drawn with one indirect multi draw
+		StaticBatcher* static_batcher;
+		bool use_impostors; //far prefabs are drawn as a quad with the views of the prefab baked in an atlas
+		float impostor_screen_size; //projected scale of the prefab below which the impostor is used
+		std::unordered_map<Impostor*, std::vector<Matrix44>> impostor_instances; //models of the impostors to draw this frame
+		eRenderMode render_mode;
 		bool gui_use_normalmaps = true;
 		bool gui_use_emissive = true;
 		bool gui_use_occlusion = true;
@@ -39,6 +173,28 @@ namespace SCN {
 
 		SCN::Scene* scene;
 
+		LightGrid* light_grid;
+		OcclusionBuffer* occlusion_buffer;
+		GFX::FBO* gbuffers; //albedo, normal, metalness roughness occlusion, emissive and depth
+		bool rendering_gbuffers; //the queue is being rendered to the gbuffers
+
+		GFX::BufferObject* frame_block;		//camera, time and ambient, updated once per frame
+		GFX::BufferObject* light_block;		//sLightData of the frame lights, same order than the lights
+		GFX::BufferObject* material_blocks;	//one sMaterialBlock per material index, every one aligned to the offset alignment
+		int material_block_stride;
+		std::vector<uint32> material_block_versions; //material version + 1 of every built block, 0 if not built
+		int material_block_flags; //gui toggles the blocks were built with
+
+		std::vector<SCN::Node*> cull_candidates; //nodes waiting for the batch culling, same order than cull_boxes
+		sBoxArrays cull_boxes;
+		std::vector<uint32> cull_visibility;
+		std::string culling_benchmark; //text of the last benchmark
+		std::string mesh_bin_benchmark; //text of the last benchmark of the mesh binary versions
+
+		std::vector<sDrawCall> render_queue; //visible draw items, filled every frame by categorizeNodes
+		std::vector<sSortItem> sorted_queue; //keys of the render queue in render order
+		sRenderStats stats;
+
 		//updated every frame
 		Renderer(const char* shaders_atlas_filename );
 
@@ -57,8 +213,58 @@ namespace SCN {
 		//to render one node from the prefab and its children
 		void renderNode(SCN::Node* node, Camera* camera);
 
-		//sorts node and children nodes to their respective container
-		void categorizeNodes(SCN::Node* node, Camera* camera);
+		//adds the visible node and children nodes to the render queue, plane_mask has the frustum planes the parent crosses
+		void categorizeNodes(SCN::Node* node, Camera* camera, uint8 plane_mask = 0x3F /*all*/);
+
+		//pushes the draw item of a visible node to the render queue
+		void addDrawCall(SCN::Node* node, Camera* camera);
+
+		//detail level of the mesh of the node for its size on screen, starting from the level of the last frame
+		int selectLOD(SCN::Node* node, Camera* camera);
+
+		//adds the batches (and the nodes that cannot be merged) of the cells that are in the frustum
+		void categorizeStaticCells(Camera* camera);
+
+		//queues the impostor of the prefab if it is small on screen, false if the nodes must be categorized
+		bool addImpostorInstance(SCN::PrefabEntity* entity, Camera* camera);
+
+		//renders the impostors of the frame, one instanced draw per prefab
+		void renderImpostors(Camera* camera);
+
+		//tests the boxes of the candidates together and adds the visible ones to the render queue
+		void cullCandidates(Camera* camera);
+
+		//rasterizes the biggest opaque items of the queue as occluders and removes the items hidden by them
+		void cullOccludedItems(Camera* camera);
+
+		//reads the ready queries, removes the items known to be hidden and chooses the nodes to test this frame
+		void applyOcclusionQueries(Camera* camera);
+
+		//renders the boxes of the chosen nodes against the opaque depth, before the blended items, results are read in the next frames
+		void issueOcclusionQueries(Camera* camera);
+
+		//packs pass, shader, material, mesh and depth of a draw item in a 64 bits key
+		uint64 computeDrawKey(const sDrawCall& dc, Camera* camera);
+
+		//radix sorts the render queue keys
+		void sortRenderQueue();
+
+		//fills the ranges drawMeshInstances uses with the visible meshlets of the item, false if it must draw the whole mesh
+		bool prepareMeshletRanges(const sDrawCall& dc, Camera* camera);
+		//fills the commands and per draw data of the multi draw of the items from first, returns the end of the batch or first if it is not worth it
+		size_t prepareMultiDraw(size_t first, size_t end, Camera* camera, bool light_lists);
+
+		//renders in order the draw items of the passes in the range
+		void renderRenderQueue(Camera* camera, int first_pass = PASS_OPAQUE, int last_pass = PASS_BLEND);
+
+		//opaque items to the gbuffers, lights accumulated on screen, then blended items with the forward path
+		void renderDeferred(Camera* camera);
+
+		//GFX_STATE bits of blending, culling, depth and wireframe of a material
+		uint64 getMaterialState(SCN::Material* material);
+
+		//shader used to render a material with the current settings
+		GFX::Shader* getMaterialShader(SCN::Material* material, bool instanced = false, bool indirect = false);
 
 		//to render one mesh given its material and transformation matrix
 		void renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material);
@@ -66,12 +272,32 @@ namespace SCN {
 		//lab1
 		void renderMeshWithMaterialLights(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material);
 
+		//same but renders all the instances in one draw call, models are sent as a per instance attribute, world_bounding contains all of them
+		void renderMeshWithMaterialLights(const Matrix44* models, int num_instances, GFX::Mesh* mesh, SCN::Material* material, const BoundingBox& world_bounding, const uint16* light_list = nullptr, int num_lights = 0);
+
+		//computes the bounds and scissor rect of every light for the multipass culling
+		void computeLightVolumes(Camera* camera);
+
+		//per object light lists are only used by the single pass shaders
+		bool usingLightLists() { return use_light_lists && render_lights && !use_multipass && !use_clustered; }
+
+		//fills the light list of every draw item with the top MAX_LIGHTS_SP lights that reach it, needs the light volumes
+		void assignLightLists(Camera* camera);
+
+		//uploads the frame and light blocks, call it once the lights of the frame are known
+		void updateFrameBlocks(Camera* camera);
+
+		//binds the range of the material block, it is rebuilt first if the material changed since it was uploaded
+		void bindMaterialBlock(SCN::Material* material, GFX::Shader* shader);
+
 		void showUI();
 
 		void cameraToShader(Camera* camera, GFX::Shader* shader); //sends camera uniforms to shader
-		void lightToShaderSP(GFX::Shader* shader); //send light uniforms to shader for single-pass rendering
+		void lightToShaderSP(GFX::Shader* shader, const uint16* light_list = nullptr, int num_lights = 0); //send light uniforms to shader for single-pass rendering, all the lights if there is no list
 		void lightToShaderMP(LightEntity* light, GFX::Shader* shader); //send light uniforms to shader for multi-pass rendering (one light)
-		void baseRenderMP(GFX::Mesh* mesh, GFX::Shader* shader); //draws first render of multi-pass using only ambien light (blends others on top)
+		void baseRenderMP(GFX::Mesh* mesh, GFX::Shader* shader, const Matrix44* models = nullptr, int num_instances = 1); //draws first render of multi-pass using only ambien light (blends others on top)
+		void materialToShader(SCN::Material* material, GFX::Shader* shader); //sends material textures, the parameters are in the material block
+		void gbuffersToShader(Camera* camera, GFX::Shader* shader); //sends gbuffer textures and what is needed to reconstruct the position
 	};
 
 };
\ No newline at end of file
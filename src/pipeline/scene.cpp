@@ -267,6 +267,7 @@ SCN::BaseEntity* SCN::BaseEntity::createEntity(const char* type)
 SCN::PrefabEntity::PrefabEntity()
 {
 	prefab = NULL;
+	is_static = false;
 }
 
 void SCN::PrefabEntity::configure(cJSON* json)
@@ -276,11 +277,14 @@ void SCN::PrefabEntity::configure(cJSON* json)
 		filename = cJSON_GetObjectItem(json, "filename")->valuestring;
 		loadPrefab( filename.c_str() );
 	}
+	is_static = readJSONBool(json, "static", false);
 }
 
 void SCN::PrefabEntity::serialize(cJSON* json)
 {
 	cJSON_AddStringToObject(json, "filename", filename.c_str());
+	if (is_static)
+		writeJSONBool(json, "static", true);
 }
 
 void SCN::PrefabEntity::loadPrefab(const char* filename)
@@ -96,6 +96,7 @@ namespace SCN {
 	public:
 		std::string filename;
 		Prefab* prefab;
+		bool is_static; //never moves, it can be merged with other static entities
 		
 		PrefabEntity();
 
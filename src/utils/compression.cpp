@@ -0,0 +1,232 @@
+#include "compression.h"
+
+#include "../core/task.h"
+
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+
+//compressed stream: block_size, num_blocks, end of every block (from the start of the first one), blocks
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5 //the end of a block is always literals
+#define LZ_HASH_BITS 12
+
+static uint32 read32(const uint8* p) { uint32 v; memcpy(&v, p, 4); return v; }
+static void write32(std::vector<uint8>& out, uint32 v) { out.insert(out.end(), (uint8*)&v, (uint8*)&v + 4); }
+
+//bytes grouped by their position in the element and stored as the difference with the previous one
+static void filterBlock(const uint8* data, size_t size, int element_size, uint8* out)
+{
+	size_t num_elements = size / element_size;
+	size_t pos = 0;
+	for (int j = 0; j < element_size; ++j)
+		for (size_t i = 0; i < num_elements; ++i)
+			out[pos++] = data[i * element_size + j];
+	memcpy(out + pos, data + pos, size - pos); //bytes of an incomplete element
+
+	uint8 last = 0;
+	for (size_t i = 0; i < size; ++i)
+	{
+		uint8 v = out[i];
+		out[i] = v - last;
+		last = v;
+	}
+}
+
+static void unfilterBlock(uint8* data, size_t size, int element_size, uint8* out)
+{
+	uint8 last = 0;
+	for (size_t i = 0; i < size; ++i)
+	{
+		last += data[i];
+		data[i] = last;
+	}
+
+	size_t num_elements = size / element_size;
+	size_t pos = 0;
+	for (int j = 0; j < element_size; ++j)
+		for (size_t i = 0; i < num_elements; ++i)
+			out[i * element_size + j] = data[pos++];
+	memcpy(out + pos, data + pos, size - pos);
+}
+
+static void writeLength(std::vector<uint8>& out, size_t length)
+{
+	for (; length >= 255; length -= 255)
+		out.push_back(255);
+	out.push_back((uint8)length);
+}
+
+static void writeSequence(std::vector<uint8>& out, const uint8* literals, size_t num_literals, uint32 offset, size_t match_length)
+{
+	size_t match_code = match_length ? match_length - LZ_MIN_MATCH : 0;
+	out.push_back((uint8)((std::min(num_literals, (size_t)15) << 4) | std::min(match_code, (size_t)15)));
+	if (num_literals >= 15)
+		writeLength(out, num_literals - 15);
+	out.insert(out.end(), literals, literals + num_literals);
+	if (!match_length)
+		return; //last sequence
+	out.push_back((uint8)(offset & 0xFF));
+	out.push_back((uint8)(offset >> 8));
+	if (match_code >= 15)
+		writeLength(out, match_code - 15);
+}
+
+static void compressBlock(const uint8* data, size_t size, std::vector<uint8>& out)
+{
+	int table[1 << LZ_HASH_BITS];
+	for (int& entry : table)
+		entry = -1;
+
+	size_t anchor = 0;
+	size_t pos = 0;
+	while (pos + LZ_MIN_MATCH + LZ_LAST_LITERALS <= size)
+	{
+		uint32 sequence = read32(data + pos);
+		uint32 hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+		int candidate = table[hash];
+		table[hash] = (int)pos;
+		if (candidate < 0 || pos - candidate > 0xFFFF || read32(data + candidate) != sequence)
+		{
+			pos++;
+			continue;
+		}
+
+		size_t length = LZ_MIN_MATCH;
+		while (pos + length + LZ_LAST_LITERALS < size && data[candidate + length] == data[pos + length])
+			length++;
+		writeSequence(out, data + anchor, pos - anchor, (uint32)(pos - candidate), length);
+		pos += length;
+		anchor = pos;
+	}
+	writeSequence(out, data + anchor, size - anchor, 0, 0);
+}
+
+static bool readLength(const uint8*& src, const uint8* end, size_t& length)
+{
+	uint8 v;
+	do {
+		if (src == end)
+			return false;
+		v = *src++;
+		length += v;
+	} while (v == 255);
+	return true;
+}
+
+//returns false if the data does not fill exactly the block
+static bool decompressBlock(const uint8* src, size_t src_size, uint8* dst, size_t dst_size)
+{
+	const uint8* end = src + src_size;
+	uint8* out = dst;
+	uint8* out_end = dst + dst_size;
+	while (src < end)
+	{
+		uint8 token = *src++;
+		size_t num_literals = token >> 4;
+		if (num_literals == 15 && !readLength(src, end, num_literals))
+			return false;
+		if (num_literals > (size_t)(end - src) || num_literals > (size_t)(out_end - out))
+			return false;
+		memcpy(out, src, num_literals);
+		src += num_literals;
+		out += num_literals;
+		if (src == end)
+			break; //last sequence, only literals
+
+		if (end - src < 2)
+			return false;
+		size_t offset = src[0] | (src[1] << 8);
+		src += 2;
+		size_t length = token & 15;
+		if (length == 15 && !readLength(src, end, length))
+			return false;
+		length += LZ_MIN_MATCH;
+		if (offset == 0 || offset > (size_t)(out - dst) || length > (size_t)(out_end - out))
+			return false;
+		//it can overlap with itself, byte by byte
+		const uint8* match = out - offset;
+		for (size_t i = 0; i < length; ++i)
+			out[i] = match[i];
+		out += length;
+	}
+	return out == out_end;
+}
+
+void compressStream(const uint8* data, size_t size, int element_size, std::vector<uint8>& out)
+{
+	//whole elements in every block so the filter works the same in all of them
+	uint32 block_size = (uint32)std::max(STREAM_BLOCK_SIZE / element_size * element_size, element_size);
+	uint32 num_blocks = (uint32)((size + block_size - 1) / block_size);
+
+	std::vector<uint8> blocks;
+	std::vector<uint8> filtered(block_size);
+	std::vector<uint32> ends;
+	for (uint32 i = 0; i < num_blocks; ++i)
+	{
+		size_t start = (size_t)i * block_size;
+		size_t length = std::min((size_t)block_size, size - start);
+		filterBlock(data + start, length, element_size, &filtered[0]);
+		compressBlock(&filtered[0], length, blocks);
+		ends.push_back((uint32)blocks.size());
+	}
+
+	out.clear();
+	write32(out, block_size);
+	write32(out, num_blocks);
+	for (uint32 end : ends)
+		write32(out, end);
+	out.insert(out.end(), blocks.begin(), blocks.end());
+}
+
+bool decompressStreams(const std::vector<sStreamDecode>& streams)
+{
+	//the blocks of all the streams in one list, so small streams do not leave threads idle
+	struct sBlock {
+		const sStreamDecode* stream;
+		const uint8* src;
+		size_t src_size;
+		size_t dst_offset;
+		size_t dst_size;
+	};
+	std::vector<sBlock> blocks;
+	for (const sStreamDecode& stream : streams)
+	{
+		if (stream.src_size < 8 || stream.element_size <= 0)
+			return false;
+		uint32 block_size = read32(stream.src);
+		uint32 num_blocks = read32(stream.src + 4);
+		size_t header_size = 8 + (size_t)num_blocks * 4;
+		if (!block_size || header_size > stream.src_size || num_blocks != (stream.dst_size + block_size - 1) / block_size)
+			return false;
+
+		uint32 start = 0;
+		for (uint32 i = 0; i < num_blocks; ++i)
+		{
+			uint32 end = read32(stream.src + 8 + i * 4);
+			if (end < start || header_size + end > stream.src_size)
+				return false;
+			sBlock block = { &stream, stream.src + header_size + start, end - start, (size_t)i * block_size, std::min((size_t)block_size, stream.dst_size - (size_t)i * block_size) };
+			blocks.push_back(block);
+			start = end;
+		}
+	}
+
+	std::atomic<bool> valid(true);
+	TaskManager::parallelFor((int)blocks.size(), [&](int start, int end) {
+		std::vector<uint8> filtered;
+		for (int i = start; i < end; ++i)
+		{
+			const sBlock& block = blocks[i];
+			filtered.resize(block.dst_size);
+			if (!decompressBlock(block.src, block.src_size, &filtered[0], block.dst_size))
+			{
+				valid = false;
+				continue;
+			}
+			unfilterBlock(&filtered[0], block.dst_size, block.stream->element_size, block.stream->dst + block.dst_offset);
+		}
+	});
+	return valid;
+}
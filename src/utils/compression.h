@@ -0,0 +1,32 @@
+#pragma once
+
+#include <vector>
+
+#include "../core/math.h"
+
+//Compression of binary streams (vertices, indices...) to store them in the cached files.
+//Every stream is split in blocks that are compressed and decompressed independently so the decoding can be parallel.
+//Every block goes through a filter (the bytes are grouped by their position in the element and stored as the
+//difference with the previous one) and then through an LZ77 codec with byte aligned tokens, similar to LZ4.
+
+enum eStreamCodec {
+	CODEC_NONE = 0,	//stored as it is
+	CODEC_LZ = 1	//filter + lz
+};
+
+#define STREAM_BLOCK_SIZE (64 * 1024) //max bytes of a block before compressing, the lz offsets are 16 bits
+
+//out gets the compressed stream, element_size is the bytes of every vertex/index for the filter
+void compressStream(const uint8* data, size_t size, int element_size, std::vector<uint8>& out);
+
+//a compressed stream to decompress in dst, that must have the size of the original
+struct sStreamDecode {
+	const uint8* src;
+	size_t src_size;
+	uint8* dst;
+	size_t dst_size;
+	int element_size;
+};
+
+//decompresses all the blocks of all the streams in the worker threads, returns false if any of them is corrupted
+bool decompressStreams(const std::vector<sStreamDecode>& streams);
@@ -6,11 +6,13 @@
 #include "../extra/cgltf.h"
 
 #include "../gfx/mesh.h"
+#include "../gfx/optimize.h"
 #include "../gfx/texture.h"
 #include "../pipeline/material.h"
 #include "../pipeline/prefab.h"
 #include "../utils/utils.h"
 
+#include <algorithm>
 #include <iostream>
 
 //** PARSING GLTF IS UGLY
@@ -22,7 +24,7 @@ std::string base_folder;
 	bool load_textures = true; //must textures be loadead?
 #endif
 
-void parseGLTFBufferVector4(std::vector<Vector4f>& container, cgltf_accessor* acc, cgltf_accessor* indices_acc = NULL)
+void parseGLTFBufferVector4(std::vector<Vector4f>& container, cgltf_accessor* acc)
 {
 	int i = 0;
 
@@ -73,7 +75,7 @@ void parseGLTFBufferVector4(std::vector<Vector4f>& container, cgltf_accessor* ac
 				for (size_t j = 0; j < 4; ++j)
 				{
 					values[i * 4 + j] = *(current + j);
-					if (acc->normalized) values[i * 4 + j] /= (float)0xFFFF;
+					if (acc->normalized) values[i * 4 + j] /= (float)0xFF;
 				}
 				current += stride;
 			}
@@ -98,35 +100,10 @@ void parseGLTFBufferVector4(std::vector<Vector4f>& container, cgltf_accessor* ac
 		}
 	}
 
-	if (!indices_acc)
-	{
-		container = unindexed;
-		return;
-	}
-
-	//deindex
-	container.resize(indices_acc->count);
-
-	unsigned char* indices = (unsigned char*)indices_acc->buffer_view->buffer->data + indices_acc->offset;
-	int stride = indices_acc->stride;
-	for (size_t i = 0; i < indices_acc->count; ++i)
-	{
-		size_t index = 0;
-		unsigned char* pos = indices + i * stride;
-		switch (indices_acc->component_type)
-		{
-		case cgltf_component_type_r_8u: index = (int)*pos; break;
-		case cgltf_component_type_r_16u: index = (int)*(unsigned short*)pos; break;
-		case cgltf_component_type_r_32u: index = (int)*(unsigned int*)pos; break;
-		}
-		if (index < unindexed.size()) //sometimes indices are out of bounds
-			container[i] = unindexed[index];
-		else
-			std::cout << "index out of bounds:" << index << std::endl;
-	}
+	container.swap(unindexed);
 }
 
-void parseGLTFBufferVector3(std::vector<Vector3f>& container, cgltf_accessor* acc, cgltf_accessor* indices_acc = NULL)
+void parseGLTFBufferVector3(std::vector<Vector3f>& container, cgltf_accessor* acc)
 {
 	int i = 0;
 
@@ -152,35 +129,10 @@ void parseGLTFBufferVector3(std::vector<Vector3f>& container, cgltf_accessor* ac
 		}
 	}
 
-	if (!indices_acc)
-	{
-		container = unindexed;
-		return;
-	}
-
-	//deindex
-	container.resize(indices_acc->count);
-
-	unsigned char* indices = (unsigned char*)indices_acc->buffer_view->buffer->data + indices_acc->offset;
-	int stride = indices_acc->stride;
-	for (size_t i = 0; i < indices_acc->count; ++i)
-	{
-		size_t index = 0;
-		unsigned char* pos = indices + i * stride;
-		switch (indices_acc->component_type)
-		{
-		case cgltf_component_type_r_8u: index = (int)*pos; break;
-		case cgltf_component_type_r_16u: index = (int)*(unsigned short*)pos; break;
-		case cgltf_component_type_r_32u: index = (int)*(unsigned int*)pos; break;
-		}
-		if (index < unindexed.size()) //sometimes indices are out of bounds
-			container[i] = unindexed[index];
-		else
-			std::cout << "index out of bounds:" << index << std::endl;
-	}
+	container.swap(unindexed);
 }
 
-void parseGLTFBufferVector2(std::vector<Vector2f>& container, cgltf_accessor* acc, cgltf_accessor* indices_acc = NULL)
+void parseGLTFBufferVector2(std::vector<Vector2f>& container, cgltf_accessor* acc)
 {
 	assert(acc->buffer_view->buffer->data);
 	unsigned char* data = (unsigned char*)(acc->buffer_view->buffer->data) + acc->offset + acc->buffer_view->offset;
@@ -204,35 +156,7 @@ void parseGLTFBufferVector2(std::vector<Vector2f>& container, cgltf_accessor* ac
 		}
 	}
 
-	if (!indices_acc)
-	{
-		container = unindexed;
-		return;
-	}
-
-	//deindex
-	container.resize(indices_acc->count);
-
-	assert(indices_acc->sparse.count == 0); //sparse not supported yet
-
-	unsigned char* indices = (unsigned char*)indices_acc->buffer_view->buffer->data + indices_acc->offset;
-	int stride = indices_acc->stride;
-	for (size_t i = 0; i < indices_acc->count; ++i)
-	{
-		unsigned int index = 0;
-		unsigned char* pos = indices + i * stride;
-		switch (indices_acc->component_type)
-		{
-		case cgltf_component_type_r_8u: index = static_cast<unsigned int>(*pos); break;
-		case cgltf_component_type_r_16u: index = static_cast<unsigned int>(*(unsigned short*)pos); break;
-		case cgltf_component_type_r_32u: index = static_cast<unsigned int>(*(unsigned int*)pos); break;
-		}
-		if (index < unindexed.size())  //sometimes indices are out of bounds
-			container[i] = unindexed[index];
-		else
-			std::cout << "index out of bounds:" << index << std::endl;
-	}
-
+	container.swap(unindexed);
 }
 
 void parseGLTFBufferIndices(std::vector<unsigned int>& container, cgltf_accessor* acc)
@@ -258,6 +182,52 @@ void parseGLTFBufferIndices(std::vector<unsigned int>& container, cgltf_accessor
 	}
 }
 
+//sometimes indices are out of bounds, the triangles using them are dropped before anything indexes the streams with them
+void removeOutOfBoundsTriangles(std::vector<unsigned int>& indices, size_t num_vertices)
+{
+	size_t num_valid = 0;
+	for (size_t i = 0; i + 2 < indices.size(); i += 3)
+	{
+		unsigned int a = indices[i], b = indices[i + 1], c = indices[i + 2];
+		if (a >= num_vertices || b >= num_vertices || c >= num_vertices)
+		{
+			std::cout << "index out of bounds:" << std::max(std::max(a, b), c) << std::endl;
+			continue;
+		}
+		indices[num_valid++] = a;
+		indices[num_valid++] = b;
+		indices[num_valid++] = c;
+	}
+	indices.resize(num_valid);
+}
+
+//bytes of the geometry of the meshes of the prefab being loaded, indexed and as it would be with 3 vertices per triangle
+size_t indexed_bytes = 0;
+size_t deindexed_bytes = 0;
+
+void countIndexedMemory(GFX::Mesh* mesh)
+{
+	size_t vertex_size = sizeof(Vector3f);
+	if (mesh->normals.size()) vertex_size += sizeof(Vector3f);
+	if (mesh->uvs.size()) vertex_size += sizeof(Vector2f);
+	if (mesh->m_uvs1.size()) vertex_size += sizeof(Vector2f);
+	if (mesh->colors.size()) vertex_size += sizeof(Vector4f);
+	if (mesh->weights.size()) vertex_size += sizeof(Vector4f);
+	size_t index_size = mesh->vertices.size() < 65536 ? sizeof(uint16) : sizeof(uint32); //as uploaded to the GPU
+	indexed_bytes += mesh->vertices.size() * vertex_size + mesh->m_indices.size() * index_size;
+	deindexed_bytes += mesh->m_indices.size() * vertex_size;
+}
+
+//the processed submeshes are cached next to the gltf, with the name made safe for the filesystem
+std::string getGLTFMeshBinName(const char* basename, const char* meshname, size_t primitive)
+{
+	std::string name = meshname;
+	for (char& c : name)
+		if (!isalnum((unsigned char)c) && c != '_' && c != '-')
+			c = '_';
+	return std::string(basename) + "." + name + "." + std::to_string(primitive); //writeBin adds the .mbin
+}
+
 std::vector<GFX::Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename)
 {
 	std::vector<GFX::Mesh*> result;
@@ -285,6 +255,23 @@ std::vector<GFX::Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename
 
 		mesh = new GFX::Mesh();
 
+		//optimize, lods and meshlets are done once, it is imported again if it was written with other optimize_meshes
+		std::string binfilename;
+		if (meshdata->name && GFX::Mesh::use_binary)
+		{
+			binfilename = getGLTFMeshBinName(basename, meshdata->name, i);
+			if (mesh->readBin((binfilename + ".mbin").c_str()) && mesh->optimized == GFX::Mesh::optimize_meshes)
+			{
+				countIndexedMemory(mesh);
+				mesh->vertex_layout = GFX::Mesh::asset_layout;
+				mesh->uploadToVRAM();
+				mesh->registerMesh(submesh_name);
+				result.push_back(mesh);
+				continue;
+			}
+			mesh->clear();
+		}
+
         //streams
 		for (size_t j = 0; j < primitive->attributes_count; ++j)
 		{
@@ -330,11 +317,30 @@ std::vector<GFX::Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename
 			{
 				//parseGLTFBufferVector4(mesh->bones, attr->data);
 			}
+		}
 
-			if (primitive->indices && primitive->indices->count)
-				parseGLTFBufferIndices(mesh->m_indices, primitive->indices);
+		//the index buffer is kept, attributes are shared by the triangles like in the file
+		if (primitive->indices && primitive->indices->count)
+		{
+			parseGLTFBufferIndices(mesh->m_indices, primitive->indices);
+			removeOutOfBoundsTriangles(mesh->m_indices, mesh->vertices.size());
+			countIndexedMemory(mesh);
+		}
+		GFX::sVertexCacheStats before, after;
+		if (GFX::Mesh::optimize_meshes && mesh->optimize(&before, &after))
+		{
+			char str[128];
+			snprintf(str, sizeof(str), " + Mesh optimized: %s [OPT ACMR %.2f>%.2f ATVR %.2f>%.2f]", meshdata->name ? submesh_name.c_str() : "", before.acmr, after.acmr, before.atvr, after.atvr);
+			std::cout << str << std::endl;
 		}
+		else if (GFX::Mesh::generate_lods)
+			mesh->generateLODs();
+		if (GFX::Mesh::generate_meshlets)
+			mesh->buildMeshlets();
+		mesh->vertex_layout = GFX::Mesh::asset_layout;
 		mesh->uploadToVRAM();
+		if (binfilename.size())
+			mesh->writeBin(binfilename.c_str());
 		if (meshdata->name)
 			mesh->registerMesh(submesh_name);
 		result.push_back(mesh);
@@ -613,6 +619,7 @@ SCN::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& opt
 	}
 
 	SCN::Prefab* prefab = new SCN::Prefab();
+	indexed_bytes = deindexed_bytes = 0;
 
 	{
 		if (scene->nodes_count > 1)
@@ -656,6 +663,8 @@ SCN::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& opt
 	cgltf_free(data);
 
     stdlog( std::string(" - Loaded ") + filename );
+	if (deindexed_bytes)
+		std::cout << "   indexed geometry: " << (indexed_bytes / 1024) << " KB, saved " << ((long long)deindexed_bytes - (long long)indexed_bytes) / 1024 << " KB" << std::endl;
 
     return prefab;
 }
@@ -3,10 +3,18 @@
 #include <cassert>
 #include <iostream>
 #include <algorithm>
+#include <chrono>
 
 #include "../core/includes.h"
 #include "../core/core.h"
 
+#ifndef WIN32
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
 #ifndef WIN32
 	#include <sys/time.h>
 #endif
@@ -23,6 +31,12 @@ long getTime()
 	#endif
 }
 
+double getPreciseTime()
+{
+	using namespace std::chrono;
+	return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
 //this function is used to access OpenGL Extensions (special features not supported by all cards)
 void* getGLProcAddress(const char* name)
 {
@@ -118,6 +132,56 @@ bool readFileBin(const std::string& filename, std::vector<unsigned char>& buffer
 	return true;
 }
 
+bool mapFile(const char* filename, sMappedFile& file)
+{
+	file = sMappedFile();
+#ifdef WIN32
+	HANDLE handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	HANDLE mapping = GetFileSizeEx(handle, &size) && size.QuadPart ? CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+	void* data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+	if (!data)
+	{
+		if (mapping)
+			CloseHandle(mapping);
+		CloseHandle(handle);
+		return false;
+	}
+	file.handle = handle;
+	file.mapping = mapping;
+	file.size = (size_t)size.QuadPart;
+	file.data = (const unsigned char*)data;
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return false;
+	struct stat info;
+	void* data = fstat(fd, &info) == 0 && info.st_size ? mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd); //the mapping keeps the file
+	if (data == MAP_FAILED)
+		return false;
+	file.size = (size_t)info.st_size;
+	file.data = (const unsigned char*)data;
+#endif
+	return true;
+}
+
+void unmapFile(sMappedFile& file)
+{
+	if (!file.data)
+		return;
+#ifdef WIN32
+	UnmapViewOfFile(file.data);
+	CloseHandle(file.mapping);
+	CloseHandle(file.handle);
+#else
+	munmap((void*)file.data, file.size);
+#endif
+	file = sMappedFile();
+}
+
 bool writeFile(const std::string& filename, std::string& content)
 {
 	FILE* f = fopen(filename.c_str(), "w");
@@ -15,10 +15,22 @@
 
 //General functions **************
 long getTime(); //there is also CORE::getTime
+double getPreciseTime(); //in ms but with sub-ms precision, to measure short tasks
 bool readFile(const std::string& filename, std::string& content);
 bool readFileBin(const std::string& filename, std::vector<unsigned char>& buffer);
 bool writeFile(const std::string& filename, std::string& content);
 
+//read only view of a whole file, the system loads the pages when they are touched
+struct sMappedFile {
+	const unsigned char* data;
+	size_t size;
+	void* handle; //file and mapping in windows
+	void* mapping;
+	sMappedFile() : data(NULL), size(0), handle(NULL), mapping(NULL) {}
+};
+bool mapFile(const char* filename, sMappedFile& file);
+void unmapFile(sMappedFile& file);
+
 //work with file paths
 std::string getFolderName(std::string path);
 std::string getExtension(std::string path);